@@ -0,0 +1,166 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#include "Aead.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+namespace lrm::crypto {
+namespace {
+unsigned char* as_uchar(std::byte* ptr) {
+  return reinterpret_cast<unsigned char*>(ptr);
+}
+const unsigned char* as_uchar(const std::byte* ptr) {
+  return reinterpret_cast<const unsigned char*>(ptr);
+}
+}
+
+Aead::Aead(std::span<const std::byte> key, std::span<const std::byte> nonce,
+           const EVP_CIPHER* cipher)
+    : encrypt_ctx_{EVP_CIPHER_CTX_new()},
+      decrypt_ctx_{EVP_CIPHER_CTX_new()},
+      base_nonce_(nonce.begin(), nonce.end()) {
+  if (key.size() != static_cast<size_t>(EVP_CIPHER_key_length(cipher))) {
+    EVP_CIPHER_CTX_free(encrypt_ctx_);
+    EVP_CIPHER_CTX_free(decrypt_ctx_);
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'key' length doesn't match the cipher"));
+  }
+  if (nonce.size() != static_cast<size_t>(EVP_CIPHER_iv_length(cipher)) or
+      nonce.size() < sizeof(uint64_t)) {
+    EVP_CIPHER_CTX_free(encrypt_ctx_);
+    EVP_CIPHER_CTX_free(decrypt_ctx_);
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'nonce' length doesn't match the cipher"));
+  }
+
+  // The key is set once, every message only sets the iv.
+  if (EVP_EncryptInit_ex(encrypt_ctx_, cipher, nullptr, as_uchar(key.data()),
+                         nullptr) != 1 or
+      EVP_DecryptInit_ex(decrypt_ctx_, cipher, nullptr, as_uchar(key.data()),
+                         nullptr) != 1) {
+    EVP_CIPHER_CTX_free(encrypt_ctx_);
+    EVP_CIPHER_CTX_free(decrypt_ctx_);
+    throw std::runtime_error(
+        __PRETTY_FUNCTION__ + std::string(": Couldn't set the key"));
+  }
+}
+
+Aead::~Aead() {
+  EVP_CIPHER_CTX_free(encrypt_ctx_);
+  EVP_CIPHER_CTX_free(decrypt_ctx_);
+}
+
+void Aead::Seal(uint64_t counter, std::span<const std::byte> aad,
+                std::span<const std::byte> plaintext,
+                std::span<std::byte> ciphertext) {
+  if (ciphertext.size() != plaintext.size() + TAG_SIZE) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'ciphertext' must be TAG_SIZE longer than "
+                    "'plaintext'"));
+  }
+
+  Seal(counter, aad, plaintext, ciphertext.first(plaintext.size()),
+       ciphertext.last(TAG_SIZE));
+}
+
+void Aead::Seal(uint64_t counter, std::span<const std::byte> aad,
+                std::span<const std::byte> plaintext,
+                std::span<std::byte> ciphertext, std::span<std::byte> tag) {
+  if (ciphertext.size() != plaintext.size() or tag.size() != TAG_SIZE) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'ciphertext' must be as long as 'plaintext' and 'tag' "
+                    "must be TAG_SIZE long"));
+  }
+
+  Nonce nonce;
+  make_nonce(counter, nonce);
+  int len = 0;
+  if (EVP_EncryptInit_ex(encrypt_ctx_, nullptr, nullptr, nullptr,
+                         as_uchar(nonce.data())) != 1 or
+      EVP_EncryptUpdate(encrypt_ctx_, nullptr, &len, as_uchar(aad.data()),
+                        aad.size()) != 1 or
+      EVP_EncryptUpdate(encrypt_ctx_, as_uchar(ciphertext.data()), &len,
+                        as_uchar(plaintext.data()), plaintext.size()) != 1 or
+      EVP_EncryptFinal_ex(encrypt_ctx_, as_uchar(ciphertext.data()) + len,
+                          &len) != 1 or
+      EVP_CIPHER_CTX_ctrl(encrypt_ctx_, EVP_CTRL_AEAD_GET_TAG, TAG_SIZE,
+                          tag.data()) != 1) {
+    throw std::runtime_error(
+        __PRETTY_FUNCTION__ + std::string(": Couldn't encrypt"));
+  }
+}
+
+bool Aead::Open(uint64_t counter, std::span<const std::byte> aad,
+                std::span<const std::byte> ciphertext,
+                std::span<std::byte> plaintext) {
+  if (ciphertext.size() < TAG_SIZE) return false;
+  if (plaintext.size() != ciphertext.size() - TAG_SIZE) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'plaintext' must be TAG_SIZE shorter than "
+                    "'ciphertext'"));
+  }
+
+  return Open(counter, aad, ciphertext.first(plaintext.size()),
+              ciphertext.last(TAG_SIZE), plaintext);
+}
+
+bool Aead::Open(uint64_t counter, std::span<const std::byte> aad,
+                std::span<const std::byte> ciphertext,
+                std::span<const std::byte> tag,
+                std::span<std::byte> plaintext) {
+  if (tag.size() != TAG_SIZE) return false;
+  if (plaintext.size() != ciphertext.size()) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'plaintext' must be as long as 'ciphertext'"));
+  }
+
+  Nonce nonce;
+  make_nonce(counter, nonce);
+  int len = 0;
+  // EVP_CIPHER_CTX_ctrl() takes a non-const tag, but doesn't modify it.
+  return EVP_DecryptInit_ex(decrypt_ctx_, nullptr, nullptr, nullptr,
+                            as_uchar(nonce.data())) == 1 and
+      EVP_DecryptUpdate(decrypt_ctx_, nullptr, &len, as_uchar(aad.data()),
+                        aad.size()) == 1 and
+      EVP_DecryptUpdate(decrypt_ctx_, as_uchar(plaintext.data()), &len,
+                        as_uchar(ciphertext.data()),
+                        ciphertext.size()) == 1 and
+      EVP_CIPHER_CTX_ctrl(decrypt_ctx_, EVP_CTRL_AEAD_SET_TAG, TAG_SIZE,
+                          const_cast<std::byte*>(tag.data())) == 1 and
+      EVP_DecryptFinal_ex(decrypt_ctx_, as_uchar(plaintext.data()) + len,
+                          &len) == 1;
+}
+
+void Aead::make_nonce(uint64_t counter, Nonce& nonce) const {
+  std::copy(base_nonce_.begin(), base_nonce_.end(), nonce.begin());
+  for (size_t i = 0; i < sizeof(counter); ++i) {
+    nonce[base_nonce_.size() - 1 - i] ^=
+        static_cast<std::byte>((counter >> (8 * i)) & 0xff);
+  }
+}
+}
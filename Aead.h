@@ -0,0 +1,105 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#ifndef LRM_AEAD_H_
+#define LRM_AEAD_H_
+
+#include <array>
+#include <cstdint>
+#include <span>
+
+#include <openssl/evp.h>
+
+#include "config.h"
+
+namespace lrm::crypto {
+/// \brief Authenticated encryption with a key scheduled once.
+///
+/// Every message is encrypted with a nonce made from the base nonce given to
+/// the constructor XORed with a 64-bit \e counter, big-endian, in its last 8
+/// bytes. The same counter must never be used twice with the same key, so
+/// the caller has to keep counters unique, e.g. by counting messages.
+///
+/// The cipher has to be an AEAD mode with \ref TAG_SIZE tags, like
+/// \ref LRM_SPEKE_CIPHER_TYPE (AES-GCM).
+///
+/// \ref Seal() and \ref Open() use separate contexts and build the nonce
+/// on the stack, so one thread can encrypt while another decrypts, but
+/// neither of them can be called from multiple threads at once.
+class Aead {
+ public:
+  /// Length of the authentication tag appended to every ciphertext.
+  static constexpr size_t TAG_SIZE = 16;
+
+  Aead(const Aead&) = delete;
+  Aead& operator=(const Aead&) = delete;
+  /// \param key Secret key, its length must match the \e cipher.
+  /// \param nonce Base nonce, its length must match the \e cipher's iv and
+  /// be at least 8 bytes.
+  ///
+  /// \throw std::invalid_argument If \e key or \e nonce have wrong length.
+  Aead(std::span<const std::byte> key, std::span<const std::byte> nonce,
+       const EVP_CIPHER* cipher = LRM_SPEKE_CIPHER_TYPE);
+  ~Aead();
+
+  /// \brief Encrypt \e plaintext and authenticate it together with \e aad.
+  ///
+  /// \param ciphertext Output, must be \ref TAG_SIZE bytes longer than
+  /// \e plaintext. The tag is written at the end.
+  void Seal(uint64_t counter, std::span<const std::byte> aad,
+            std::span<const std::byte> plaintext,
+            std::span<std::byte> ciphertext);
+
+  /// \brief Same as above, but the tag is written separately to \e tag,
+  /// which must be \ref TAG_SIZE long. \e ciphertext must be as long as
+  /// \e plaintext.
+  void Seal(uint64_t counter, std::span<const std::byte> aad,
+            std::span<const std::byte> plaintext,
+            std::span<std::byte> ciphertext, std::span<std::byte> tag);
+
+  /// \brief Decrypt \e ciphertext made by \ref Seal() and check its tag.
+  ///
+  /// \param plaintext Output, must be \ref TAG_SIZE bytes shorter than
+  /// \e ciphertext. Its contents are unspecified if this returns false.
+  ///
+  /// \return false if \e ciphertext, \e aad or \e counter don't match the
+  /// ones used to seal it, or if \e ciphertext is too short.
+  bool Open(uint64_t counter, std::span<const std::byte> aad,
+            std::span<const std::byte> ciphertext,
+            std::span<std::byte> plaintext);
+
+  /// \brief Same as above, but with the \e tag separate from
+  /// \e ciphertext. \e plaintext must be as long as \e ciphertext.
+  bool Open(uint64_t counter, std::span<const std::byte> aad,
+            std::span<const std::byte> ciphertext,
+            std::span<const std::byte> tag,
+            std::span<std::byte> plaintext);
+
+ private:
+  using Nonce = std::array<std::byte, EVP_MAX_IV_LENGTH>;
+  // Only the first base_nonce_.size() bytes of \e nonce are used.
+  void make_nonce(uint64_t counter, Nonce& nonce) const;
+
+  EVP_CIPHER_CTX* encrypt_ctx_;
+  EVP_CIPHER_CTX* decrypt_ctx_;
+  Bytes base_nonce_;
+};
+}
+
+#endif  // LRM_AEAD_H_
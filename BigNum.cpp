@@ -19,8 +19,10 @@
 #include "BigNum.h"
 
 #include <array>
+#include <mutex>
 #include <string>
 #include <stdexcept>
+#include <unordered_map>
 
 #include <openssl/err.h>
 
@@ -52,13 +54,14 @@ BigNum::BigNum(const unsigned char* bytes, size_t size) noexcept
     : bignum_{BN_bin2bn(bytes, size, nullptr)} {}
 
 BigNum::BigNum(const BigNum& other) noexcept
-    : bignum_(BN_dup(other.bignum_)) {}
+    : bignum_(BN_dup(other.bignum_)), secret_{other.secret_} {}
 
 BigNum::BigNum(BigNum&& other) noexcept
-    : bignum_{std::exchange(other.bignum_, nullptr)} {}
+    : bignum_{std::exchange(other.bignum_, nullptr)},
+      secret_{other.secret_} {}
 
 BigNum::~BigNum() {
-  BN_free(bignum_);
+  free_bignum();
 }
 
 BigNum& BigNum::operator=(const BigNum& other) noexcept {
@@ -66,28 +69,50 @@ BigNum& BigNum::operator=(const BigNum& other) noexcept {
     if (not bignum_) {
       bignum_ = BN_dup(other.bignum_);
     } else {
+      // A grown BIGNUM wipes its old words, so nothing is left behind.
       BN_copy(this->bignum_, other.bignum_);
     }
+    secret_ = secret_ or other.secret_;
   }
   return *this;
 }
 
 BigNum& BigNum::operator=(BigNum&& other) noexcept {
-  BN_free(bignum_);
+  free_bignum();
 
   bignum_ = std::exchange(other.bignum_, nullptr);
+  secret_ = other.secret_;
 
   return *this;
 }
 
+void BigNum::free_bignum() noexcept {
+  if (secret_) {
+    BN_clear_free(bignum_);
+  } else {
+    BN_free(bignum_);
+  }
+}
+
 BigNum& BigNum::operator+=(const BigNum& rhs) noexcept {
   BN_add(bignum_, bignum_, rhs.bignum_);
   return *this;
 }
 
-BigNum operator+(BigNum lhs, const BigNum& rhs) noexcept {
+BigNum& BigNum::operator+=(BN_ULONG rhs) noexcept {
+  BN_add_word(bignum_, rhs);
+  return *this;
+}
+
+BigNum operator+(const BigNum& lhs, const BigNum& rhs) noexcept {
+  BigNum result;
+  BN_add(result.bignum_, lhs.bignum_, rhs.bignum_);
+  return result;
+}
+
+BigNum operator+(BigNum&& lhs, const BigNum& rhs) noexcept {
   lhs += rhs;
-  return lhs;
+  return std::move(lhs);
 }
 
 BigNum& BigNum::operator-=(const BigNum& rhs) noexcept {
@@ -95,9 +120,20 @@ BigNum& BigNum::operator-=(const BigNum& rhs) noexcept {
   return *this;
 }
 
-BigNum operator-(BigNum lhs, const BigNum& rhs) noexcept {
+BigNum& BigNum::operator-=(BN_ULONG rhs) noexcept {
+  BN_sub_word(bignum_, rhs);
+  return *this;
+}
+
+BigNum operator-(const BigNum& lhs, const BigNum& rhs) noexcept {
+  BigNum result;
+  BN_sub(result.bignum_, lhs.bignum_, rhs.bignum_);
+  return result;
+}
+
+BigNum operator-(BigNum&& lhs, const BigNum& rhs) noexcept {
   lhs -= rhs;
-  return lhs;
+  return std::move(lhs);
 }
 
 BigNum& BigNum::operator*=(const BigNum& rhs) noexcept {
@@ -105,9 +141,10 @@ BigNum& BigNum::operator*=(const BigNum& rhs) noexcept {
   return *this;
 }
 
-BigNum operator*(BigNum lhs, const BigNum& rhs) noexcept {
-  lhs *= rhs;
-  return lhs;
+BigNum operator*(const BigNum& lhs, const BigNum& rhs) noexcept {
+  BigNum result;
+  BN_mul(result.bignum_, lhs.bignum_, rhs.bignum_, BigNum::ctx_.ctx);
+  return result;
 }
 
 BigNum& BigNum::operator/=(const BigNum& rhs) noexcept {
@@ -115,9 +152,10 @@ BigNum& BigNum::operator/=(const BigNum& rhs) noexcept {
   return *this;
 }
 
-BigNum operator/(BigNum lhs, const BigNum& rhs) noexcept {
-  lhs /= rhs;
-  return lhs;
+BigNum operator/(const BigNum& lhs, const BigNum& rhs) noexcept {
+  BigNum result;
+  BN_div(result.bignum_, NULL, lhs.bignum_, rhs.bignum_, BigNum::ctx_.ctx);
+  return result;
 }
 
 BigNum& BigNum::operator%=(const BigNum& rhs) noexcept {
@@ -125,9 +163,10 @@ BigNum& BigNum::operator%=(const BigNum& rhs) noexcept {
   return *this;
 }
 
-BigNum operator%(BigNum lhs, const BigNum& rhs) noexcept {
-  lhs %= rhs;
-  return lhs;
+BigNum operator%(const BigNum& lhs, const BigNum& rhs) noexcept {
+  BigNum result;
+  BN_mod(result.bignum_, lhs.bignum_, rhs.bignum_, BigNum::ctx_.ctx);
+  return result;
 }
 
 BigNum& BigNum::operator^=(const BigNum& rhs) noexcept {
@@ -135,9 +174,10 @@ BigNum& BigNum::operator^=(const BigNum& rhs) noexcept {
   return *this;
 }
 
-BigNum operator^(BigNum lhs, const BigNum& rhs) noexcept {
-  lhs ^= rhs;
-  return lhs;
+BigNum operator^(const BigNum& lhs, const BigNum& rhs) noexcept {
+  BigNum result;
+  BN_exp(result.bignum_, lhs.bignum_, rhs.bignum_, BigNum::ctx_.ctx);
+  return result;
 }
 
 bool operator==(const BigNum& lhs, const BigNum& rhs) noexcept {
@@ -171,29 +211,62 @@ std::ostream& operator<<(std::ostream& stream, const BigNum& num) {
 
 BigNum BigNum::ModAdd(const BigNum& other, const BigNum& mod) const noexcept {
   BigNum result;
-  BN_mod_add(result.bignum_, bignum_, other.bignum_, mod.bignum_, ctx_.ctx);
+  ModAddInto(result, other, mod);
   return result;
 }
 
 BigNum BigNum::ModSub(const BigNum& other, const BigNum& mod) const noexcept {
   BigNum result;
-  BN_mod_sub(result.bignum_, bignum_, other.bignum_, mod.bignum_, ctx_.ctx);
+  ModSubInto(result, other, mod);
   return result;
 }
 
 BigNum BigNum::ModMul(const BigNum& other, const BigNum& mod) const noexcept {
   BigNum result;
-  BN_mod_mul(result.bignum_, bignum_, other.bignum_, mod.bignum_, ctx_.ctx);
+  ModMulInto(result, other, mod);
   return result;
 }
 
 BigNum BigNum::ModSqr(const BigNum& mod) const noexcept {
   BigNum result;
-  BN_mod_sqr(result.bignum_, bignum_, mod.bignum_, ctx_.ctx);
+  ModSqrInto(result, mod);
   return result;
 }
 
 BigNum BigNum::ModExp(const BigNum& power, const BigNum& mod) const {
+  BigNum result;
+  ModExpInto(result, power, mod);
+  return result;
+}
+
+BigNum BigNum::ModExp(const BigNum& power,
+                      const MontgomeryContext& mont) const {
+  BigNum result;
+  ModExpInto(result, power, mont);
+  return result;
+}
+
+void BigNum::ModAddInto(BigNum& result, const BigNum& other,
+                        const BigNum& mod) const noexcept {
+  BN_mod_add(result.bignum_, bignum_, other.bignum_, mod.bignum_, ctx_.ctx);
+}
+
+void BigNum::ModSubInto(BigNum& result, const BigNum& other,
+                        const BigNum& mod) const noexcept {
+  BN_mod_sub(result.bignum_, bignum_, other.bignum_, mod.bignum_, ctx_.ctx);
+}
+
+void BigNum::ModMulInto(BigNum& result, const BigNum& other,
+                        const BigNum& mod) const noexcept {
+  BN_mod_mul(result.bignum_, bignum_, other.bignum_, mod.bignum_, ctx_.ctx);
+}
+
+void BigNum::ModSqrInto(BigNum& result, const BigNum& mod) const noexcept {
+  BN_mod_sqr(result.bignum_, bignum_, mod.bignum_, ctx_.ctx);
+}
+
+void BigNum::ModExpInto(BigNum& result, const BigNum& power,
+                        const BigNum& mod) const {
   if (not BN_is_odd(mod.bignum_)) {
     throw std::runtime_error(
         "In BigNum::ModExp(): mod must be an odd number");
@@ -204,9 +277,26 @@ BigNum BigNum::ModExp(const BigNum& power, const BigNum& mod) const {
         "In BigNum::ModExp(): none of BigNums should have BN_FLG_CONSTTIME "
         "flag set");
   }
-  BigNum result;
   BN_mod_exp(result.bignum_, bignum_, power.bignum_, mod.bignum_, ctx_.ctx);
-  return result;
+}
+
+void BigNum::ModExpInto(BigNum& result, const BigNum& power,
+                        const MontgomeryContext& mont) const {
+  if (BN_get_flags(bignum_, BN_FLG_CONSTTIME) != 0) {
+    throw std::runtime_error(
+        "In BigNum::ModExp(): base should not have BN_FLG_CONSTTIME flag set");
+  }
+  BN_mod_exp_mont(result.bignum_, bignum_, power.bignum_,
+                  mont.GetModulus().bignum_, ctx_.ctx, mont.get());
+}
+
+void BigNum::SetBytes(std::span<const std::byte> bytes) noexcept {
+  BN_bin2bn(reinterpret_cast<const unsigned char*>(bytes.data()),
+            bytes.size(), bignum_);
+}
+
+BN_CTX* BigNum::ThreadContext() noexcept {
+  return ctx_.ctx;
 }
 
 bool BigNum::IsPrime() const noexcept {
@@ -240,6 +330,18 @@ Bytes BigNum::to_bytes() const {
   return result;
 }
 
+void BigNum::to_bytes(std::span<std::byte> out) const {
+  if (BN_bn2binpad(bignum_, reinterpret_cast<unsigned char*>(out.data()),
+                   out.size()) < 0) {
+    throw std::invalid_argument(
+        "In BigNum::to_bytes(): the number doesn't fit in 'out'");
+  }
+}
+
+size_t BigNum::ByteSize() const noexcept {
+  return BN_num_bytes(bignum_);
+}
+
 void check_error(int return_code) {
   if (return_code != 1) {
     std::array<char, 384> buffer;
@@ -248,6 +350,48 @@ void check_error(int return_code) {
   }
 }
 
+MontgomeryContext::MontgomeryContext(BigNum mod)
+    : mod_{std::move(mod)},
+      mont_ctx_{BN_MONT_CTX_new()} {
+  if (not mod_.IsOdd()) {
+    BN_MONT_CTX_free(mont_ctx_);
+    throw std::runtime_error(
+        "In MontgomeryContext::MontgomeryContext(): mod must be an odd "
+        "number");
+  }
+  BN_CTX* ctx = BN_CTX_new();
+  const int result = BN_MONT_CTX_set(mont_ctx_, mod_.get(), ctx);
+  BN_CTX_free(ctx);
+  if (result != 1) {
+    BN_MONT_CTX_free(mont_ctx_);
+    check_error(result);
+  }
+}
+
+MontgomeryContext::~MontgomeryContext() {
+  BN_MONT_CTX_free(mont_ctx_);
+}
+
+std::shared_ptr<const MontgomeryContext> MontgomeryContext::GetShared(
+    const BigNum& mod) {
+  static std::mutex mtx;
+  static std::unordered_map<std::string,
+                            std::weak_ptr<const MontgomeryContext>> cache;
+
+  const Bytes mod_bytes = mod.to_bytes();
+  std::string key(reinterpret_cast<const char*>(mod_bytes.data()),
+                  mod_bytes.size());
+
+  std::lock_guard lck{mtx};
+  std::weak_ptr<const MontgomeryContext>& entry = cache[key];
+  auto result = entry.lock();
+  if (not result) {
+    result = std::make_shared<const MontgomeryContext>(mod);
+    entry = result;
+  }
+  return result;
+}
+
 BigNum PrimeGenerate(int bits, bool safe,
                      const BigNum& add, const BigNum& rem) {
   BIGNUM* prime = BN_new();
@@ -270,17 +414,37 @@ BigNum PrimeGenerate(int bits, bool safe) {
 }
 
 BigNum RandomInRange(const BigNum& ex_upper_bound) {
-  BIGNUM* num = BN_new();
-  check_error(BN_priv_rand_range(num, ex_upper_bound.get()));
-  BigNum result(num);
-  BN_free(num);
+  BigNum result;
+  RandomInRangeInto(result, ex_upper_bound);
 
   return result;
 }
 
+void RandomInRangeInto(BigNum& result, const BigNum& ex_upper_bound) {
+  check_error(BN_priv_rand_range(result.get(), ex_upper_bound.get()));
+}
+
 BigNum RandomInRange(const BigNum& in_lower_bound,
                      const BigNum& in_upper_bound) {
-  return RandomInRange(in_upper_bound - in_lower_bound + BigNum{1})
-      + in_lower_bound;
+  BigNum result;
+  RandomInRangeInto(result, in_lower_bound, in_upper_bound);
+
+  return result;
+}
+
+void RandomInRangeInto(BigNum& result, const BigNum& in_lower_bound,
+                       const BigNum& in_upper_bound) {
+  BN_CTX* ctx = BigNum::ThreadContext();
+  BN_CTX_start(ctx);
+  BIGNUM* range = BN_CTX_get(ctx);
+  // Only the last BN_CTX_get() has to be checked.
+  const int ok = range != nullptr and
+      BN_sub(range, in_upper_bound.get(), in_lower_bound.get()) and
+      BN_add_word(range, 1) and
+      BN_priv_rand_range(result.get(), range) and
+      BN_add(result.get(), result.get(), in_lower_bound.get());
+  BN_CTX_end(ctx);
+
+  check_error(ok);
 }
 }
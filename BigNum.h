@@ -19,6 +19,8 @@
 #ifndef LRM_BIGNUM_H_
 #define LRM_BIGNUM_H_
 
+#include <memory>
+#include <span>
 #include <string_view>
 #include <vector>
 
@@ -27,6 +29,15 @@
 #include "config.h"
 
 namespace lrm::crypto {
+class MontgomeryContext;
+
+/// \brief Owning wrapper of an OpenSSL \c BIGNUM.
+///
+/// Every operation returning a BigNum allocates a new number. The
+/// \e ...Into() methods, the compound assignments and \ref SetBytes() reuse
+/// an existing one instead, so a number that is written repeatedly, e.g. a
+/// member, doesn't allocate once its storage is big enough. Intermediates
+/// are taken from the thread's \c BN_CTX (\ref ThreadContext()).
 class BigNum {
  public:
   BigNum() noexcept;
@@ -43,17 +54,21 @@ class BigNum {
   BigNum& operator=(const BigNum& other) noexcept;
   BigNum& operator=(BigNum&& other) noexcept;
   BigNum& operator+=(const BigNum& rhs) noexcept;
-  friend BigNum operator+(BigNum lhs, const BigNum& rhs) noexcept;
+  BigNum& operator+=(BN_ULONG rhs) noexcept;
+  friend BigNum operator+(const BigNum& lhs, const BigNum& rhs) noexcept;
+  friend BigNum operator+(BigNum&& lhs, const BigNum& rhs) noexcept;
   BigNum& operator-=(const BigNum& rhs) noexcept;
-  friend BigNum operator-(BigNum lhs, const BigNum& rhs) noexcept;
+  BigNum& operator-=(BN_ULONG rhs) noexcept;
+  friend BigNum operator-(const BigNum& lhs, const BigNum& rhs) noexcept;
+  friend BigNum operator-(BigNum&& lhs, const BigNum& rhs) noexcept;
   BigNum& operator*=(const BigNum& rhs) noexcept;
-  friend BigNum operator*(BigNum lhs, const BigNum& rhs) noexcept;
+  friend BigNum operator*(const BigNum& lhs, const BigNum& rhs) noexcept;
   BigNum& operator/=(const BigNum& rhs) noexcept;
-  friend BigNum operator/(BigNum lhs, const BigNum& rhs) noexcept;
+  friend BigNum operator/(const BigNum& lhs, const BigNum& rhs) noexcept;
   BigNum& operator%=(const BigNum& rhs) noexcept;
-  friend BigNum operator%(BigNum lhs, const BigNum& rhs) noexcept;
+  friend BigNum operator%(const BigNum& lhs, const BigNum& rhs) noexcept;
   BigNum& operator^=(const BigNum& rhs) noexcept;
-  friend BigNum operator^(BigNum lhs, const BigNum& rhs) noexcept;
+  friend BigNum operator^(const BigNum& lhs, const BigNum& rhs) noexcept;
 
   friend bool operator==(const BigNum& lhs, const BigNum& rhs) noexcept;
   friend bool operator!=(const BigNum& lhs, const BigNum& rhs) noexcept;
@@ -67,11 +82,55 @@ class BigNum {
   BigNum ModMul(const BigNum& other, const BigNum& mod) const noexcept;
   BigNum ModSqr(const BigNum& mod) const noexcept;
   BigNum ModExp(const BigNum& power, const BigNum& mod) const;
+  /// Same as ModExp(const BigNum&, const BigNum&) but reuses the Montgomery
+  /// setup of \e mont instead of computing it for every call.
+  BigNum ModExp(const BigNum& power, const MontgomeryContext& mont) const;
+
+  /// \name In-place modular arithmetic
+  /// Same as the methods above, but the result is written to \e result.
+  /// Except for \ref ModExpInto(), it can be \c this or one of the
+  /// arguments.
+  /// @{
+  void ModAddInto(BigNum& result, const BigNum& other,
+                  const BigNum& mod) const noexcept;
+  void ModSubInto(BigNum& result, const BigNum& other,
+                  const BigNum& mod) const noexcept;
+  void ModMulInto(BigNum& result, const BigNum& other,
+                  const BigNum& mod) const noexcept;
+  void ModSqrInto(BigNum& result, const BigNum& mod) const noexcept;
+  void ModExpInto(BigNum& result, const BigNum& power,
+                  const BigNum& mod) const;
+  void ModExpInto(BigNum& result, const BigNum& power,
+                  const MontgomeryContext& mont) const;
+  /// @}
+
+  /// Set the value from big-endian \e bytes, reusing the storage.
+  void SetBytes(std::span<const std::byte> bytes) noexcept;
+
+  /// \brief Mark the number as a secret, e.g. a private key.
+  ///
+  /// The memory of a secret is wiped when it's freed. Copies and moves of a
+  /// secret are secrets too.
+  inline void SetSecret() noexcept {
+    secret_ = true;
+  }
+
+  inline bool IsSecret() const noexcept {
+    return secret_;
+  }
 
   inline const BIGNUM* get() const noexcept {
     return bignum_;
   }
 
+  inline BIGNUM* get() noexcept {
+    return bignum_;
+  }
+
+  /// Return the thread's \c BN_CTX. Intermediates can be taken from it
+  /// between \c BN_CTX_start() and \c BN_CTX_end().
+  static BN_CTX* ThreadContext() noexcept;
+
   bool IsPrime() const noexcept;
   bool IsOdd() const noexcept;
 
@@ -80,6 +139,13 @@ class BigNum {
   std::string to_string() const;
   operator std::string() const;
   Bytes to_bytes() const;
+  /// \brief Write the number big-endian to the whole \e out, left-padded
+  /// with zeros.
+  ///
+  /// \throw std::invalid_argument If the number doesn't fit in \e out.
+  void to_bytes(std::span<std::byte> out) const;
+  /// Return the number of bytes \ref to_bytes() returns.
+  size_t ByteSize() const noexcept;
 
  private:
   static thread_local struct Context {
@@ -88,7 +154,48 @@ class BigNum {
     BN_CTX* ctx;
   } ctx_;
 
+  // BN_clear_free() if secret_, BN_free() otherwise
+  void free_bignum() noexcept;
+
   BIGNUM* bignum_;
+  bool secret_ = false;
+};
+
+/// \brief Precomputed Montgomery setup for a single odd modulus.
+///
+/// Computing \c BN_MONT_CTX is a noticeable part of every modular
+/// exponentiation with a big modulus, so this class does it once and lets
+/// BigNum::ModExp(const BigNum&, const MontgomeryContext&) reuse it.
+///
+/// The object is read-only after construction, so it can be shared between
+/// threads. Use \ref GetShared() to get the instance shared by everyone
+/// using the same modulus.
+class MontgomeryContext {
+ public:
+  MontgomeryContext(const MontgomeryContext&) = delete;
+  MontgomeryContext& operator=(const MontgomeryContext&) = delete;
+  /// \param mod Odd modulus.
+  explicit MontgomeryContext(BigNum mod);
+  ~MontgomeryContext();
+
+  /// Return the context for \e mod shared between all of its users.
+  ///
+  /// The context is created on the first call and is kept alive for as
+  /// long as someone holds it.
+  static std::shared_ptr<const MontgomeryContext> GetShared(
+      const BigNum& mod);
+
+  inline const BigNum& GetModulus() const noexcept {
+    return mod_;
+  }
+
+  inline BN_MONT_CTX* get() const noexcept {
+    return mont_ctx_;
+  }
+
+ private:
+  const BigNum mod_;
+  BN_MONT_CTX* mont_ctx_;
 };
 
 BigNum PrimeGenerate(int bits, bool safe,
@@ -103,6 +210,13 @@ BigNum RandomInRange(const BigNum& ex_upper_bound);
 /// \param in_upper_bound Upper bound, included in the set.
 BigNum RandomInRange(const BigNum& in_lower_bound,
                      const BigNum& in_upper_bound);
+/// Same as RandomInRange(const BigNum&) but the result is written to
+/// \e result, which must not be the bound.
+void RandomInRangeInto(BigNum& result, const BigNum& ex_upper_bound);
+/// Same as RandomInRange(const BigNum&, const BigNum&) but the result is
+/// written to \e result, which must not be one of the bounds.
+void RandomInRangeInto(BigNum& result, const BigNum& in_lower_bound,
+                       const BigNum& in_upper_bound);
 }
 
 #endif  // LRM_BIGNUM_H_
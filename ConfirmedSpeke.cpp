@@ -0,0 +1,120 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#include "ConfirmedSpeke.h"
+
+#include <array>
+#include <stdexcept>
+
+#include <openssl/crypto.h>
+
+#include "SpekeCommon.h"
+
+namespace lrm::crypto {
+ConfirmedSpeke::ConfirmedSpeke(SpekeBackend backend, SpekeGroup group,
+                               std::string id, Bytes encryption_key,
+                               Bytes nonce, Bytes key_confirmation_data,
+                               Bytes remote_key_confirmation_data,
+                               const SpekeHandshakeTimings& timings)
+    : backend_(backend),
+      group_(group),
+      id_(std::move(id)),
+      encryption_key_(std::move(encryption_key)),
+      nonce_(std::move(nonce)),
+      key_confirmation_data_(std::move(key_confirmation_data)),
+      remote_key_confirmation_data_(std::move(remote_key_confirmation_data)),
+      timings_(timings) {
+  if (encryption_key_.empty()) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'encryption_key' must not be empty"));
+  }
+  hmac_.SetKey(encryption_key_);
+}
+
+ConfirmedSpeke::~ConfirmedSpeke() {
+  Cleanse(encryption_key_);
+  Cleanse(nonce_);
+}
+
+Bytes ConfirmedSpeke::GetPublicKey() const {
+  return {};
+}
+
+void ConfirmedSpeke::ProvideRemotePublicKeyIdPair(const Bytes&,
+                                                  const std::string&) {
+  throw std::logic_error(
+      "ConfirmedSpeke: The remote's information already provided");
+}
+
+void ConfirmedSpeke::SetTranscript(Bytes, Bytes) {
+  throw std::logic_error(
+      "ConfirmedSpeke: The key confirmation data is already made");
+}
+
+const Bytes& ConfirmedSpeke::GetEncryptionKey() {
+  return encryption_key_;
+}
+
+const Bytes& ConfirmedSpeke::GetNonce() {
+  return nonce_;
+}
+
+const Bytes& ConfirmedSpeke::GetKeyConfirmationData() {
+  return key_confirmation_data_;
+}
+
+bool ConfirmedSpeke::ConfirmKey(const Bytes& remote_kcd) {
+  return remote_kcd.size() == remote_key_confirmation_data_.size() and
+      CRYPTO_memcmp(remote_kcd.data(), remote_key_confirmation_data_.data(),
+                    remote_kcd.size()) == 0;
+}
+
+Bytes ConfirmedSpeke::HmacSign(const Bytes& message) {
+  std::array<std::byte, MAX_HMAC_SIZE> signature;
+  const size_t size = HmacSign(message, signature);
+  return Bytes(signature.begin(), signature.begin() + size);
+}
+
+bool ConfirmedSpeke::ConfirmHmacSignature(const Bytes& hmac_signature,
+                                          const Bytes& message) {
+  return ConfirmHmacSignature(std::span<const std::byte>(hmac_signature),
+                              std::span<const std::byte>(message));
+}
+
+size_t ConfirmedSpeke::HmacSign(
+    std::span<const std::byte> message,
+    std::span<std::byte, MAX_HMAC_SIZE> hmac_signature) {
+  return hmac_.Sign(message, hmac_signature);
+}
+
+bool ConfirmedSpeke::ConfirmHmacSignature(
+    std::span<const std::byte> hmac_signature,
+    std::span<const std::byte> message) {
+  return hmac_.Verify(hmac_signature, message);
+}
+
+Hmac::Stream ConfirmedSpeke::MakeHmacStream() {
+  return hmac_.MakeStream();
+}
+
+SpekeHandshakeTimings ConfirmedSpeke::GetHandshakeTimings() const {
+  return timings_;
+}
+}
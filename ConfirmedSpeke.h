@@ -0,0 +1,133 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#ifndef LRM_CONFIRMEDSPEKE_H_
+#define LRM_CONFIRMEDSPEKE_H_
+
+#include "SpekeInterface.h"
+
+#include "Hmac.h"
+
+namespace lrm::crypto {
+/// \brief Keys of a finished handshake, without anything used to derive
+/// them.
+///
+/// Made by \ref SpekeInterface::Compact() once the keys are derived, so a
+/// long-lived \ref SpekeSession doesn't keep the group, the private key and
+/// the public keys of both parties. It holds only the encryption key and
+/// the nonce, the key confirmation data of both parties and an HMAC keyed
+/// with the encryption key.
+///
+/// It can't take part in another handshake, so
+/// \ref ProvideRemotePublicKeyIdPair() always throws and
+/// \ref GetPublicKey() is empty.
+///
+/// The object doesn't change after construction, so every method can be
+/// called from multiple threads at once.
+class ConfirmedSpeke : public SpekeInterface {
+ public:
+  ConfirmedSpeke(const ConfirmedSpeke&) = delete;
+  /// \param backend Backend of the compacted session.
+  /// \param group Group of the compacted session.
+  /// \param id Id of the compacted session, see
+  ///        \ref SpekeInterface::GetId().
+  /// \param encryption_key Key derived in the handshake.
+  /// \param nonce Nonce derived in the handshake.
+  /// \param key_confirmation_data What this party sends to the peer.
+  /// \param remote_key_confirmation_data What the peer should send.
+  /// \param timings Timings of the compacted session.
+  ///
+  /// \throw std::invalid_argument If \e encryption_key is empty.
+  ConfirmedSpeke(SpekeBackend backend, SpekeGroup group, std::string id,
+                 Bytes encryption_key, Bytes nonce,
+                 Bytes key_confirmation_data,
+                 Bytes remote_key_confirmation_data,
+                 const SpekeHandshakeTimings& timings);
+  virtual ~ConfirmedSpeke();
+
+  inline SpekeBackend GetBackend() const final {
+    return backend_;
+  }
+
+  inline SpekeGroup GetGroup() const final {
+    return group_;
+  }
+
+  /// Return nothing, the public key isn't kept.
+  Bytes GetPublicKey() const final;
+
+  inline const std::string& GetId() const final {
+    return id_;
+  }
+
+  /// \throw std::logic_error Always, the handshake is done.
+  void ProvideRemotePublicKeyIdPair(
+      const Bytes& remote_pubkey,
+      const std::string& remote_id) final;
+
+  /// \throw std::logic_error Always, the handshake is done.
+  void SetTranscript(Bytes transcript, Bytes remote_transcript) final;
+
+  const Bytes& GetEncryptionKey() final;
+
+  const Bytes& GetNonce() final;
+
+  const Bytes& GetKeyConfirmationData() final;
+
+  /// The comparison takes constant time.
+  bool ConfirmKey(const Bytes& remote_kcd) final;
+
+  Bytes HmacSign(const Bytes& message) final;
+
+  bool ConfirmHmacSignature(
+      const Bytes& hmac_signature,
+      const Bytes& message) final;
+
+  size_t HmacSign(std::span<const std::byte> message,
+                  std::span<std::byte, MAX_HMAC_SIZE> hmac_signature) final;
+
+  bool ConfirmHmacSignature(
+      std::span<const std::byte> hmac_signature,
+      std::span<const std::byte> message) final;
+
+  /// The stream is keyed like \ref HmacSign().
+  Hmac::Stream MakeHmacStream() final;
+
+  SpekeHandshakeTimings GetHandshakeTimings() const final;
+
+ private:
+  const SpekeBackend backend_;
+  const SpekeGroup group_;
+  const std::string id_;
+
+  // Not const, the destructor wipes them.
+  Bytes encryption_key_;
+  Bytes nonce_;
+
+  const Bytes key_confirmation_data_;
+  const Bytes remote_key_confirmation_data_;
+
+  // HMAC keyed with encryption_key_
+  Hmac hmac_;
+
+  const SpekeHandshakeTimings timings_;
+};
+}
+
+#endif  // LRM_CONFIRMEDSPEKE_H_
@@ -0,0 +1,330 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "EcSpeke.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <stdexcept>
+
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+
+#include "ConfirmedSpeke.h"
+#include "SpekeCommon.h"
+#include "config.h"
+
+#define check_init() check_initialized(__FUNCTION__)
+
+namespace lrm::crypto {
+namespace {
+struct BnCtx {
+  BnCtx() : ctx{BN_CTX_new()} {}
+  ~BnCtx() { BN_CTX_free(ctx); }
+  BN_CTX* ctx;
+};
+
+BigNum group_order(const EC_GROUP* group) {
+  return BigNum(EC_GROUP_get0_order(group));
+}
+
+BigNum make_privkey(const EC_GROUP* group) {
+  BigNum privkey = RandomInRange(1, group_order(group) - 1);
+  privkey.SetSecret();
+  return privkey;
+}
+}
+
+EcSpeke::EcSpeke(std::string_view id,
+                 std::string_view password,
+                 int curve_nid)
+    : group_{make_group(curve_nid)},
+      gen_{make_generator(password)},
+      privkey_{make_privkey(group_.get())},
+      pubkey_{[this]{
+                BnCtx bn;
+                PointPtr point{EC_POINT_new(group_.get()), &EC_POINT_free};
+                if (EC_POINT_mul(group_.get(), point.get(), nullptr,
+                                 gen_.get(), privkey_.get(), bn.ctx) != 1) {
+                  throw std::runtime_error(
+                      "In EcSpeke::EcSpeke(): Couldn't create the public "
+                      "key");
+                }
+                return encode_point(point.get());}()},
+      id_{MakeSpekeId(pubkey_, id)} {}
+
+EcSpeke::~EcSpeke() {
+  Cleanse(encryption_key_);
+  Cleanse(nonce_);
+}
+
+Bytes EcSpeke::GetPublicKey() const {
+  return pubkey_;
+}
+
+void EcSpeke::ProvideRemotePublicKeyIdPair(const Bytes& remote_pubkey,
+                                           const std::string& remote_id) {
+  if (not (remote_pubkey_.empty() and remote_id_numbered_.empty())) {
+    throw std::logic_error(
+        "EcSpeke: The remote's information already provided");
+  }
+  if (remote_id == id_) {
+    throw std::runtime_error(
+        "EcSpeke: The remote's identifier is the same as the local "
+        "identifier");
+  }
+
+  const auto dh_start = std::chrono::steady_clock::now();
+  BnCtx bn;
+  PointPtr remote_point{EC_POINT_new(group_.get()), &EC_POINT_free};
+  PointPtr shared_point{EC_POINT_new(group_.get()), &EC_POINT_free};
+  if (EC_POINT_oct2point(
+          group_.get(), remote_point.get(),
+          reinterpret_cast<const unsigned char*>(remote_pubkey.data()),
+          remote_pubkey.size(), bn.ctx) != 1 or
+      EC_POINT_is_at_infinity(group_.get(), remote_point.get()) or
+      EC_POINT_is_on_curve(group_.get(), remote_point.get(), bn.ctx) != 1) {
+    ERR_clear_error();
+    throw std::runtime_error("EcSpeke: The remote's public key is invalid");
+  }
+  // Shared secret: x coordinate of privkey_ * remote_point
+  if (EC_POINT_mul(group_.get(), shared_point.get(), nullptr,
+                   remote_point.get(), privkey_.get(), bn.ctx) != 1 or
+      EC_POINT_is_at_infinity(group_.get(), shared_point.get())) {
+    ERR_clear_error();
+    throw std::runtime_error("EcSpeke: The remote's public key is invalid");
+  }
+  Bytes shared_secret((EC_GROUP_get_degree(group_.get()) + 7) / 8);
+  BN_CTX_start(bn.ctx);
+  BIGNUM* x = BN_CTX_get(bn.ctx);
+  EC_POINT_get_affine_coordinates(group_.get(), shared_point.get(),
+                                  x, nullptr, bn.ctx);
+  BN_bn2binpad(x, reinterpret_cast<unsigned char*>(shared_secret.data()),
+               shared_secret.size());
+  BN_CTX_end(bn.ctx);
+  const auto kdf_start = std::chrono::steady_clock::now();
+
+  // Compressed points of the same curve have the same length, so they can
+  // be sorted as bytes.
+  remote_pubkey_ = encode_point(remote_point.get());
+
+  const std::string id_num = std::to_string(NextSpekeIdNumber(remote_id));
+  id_numbered_ = id_ + "-" + id_num;
+  remote_id_numbered_ = remote_id + "-" + id_num;
+
+  const auto ids = std::minmax(id_numbered_, remote_id_numbered_);
+  const auto keys = std::minmax(pubkey_, remote_pubkey_);
+  Bytes keying_material = MakeKeyingMaterial(
+      ids.first, ids.second, keys.first, keys.second, shared_secret);
+  auto [key, nonce] = MakeEncryptionKey(keying_material,
+                                        keys.first, keys.second);
+  encryption_key_ = std::move(key);
+  nonce_ = std::move(nonce);
+  Cleanse(keying_material);
+  Cleanse(shared_secret);
+
+  key_confirmation_data_ =
+      MakeKeyConfirmationData(encryption_key_,
+                              id_numbered_, remote_id_numbered_,
+                              pubkey_, remote_pubkey_,
+                              transcript_, remote_transcript_);
+  remote_key_confirmation_data_ =
+      MakeKeyConfirmationData(encryption_key_,
+                              remote_id_numbered_, id_numbered_,
+                              remote_pubkey_, pubkey_,
+                              remote_transcript_, transcript_);
+
+  hmac_.SetKey(encryption_key_);
+
+  timings_.dh = kdf_start - dh_start;
+  timings_.kdf = std::chrono::steady_clock::now() - kdf_start;
+  initialized_.store(true, std::memory_order_release);
+}
+
+const Bytes& EcSpeke::GetEncryptionKey() {
+  check_init();
+  return encryption_key_;
+}
+
+const Bytes& EcSpeke::GetNonce() {
+  check_init();
+  return nonce_;
+}
+
+void EcSpeke::SetTranscript(Bytes transcript, Bytes remote_transcript) {
+  transcript_ = std::move(transcript);
+  remote_transcript_ = std::move(remote_transcript);
+}
+
+const Bytes& EcSpeke::GetKeyConfirmationData() {
+  check_init();
+  return key_confirmation_data_;
+}
+
+bool EcSpeke::ConfirmKey(const Bytes& remote_kcd) {
+  check_init();
+  return remote_kcd.size() == remote_key_confirmation_data_.size() and
+      CRYPTO_memcmp(remote_kcd.data(), remote_key_confirmation_data_.data(),
+                    remote_kcd.size()) == 0;
+}
+
+SpekeHandshakeTimings EcSpeke::GetHandshakeTimings() const {
+  return timings_;
+}
+
+Bytes EcSpeke::HmacSign(const Bytes& message) {
+  std::array<std::byte, MAX_HMAC_SIZE> signature;
+  const size_t size = HmacSign(message, signature);
+  return Bytes(signature.begin(), signature.begin() + size);
+}
+
+bool EcSpeke::ConfirmHmacSignature(const Bytes& hmac_signature,
+                                   const Bytes& message) {
+  return ConfirmHmacSignature(std::span<const std::byte>(hmac_signature),
+                              std::span<const std::byte>(message));
+}
+
+size_t EcSpeke::HmacSign(std::span<const std::byte> message,
+                         std::span<std::byte, MAX_HMAC_SIZE> hmac_signature) {
+  check_init();
+  return hmac_.Sign(message, hmac_signature);
+}
+
+bool EcSpeke::ConfirmHmacSignature(std::span<const std::byte> hmac_signature,
+                                   std::span<const std::byte> message) {
+  check_init();
+  return hmac_.Verify(hmac_signature, message);
+}
+
+Hmac::Stream EcSpeke::MakeHmacStream() {
+  check_init();
+  return hmac_.MakeStream();
+}
+
+std::unique_ptr<SpekeInterface> EcSpeke::Compact() {
+  check_init();
+  return std::make_unique<ConfirmedSpeke>(
+      GetBackend(), GetGroup(), id_, encryption_key_, nonce_,
+      key_confirmation_data_, remote_key_confirmation_data_, timings_);
+}
+
+EcSpeke::GroupPtr EcSpeke::make_group(int curve_nid) {
+  GroupPtr group{EC_GROUP_new_by_curve_name(curve_nid), &EC_GROUP_free};
+  if (not group) {
+    ERR_clear_error();
+    throw std::invalid_argument(
+        "In EcSpeke::EcSpeke(): Unknown curve");
+  }
+  if (EC_METHOD_get_field_type(EC_GROUP_method_of(group.get())) !=
+      NID_X9_62_prime_field or
+      not BN_is_one(EC_GROUP_get0_cofactor(group.get()))) {
+    throw std::invalid_argument(
+        "In EcSpeke::EcSpeke(): Only prime field curves with cofactor 1 are "
+        "supported");
+  }
+  return group;
+}
+
+EcSpeke::PointPtr EcSpeke::make_generator(std::string_view password) {
+  BnCtx bn;
+  BN_CTX_start(bn.ctx);
+  BIGNUM* field = BN_CTX_get(bn.ctx);
+  BIGNUM* x = BN_CTX_get(bn.ctx);
+  EC_GROUP_get_curve(group_.get(), field, nullptr, nullptr, bn.ctx);
+
+  PointPtr gen{EC_POINT_new(group_.get()), &EC_POINT_free};
+  PointPtr candidate{EC_POINT_new(group_.get()), &EC_POINT_free};
+  // Digest of the first candidate on the curve. It's written in every round
+  // through a mask, so which round found it doesn't show in the timing.
+  unsigned char selected[EVP_MAX_MD_SIZE] = {};
+  unsigned int md_len = 0;
+  unsigned char found = 0;
+
+  EVP_MD_CTX* mdctx = EVP_MD_CTX_new();
+  // Candidates that don't lie on the curve leave errors on the OpenSSL error
+  // queue.
+  ERR_set_mark();
+  for (unsigned char counter = 1;
+       counter <= LRM_SPEKE_EC_HASH_TO_CURVE_ROUNDS; ++counter) {
+    // x = H(counter|password) mod field
+    EVP_DigestInit_ex(mdctx, LRM_SPEKE_HASHFUNC, nullptr);
+    EVP_DigestUpdate(mdctx, &counter, sizeof(counter));
+    EVP_DigestUpdate(mdctx, password.data(), password.length());
+
+    unsigned char md_value[EVP_MAX_MD_SIZE];
+    EVP_DigestFinal_ex(mdctx, md_value, &md_len);
+
+    BN_bin2bn(md_value, md_len, x);
+    BN_nnmod(x, x, field, bn.ctx);
+    const int y_bit = md_value[md_len - 1] & 1;
+
+    // The square root inside takes a time that depends on x.
+    const int set = EC_POINT_set_compressed_coordinates(
+        group_.get(), candidate.get(), x, y_bit, bn.ctx);
+    const int at_infinity =
+        EC_POINT_is_at_infinity(group_.get(), candidate.get());
+    const unsigned char on_curve = (set == 1) & (at_infinity == 0);
+    // 0xff for the first candidate on the curve, 0 otherwise
+    const unsigned char mask = -(on_curve & (found ^ 1));
+    for (unsigned int i = 0; i < md_len; ++i) {
+      selected[i] = (selected[i] & ~mask) | (md_value[i] & mask);
+    }
+    found |= on_curve;
+    OPENSSL_cleanse(md_value, sizeof(md_value));
+  }
+  ERR_pop_to_mark();
+  EVP_MD_CTX_free(mdctx);
+
+  if (found) {
+    BN_bin2bn(selected, md_len, x);
+    BN_nnmod(x, x, field, bn.ctx);
+    EC_POINT_set_compressed_coordinates(group_.get(), gen.get(), x,
+                                        selected[md_len - 1] & 1, bn.ctx);
+  }
+  OPENSSL_cleanse(selected, sizeof(selected));
+  BN_CTX_end(bn.ctx);
+
+  if (not found) {
+    throw std::runtime_error(
+        "In EcSpeke::EcSpeke(): Couldn't map the password to a point on the "
+        "curve");
+  }
+  return gen;
+}
+
+Bytes EcSpeke::encode_point(const EC_POINT* point) const {
+  BnCtx bn;
+  Bytes result(EC_POINT_point2oct(group_.get(), point,
+                                  POINT_CONVERSION_COMPRESSED,
+                                  nullptr, 0, bn.ctx));
+  EC_POINT_point2oct(group_.get(), point, POINT_CONVERSION_COMPRESSED,
+                     reinterpret_cast<unsigned char*>(result.data()),
+                     result.size(), bn.ctx);
+  return result;
+}
+
+void EcSpeke::check_initialized(const std::string_view function) {
+  if (not initialized_.load(std::memory_order_acquire)) {
+    throw std::logic_error(
+        std::string("Called '") + function.data() +
+        "()' before peer initialization");
+  }
+}
+}
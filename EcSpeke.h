@@ -0,0 +1,164 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef LRM_ECSPEKE_H_
+#define LRM_ECSPEKE_H_
+
+#include "SpekeInterface.h"
+
+#include <atomic>
+#include <memory>
+
+#include <openssl/ec.h>
+
+#include "BigNum.h"
+#include "Hmac.h"
+
+namespace lrm::crypto {
+/// \brief SPEKE over an elliptic curve.
+///
+/// Works in the same way as \ref SPEKE, but the Diffie-Hellman exchange
+/// happens in the group of points of an elliptic curve instead of modulo
+/// a big safe prime. Key derivation, key confirmation and HMAC signatures
+/// are the same as in \ref SPEKE, so both can be used interchangeably by
+/// \ref SpekeSession, although both parties must use the same backend.
+///
+/// The generator is a point derived from the password: candidates for its
+/// x coordinate are made by hashing the password with a counter and the
+/// first one that lies on the curve is used. A fixed number of candidates
+/// (\ref LRM_SPEKE_EC_HASH_TO_CURVE_ROUNDS) is always checked and the
+/// first one is picked without branching. It isn't fully constant-time
+/// though: checking a candidate takes a modular square root, and OpenSSL's
+/// takes a time that depends on the candidate, so on the password.
+///
+/// Scalar multiplication with a 256-bit curve is much cheaper than
+/// exponentiation modulo a 4096-bit prime, and public keys are only 33
+/// bytes long (a compressed point) instead of 512.
+///
+/// Only prime field curves with cofactor 1 are supported, like the default
+/// \ref LRM_SPEKE_EC_CURVE (NIST P-256).
+///
+/// The thread safety guarantees are the same as in \ref SPEKE.
+class EcSpeke : public SpekeInterface {
+ public:
+  EcSpeke(const EcSpeke&) = delete;
+  /// \param id Unique identifier.
+  /// \param password A password shared with the remote party.
+  /// \param curve_nid OpenSSL NID of the curve. Shared with the remote party.
+  EcSpeke(std::string_view id, std::string_view password,
+          int curve_nid = LRM_SPEKE_EC_CURVE);
+  virtual ~EcSpeke();
+
+  inline SpekeBackend GetBackend() const final {
+    return SpekeBackend::ELLIPTIC_CURVE;
+  }
+
+  /// Return the public key as a compressed point.
+  Bytes GetPublicKey() const final;
+
+  inline const std::string& GetId() const final {
+    return id_;
+  }
+
+  void ProvideRemotePublicKeyIdPair(
+      const Bytes& remote_pubkey,
+      const std::string& remote_id) final;
+
+  void SetTranscript(Bytes transcript, Bytes remote_transcript) final;
+
+  const Bytes& GetEncryptionKey() final;
+
+  const Bytes& GetNonce() final;
+
+  const Bytes& GetKeyConfirmationData() final;
+
+  bool ConfirmKey(const Bytes& remote_kcd) final;
+
+  Bytes HmacSign(const Bytes& message) final;
+
+  bool ConfirmHmacSignature(
+      const Bytes& hmac_signature,
+      const Bytes& message) final;
+
+  size_t HmacSign(std::span<const std::byte> message,
+                  std::span<std::byte, MAX_HMAC_SIZE> hmac_signature) final;
+
+  bool ConfirmHmacSignature(
+      std::span<const std::byte> hmac_signature,
+      std::span<const std::byte> message) final;
+
+  /// The stream is keyed like \ref HmacSign().
+  Hmac::Stream MakeHmacStream() final;
+
+  /// Return a \ref ConfirmedSpeke with the keys of this session.
+  std::unique_ptr<SpekeInterface> Compact() final;
+
+  /// The keygen phase isn't measured.
+  SpekeHandshakeTimings GetHandshakeTimings() const final;
+
+ private:
+  using GroupPtr = std::unique_ptr<EC_GROUP, decltype(&EC_GROUP_free)>;
+  using PointPtr = std::unique_ptr<EC_POINT, decltype(&EC_POINT_free)>;
+
+  static GroupPtr make_group(int curve_nid);
+  // First of the hashed password candidates that lies on the curve, see the
+  // class documentation for what its timing leaks
+  PointPtr make_generator(std::string_view password);
+  Bytes encode_point(const EC_POINT* point) const;
+  void check_initialized(const std::string_view function);
+
+  const GroupPtr group_;
+  const PointPtr gen_;
+
+  // random value in [1; order - 1]
+  const BigNum privkey_;
+
+  // privkey_ * gen_, compressed
+  const Bytes pubkey_;
+
+  const std::string id_;
+  std::string id_numbered_;
+
+  std::string remote_id_numbered_;
+
+  // compressed public key of the remote party
+  Bytes remote_pubkey_;
+
+  // see SetTranscript()
+  Bytes transcript_;
+  Bytes remote_transcript_;
+
+  // a uniform key derived from keying material with HKDF
+  Bytes encryption_key_;
+  Bytes nonce_;
+
+  Bytes key_confirmation_data_;
+  // What the remote party should send to ConfirmKey()
+  Bytes remote_key_confirmation_data_;
+
+  // HMAC keyed with encryption_key_
+  Hmac hmac_;
+
+  // Written before initialized_ is set
+  SpekeHandshakeTimings timings_;
+
+  std::atomic_bool initialized_ = false;
+};
+}
+
+#endif  // LRM_ECSPEKE_H_
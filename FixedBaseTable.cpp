@@ -0,0 +1,172 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#include "FixedBaseTable.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+namespace lrm::crypto {
+namespace {
+// All ones if a == b, zero otherwise, without branching.
+uint64_t equal_mask(unsigned a, unsigned b) {
+  const uint64_t diff = a ^ b;
+  // (diff - 1) has the top bit set only if diff is 0.
+  return 0 - ((diff - 1) >> 63);
+}
+
+class CtxFrame {
+ public:
+  explicit CtxFrame(BN_CTX* ctx) : ctx_(ctx) { BN_CTX_start(ctx_); }
+  ~CtxFrame() { BN_CTX_end(ctx_); }
+
+  BIGNUM* get() {
+    BIGNUM* result = BN_CTX_get(ctx_);
+    if (not result) throw std::bad_alloc();
+    return result;
+  }
+
+ private:
+  BN_CTX* ctx_;
+};
+}
+
+FixedBaseTable::FixedBaseTable(const BigNum& base,
+                               std::shared_ptr<const MontgomeryContext> mont,
+                               int exponent_bits, int window_bits)
+    : mont_{[&mont]{
+              if (not mont) {
+                throw std::invalid_argument(
+                    __PRETTY_FUNCTION__ +
+                    std::string(": 'mont' must not be nullptr"));
+              }
+              return std::move(mont);}()},
+      window_bits_{window_bits},
+      windows_{window_bits > 0 ?
+               (exponent_bits + window_bits - 1) / window_bits : 0},
+      entry_words_{(mont_->GetModulus().ByteSize() + sizeof(uint64_t) - 1) /
+                   sizeof(uint64_t)} {
+  if (window_bits_ < 1 or window_bits_ > MAX_WINDOW_BITS) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'window_bits' must be between 1 and ") +
+        std::to_string(MAX_WINDOW_BITS));
+  }
+  if (exponent_bits < 1) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'exponent_bits' must be positive"));
+  }
+  if (base >= mont_->GetModulus() or BN_is_negative(base.get())) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'base' must be in [0; modulus)"));
+  }
+
+  const size_t row_size = size_t{1} << window_bits_;
+  table_.resize(windows_ * row_size * entry_words_);
+
+  BN_CTX* ctx = BigNum::ThreadContext();
+  CtxFrame frame(ctx);
+  BIGNUM* power = frame.get();  // base^(2^(window_bits * i))
+  BIGNUM* entry = frame.get();
+  BN_MONT_CTX* mont_ctx = mont_->get();
+
+  if (not BN_to_montgomery(power, base.get(), mont_ctx, ctx)) {
+    throw std::bad_alloc();
+  }
+  for (int window = 0; window < windows_; ++window) {
+    // 1 in Montgomery form
+    BN_to_montgomery(entry, BN_value_one(), mont_ctx, ctx);
+    for (size_t digit = 0; digit < row_size; ++digit) {
+      if (digit > 0) {
+        BN_mod_mul_montgomery(entry, entry, power, mont_ctx, ctx);
+      }
+      uint64_t* out =
+          table_.data() + (window * row_size + digit) * entry_words_;
+      BN_bn2lebinpad(entry, reinterpret_cast<unsigned char*>(out),
+                     entry_words_ * sizeof(uint64_t));
+    }
+    // The last entry is power^(2^window_bits - 1).
+    BN_mod_mul_montgomery(power, entry, power, mont_ctx, ctx);
+  }
+}
+
+void FixedBaseTable::select(int window, unsigned digit,
+                            std::vector<uint64_t>& out) const {
+  const size_t row_size = size_t{1} << window_bits_;
+  const uint64_t* row = table_.data() + window * row_size * entry_words_;
+
+  std::fill(out.begin(), out.end(), 0);
+  for (size_t d = 0; d < row_size; ++d) {
+    const uint64_t mask = equal_mask(d, digit);
+    const uint64_t* entry = row + d * entry_words_;
+    for (size_t i = 0; i < entry_words_; ++i) {
+      out[i] |= entry[i] & mask;
+    }
+  }
+}
+
+void FixedBaseTable::ModExpInto(BigNum& result,
+                                const BigNum& exponent) const {
+  if (BN_is_negative(exponent.get()) or
+      BN_num_bits(exponent.get()) > GetExponentBits()) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'exponent' is out of the table's range"));
+  }
+
+  BN_CTX* ctx = BigNum::ThreadContext();
+  CtxFrame frame(ctx);
+  BIGNUM* acc = frame.get();
+  BIGNUM* selected = frame.get();
+  BN_MONT_CTX* mont_ctx = mont_->get();
+
+  // Thread-local, so exponentiations don't allocate once it's big enough.
+  thread_local std::vector<uint64_t> buffer;
+  buffer.resize(entry_words_);
+  const auto bytes = reinterpret_cast<const unsigned char*>(buffer.data());
+  const int size = entry_words_ * sizeof(uint64_t);
+
+  for (int window = 0; window < windows_; ++window) {
+    unsigned digit = 0;
+    for (int bit = 0; bit < window_bits_; ++bit) {
+      digit |= static_cast<unsigned>(
+          BN_is_bit_set(exponent.get(), window * window_bits_ + bit)) << bit;
+    }
+
+    select(window, digit, buffer);
+    if (window == 0) {
+      BN_lebin2bn(bytes, size, acc);
+    } else {
+      BN_lebin2bn(bytes, size, selected);
+      BN_mod_mul_montgomery(acc, acc, selected, mont_ctx, ctx);
+    }
+  }
+
+  BN_from_montgomery(result.get(), acc, mont_ctx, ctx);
+}
+
+BigNum FixedBaseTable::ModExp(const BigNum& exponent) const {
+  BigNum result;
+  ModExpInto(result, exponent);
+  return result;
+}
+}
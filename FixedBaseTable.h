@@ -0,0 +1,100 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#ifndef LRM_FIXEDBASETABLE_H_
+#define LRM_FIXEDBASETABLE_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "BigNum.h"
+
+namespace lrm::crypto {
+/// \brief Precomputed powers of a fixed base for fast modular
+/// exponentiation.
+///
+/// The exponent is split into windows of \e window_bits bits. For every
+/// window \c i the table keeps <tt> base^(d * 2^(window_bits * i)) </tt> for
+/// every digit \c d, in Montgomery form. An exponentiation is then one
+/// multiplication per window, with no squarings, which is several times
+/// cheaper than a regular modular exponentiation.
+///
+/// The table takes
+/// <tt> ceil(exponent_bits / window_bits) * 2^window_bits </tt> numbers of
+/// the size of the modulus, see \ref MemoryUsage().
+///
+/// Exponents are meant to be secret, so every window reads all entries of
+/// its row and picks the right one with a mask, and a multiplication is
+/// done for every window, including zero digits. The memory access pattern
+/// and the number of operations don't depend on the exponent.
+///
+/// The object is read-only after construction, so it can be shared between
+/// threads.
+class FixedBaseTable {
+ public:
+  /// Largest supported \e window_bits.
+  static constexpr int MAX_WINDOW_BITS = 8;
+
+  FixedBaseTable(const FixedBaseTable&) = delete;
+  FixedBaseTable& operator=(const FixedBaseTable&) = delete;
+  /// \param base Base of every exponentiation, smaller than the modulus.
+  /// \param mont Montgomery setup for the modulus.
+  /// \param exponent_bits Maximal length of exponents in bits.
+  /// \param window_bits Width of a window, from 1 to \ref MAX_WINDOW_BITS.
+  ///
+  /// \throw std::invalid_argument If an argument is out of range.
+  FixedBaseTable(const BigNum& base,
+                 std::shared_ptr<const MontgomeryContext> mont,
+                 int exponent_bits, int window_bits);
+
+  /// \brief Write <tt> base^exponent mod m </tt> to \e result.
+  ///
+  /// \throw std::invalid_argument If \e exponent is negative or longer than
+  /// \ref GetExponentBits().
+  void ModExpInto(BigNum& result, const BigNum& exponent) const;
+
+  /// Same as \ref ModExpInto(), but returns a new number.
+  BigNum ModExp(const BigNum& exponent) const;
+
+  /// Maximal length of exponents in bits.
+  inline int GetExponentBits() const noexcept {
+    return windows_ * window_bits_;
+  }
+
+  /// Return the size of the table in bytes.
+  inline size_t MemoryUsage() const noexcept {
+    return table_.size() * sizeof(uint64_t);
+  }
+
+ private:
+  // Copy the entry for \e digit of \e window to \e out in constant time.
+  void select(int window, unsigned digit, std::vector<uint64_t>& out) const;
+
+  const std::shared_ptr<const MontgomeryContext> mont_;
+  const int window_bits_;
+  const int windows_;
+  // Words per entry. Entries are little-endian bytes of numbers in
+  // Montgomery form, row after row.
+  const size_t entry_words_;
+  std::vector<uint64_t> table_;
+};
+}
+
+#endif  // LRM_FIXEDBASETABLE_H_
@@ -0,0 +1,124 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "Hmac.h"
+
+#include <array>
+#include <stdexcept>
+
+#include <openssl/crypto.h>
+
+namespace lrm::crypto {
+thread_local Hmac::Context Hmac::ctx_{};
+
+Hmac::Hmac() : keyed_ctx_{HMAC_CTX_new()} {}
+
+Hmac::Hmac(std::span<const std::byte> key, const EVP_MD* md) : Hmac() {
+  SetKey(key, md);
+}
+
+Hmac::~Hmac() {
+  HMAC_CTX_free(keyed_ctx_);
+}
+
+void Hmac::SetKey(std::span<const std::byte> key, const EVP_MD* md) {
+  if (HMAC_Init_ex(keyed_ctx_, key.data(), key.size(), md, nullptr) != 1) {
+    throw std::runtime_error("In Hmac::SetKey(): Couldn't set the key");
+  }
+  md_ = md;
+}
+
+bool Hmac::HasKey() const noexcept {
+  return md_ != nullptr;
+}
+
+size_t Hmac::Size() const noexcept {
+  return md_ ? EVP_MD_size(md_) : 0;
+}
+
+size_t Hmac::Sign(std::span<const std::byte> message,
+                  std::span<std::byte, MAX_SIZE> signature) const {
+  if (not HasKey()) {
+    throw std::logic_error("In Hmac::Sign(): The key is not set");
+  }
+
+  HMAC_CTX_copy(ctx_.ctx, keyed_ctx_);
+  HMAC_Update(ctx_.ctx,
+              reinterpret_cast<const unsigned char*>(message.data()),
+              message.size());
+
+  unsigned int len = 0;
+  HMAC_Final(ctx_.ctx, reinterpret_cast<unsigned char*>(signature.data()),
+             &len);
+
+  return len;
+}
+
+bool Hmac::Verify(std::span<const std::byte> signature,
+                  std::span<const std::byte> message) const {
+  std::array<std::byte, MAX_SIZE> expected;
+  const size_t len = Sign(message, expected);
+
+  return signature.size() == len and
+      CRYPTO_memcmp(signature.data(), expected.data(), len) == 0;
+}
+
+Hmac::Stream Hmac::MakeStream() const {
+  if (not HasKey()) {
+    throw std::logic_error("In Hmac::MakeStream(): The key is not set");
+  }
+  return Stream(keyed_ctx_);
+}
+
+Hmac::Stream::Stream(HMAC_CTX* keyed_ctx) : ctx_{HMAC_CTX_new()} {
+  if (not ctx_ or HMAC_CTX_copy(ctx_, keyed_ctx) != 1) {
+    HMAC_CTX_free(ctx_);
+    throw std::runtime_error(
+        "In Hmac::Stream::Stream(): Couldn't copy the key schedule");
+  }
+}
+
+Hmac::Stream::Stream(const Stream& other) : Stream(other.ctx_) {}
+
+Hmac::Stream::Stream(Stream&& other) noexcept : ctx_{other.ctx_} {
+  other.ctx_ = nullptr;
+}
+
+Hmac::Stream::~Stream() {
+  HMAC_CTX_free(ctx_);
+}
+
+void Hmac::Stream::Update(std::span<const std::byte> data) {
+  HMAC_Update(ctx_, reinterpret_cast<const unsigned char*>(data.data()),
+              data.size());
+}
+
+size_t Hmac::Stream::Final(std::span<std::byte, MAX_SIZE> signature) {
+  unsigned int len = 0;
+  HMAC_Final(ctx_, reinterpret_cast<unsigned char*>(signature.data()), &len);
+  return len;
+}
+
+bool Hmac::Stream::Verify(std::span<const std::byte> signature) {
+  std::array<std::byte, MAX_SIZE> expected;
+  const size_t len = Final(expected);
+
+  return signature.size() == len and
+      CRYPTO_memcmp(signature.data(), expected.data(), len) == 0;
+}
+}
@@ -0,0 +1,131 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef LRM_HMAC_H_
+#define LRM_HMAC_H_
+
+#include <span>
+
+#include <openssl/hmac.h>
+
+#include "config.h"
+
+namespace lrm::crypto {
+/// \brief HMAC with a key scheduled once.
+///
+/// Initializing HMAC with a key hashes the key and sets up the inner and
+/// outer digest states. This class does it once in \ref SetKey() and every
+/// signature starts from a copy of that state, so signing a message doesn't
+/// allocate and doesn't process the key again.
+///
+/// \ref Sign() and \ref Verify() don't modify the object, so they can be
+/// called from multiple threads at once.
+///
+/// Messages that aren't in memory at once can be signed part by part with
+/// a \ref Stream made by \ref MakeStream().
+class Hmac {
+ public:
+  /// Maximal length of a signature.
+  static constexpr size_t MAX_SIZE = EVP_MAX_MD_SIZE;
+
+  /// \brief HMAC of a message given in parts.
+  ///
+  /// It starts from a copy of the key schedule of the \ref Hmac that made
+  /// it and doesn't depend on it afterwards. The signature is the same as
+  /// \ref Hmac::Sign() of all the parts concatenated.
+  class Stream {
+   public:
+    Stream(const Stream& other);
+    Stream(Stream&& other) noexcept;
+    Stream& operator=(const Stream&) = delete;
+    ~Stream();
+
+    /// Add the next part of the message.
+    void Update(std::span<const std::byte> data);
+
+    /// \brief Write the signature of the message to \e signature.
+    ///
+    /// The stream can't be used afterwards.
+    ///
+    /// \return Length of the signature.
+    size_t Final(std::span<std::byte, MAX_SIZE> signature);
+
+    /// \brief Finish the stream and compare its signature with
+    /// \e signature in constant time.
+    bool Verify(std::span<const std::byte> signature);
+
+   private:
+    friend class Hmac;
+    explicit Stream(HMAC_CTX* keyed_ctx);
+
+    HMAC_CTX* ctx_;
+  };
+
+  Hmac(const Hmac&) = delete;
+  Hmac& operator=(const Hmac&) = delete;
+  /// Construct an HMAC without a key. \ref SetKey() has to be called before
+  /// signing anything.
+  Hmac();
+  /// \param key Secret key.
+  /// \param md Hash function to use.
+  explicit Hmac(std::span<const std::byte> key,
+                const EVP_MD* md = LRM_SPEKE_HASHFUNC);
+  ~Hmac();
+
+  /// \brief Set the key used for signing.
+  ///
+  /// Not thread-safe, it's meant to be used once before any signing.
+  void SetKey(std::span<const std::byte> key,
+              const EVP_MD* md = LRM_SPEKE_HASHFUNC);
+
+  /// Return \c true if the key was set.
+  bool HasKey() const noexcept;
+
+  /// Return the length of signatures.
+  size_t Size() const noexcept;
+
+  /// \brief Sign a \e message and write the signature to \e signature.
+  ///
+  /// \return Length of the signature, which is \ref Size().
+  size_t Sign(std::span<const std::byte> message,
+              std::span<std::byte, MAX_SIZE> signature) const;
+
+  /// \brief Confirm that \e signature was created from \e message with the
+  /// same key.
+  ///
+  /// The comparison takes constant time.
+  bool Verify(std::span<const std::byte> signature,
+              std::span<const std::byte> message) const;
+
+  /// \brief Start signing a message given in parts.
+  Stream MakeStream() const;
+
+ private:
+  // Scratch context the key schedule is copied into for every signature.
+  static thread_local struct Context {
+    Context() : ctx{HMAC_CTX_new()} {}
+    ~Context() { HMAC_CTX_free(ctx); }
+    HMAC_CTX* ctx;
+  } ctx_;
+
+  HMAC_CTX* keyed_ctx_;
+  const EVP_MD* md_ = nullptr;
+};
+}
+
+#endif  // LRM_HMAC_H_
@@ -0,0 +1,190 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#include "ResumedSpeke.h"
+
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+
+#include "ConfirmedSpeke.h"
+#include "SpekeCommon.h"
+
+#include <openssl/crypto.h>
+
+#define check_init() check_initialized(__FUNCTION__)
+
+namespace lrm::crypto {
+ResumedSpeke::ResumedSpeke(std::string_view id,
+                           const SpekeResumptionTicket& ticket)
+    : backend_(ticket.backend),
+      secret_(ticket.secret),
+      ticket_(ticket.ticket),
+      pubkey_(MakeRandomBytes(NONCE_SIZE)),
+      id_(MakeSpekeId(pubkey_, id)) {
+  if (ticket_.empty() or secret_.empty()) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'ticket' must have a ticket and a secret"));
+  }
+}
+
+ResumedSpeke::ResumedSpeke(std::string id, Bytes secret,
+                           SpekeBackend backend)
+    : backend_(backend),
+      secret_(std::move(secret)),
+      pubkey_(MakeRandomBytes(NONCE_SIZE)),
+      id_(std::move(id)) {
+  if (secret_.empty()) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ + std::string(": 'secret' must not be empty"));
+  }
+}
+
+ResumedSpeke::~ResumedSpeke() {
+  Cleanse(secret_);
+  Cleanse(encryption_key_);
+  Cleanse(nonce_);
+}
+
+Bytes ResumedSpeke::GetPublicKey() const {
+  return pubkey_;
+}
+
+void ResumedSpeke::ProvideRemotePublicKeyIdPair(
+    const Bytes& remote_pubkey,
+    const std::string& remote_id) {
+  if (not (remote_pubkey_.empty() and remote_id_numbered_.empty())) {
+    throw std::logic_error(
+        "ResumedSpeke: The remote's information already provided");
+  }
+  if (remote_id == id_) {
+    throw std::runtime_error(
+        "ResumedSpeke: The remote's identifier is the same as the local "
+        "identifier");
+  }
+  if (remote_pubkey.size() != NONCE_SIZE or remote_pubkey == pubkey_) {
+    throw std::runtime_error("ResumedSpeke: The remote's nonce is invalid");
+  }
+  remote_pubkey_ = remote_pubkey;
+
+  const std::string id_num = std::to_string(NextSpekeIdNumber(remote_id));
+  id_numbered_ = id_ + "-" + id_num;
+  remote_id_numbered_ = remote_id + "-" + id_num;
+
+  const auto nonces = std::minmax(pubkey_, remote_pubkey_);
+  Bytes keying_material =
+      MakeKeyingMaterial(std::min(id_numbered_, remote_id_numbered_),
+                         std::max(id_numbered_, remote_id_numbered_),
+                         nonces.first, nonces.second, secret_);
+  auto [key, nonce] = MakeEncryptionKey(keying_material,
+                                        nonces.first, nonces.second);
+  encryption_key_ = std::move(key);
+  nonce_ = std::move(nonce);
+  Cleanse(keying_material);
+
+  key_confirmation_data_ =
+      MakeKeyConfirmationData(encryption_key_, id_numbered_,
+                              remote_id_numbered_, pubkey_, remote_pubkey_,
+                              transcript_, remote_transcript_);
+  remote_key_confirmation_data_ =
+      MakeKeyConfirmationData(encryption_key_, remote_id_numbered_,
+                              id_numbered_, remote_pubkey_, pubkey_,
+                              remote_transcript_, transcript_);
+
+  hmac_.SetKey(encryption_key_);
+
+  initialized_.store(true, std::memory_order_release);
+}
+
+void ResumedSpeke::SetTranscript(Bytes transcript,
+                                 Bytes remote_transcript) {
+  transcript_ = std::move(transcript);
+  remote_transcript_ = std::move(remote_transcript);
+}
+
+const Bytes& ResumedSpeke::GetEncryptionKey() {
+  check_init();
+  return encryption_key_;
+}
+
+const Bytes& ResumedSpeke::GetNonce() {
+  check_init();
+  return nonce_;
+}
+
+const Bytes& ResumedSpeke::GetKeyConfirmationData() {
+  check_init();
+  return key_confirmation_data_;
+}
+
+bool ResumedSpeke::ConfirmKey(const Bytes& remote_kcd) {
+  check_init();
+  return remote_kcd.size() == remote_key_confirmation_data_.size() and
+      CRYPTO_memcmp(remote_kcd.data(), remote_key_confirmation_data_.data(),
+                    remote_kcd.size()) == 0;
+}
+
+Bytes ResumedSpeke::HmacSign(const Bytes& message) {
+  std::array<std::byte, MAX_HMAC_SIZE> signature;
+  const size_t size = HmacSign(message, signature);
+  return Bytes(signature.begin(), signature.begin() + size);
+}
+
+bool ResumedSpeke::ConfirmHmacSignature(const Bytes& hmac_signature,
+                                        const Bytes& message) {
+  return ConfirmHmacSignature(std::span<const std::byte>(hmac_signature),
+                              std::span<const std::byte>(message));
+}
+
+size_t ResumedSpeke::HmacSign(
+    std::span<const std::byte> message,
+    std::span<std::byte, MAX_HMAC_SIZE> hmac_signature) {
+  check_init();
+  return hmac_.Sign(message, hmac_signature);
+}
+
+bool ResumedSpeke::ConfirmHmacSignature(
+    std::span<const std::byte> hmac_signature,
+    std::span<const std::byte> message) {
+  check_init();
+  return hmac_.Verify(hmac_signature, message);
+}
+
+Hmac::Stream ResumedSpeke::MakeHmacStream() {
+  check_init();
+  return hmac_.MakeStream();
+}
+
+std::unique_ptr<SpekeInterface> ResumedSpeke::Compact() {
+  check_init();
+  return std::make_unique<ConfirmedSpeke>(
+      GetBackend(), GetGroup(), id_, encryption_key_, nonce_,
+      key_confirmation_data_, remote_key_confirmation_data_,
+      GetHandshakeTimings());
+}
+
+void ResumedSpeke::check_initialized(const std::string_view function) {
+  if (not initialized_.load(std::memory_order_acquire)) {
+    throw std::logic_error(
+        std::string("Called '") + function.data() +
+        "()' before peer initialization");
+  }
+}
+}
@@ -0,0 +1,174 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#ifndef LRM_RESUMEDSPEKE_H_
+#define LRM_RESUMEDSPEKE_H_
+
+#include "SpekeInterface.h"
+
+#include <atomic>
+#include <chrono>
+
+#include "Hmac.h"
+
+namespace lrm::crypto {
+/// \brief What a client needs to resume a session, see \ref ResumedSpeke.
+///
+/// Obtained from \ref SpekeSession::GetResumptionTicket(). The \e secret
+/// must be kept as safe as a password.
+struct SpekeResumptionTicket {
+  /// Opaque ticket issued by the server.
+  Bytes ticket;
+  /// Resumption secret, see \ref MakeResumptionSecret().
+  Bytes secret;
+  /// Backend of the session the ticket was issued in.
+  SpekeBackend backend = SpekeBackend::FINITE_FIELD;
+  /// Time after which the server won't accept the ticket.
+  std::chrono::system_clock::time_point expiry;
+};
+
+/// \brief Session keys derived from a resumption secret instead of the
+/// Diffie-Hellman exchange.
+///
+/// After the key confirmation both parties of a \ref SpekeSession can
+/// derive the same resumption secret from the session key. The server
+/// gives the client a ticket with the secret sealed by its
+/// \ref SpekeTicketIssuer. On reconnect, the client presents the ticket in
+/// its InitData and the server gets the secret back from it.
+///
+/// Instead of public keys, both parties send fresh random nonces. The keys
+/// are derived exactly like in \ref SPEKE, with the secret in place of the
+/// Diffie-Hellman result and the nonces in place of the public keys, so
+/// every resumed session has its own keys. The key confirmation proves
+/// that both parties know the secret.
+///
+/// Resuming takes only a few hashes, but it isn't forward secret: whoever
+/// learns the secret can derive the keys of every session resumed with it
+/// until the ticket expires.
+///
+/// The thread safety guarantees are the same as in \ref SPEKE.
+class ResumedSpeke : public SpekeInterface {
+ public:
+  /// Size of the nonces sent in place of public keys.
+  static constexpr size_t NONCE_SIZE = 32;
+
+  ResumedSpeke(const ResumedSpeke&) = delete;
+  /// Resume a session on the client side.
+  ///
+  /// \param id Unique identifier, more information is appended to it like
+  ///        in \ref SPEKE.
+  /// \param ticket Ticket from the previous session.
+  ///
+  /// \throw std::invalid_argument If the ticket or the secret is empty.
+  ResumedSpeke(std::string_view id, const SpekeResumptionTicket& ticket);
+  /// Resume a session on the server side.
+  ///
+  /// \param id Identifier used as is, e.g. of the \ref SpekeInterface this
+  ///        one replaces.
+  /// \param secret Secret redeemed from the client's ticket.
+  /// \param backend Backend of the server.
+  ResumedSpeke(std::string id, Bytes secret, SpekeBackend backend);
+  virtual ~ResumedSpeke();
+
+  inline SpekeBackend GetBackend() const final {
+    return backend_;
+  }
+
+  /// Return the nonce of this party.
+  Bytes GetPublicKey() const final;
+
+  inline const std::string& GetId() const final {
+    return id_;
+  }
+
+  /// Return the ticket to present to the server, empty on the server side.
+  inline const Bytes& GetTicket() const {
+    return ticket_;
+  }
+
+  /// \param remote_pubkey Nonce of the remote party.
+  /// \param remote_id Id of the remote party.
+  void ProvideRemotePublicKeyIdPair(
+      const Bytes& remote_pubkey,
+      const std::string& remote_id) final;
+
+  void SetTranscript(Bytes transcript, Bytes remote_transcript) final;
+
+  const Bytes& GetEncryptionKey() final;
+
+  const Bytes& GetNonce() final;
+
+  const Bytes& GetKeyConfirmationData() final;
+
+  bool ConfirmKey(const Bytes& remote_kcd) final;
+
+  Bytes HmacSign(const Bytes& message) final;
+
+  bool ConfirmHmacSignature(
+      const Bytes& hmac_signature,
+      const Bytes& message) final;
+
+  size_t HmacSign(std::span<const std::byte> message,
+                  std::span<std::byte, MAX_HMAC_SIZE> hmac_signature) final;
+
+  bool ConfirmHmacSignature(
+      std::span<const std::byte> hmac_signature,
+      std::span<const std::byte> message) final;
+
+  /// The stream is keyed like \ref HmacSign().
+  Hmac::Stream MakeHmacStream() final;
+
+  /// Return a \ref ConfirmedSpeke with the keys of this session.
+  std::unique_ptr<SpekeInterface> Compact() final;
+
+ private:
+  void check_initialized(const std::string_view function);
+
+  const SpekeBackend backend_;
+  // Not const, the destructor wipes it.
+  Bytes secret_;
+  const Bytes ticket_;
+  // Sent in place of the public key
+  const Bytes pubkey_;
+
+  const std::string id_;
+  std::string id_numbered_;
+
+  std::string remote_id_numbered_;
+  Bytes remote_pubkey_;
+
+  // see SetTranscript()
+  Bytes transcript_;
+  Bytes remote_transcript_;
+
+  Bytes encryption_key_;
+  Bytes nonce_;
+
+  Bytes key_confirmation_data_;
+  // What the remote party should send to ConfirmKey()
+  Bytes remote_key_confirmation_data_;
+
+  // HMAC keyed with encryption_key_
+  Hmac hmac_;
+
+  std::atomic_bool initialized_ = false;
+};
+}
+
+#endif  // LRM_RESUMEDSPEKE_H_
@@ -19,40 +19,62 @@
 #include "SPEKE.h"
 
 #include <algorithm>
+#include <array>
 #include <chrono>
 #include <stdexcept>
 
-#include <openssl/hmac.h>
-#include <openssl/kdf.h>
-#include <openssl/md5.h>
-
-#include "SPEKE.pb.h"
-
+#include "ConfirmedSpeke.h"
+#include "SpekeCommon.h"
 #include "config.h"
 
+#include <openssl/crypto.h>
+
 #define check_init() check_initialized(__FUNCTION__)
 
 namespace lrm::crypto {
-std::unordered_map<std::string, int> SPEKE::id_counts;
+namespace {
+Bytes to_fixed_bytes(const BigNum& num, size_t size) {
+  Bytes result(size);
+  num.to_bytes(result);
+  return result;
+}
+}
 
 SPEKE::SPEKE(std::string_view id,
              std::string_view password,
              BigNum safe_prime)
-    : mdctx_{EVP_MD_CTX_new()},
-      p_{[&safe_prime]{
-           if (not safe_prime.IsOdd()) {
-             throw std::runtime_error(
-                 "In SPEKE::SPEKE(): safe_prime is not an odd number");
-           }
-           return std::move(safe_prime);}()},
-      q_{(p_ - 1) / 2},
-      gen_{make_generator(password, p_)},
-      privkey_{RandomInRange(1, q_)},
-      pubkey_{gen_.ModExp(privkey_, p_)},
-      id_{make_id(pubkey_, id.data())} {}
+    : SPEKE(id,
+            std::make_shared<const SpekeParams>(password,
+                                                std::move(safe_prime))) {}
+
+SPEKE::SPEKE(std::string_view id, std::shared_ptr<const SpekeParams> params)
+    : SPEKE(id, params, generate_keypair(params)) {}
+
+SPEKE::SPEKE(std::string_view id, SpekeKeypairPool& pool)
+    : SPEKE(id, pool.GetParams(), pool.Pop()) {}
+
+SPEKE::SPEKE(std::string_view id, std::shared_ptr<const SpekeParams> params,
+             SpekeKeypair keypair)
+    : SPEKE(id, std::move(params), TimedKeypair{std::move(keypair)}) {}
+
+SPEKE::SPEKE(std::string_view id, std::shared_ptr<const SpekeParams> params,
+             TimedKeypair keypair)
+    : params_{[&params]{
+                if (not params) {
+                  throw std::invalid_argument(
+                      "In SPEKE::SPEKE(): params must not be nullptr");
+                }
+                return std::move(params);}()},
+      privkey_{std::move(keypair.keypair.privkey)},
+      pubkey_{std::move(keypair.keypair.pubkey)},
+      pubkey_bytes_{to_fixed_bytes(pubkey_,
+                                   params_->GetSafePrime().ByteSize())},
+      id_{MakeSpekeId(pubkey_bytes_, id)},
+      timings_{.keygen = keypair.keygen_time} {}
 
 SPEKE::~SPEKE() {
-  EVP_MD_CTX_free(mdctx_);
+  Cleanse(encryption_key_);
+  Cleanse(nonce_);
 }
 
 Bytes SPEKE::GetPublicKey() const {
@@ -61,7 +83,7 @@ Bytes SPEKE::GetPublicKey() const {
           "SPEKE uninitialized: Can't get the public key");
   }
 
-  return pubkey_.to_bytes();
+  return pubkey_bytes_;
 }
 
 void SPEKE::ProvideRemotePublicKeyIdPair(const Bytes& remote_pubkey,
@@ -76,25 +98,46 @@ void SPEKE::ProvideRemotePublicKeyIdPair(const Bytes& remote_pubkey,
   }
 
   BigNum temp = BigNum(remote_pubkey);
-  if (temp > p_ - 2 or temp < 2) {
+  if (temp > params_->GetPublicKeyMax() or temp < 2) {
     throw std::runtime_error("SPEKE: The remote's public key is invalid");
   }
   remote_pubkey_ = std::move(temp);
+  // The peer may have sent it with a different padding.
+  remote_pubkey_bytes_ = to_fixed_bytes(remote_pubkey_, pubkey_bytes_.size());
 
-  const std::string id_num = std::to_string(++id_counts[remote_id]);
+  const std::string id_num = std::to_string(NextSpekeIdNumber(remote_id));
   id_numbered_ = id_ + "-" + id_num;
   remote_id_numbered_ = remote_id + "-" + id_num;
 
-  auto [key, nonce] = make_encryption_key(
-      make_keying_material(remote_id_numbered_, remote_pubkey_),
-      remote_pubkey_);
+  const auto dh_start = std::chrono::steady_clock::now();
+  Bytes shared_secret = make_shared_secret();
+  const auto kdf_start = std::chrono::steady_clock::now();
+
+  Bytes keying_material = make_keying_material(shared_secret);
+  auto [key, nonce] = make_encryption_key(keying_material);
   encryption_key_ = std::move(key);
   nonce_ = std::move(nonce);
+  Cleanse(keying_material);
+  Cleanse(shared_secret);
+
+  key_confirmation_data_ = gen_kcd(id_numbered_, remote_id_numbered_,
+                                   pubkey_bytes_, remote_pubkey_bytes_,
+                                   transcript_, remote_transcript_);
+  remote_key_confirmation_data_ =
+      gen_kcd(remote_id_numbered_, id_numbered_,
+              remote_pubkey_bytes_, pubkey_bytes_,
+              remote_transcript_, transcript_);
+
+  hmac_.SetKey(encryption_key_);
+
+  timings_.dh = kdf_start - dh_start;
+  timings_.kdf = std::chrono::steady_clock::now() - kdf_start;
+  initialized_.store(true, std::memory_order_release);
+}
 
-  key_confirmation_data_ =
-      gen_kcd(id_numbered_, remote_id_numbered_, pubkey_, remote_pubkey_);
-
-  initialized_ = true;
+void SPEKE::SetTranscript(Bytes transcript, Bytes remote_transcript) {
+  transcript_ = std::move(transcript);
+  remote_transcript_ = std::move(remote_transcript);
 }
 
 const Bytes& SPEKE::GetEncryptionKey() {
@@ -114,203 +157,103 @@ const Bytes& SPEKE::GetKeyConfirmationData() {
 
 bool SPEKE::ConfirmKey(const Bytes& remote_kcd) {
   check_init();
-  return remote_kcd == gen_kcd(remote_id_numbered_, id_numbered_,
-                               remote_pubkey_, pubkey_);
+  return remote_kcd.size() == remote_key_confirmation_data_.size() and
+      CRYPTO_memcmp(remote_kcd.data(), remote_key_confirmation_data_.data(),
+                    remote_kcd.size()) == 0;
 }
 
 Bytes SPEKE::HmacSign(const Bytes& message) {
-  check_init();
-
-  HMAC_CTX* ctx = HMAC_CTX_new();
-
-  HMAC_Init_ex(ctx, encryption_key_.data(), encryption_key_.size(),
-               LRM_SPEKE_HASHFUNC, nullptr);
-  HMAC_Update(ctx,
-              reinterpret_cast<const unsigned char*>(message.data()),
-              message.size());
-
-  Bytes md(EVP_MAX_MD_SIZE);
-  // unsigned char md[EVP_MAX_MD_SIZE];
-  unsigned int len = 0;
-  HMAC_Final(ctx, reinterpret_cast<unsigned char*>(md.data()), &len);
-  md.resize(len);
-
-  HMAC_CTX_free(ctx);
-
-  return md;
+  std::array<std::byte, MAX_HMAC_SIZE> signature;
+  const size_t size = HmacSign(message, signature);
+  return Bytes(signature.begin(), signature.begin() + size);
 }
 
 bool SPEKE::ConfirmHmacSignature(const Bytes& hmac_signature,
                                  const Bytes& message) {
-  check_init();
-  return hmac_signature == HmacSign(message);
+  return ConfirmHmacSignature(std::span<const std::byte>(hmac_signature),
+                              std::span<const std::byte>(message));
 }
 
-BigNum SPEKE::make_generator(std::string_view password, const BigNum& mod) {
-  // Create a hash of the password: H(s)
-  EVP_DigestInit_ex(mdctx_, LRM_SPEKE_HASHFUNC, nullptr);
-  EVP_DigestUpdate(mdctx_, password.data(), password.length());
-
-  unsigned char md_value[EVP_MAX_MD_SIZE];
-  unsigned int md_len;
-  EVP_DigestFinal_ex(mdctx_, md_value, &md_len);
-
-  EVP_MD_CTX_reset(mdctx_);
-
-  // g = H(s)^2 mod p
-  return BigNum(md_value, md_len).ModExp(2, mod);
+size_t SPEKE::HmacSign(std::span<const std::byte> message,
+                       std::span<std::byte, MAX_HMAC_SIZE> hmac_signature) {
+  check_init();
+  return hmac_.Sign(message, hmac_signature);
 }
 
-std::string SPEKE::make_id(const BigNum& pubkey,
-                    const std::string_view prefix) {
-  EVP_MD_CTX* ctx = EVP_MD_CTX_new();
-
-  EVP_DigestInit_ex(ctx, EVP_md5(), nullptr);
-
-  const Bytes pkey = pubkey.to_bytes();
-  assert(not pkey.empty());
-  EVP_DigestUpdate(ctx, pkey.data(), pkey.size());
-
-  const auto timestamp = std::chrono::high_resolution_clock::now()
-                         .time_since_epoch().count();
-  EVP_DigestUpdate(ctx, &timestamp, sizeof(timestamp));
-
-  unsigned char md_val[MD5_DIGEST_LENGTH];
-  unsigned int md_len;
-  EVP_DigestFinal_ex(ctx, md_val, &md_len);
-
-  EVP_MD_CTX_free(ctx);
-
-  std::string buffer(MD5_DIGEST_LENGTH * 2, ' ');
-  for (unsigned int i = 0; i < md_len; ++i) {
-    std::sprintf(buffer.data() + 2*i, "%02X", md_val[i]);
-  }
-
-  return std::string(prefix)  + '-' + buffer;
+bool SPEKE::ConfirmHmacSignature(std::span<const std::byte> hmac_signature,
+                                 std::span<const std::byte> message) {
+  check_init();
+  return hmac_.Verify(hmac_signature, message);
 }
 
-Bytes SPEKE::make_keying_material(const std::string& peer_id,
-                                  const BigNum& peer_pubkey) {
-  Bytes keying_material = peer_pubkey.ModExp(privkey_, p_).to_bytes();
+Hmac::Stream SPEKE::MakeHmacStream() {
+  check_init();
+  return hmac_.MakeStream();
+}
 
-  EVP_DigestInit_ex(mdctx_, LRM_SPEKE_HASHFUNC, nullptr);
+std::unique_ptr<SpekeInterface> SPEKE::Compact() {
+  check_init();
+  return std::make_unique<ConfirmedSpeke>(
+      GetBackend(), GetGroup(), id_, encryption_key_, nonce_,
+      key_confirmation_data_, remote_key_confirmation_data_, timings_);
+}
 
-  const std::string& first_id =
-      std::min(id_numbered_, peer_id);
-  const std::string& second_id =
-      std::max(id_numbered_, peer_id);
-  EVP_DigestUpdate(mdctx_, first_id.c_str(), first_id.length());
-  EVP_DigestUpdate(mdctx_, second_id.c_str(), second_id.length());
+SpekeGroup SPEKE::GetGroup() const {
+  return params_->GetGroup();
+}
 
-  const Bytes first_pubkey = std::min(pubkey_, peer_pubkey).to_bytes();
-  const Bytes second_pubkey = std::max(pubkey_, peer_pubkey).to_bytes();
-  EVP_DigestUpdate(mdctx_, first_pubkey.data(), first_pubkey.size());
-  EVP_DigestUpdate(mdctx_, second_pubkey.data(), second_pubkey.size());
+SpekeHandshakeTimings SPEKE::GetHandshakeTimings() const {
+  return timings_;
+}
 
-  EVP_DigestUpdate(mdctx_, keying_material.data(), keying_material.size());
+SPEKE::TimedKeypair SPEKE::generate_keypair(
+    const std::shared_ptr<const SpekeParams>& params) {
+  // The constructor throws on nullptr.
+  if (not params) return {};
 
-  keying_material.clear();
-  keying_material.resize(EVP_MAX_MD_SIZE);
-  unsigned int md_len;
-  EVP_DigestFinal_ex(
-      mdctx_,
-      reinterpret_cast<unsigned char*>(keying_material.data()),
-      &md_len);
-  keying_material.resize(md_len);
+  const auto start = std::chrono::steady_clock::now();
+  SpekeKeypair keypair = params->GenerateKeypair();
+  return {std::move(keypair), std::chrono::steady_clock::now() - start};
+}
 
-  EVP_MD_CTX_reset(mdctx_);
+Bytes SPEKE::make_shared_secret() const {
+  BigNum shared_secret =
+      remote_pubkey_.ModExp(privkey_, params_->GetMontgomeryContext());
+  shared_secret.SetSecret();
+  return to_fixed_bytes(shared_secret, pubkey_bytes_.size());
+}
 
-  return keying_material;
+Bytes SPEKE::make_keying_material(const Bytes& shared_secret) const {
+  // Pairs of references, nothing is copied.
+  const auto ids = std::minmax(id_numbered_, remote_id_numbered_);
+  const auto keys = std::minmax(pubkey_bytes_, remote_pubkey_bytes_);
+  return MakeKeyingMaterial(ids.first, ids.second,
+                            keys.first, keys.second,
+                            shared_secret);
 }
 
 std::pair<Bytes, Bytes>
-SPEKE::make_encryption_key(const Bytes& keying_material,
-                           const BigNum& peer_pubkey) {
-  EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
-
-  EVP_PKEY_derive_init(pctx);
-  EVP_PKEY_CTX_set_hkdf_md(pctx, LRM_SPEKE_HASHFUNC);
-
-  // generate salt from public keys
-  const auto keys = std::minmax(pubkey_, peer_pubkey);
-  Bytes key = keys.first.to_bytes();
-  Bytes salt;
-  salt.insert(salt.end(), key.begin(), key.end());
-  key = keys.second.to_bytes();
-  salt.insert(salt.end(), key.begin(), key.end());
-
-  EVP_PKEY_CTX_set1_hkdf_salt(pctx, salt.data(), salt.size());
-
-  EVP_PKEY_CTX_set1_hkdf_key(pctx,
-                             keying_material.data(),
-                             keying_material.size());
-
-  constexpr char info[] = "Larmo_SPEKE_HKDF";
-  // 'sizeof - 1' to drop the last null byte
-  EVP_PKEY_CTX_add1_hkdf_info(pctx, info, sizeof(info) - 1);
-
-  const size_t key_len = EVP_CIPHER_key_length(LRM_SPEKE_CIPHER_TYPE);
-  const size_t nonce_len = EVP_CIPHER_iv_length(LRM_SPEKE_CIPHER_TYPE);
-  size_t full_length = key_len + nonce_len;
-  Bytes key_and_nonce(full_length);
-  EVP_PKEY_derive(pctx,
-                  reinterpret_cast<unsigned char*>(key_and_nonce.data()),
-                  &full_length);
-
-  EVP_PKEY_CTX_free(pctx);
-
-  Bytes nonce(std::begin(key_and_nonce) + key_len, std::end(key_and_nonce));
-  // remove nonce from the key_and_nonce, it becomes an encryption key
-  key_and_nonce.resize(key_len);
-
-  return {key_and_nonce, nonce};
+SPEKE::make_encryption_key(const Bytes& keying_material) const {
+  const auto keys = std::minmax(pubkey_bytes_, remote_pubkey_bytes_);
+  return MakeEncryptionKey(keying_material, keys.first, keys.second);
 }
 
 Bytes SPEKE::gen_kcd(std::string_view first_id,
                      std::string_view second_id,
-                     const BigNum& first_pubkey,
-                     const BigNum& second_pubkey) {
-  HMAC_CTX* hmac_ctx = HMAC_CTX_new();
-
-  // HMAC(K, "KC_1_U"|A|B|M|N) -- M and N are pubkeys for A and B respectively
-  HMAC_Init_ex(hmac_ctx, encryption_key_.data(), encryption_key_.size(),
-               LRM_SPEKE_HASHFUNC, nullptr);
-
-  const unsigned char method[] = "KC_1_U";
-  // 'sizeof - 1' to drop the last null byte
-  HMAC_Update(hmac_ctx, method, sizeof(method) - 1);
-
-  HMAC_Update(hmac_ctx,
-              reinterpret_cast<const unsigned char*>(first_id.data()),
-              first_id.size());
-  HMAC_Update(hmac_ctx,
-              reinterpret_cast<const unsigned char*>(second_id.data()),
-              second_id.size());
-
-  Bytes pk_bytes = first_pubkey.to_bytes();
-  HMAC_Update(hmac_ctx,
-              reinterpret_cast<unsigned char*>(pk_bytes.data()),
-              pk_bytes.size());
-  pk_bytes = second_pubkey.to_bytes();
-  HMAC_Update(hmac_ctx,
-              reinterpret_cast<unsigned char*>(pk_bytes.data()),
-              pk_bytes.size());
-
-  Bytes md_value(EVP_MAX_MD_SIZE);
-  unsigned int md_len = 0;
-  HMAC_Final(hmac_ctx,
-             reinterpret_cast<unsigned char*>(md_value.data()),
-             &md_len);
-  md_value.resize(md_len);
-
-  HMAC_CTX_free(hmac_ctx);
-
-  return md_value;
+                     const Bytes& first_pubkey,
+                     const Bytes& second_pubkey,
+                     const Bytes& first_transcript,
+                     const Bytes& second_transcript) const {
+  return MakeKeyConfirmationData(encryption_key_, first_id, second_id,
+                                 first_pubkey, second_pubkey,
+                                 first_transcript, second_transcript);
 }
 
 void SPEKE::check_initialized(const std::string_view function) {
-  if (not initialized_) throw std::logic_error(
-          std::string("Called '") + function.data() +
-          "()' before peer initialization");
+  if (not initialized_.load(std::memory_order_acquire)) {
+    throw std::logic_error(
+        std::string("Called '") + function.data() +
+        "()' before peer initialization");
+  }
 }
 }
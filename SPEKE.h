@@ -21,11 +21,12 @@
 
 #include "SpekeInterface.h"
 
-#include <unordered_map>
-
-#include <openssl/evp.h>
+#include <atomic>
 
 #include "BigNum.h"
+#include "Hmac.h"
+#include "SpekeKeypairPool.h"
+#include "SpekeParams.h"
 
 namespace lrm::crypto {
 
@@ -54,13 +55,27 @@ namespace lrm::crypto {
 /// This step is used to confirm that the remote party has the same password,
 /// so it acts as an authentication mechanism.
 ///
+/// When many sessions use the same password and safe prime, construct them
+/// from a single \ref SpekeParams object instead, so the group and the
+/// generator are computed only once. A \ref SpekeKeypairPool can also take
+/// the generation of the keypair off the thread constructing the session.
+///
 /// To combat impersonation attacks a session adds a counter to an id and
 /// a remote id provided by the user, so when the session is dropped it can't
 /// be restored. The counter is incremented when \ref
 /// ProvideRemotePublicKeyIdPair() is called.
+///
+/// \section speke_threads Thread safety
+///
+/// Construction and \ref ProvideRemotePublicKeyIdPair() have to happen on
+/// one thread, or be synchronized externally. Once
+/// \ref ProvideRemotePublicKeyIdPair() has returned, the session doesn't
+/// change anymore and every other method, most notably \ref HmacSign() and
+/// \ref ConfirmHmacSignature(), can be called from any number of threads at
+/// once without locking. Each call uses its own (or thread-local) OpenSSL
+/// contexts. Different sessions can always be used concurrently,
+/// including their handshakes.
 class SPEKE : public SpekeInterface {
-  static std::unordered_map<std::string, int> id_counts;
-
  public:
   SPEKE(const SPEKE&) = delete;
   /// \param id Unique identifier.
@@ -69,8 +84,29 @@ class SPEKE : public SpekeInterface {
   ///        <tt> p = 2q + 1 </tt> where \c q is also a prime. Shared with the
   ///        remote party.
   SPEKE(std::string_view id, std::string_view password, BigNum safe_prime);
+  /// \param id Unique identifier.
+  /// \param params Group and generator shared with other sessions. Both
+  ///        the password and the safe prime must match the remote party's.
+  SPEKE(std::string_view id, std::shared_ptr<const SpekeParams> params);
+  /// \param id Unique identifier.
+  /// \param params Group and generator shared with other sessions.
+  /// \param keypair Ephemeral keypair generated with \e params, i.e. by
+  ///        SpekeParams::GenerateKeypair(). It must not be used by any other
+  ///        session.
+  SPEKE(std::string_view id, std::shared_ptr<const SpekeParams> params,
+        SpekeKeypair keypair);
+  /// \param id Unique identifier.
+  /// \param pool Pool to take the precomputed ephemeral keypair and the
+  ///        parameters from.
+  SPEKE(std::string_view id, SpekeKeypairPool& pool);
   virtual ~SPEKE();
 
+  inline SpekeBackend GetBackend() const final {
+    return SpekeBackend::FINITE_FIELD;
+  }
+
+  SpekeGroup GetGroup() const final;
+
   Bytes GetPublicKey() const final;
 
   inline const std::string& GetId() const final {
@@ -84,6 +120,8 @@ class SPEKE : public SpekeInterface {
       const Bytes& remote_pubkey,
       const std::string& remote_id) final;
 
+  void SetTranscript(Bytes transcript, Bytes remote_transcript) final;
+
   /// Return the encryption key created by using HKDF on Diffie-Hellman key
   /// provided by the SPEKE algorithm.
   ///
@@ -127,41 +165,70 @@ class SPEKE : public SpekeInterface {
       const Bytes& hmac_signature,
       const Bytes& message) final;
 
- private:
-  /// \brief Make an ID out of the public key and the timestamp.
+  /// Sign a \e message with HMAC and write the signature to
+  /// \e hmac_signature without allocating memory.
   ///
-  /// \param prefix The resulting ID will be prepended with this value.
+  /// The key schedule of HMAC is computed once, in
+  /// \ref ProvideRemotePublicKeyIdPair().
   ///
-  /// \return Newly generated id.
-  BigNum make_generator(std::string_view password, const BigNum& mod);
-  std::string make_id(const BigNum& pubkey,
-                      const std::string_view prefix = "");
+  /// \return Length of the signature.
+  size_t HmacSign(std::span<const std::byte> message,
+                  std::span<std::byte, MAX_HMAC_SIZE> hmac_signature) final;
+
+  /// Confirm a signature created by the remote party with \ref HmacSign()
+  /// without allocating memory. The comparison takes constant time.
+  bool ConfirmHmacSignature(
+      std::span<const std::byte> hmac_signature,
+      std::span<const std::byte> message) final;
+
+  /// The stream is keyed like \ref HmacSign().
+  Hmac::Stream MakeHmacStream() final;
+
+  /// Return a \ref ConfirmedSpeke with the keys of this session.
+  std::unique_ptr<SpekeInterface> Compact() final;
 
+  /// The keygen phase is only measured if the keypair was generated by this
+  /// object, not given or taken from a pool.
+  SpekeHandshakeTimings GetHandshakeTimings() const final;
+
+ private:
+  struct TimedKeypair {
+    SpekeKeypair keypair;
+    std::chrono::nanoseconds keygen_time{0};
+  };
+  static TimedKeypair generate_keypair(
+      const std::shared_ptr<const SpekeParams>& params);
+  SPEKE(std::string_view id, std::shared_ptr<const SpekeParams> params,
+        TimedKeypair keypair);
+
+  // (remote_pubkey_ ^ privkey_) mod p, padded to the size of p
+  Bytes make_shared_secret() const;
   // H(min(id_numbered_, remote_id_numbered_),
   //   max(id_numbered_, remote_id_numbered_),
   //   min(pubkey_, remote_pubkey_),
   //   max(pubkey_, remote_pubkey_),
-  //   (remote_pubkey_ ^ privkey_) mod p_)
-  Bytes make_keying_material(const std::string& peer_id,
-                             const BigNum& peer_pubkey);
+  //   shared_secret)
+  Bytes make_keying_material(const Bytes& shared_secret) const;
   /// \brief Make a pair of \e Bytes - encryption key and nonce in that order.
-  std::pair<Bytes, Bytes> make_encryption_key(const Bytes& keying_material,
-                                              const BigNum& peer_pubkey);
+  std::pair<Bytes, Bytes> make_encryption_key(
+      const Bytes& keying_material) const;
   Bytes gen_kcd(std::string_view first_id, std::string_view second_id,
-                const BigNum& first_pubkey, const BigNum& second_pubkey);
+                const Bytes& first_pubkey, const Bytes& second_pubkey,
+                const Bytes& first_transcript,
+                const Bytes& second_transcript) const;
   void check_initialized(const std::string_view function);
 
-  EVP_MD_CTX* mdctx_;
-
-  const BigNum p_;   // safe prime
-  const BigNum q_;   // (p_ - 1) / 2
-  const BigNum gen_; // H(password)^2 mod p_
+  // p, q and the generator, shared between sessions
+  const std::shared_ptr<const SpekeParams> params_;
 
-  // random value in [1; q_ - 1]
+  // random value in [1; q - 1]
   const BigNum privkey_;
 
-  // (gen_ ^ privkey_) mod p_
+  // (gen ^ privkey_) mod p
   const BigNum pubkey_;
+  // pubkey_ serialized once, padded to the size of p. Public keys are
+  // hashed in this form, so padded keys compare like the numbers.
+  const Bytes pubkey_bytes_;
 
   const std::string id_;
   std::string id_numbered_;
@@ -170,14 +237,27 @@ class SPEKE : public SpekeInterface {
 
   // public key of the remote party
   BigNum remote_pubkey_;
+  Bytes remote_pubkey_bytes_;
+
+  // see SetTranscript()
+  Bytes transcript_;
+  Bytes remote_transcript_;
 
   // a uniform key derived from keying material with HKDF
   Bytes encryption_key_;
   Bytes nonce_;
 
   Bytes key_confirmation_data_;
+  // What the remote party should send to ConfirmKey()
+  Bytes remote_key_confirmation_data_;
+
+  // HMAC keyed with encryption_key_
+  Hmac hmac_;
+
+  // Written before initialized_ is set, except for keygen.
+  SpekeHandshakeTimings timings_;
 
-  bool initialized_ = false;
+  std::atomic_bool initialized_ = false;
 };
 }
 
@@ -0,0 +1,233 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "SpekeCommon.h"
+
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <stdexcept>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/kdf.h>
+#include <openssl/md5.h>
+#include <openssl/rand.h>
+
+#include "SpekeIdRegistry.h"
+
+namespace lrm::crypto {
+std::string MakeSpekeId(const Bytes& pubkey, std::string_view prefix) {
+  EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+
+  EVP_DigestInit_ex(ctx, EVP_md5(), nullptr);
+
+  assert(not pubkey.empty());
+  EVP_DigestUpdate(ctx, pubkey.data(), pubkey.size());
+
+  const auto timestamp = std::chrono::high_resolution_clock::now()
+                         .time_since_epoch().count();
+  EVP_DigestUpdate(ctx, &timestamp, sizeof(timestamp));
+
+  unsigned char md_val[MD5_DIGEST_LENGTH];
+  unsigned int md_len;
+  EVP_DigestFinal_ex(ctx, md_val, &md_len);
+
+  EVP_MD_CTX_free(ctx);
+
+  std::string buffer(MD5_DIGEST_LENGTH * 2, ' ');
+  for (unsigned int i = 0; i < md_len; ++i) {
+    std::sprintf(buffer.data() + 2*i, "%02X", md_val[i]);
+  }
+
+  return std::string(prefix)  + '-' + buffer;
+}
+
+Bytes MakeRandomBytes(size_t size) {
+  Bytes result(size);
+  if (RAND_bytes(reinterpret_cast<unsigned char*>(result.data()),
+                 result.size()) != 1) {
+    throw std::runtime_error(
+        __PRETTY_FUNCTION__ + std::string(": RAND_bytes() failed"));
+  }
+  return result;
+}
+
+void Cleanse(Bytes& bytes) noexcept {
+  OPENSSL_cleanse(bytes.data(), bytes.size());
+}
+
+int NextSpekeIdNumber(const std::string& remote_id) {
+  static SpekeIdRegistry registry;
+
+  return registry.Next(remote_id);
+}
+
+Bytes MakeKeyingMaterial(std::string_view first_id,
+                         std::string_view second_id,
+                         const Bytes& first_pubkey,
+                         const Bytes& second_pubkey,
+                         const Bytes& shared_secret) {
+  EVP_MD_CTX* mdctx = EVP_MD_CTX_new();
+
+  EVP_DigestInit_ex(mdctx, LRM_SPEKE_HASHFUNC, nullptr);
+
+  EVP_DigestUpdate(mdctx, first_id.data(), first_id.length());
+  EVP_DigestUpdate(mdctx, second_id.data(), second_id.length());
+
+  EVP_DigestUpdate(mdctx, first_pubkey.data(), first_pubkey.size());
+  EVP_DigestUpdate(mdctx, second_pubkey.data(), second_pubkey.size());
+
+  EVP_DigestUpdate(mdctx, shared_secret.data(), shared_secret.size());
+
+  Bytes keying_material(EVP_MAX_MD_SIZE);
+  unsigned int md_len;
+  EVP_DigestFinal_ex(
+      mdctx,
+      reinterpret_cast<unsigned char*>(keying_material.data()),
+      &md_len);
+  keying_material.resize(md_len);
+
+  EVP_MD_CTX_free(mdctx);
+
+  return keying_material;
+}
+
+std::pair<Bytes, Bytes> MakeEncryptionKey(const Bytes& keying_material,
+                                          const Bytes& first_pubkey,
+                                          const Bytes& second_pubkey) {
+  EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+
+  EVP_PKEY_derive_init(pctx);
+  EVP_PKEY_CTX_set_hkdf_md(pctx, LRM_SPEKE_HASHFUNC);
+
+  // generate salt from public keys
+  Bytes salt;
+  salt.reserve(first_pubkey.size() + second_pubkey.size());
+  salt.insert(salt.end(), first_pubkey.begin(), first_pubkey.end());
+  salt.insert(salt.end(), second_pubkey.begin(), second_pubkey.end());
+
+  EVP_PKEY_CTX_set1_hkdf_salt(pctx, salt.data(), salt.size());
+
+  EVP_PKEY_CTX_set1_hkdf_key(pctx,
+                             keying_material.data(),
+                             keying_material.size());
+
+  constexpr char info[] = "Larmo_SPEKE_HKDF";
+  // 'sizeof - 1' to drop the last null byte
+  EVP_PKEY_CTX_add1_hkdf_info(pctx, info, sizeof(info) - 1);
+
+  const size_t key_len = EVP_CIPHER_key_length(LRM_SPEKE_CIPHER_TYPE);
+  const size_t nonce_len = EVP_CIPHER_iv_length(LRM_SPEKE_CIPHER_TYPE);
+  size_t full_length = key_len + nonce_len;
+  Bytes key_and_nonce(full_length);
+  EVP_PKEY_derive(pctx,
+                  reinterpret_cast<unsigned char*>(key_and_nonce.data()),
+                  &full_length);
+
+  EVP_PKEY_CTX_free(pctx);
+
+  Bytes nonce(std::begin(key_and_nonce) + key_len, std::end(key_and_nonce));
+  // remove nonce from the key_and_nonce, it becomes an encryption key
+  key_and_nonce.resize(key_len);
+
+  return {key_and_nonce, nonce};
+}
+
+Bytes MakeResumptionSecret(const Bytes& encryption_key, const Bytes& nonce) {
+  EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+
+  EVP_PKEY_derive_init(pctx);
+  EVP_PKEY_CTX_set_hkdf_md(pctx, LRM_SPEKE_HASHFUNC);
+  EVP_PKEY_CTX_set1_hkdf_salt(pctx, nonce.data(), nonce.size());
+  EVP_PKEY_CTX_set1_hkdf_key(pctx, encryption_key.data(),
+                             encryption_key.size());
+
+  // Different info than in MakeEncryptionKey(), so the secret doesn't
+  // reveal anything about the key.
+  constexpr char info[] = "Larmo_SPEKE_resumption";
+  // 'sizeof - 1' to drop the last null byte
+  EVP_PKEY_CTX_add1_hkdf_info(pctx, info, sizeof(info) - 1);
+
+  size_t length = EVP_MD_size(LRM_SPEKE_HASHFUNC);
+  Bytes secret(length);
+  EVP_PKEY_derive(pctx, reinterpret_cast<unsigned char*>(secret.data()),
+                  &length);
+
+  EVP_PKEY_CTX_free(pctx);
+
+  return secret;
+}
+
+Bytes MakeKeyConfirmationData(const Bytes& key,
+                              std::string_view first_id,
+                              std::string_view second_id,
+                              const Bytes& first_pubkey,
+                              const Bytes& second_pubkey,
+                              const Bytes& first_transcript,
+                              const Bytes& second_transcript) {
+  HMAC_CTX* hmac_ctx = HMAC_CTX_new();
+
+  HMAC_Init_ex(hmac_ctx, key.data(), key.size(),
+               LRM_SPEKE_HASHFUNC, nullptr);
+
+  const unsigned char method[] = "KC_1_U";
+  // 'sizeof - 1' to drop the last null byte
+  HMAC_Update(hmac_ctx, method, sizeof(method) - 1);
+
+  HMAC_Update(hmac_ctx,
+              reinterpret_cast<const unsigned char*>(first_id.data()),
+              first_id.size());
+  HMAC_Update(hmac_ctx,
+              reinterpret_cast<const unsigned char*>(second_id.data()),
+              second_id.size());
+
+  HMAC_Update(hmac_ctx,
+              reinterpret_cast<const unsigned char*>(first_pubkey.data()),
+              first_pubkey.size());
+  HMAC_Update(hmac_ctx,
+              reinterpret_cast<const unsigned char*>(second_pubkey.data()),
+              second_pubkey.size());
+
+  if (not first_transcript.empty() or not second_transcript.empty()) {
+    for (const Bytes* transcript : {&first_transcript, &second_transcript}) {
+      unsigned char length[sizeof(uint64_t)];
+      for (size_t i = 0; i < sizeof(length); ++i) {
+        length[i] = static_cast<unsigned char>(
+            uint64_t{transcript->size()} >> (8 * (sizeof(length) - 1 - i)));
+      }
+      HMAC_Update(hmac_ctx, length, sizeof(length));
+      HMAC_Update(hmac_ctx,
+                  reinterpret_cast<const unsigned char*>(transcript->data()),
+                  transcript->size());
+    }
+  }
+
+  Bytes md_value(EVP_MAX_MD_SIZE);
+  unsigned int md_len = 0;
+  HMAC_Final(hmac_ctx,
+             reinterpret_cast<unsigned char*>(md_value.data()),
+             &md_len);
+  md_value.resize(md_len);
+
+  HMAC_CTX_free(hmac_ctx);
+
+  return md_value;
+}
+}
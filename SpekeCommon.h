@@ -0,0 +1,94 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef LRM_SPEKECOMMON_H_
+#define LRM_SPEKECOMMON_H_
+
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "config.h"
+
+// Building blocks shared by the SpekeInterface implementations. Everything
+// that doesn't depend on the group the Diffie-Hellman exchange happens in
+// lives here, so the backends derive keys in exactly the same way.
+namespace lrm::crypto {
+/// \brief Make an ID out of the public key and the timestamp.
+///
+/// \param prefix The resulting ID will be prepended with this value.
+///
+/// \return Newly generated id.
+std::string MakeSpekeId(const Bytes& pubkey, std::string_view prefix);
+
+/// \brief Make \e size cryptographically secure random bytes.
+///
+/// \throw std::runtime_error If the random generator failed.
+Bytes MakeRandomBytes(size_t size);
+
+/// Overwrite \e bytes with zeros in a way the compiler doesn't optimize
+/// out, for keys and secrets that are about to be freed.
+void Cleanse(Bytes& bytes) noexcept;
+
+/// \brief Count a session with the peer identified by \e remote_id.
+///
+/// Thread-safe. Counts are kept in a process-wide \ref SpekeIdRegistry, so
+/// they're forgotten for the least recently seen ids.
+///
+/// \return Number of sessions with \e remote_id, including this one.
+int NextSpekeIdNumber(const std::string& remote_id);
+
+/// <tt> H(first_id|second_id|first_pubkey|second_pubkey|shared_secret) </tt>
+///
+/// The ids and the public keys have to be sorted in the same way by both
+/// parties.
+Bytes MakeKeyingMaterial(std::string_view first_id,
+                         std::string_view second_id,
+                         const Bytes& first_pubkey,
+                         const Bytes& second_pubkey,
+                         const Bytes& shared_secret);
+
+/// \brief Derive an encryption key and a nonce, in that order, from
+/// \e keying_material with HKDF.
+///
+/// Public keys are used as salt and have to be sorted in the same way by
+/// both parties.
+std::pair<Bytes, Bytes> MakeEncryptionKey(const Bytes& keying_material,
+                                          const Bytes& first_pubkey,
+                                          const Bytes& second_pubkey);
+
+/// \brief Derive a secret for resuming the session later, from its
+/// \e encryption_key and \e nonce with HKDF.
+///
+/// It's the same for both parties, see \ref ResumedSpeke.
+Bytes MakeResumptionSecret(const Bytes& encryption_key, const Bytes& nonce);
+
+/// <tt> HMAC(K, "KC_1_U"|A|B|M|N|len(S)|S|len(T)|T) </tt> -- M and N are
+/// public keys for A and B respectively, S and T the transcripts of what
+/// they sent, see \ref SpekeInterface::SetTranscript(). The lengths are
+/// 64-bit big-endian, and both transcripts are left out if they're empty.
+Bytes MakeKeyConfirmationData(const Bytes& key,
+                              std::string_view first_id,
+                              std::string_view second_id,
+                              const Bytes& first_pubkey,
+                              const Bytes& second_pubkey,
+                              const Bytes& first_transcript = {},
+                              const Bytes& second_transcript = {});
+}
+
+#endif  // LRM_SPEKECOMMON_H_
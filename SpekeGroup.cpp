@@ -0,0 +1,88 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#include "SpekeGroup.h"
+
+#include <array>
+#include <stdexcept>
+#include <string>
+
+#include <openssl/bn.h>
+
+namespace lrm::crypto {
+namespace {
+constexpr std::array known_groups = {
+  SpekeGroup::LRM_4096, SpekeGroup::MODP_2048, SpekeGroup::MODP_3072,
+  SpekeGroup::MODP_4096, SpekeGroup::MODP_6144};
+
+BigNum rfc3526_prime(BIGNUM* (*get_prime)(BIGNUM*)) {
+  BigNum prime;
+  get_prime(prime.get());
+  return prime;
+}
+}
+
+BigNum GetSpekeGroupPrime(SpekeGroup group) {
+  switch (group) {
+    case SpekeGroup::LRM_4096:
+      return BigNum(LRM_SPEKE_SAFE_PRIME);
+    case SpekeGroup::MODP_2048:
+      return rfc3526_prime(BN_get_rfc3526_prime_2048);
+    case SpekeGroup::MODP_3072:
+      return rfc3526_prime(BN_get_rfc3526_prime_3072);
+    case SpekeGroup::MODP_4096:
+      return rfc3526_prime(BN_get_rfc3526_prime_4096);
+    case SpekeGroup::MODP_6144:
+      return rfc3526_prime(BN_get_rfc3526_prime_6144);
+    default:
+      throw std::invalid_argument(
+          __PRETTY_FUNCTION__ +
+          std::string(": The group has no known prime"));
+  }
+}
+
+int GetSpekeGroupBits(SpekeGroup group) noexcept {
+  switch (group) {
+    case SpekeGroup::MODP_2048:
+      return 2048;
+    case SpekeGroup::MODP_3072:
+      return 3072;
+    case SpekeGroup::LRM_4096:
+    case SpekeGroup::MODP_4096:
+      return 4096;
+    case SpekeGroup::MODP_6144:
+      return 6144;
+    default:
+      return 0;
+  }
+}
+
+SpekeGroup FindSpekeGroup(const BigNum& safe_prime) {
+  // Only primes of the right size can match, so most are ruled out without
+  // building any of the known ones.
+  const int bits = BN_num_bits(safe_prime.get());
+  for (SpekeGroup group : known_groups) {
+    if (GetSpekeGroupBits(group) == bits and
+        GetSpekeGroupPrime(group) == safe_prime) {
+      return group;
+    }
+  }
+  return SpekeGroup::CUSTOM;
+}
+}
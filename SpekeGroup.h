@@ -0,0 +1,72 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#ifndef LRM_SPEKEGROUP_H_
+#define LRM_SPEKEGROUP_H_
+
+#include <cstdint>
+
+#include "BigNum.h"
+
+namespace lrm::crypto {
+/// \brief Vetted safe-prime group of the \ref SpekeBackend::FINITE_FIELD
+/// backend.
+///
+/// The MODP groups are the ones from RFC 3526, with the RFC's numbers as
+/// values. Smaller groups make handshakes cheaper. With full-length
+/// exponents the cost grows roughly with the cube of the size, so a
+/// 2048-bit handshake is about 8 times cheaper than a 4096-bit one, and with
+/// \ref short_exponents about 4 times. 2048 bits give about 112 bits of
+/// security, 3072 bits about 128.
+///
+/// Sessions carry the group of their public key in \e InitData, so peers
+/// using different ones fail early and can negotiate the cheapest group
+/// they both accept, see \ref SpekeSessionOptions::speke_factory.
+enum class SpekeGroup : uint32_t {
+  /// A prime given to \ref SpekeParams that isn't one of the below. Peers
+  /// can't tell if they use the same one.
+  CUSTOM = 0,
+  /// \ref LRM_SPEKE_SAFE_PRIME, 4096 bits. Kept for peers that use it, but
+  /// <tt> (p - 1) / 2 </tt> isn't a prime, so it's not a safe prime. New
+  /// deployments should use a MODP group.
+  LRM_4096 = 1,
+  MODP_2048 = 14,
+  MODP_3072 = 15,
+  MODP_4096 = 16,
+  MODP_6144 = 17
+};
+
+/// \brief Get the safe prime of \e group.
+///
+/// \throw std::invalid_argument If the group is \ref SpekeGroup::CUSTOM or
+/// unknown.
+BigNum GetSpekeGroupPrime(SpekeGroup group);
+
+/// \brief Get the size of the prime of \e group in bits.
+///
+/// \return 0 for \ref SpekeGroup::CUSTOM and unknown groups.
+int GetSpekeGroupBits(SpekeGroup group) noexcept;
+
+/// \brief Find the group \e safe_prime belongs to.
+///
+/// \return \ref SpekeGroup::CUSTOM if it's none of the known ones.
+SpekeGroup FindSpekeGroup(const BigNum& safe_prime);
+}
+
+#endif  // LRM_SPEKEGROUP_H_
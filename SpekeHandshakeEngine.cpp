@@ -0,0 +1,64 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "SpekeHandshakeEngine.h"
+
+#include <stdexcept>
+
+namespace lrm::crypto {
+SpekeHandshakeEngine::SpekeHandshakeEngine(size_t num_threads)
+    : pool_(num_threads) {}
+
+SpekeHandshakeEngine::~SpekeHandshakeEngine() {
+  pool_.join();
+}
+
+void SpekeHandshakeEngine::ProvideRemotePublicKeyIdPair(
+    std::shared_ptr<SpekeInterface> speke,
+    Bytes remote_pubkey,
+    std::string remote_id,
+    asio::any_io_executor executor,
+    CompletionHandler&& handler) {
+  if (not speke) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'speke' must not be nullptr"));
+  }
+
+  ++pending_;
+  asio::post(
+      pool_,
+      [this,
+       speke = std::move(speke),
+       remote_pubkey = std::move(remote_pubkey),
+       remote_id = std::move(remote_id),
+       executor = std::move(executor),
+       handler = std::move(handler)]() mutable {
+        std::exception_ptr error;
+        try {
+          speke->ProvideRemotePublicKeyIdPair(remote_pubkey, remote_id);
+        } catch (...) {
+          error = std::current_exception();
+        }
+        --pending_;
+
+        asio::post(executor,
+                   [handler = std::move(handler), error]{ handler(error); });
+      });
+}
+}
@@ -0,0 +1,88 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef LRM_SPEKEHANDSHAKEENGINE_H_
+#define LRM_SPEKEHANDSHAKEENGINE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <asio.hpp>
+
+#include "SpekeInterface.h"
+
+namespace lrm::crypto {
+/// \brief Worker pool running the expensive part of SPEKE handshakes.
+///
+/// \ref SpekeInterface::ProvideRemotePublicKeyIdPair() validates the remote
+/// public key, does the Diffie-Hellman exponentiation and derives the keys,
+/// which takes milliseconds with big primes. When many peers connect at
+/// once, doing it on the thread that read the peer's message stalls every
+/// other session on that thread.
+///
+/// The engine takes this work from any number of sessions and runs it on
+/// its own threads. The completion handler is posted to the executor given
+/// with the work, so it runs on the same thread (or strand) as the rest of
+/// the session.
+///
+/// A single engine is meant to be shared between all sessions, i.e. with
+/// \ref SpekeSession::SetHandshakeEngine(). All methods are thread-safe.
+class SpekeHandshakeEngine {
+ public:
+  /// Called with \c nullptr on success or with the exception thrown by
+  /// \ref SpekeInterface::ProvideRemotePublicKeyIdPair().
+  using CompletionHandler = std::function<void(std::exception_ptr)>;
+
+  SpekeHandshakeEngine(const SpekeHandshakeEngine&) = delete;
+  SpekeHandshakeEngine& operator=(const SpekeHandshakeEngine&) = delete;
+  /// \param num_threads Number of worker threads.
+  explicit SpekeHandshakeEngine(
+      size_t num_threads = std::max(1u, std::thread::hardware_concurrency()));
+  /// Wait for the submitted work to finish and stop the workers.
+  ~SpekeHandshakeEngine();
+
+  /// \brief Call \ref SpekeInterface::ProvideRemotePublicKeyIdPair()
+  /// on a worker thread.
+  ///
+  /// \param speke Session to provide the remote's data to. It's kept alive
+  ///        until the work is done.
+  /// \param executor Executor the \e handler is posted to.
+  /// \param handler Function called when the work is done.
+  void ProvideRemotePublicKeyIdPair(std::shared_ptr<SpekeInterface> speke,
+                                    Bytes remote_pubkey,
+                                    std::string remote_id,
+                                    asio::any_io_executor executor,
+                                    CompletionHandler&& handler);
+
+  /// Return the number of handshakes submitted and not finished yet.
+  inline size_t GetPending() const noexcept {
+    return pending_;
+  }
+
+ private:
+  asio::thread_pool pool_;
+  std::atomic_size_t pending_ = 0;
+};
+}
+
+#endif  // LRM_SPEKEHANDSHAKEENGINE_H_
@@ -0,0 +1,67 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#include "SpekeIdRegistry.h"
+
+#include <stdexcept>
+
+namespace lrm::crypto {
+SpekeIdRegistry::SpekeIdRegistry(size_t capacity, size_t shards)
+    : shard_capacity_(shards != 0 ? capacity / shards : 0),
+      shards_(new Shard[shards]),
+      shard_count_(shards) {
+  if (shards == 0 or shards > capacity) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'shards' must be between 1 and 'capacity'"));
+  }
+}
+
+int SpekeIdRegistry::Next(const std::string& remote_id) {
+  Shard& shard =
+      shards_[std::hash<std::string_view>{}(remote_id) % shard_count_];
+
+  std::lock_guard lck{shard.mtx};
+  if (auto it = shard.index.find(remote_id); it != shard.index.end()) {
+    shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+    return ++it->second->second;
+  }
+
+  if (shard.entries.size() >= shard_capacity_) {
+    // The node is reused for the new id.
+    shard.index.erase(shard.entries.back().first);
+    shard.entries.splice(shard.entries.begin(), shard.entries,
+                         std::prev(shard.entries.end()));
+    shard.entries.front() = {remote_id, 1};
+  } else {
+    shard.entries.emplace_front(remote_id, 1);
+  }
+  shard.index.emplace(shard.entries.front().first, shard.entries.begin());
+  return 1;
+}
+
+size_t SpekeIdRegistry::Size() const {
+  size_t size = 0;
+  for (size_t i = 0; i < shard_count_; ++i) {
+    std::lock_guard lck{shards_[i].mtx};
+    size += shards_[i].entries.size();
+  }
+  return size;
+}
+}
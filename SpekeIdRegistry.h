@@ -0,0 +1,84 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#ifndef LRM_SPEKEIDREGISTRY_H_
+#define LRM_SPEKEIDREGISTRY_H_
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+#include "config.h"
+
+namespace lrm::crypto {
+/// \brief Bounded counter of sessions with each remote id.
+///
+/// Ids are split between shards by their hash. Every shard has its own
+/// lock and keeps at most <tt> capacity / shards </tt> ids, evicting the
+/// least recently used one when it's full. Handshakes with different peers
+/// rarely touch the same shard, so they don't wait for each other, and the
+/// memory used doesn't grow with the number of handshakes.
+///
+/// An evicted id starts counting from 1 again. Ids made by
+/// \ref MakeSpekeId() are unique, so it only matters for peers reusing an
+/// id after the registry saw \e capacity other ids.
+///
+/// All methods are thread-safe.
+class SpekeIdRegistry {
+ public:
+  SpekeIdRegistry(const SpekeIdRegistry&) = delete;
+  SpekeIdRegistry& operator=(const SpekeIdRegistry&) = delete;
+  /// \param capacity Maximal number of ids kept.
+  /// \param shards Number of shards, at most \e capacity.
+  ///
+  /// \throw std::invalid_argument If \e shards is 0 or greater than
+  /// \e capacity.
+  explicit SpekeIdRegistry(
+      size_t capacity = LRM_SPEKE_ID_REGISTRY_CAPACITY,
+      size_t shards = LRM_SPEKE_ID_REGISTRY_SHARDS);
+
+  /// \brief Count a session with the peer identified by \e remote_id.
+  ///
+  /// \return Number of sessions with \e remote_id, including this one.
+  int Next(const std::string& remote_id);
+
+  /// Return the number of ids kept.
+  size_t Size() const;
+
+ private:
+  struct Shard {
+    mutable std::mutex mtx;
+    // Most recently used at the front. Keys of the map point into it.
+    std::list<std::pair<std::string, int>> entries;
+    std::unordered_map<std::string_view,
+                       std::list<std::pair<std::string, int>>::iterator>
+        index;
+  };
+
+  const size_t shard_capacity_;
+  const std::unique_ptr<Shard[]> shards_;
+  const size_t shard_count_;
+};
+}
+
+#endif  // LRM_SPEKEIDREGISTRY_H_
@@ -19,19 +19,53 @@
 #ifndef LRM_SPEKEINTERFACE_H_
 #define LRM_SPEKEINTERFACE_H_
 
-#include <vector>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <vector>
+
+#include <algorithm>
+#include <memory>
 
+#include "Hmac.h"
+#include "SpekeGroup.h"
+#include "SpekeStats.h"
 #include "config.h"
 
 namespace lrm::crypto {
+/// Group in which the Diffie-Hellman exchange of a SPEKE session happens.
+/// Both parties have to use the same one.
+enum class SpekeBackend {
+  /// Multiplicative group modulo a safe prime, see \ref SPEKE.
+  FINITE_FIELD = 0,
+  /// Elliptic curve group, see \ref EcSpeke.
+  ELLIPTIC_CURVE = 1
+};
+
 /// \brief Abstract class for SPEKE implementation.
 ///
 /// More info in \ref SPEKE.
+///
+/// Implementations should allow calling every method except
+/// \ref ProvideRemotePublicKeyIdPair() from multiple threads once
+/// \ref ProvideRemotePublicKeyIdPair() has returned.
 class SpekeInterface {
  public:
+  /// Maximal length of an HMAC signature.
+  static constexpr size_t MAX_HMAC_SIZE = EVP_MAX_MD_SIZE;
+
   virtual ~SpekeInterface() {};
 
+  virtual SpekeBackend GetBackend() const = 0;
+
+  /// \brief Get the group of a \ref SpekeBackend::FINITE_FIELD public key.
+  ///
+  /// It's \ref SpekeGroup::CUSTOM when it's not known, or for other
+  /// backends.
+  virtual SpekeGroup GetGroup() const {
+    return SpekeGroup::CUSTOM;
+  }
+
   virtual Bytes GetPublicKey() const = 0;
 
   virtual const std::string& GetId() const = 0;
@@ -40,6 +74,17 @@ class SpekeInterface {
       const Bytes& remote_pubkey,
       const std::string& remote_id) = 0;
 
+  /// \brief Bind what both parties sent before the key exchange into the
+  /// key confirmation data.
+  ///
+  /// \e transcript is what this party sent and \e remote_transcript what
+  /// it received, so \ref ConfirmKey() fails if either was changed on the
+  /// way. It has to be called before \ref ProvideRemotePublicKeyIdPair().
+  ///
+  /// \throw std::logic_error In the default implementation, for
+  /// implementations that can't bind a transcript.
+  virtual void SetTranscript(Bytes transcript, Bytes remote_transcript);
+
   virtual const Bytes& GetEncryptionKey() = 0;
 
   virtual const Bytes& GetNonce() = 0;
@@ -53,7 +98,85 @@ class SpekeInterface {
   virtual bool ConfirmHmacSignature(
       const Bytes& hmac_signature,
       const Bytes& message) = 0;
+
+  /// \brief Return the time spent generating the keypair and in
+  /// \ref ProvideRemotePublicKeyIdPair().
+  ///
+  /// Only \ref SpekeHandshakeTimings::keygen, \ref SpekeHandshakeTimings::dh
+  /// and \ref SpekeHandshakeTimings::kdf are set. The default implementation
+  /// doesn't measure anything and returns zeros.
+  virtual SpekeHandshakeTimings GetHandshakeTimings() const {
+    return {};
+  }
+
+  /// \brief Sign a \e message with HMAC, writing the signature to
+  /// \e hmac_signature.
+  ///
+  /// \return Length of the signature.
+  ///
+  /// The default implementation uses HmacSign(const Bytes&), implementations
+  /// should override it with one that doesn't allocate.
+  virtual size_t HmacSign(std::span<const std::byte> message,
+                          std::span<std::byte, MAX_HMAC_SIZE> hmac_signature);
+
+  /// \brief Confirm a signature created by the remote party.
+  ///
+  /// The default implementation uses
+  /// ConfirmHmacSignature(const Bytes&, const Bytes&), implementations should
+  /// override it with one that doesn't allocate.
+  virtual bool ConfirmHmacSignature(
+      std::span<const std::byte> hmac_signature,
+      std::span<const std::byte> message);
+
+  /// \brief Start an HMAC of a message given in parts, keyed like
+  /// \ref HmacSign().
+  ///
+  /// \throw std::logic_error In the default implementation, for
+  /// implementations that can't sign incrementally.
+  virtual Hmac::Stream MakeHmacStream();
+
+  /// \brief Make a copy of the session with only what's needed once the
+  /// keys are derived.
+  ///
+  /// \ref SpekeSession replaces its SPEKE with the copy right after the
+  /// handshake, so the private key and the group parameters are freed for
+  /// the rest of the session. The default implementation returns nullptr,
+  /// i.e. the session keeps using this object.
+  ///
+  /// \throw std::logic_error If the keys aren't derived yet.
+  virtual std::unique_ptr<SpekeInterface> Compact();
 };
+
+inline size_t SpekeInterface::HmacSign(
+    std::span<const std::byte> message,
+    std::span<std::byte, MAX_HMAC_SIZE> hmac_signature) {
+  const Bytes signature = HmacSign(Bytes(message.begin(), message.end()));
+  const size_t size = std::min(signature.size(), hmac_signature.size());
+  std::copy_n(signature.begin(), size, hmac_signature.begin());
+  return size;
+}
+
+inline bool SpekeInterface::ConfirmHmacSignature(
+    std::span<const std::byte> hmac_signature,
+    std::span<const std::byte> message) {
+  return ConfirmHmacSignature(
+      Bytes(hmac_signature.begin(), hmac_signature.end()),
+      Bytes(message.begin(), message.end()));
+}
+
+inline void SpekeInterface::SetTranscript(Bytes, Bytes) {
+  throw std::logic_error(
+      "SpekeInterface: Binding a transcript is not supported");
+}
+
+inline Hmac::Stream SpekeInterface::MakeHmacStream() {
+  throw std::logic_error(
+      "SpekeInterface: Incremental HMAC is not supported");
+}
+
+inline std::unique_ptr<SpekeInterface> SpekeInterface::Compact() {
+  return nullptr;
+}
 }
 
 #endif  // LRM_SPEKEINTERFACE_H_
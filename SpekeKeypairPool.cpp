@@ -0,0 +1,143 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "SpekeKeypairPool.h"
+
+#include <stdexcept>
+
+namespace lrm::crypto {
+SpekeKeypairPool::SpekeKeypairPool(std::shared_ptr<const SpekeParams> params,
+                                   size_t capacity,
+                                   size_t low_water_mark,
+                                   size_t num_threads)
+    : params_{std::move(params)},
+      capacity_{capacity},
+      low_water_mark_{low_water_mark} {
+  if (not params_) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'params' must not be nullptr"));
+  }
+  if (capacity_ == 0) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'capacity' must be greater than 0"));
+  }
+  if (low_water_mark_ >= capacity_) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'low_water_mark' must be lower than 'capacity'"));
+  }
+  if (num_threads == 0) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'num_threads' must be greater than 0"));
+  }
+
+  workers_.reserve(num_threads);
+  for (size_t i = 0; i < num_threads; ++i) {
+    workers_.emplace_back([this]{ work(); });
+  }
+}
+
+SpekeKeypairPool::~SpekeKeypairPool() {
+  {
+    std::lock_guard lck{mtx_};
+    stopped_ = true;
+  }
+  refill_cv_.notify_all();
+
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+SpekeKeypair SpekeKeypairPool::Pop() {
+  {
+    std::unique_lock lck{mtx_};
+    if (not keypairs_.empty()) {
+      SpekeKeypair keypair = std::move(keypairs_.front());
+      keypairs_.pop_front();
+
+      if (not refilling_ and keypairs_.size() <= low_water_mark_) {
+        refilling_ = true;
+        lck.unlock();
+        refill_cv_.notify_all();
+      }
+      return keypair;
+    }
+  }
+
+  // The pool is empty, don't wait for the workers.
+  return params_->GenerateKeypair();
+}
+
+void SpekeKeypairPool::SetLowWaterMark(size_t low_water_mark) {
+  if (low_water_mark >= capacity_) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'low_water_mark' must be lower than the capacity"));
+  }
+  {
+    std::lock_guard lck{mtx_};
+    low_water_mark_ = low_water_mark;
+    if (keypairs_.size() <= low_water_mark_) {
+      refilling_ = true;
+    }
+  }
+  refill_cv_.notify_all();
+}
+
+size_t SpekeKeypairPool::Size() const {
+  std::lock_guard lck{mtx_};
+  return keypairs_.size();
+}
+
+void SpekeKeypairPool::work() {
+  std::unique_lock lck{mtx_};
+  while (true) {
+    refill_cv_.wait(lck, [this]{
+      return stopped_ or
+          (refilling_ and keypairs_.size() + in_progress_ < capacity_);
+    });
+    if (stopped_) return;
+
+    ++in_progress_;
+    lck.unlock();
+
+    SpekeKeypair keypair;
+    try {
+      keypair = params_->GenerateKeypair();
+    } catch (const std::runtime_error& e) {
+      // The RNG failed. Leave this worker, Pop() will generate keypairs
+      // itself if there are no workers left.
+      // TODO: Log it
+      lck.lock();
+      --in_progress_;
+      return;
+    }
+
+    lck.lock();
+    --in_progress_;
+    keypairs_.push_back(std::move(keypair));
+    if (keypairs_.size() >= capacity_) {
+      refilling_ = false;
+    }
+  }
+}
+}
@@ -0,0 +1,107 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef LRM_SPEKEKEYPAIRPOOL_H_
+#define LRM_SPEKEKEYPAIRPOOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "SpekeParams.h"
+
+namespace lrm::crypto {
+/// \brief Pool of precomputed \ref SPEKE keypairs for one \ref SpekeParams.
+///
+/// Generating a keypair requires a modular exponentiation with the full
+/// size of the safe prime, which is the most expensive part of
+/// constructing \ref SPEKE. The pool keeps up to \e capacity keypairs ready
+/// and refills itself on its own worker threads, so the thread accepting
+/// connections only has to take one from the queue:
+/// \code{.cpp}
+/// SpekeKeypairPool pool(params, 64, 16);
+/// // For every connection:
+/// auto speke = std::make_shared<SPEKE>("server", pool);
+/// \endcode
+///
+/// Workers start refilling when the number of keypairs drops to the low
+/// water mark and stop when the pool is full again. If the pool is empty
+/// \ref Pop() generates the keypair on the calling thread instead of
+/// waiting.
+///
+/// Every keypair is given out only once. All methods are thread-safe.
+class SpekeKeypairPool {
+ public:
+  SpekeKeypairPool(const SpekeKeypairPool&) = delete;
+  SpekeKeypairPool& operator=(const SpekeKeypairPool&) = delete;
+  /// \param params Parameters the keypairs are generated for.
+  /// \param capacity Maximum number of keypairs kept in the pool.
+  /// \param low_water_mark Number of keypairs left in the pool at which
+  ///        the workers start refilling it. Must be lower than \e capacity.
+  /// \param num_threads Number of worker threads.
+  SpekeKeypairPool(std::shared_ptr<const SpekeParams> params,
+                   size_t capacity,
+                   size_t low_water_mark,
+                   size_t num_threads = 1);
+  /// Stop the worker threads, waiting for the keypairs being generated.
+  ~SpekeKeypairPool();
+
+  /// \brief Take a keypair out of the pool.
+  ///
+  /// If the pool is empty, a keypair is generated on the calling thread.
+  SpekeKeypair Pop();
+
+  /// \brief Set the number of keypairs at which the pool starts refilling.
+  ///
+  /// \param low_water_mark Must be lower than the capacity of the pool.
+  void SetLowWaterMark(size_t low_water_mark);
+
+  /// Return the number of keypairs ready to be taken.
+  size_t Size() const;
+
+  inline size_t GetCapacity() const noexcept {
+    return capacity_;
+  }
+
+  inline const std::shared_ptr<const SpekeParams>& GetParams() const noexcept {
+    return params_;
+  }
+
+ private:
+  void work();
+
+  const std::shared_ptr<const SpekeParams> params_;
+  const size_t capacity_;
+
+  mutable std::mutex mtx_;
+  std::condition_variable refill_cv_;
+  std::deque<SpekeKeypair> keypairs_;
+  size_t low_water_mark_;
+  // Keypairs currently generated by the workers
+  size_t in_progress_ = 0;
+  bool refilling_ = true;
+  bool stopped_ = false;
+
+  std::vector<std::thread> workers_;
+};
+}
+
+#endif  // LRM_SPEKEKEYPAIRPOOL_H_
@@ -0,0 +1,98 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "SpekeParams.h"
+
+#include <stdexcept>
+
+#include <openssl/evp.h>
+
+#include "config.h"
+
+namespace lrm::crypto {
+SpekeParams::SpekeParams(std::string_view password, BigNum safe_prime,
+                         int exponent_bits, int fixed_base_window_bits)
+    : p_{[&safe_prime]{
+           if (not safe_prime.IsOdd()) {
+             throw std::runtime_error(
+                 "In SpekeParams::SpekeParams(): safe_prime is not an odd "
+                 "number");
+           }
+           return std::move(safe_prime);}()},
+      group_{FindSpekeGroup(p_)},
+      mont_{MontgomeryContext::GetShared(p_)},
+      q_{(p_ - 1) / 2},
+      pubkey_max_{p_ - 2},
+      gen_{make_generator(password, *mont_)},
+      exponent_bits_{[exponent_bits]{
+                       if (exponent_bits < 0) {
+                         throw std::invalid_argument(
+                             "In SpekeParams::SpekeParams(): exponent_bits "
+                             "must not be negative");
+                       }
+                       return exponent_bits;}()},
+      privkey_max_{[this]{
+                     if (exponent_bits_ > 0) {
+                       BigNum max = (BigNum(2) ^ exponent_bits_) - 1;
+                       if (max < q_) return max;
+                     }
+                     return q_ - 1;}()},
+      fixed_base_{[this, fixed_base_window_bits]()
+                  -> std::unique_ptr<const FixedBaseTable> {
+                    if (fixed_base_window_bits == 0) return nullptr;
+                    return std::make_unique<const FixedBaseTable>(
+                        gen_, mont_, BN_num_bits(privkey_max_.get()),
+                        fixed_base_window_bits);}()} {}
+
+SpekeParams::SpekeParams(std::string_view password, SpekeGroup group,
+                         int exponent_bits, int fixed_base_window_bits)
+    : SpekeParams(password, GetSpekeGroupPrime(group), exponent_bits,
+                  fixed_base_window_bits) {}
+
+SpekeKeypair SpekeParams::GenerateKeypair() const {
+  SpekeKeypair keypair;
+  keypair.privkey.SetSecret();
+  // [0; privkey_max_) + 1
+  RandomInRangeInto(keypair.privkey, privkey_max_);
+  keypair.privkey += 1;
+  if (fixed_base_) {
+    fixed_base_->ModExpInto(keypair.pubkey, keypair.privkey);
+  } else {
+    gen_.ModExpInto(keypair.pubkey, keypair.privkey, *mont_);
+  }
+  return keypair;
+}
+
+BigNum SpekeParams::make_generator(std::string_view password,
+                                   const MontgomeryContext& mont) {
+  EVP_MD_CTX* mdctx = EVP_MD_CTX_new();
+
+  // Create a hash of the password: H(s)
+  EVP_DigestInit_ex(mdctx, LRM_SPEKE_HASHFUNC, nullptr);
+  EVP_DigestUpdate(mdctx, password.data(), password.length());
+
+  unsigned char md_value[EVP_MAX_MD_SIZE];
+  unsigned int md_len;
+  EVP_DigestFinal_ex(mdctx, md_value, &md_len);
+
+  EVP_MD_CTX_free(mdctx);
+
+  // g = H(s)^2 mod p
+  return BigNum(md_value, md_len).ModExp(2, mont);
+}
+}
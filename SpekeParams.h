@@ -0,0 +1,178 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef LRM_SPEKEPARAMS_H_
+#define LRM_SPEKEPARAMS_H_
+
+#include <memory>
+#include <string_view>
+
+#include "BigNum.h"
+#include "FixedBaseTable.h"
+#include "SpekeGroup.h"
+
+namespace lrm::crypto {
+/// Ephemeral keypair of a \ref SPEKE session.
+struct SpekeKeypair {
+  // random value in [1; q - 1]
+  BigNum privkey;
+  // (gen ^ privkey) mod p
+  BigNum pubkey;
+};
+
+/// \brief Group and generator shared by every \ref SPEKE session using the
+/// same password and safe prime.
+///
+/// Computing the generator requires hashing the password and
+/// a modular exponentiation, and \c q requires a division of big numbers.
+/// None of it depends on the session, so it can be done once and the object
+/// can be shared between any number of \ref SPEKE instances, i.e.:
+/// \code{.cpp}
+/// auto params = std::make_shared<const SpekeParams>(
+///     password, BigNum(LRM_SPEKE_SAFE_PRIME));
+/// // For every connection:
+/// auto speke = std::make_shared<SPEKE>("server", params);
+/// \endcode
+///
+/// \section short_exponents Short exponents
+///
+/// By default private keys are drawn from the whole <tt>[1; q - 1]</tt>
+/// range, so with the 4096-bit prime every exponentiation uses a ~4095-bit
+/// exponent. Setting \e exponent_bits limits private keys to that many
+/// bits, which makes both exponentiations of a handshake proportionally
+/// cheaper.
+///
+/// The best known attacks on a short exponent (e.g. Pollard's lambda) run
+/// in about <tt>2^(exponent_bits / 2)</tt> steps, so an exponent of twice the
+/// desired security level is as hard to recover as the discrete logarithm
+/// in the group itself (van Oorschot and Wiener, 1996). With a safe prime
+/// the small-subgroup attacks that break short exponents in other groups
+/// don't apply. A 4096-bit group provides about 150 bits of security, so
+/// \ref LRM_SPEKE_SHORT_EXPONENT_BITS (320) doesn't weaken it. Values
+/// below 256 are not recommended.
+///
+/// Only the local private key is affected, so peers using short and
+/// full-length exponents can talk to each other.
+///
+/// \section fixed_base Fixed-base table
+///
+/// The generator is the base of every public key, so with
+/// \e fixed_base_window_bits set the object precomputes a
+/// \ref FixedBaseTable of its powers and \ref GenerateKeypair() uses it.
+/// With 4-bit windows a keypair is several times faster to generate. The
+/// table takes <tt> ceil(bits / w) * 2^w </tt> numbers of the size of \c p,
+/// where \c bits is the length of private keys: for the 4096-bit prime and
+/// w = 4 that's 640 KiB with \ref LRM_SPEKE_SHORT_EXPONENT_BITS and 8 MiB
+/// with full-length keys. It's built once and shared by every session using
+/// the object.
+///
+/// The object is immutable after construction so it's safe to share it
+/// between threads.
+class SpekeParams {
+ public:
+  SpekeParams(const SpekeParams&) = delete;
+  SpekeParams& operator=(const SpekeParams&) = delete;
+  /// \param password A password shared with the remote party.
+  /// \param safe_prime Big prime number meeting the requirement of
+  ///        <tt> p = 2q + 1 </tt> where \c q is also a prime. Shared with the
+  ///        remote party.
+  /// \param exponent_bits Maximum length of private keys in bits. 0 means
+  ///        full-length keys. See \ref short_exponents.
+  /// \param fixed_base_window_bits Window width of the table of generator
+  ///        powers, from 1 to \ref FixedBaseTable::MAX_WINDOW_BITS. 0 means
+  ///        no table. See \ref fixed_base.
+  SpekeParams(std::string_view password, BigNum safe_prime,
+              int exponent_bits = 0, int fixed_base_window_bits = 0);
+  /// \param password A password shared with the remote party.
+  /// \param group One of the vetted groups, see \ref SpekeGroup.
+  /// \param exponent_bits See above.
+  /// \param fixed_base_window_bits See above.
+  ///
+  /// \throw std::invalid_argument If \e group is \ref SpekeGroup::CUSTOM.
+  SpekeParams(std::string_view password, SpekeGroup group,
+              int exponent_bits = 0, int fixed_base_window_bits = 0);
+
+  /// The group of the safe prime, \ref SpekeGroup::CUSTOM if it isn't one
+  /// of the known ones.
+  inline SpekeGroup GetGroup() const noexcept {
+    return group_;
+  }
+
+  /// The safe prime \c p.
+  inline const BigNum& GetSafePrime() const noexcept {
+    return p_;
+  }
+
+  /// The order of the subgroup the generator belongs to:
+  /// <tt> q = (p - 1) / 2 </tt>
+  inline const BigNum& GetSubgroupOrder() const noexcept {
+    return q_;
+  }
+
+  /// <tt> H(password)^2 mod p </tt>
+  inline const BigNum& GetGenerator() const noexcept {
+    return gen_;
+  }
+
+  /// Maximum length of private keys in bits, 0 if they're full-length.
+  inline int GetExponentBits() const noexcept {
+    return exponent_bits_;
+  }
+
+  /// The largest valid public key: <tt> p - 2 </tt>
+  inline const BigNum& GetPublicKeyMax() const noexcept {
+    return pubkey_max_;
+  }
+
+  /// Montgomery setup for the modular exponentiations mod \c p.
+  inline const MontgomeryContext& GetMontgomeryContext() const noexcept {
+    return *mont_;
+  }
+
+  /// The table of generator powers, nullptr if it's not used.
+  inline const FixedBaseTable* GetFixedBaseTable() const noexcept {
+    return fixed_base_.get();
+  }
+
+  /// Generate a new ephemeral keypair in the group.
+  ///
+  /// Safe to call from multiple threads at once. Intermediates come from
+  /// the thread's \c BN_CTX, so only the keys themselves are allocated.
+  SpekeKeypair GenerateKeypair() const;
+
+ private:
+  static BigNum make_generator(std::string_view password,
+                               const MontgomeryContext& mont);
+
+  const BigNum p_;   // safe prime
+  const SpekeGroup group_;
+  // Montgomery setup for p_, shared with every other SpekeParams using p_
+  const std::shared_ptr<const MontgomeryContext> mont_;
+  const BigNum q_;   // (p_ - 1) / 2
+  const BigNum pubkey_max_; // p_ - 2
+  const BigNum gen_; // H(password)^2 mod p_
+
+  const int exponent_bits_;
+  // Maximal private key: min(q_ - 1, 2^exponent_bits_ - 1)
+  const BigNum privkey_max_;
+
+  const std::unique_ptr<const FixedBaseTable> fixed_base_;
+};
+}
+
+#endif  // LRM_SPEKEPARAMS_H_
@@ -0,0 +1,365 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#include "SpekeServer.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+#include <sys/socket.h>
+
+namespace lrm::crypto {
+namespace {
+// SO_REUSEPORT as a SettableSocketOption, asio has no public one.
+class ReusePort {
+ public:
+  explicit ReusePort(bool enabled) : value_(enabled ? 1 : 0) {}
+
+  template <typename Protocol>
+  int level(const Protocol&) const {
+    return SOL_SOCKET;
+  }
+
+  template <typename Protocol>
+  int name(const Protocol&) const {
+    return SO_REUSEPORT;
+  }
+
+  template <typename Protocol>
+  const void* data(const Protocol&) const {
+    return &value_;
+  }
+
+  template <typename Protocol>
+  size_t size(const Protocol&) const {
+    return sizeof(value_);
+  }
+
+ private:
+  int value_;
+};
+}
+
+template <typename Protocol>
+SpekeServer<Protocol>::Shard::Shard(asio::io_context& context)
+    : strand(asio::make_strand(context)),
+      acceptor(strand),
+      reap_timer(strand) {}
+
+template <typename Protocol>
+SpekeServer<Protocol>::SpekeServer(
+    asio::io_context& context,
+    const typename Protocol::endpoint& endpoint,
+    SpekeFactory&& speke_factory,
+    typename Session::MessageHandler&& handler,
+    const SpekeServerOptions& options)
+    : context_(context),
+      endpoint_(endpoint),
+      speke_factory_(std::move(speke_factory)),
+      handler_(std::move(handler)),
+      options_(options) {
+  if (not speke_factory_) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'speke_factory' must be a valid function"));
+  }
+  if (not handler_) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'handler' must be a valid function"));
+  }
+
+  const size_t shards =
+      options_.shards != 0 ? options_.shards :
+      std::max(1u, std::thread::hardware_concurrency());
+  for (size_t i = 0; i < shards; ++i) {
+    shards_.push_back(std::make_unique<Shard>(context_));
+  }
+
+  // Only TCP can spread the connections between many acceptors listening on
+  // the same endpoint.
+  if constexpr (std::is_same_v<Protocol, asio::ip::tcp>) {
+    accepting_shards_ = shards_.size();
+  } else {
+    accepting_shards_ = 1;
+  }
+  for (size_t i = 0; i < accepting_shards_; ++i) {
+    // May throw
+    open_acceptor(*shards_[i]);
+    // If the port was chosen by the system, use it for the rest.
+    if (i == 0) endpoint_ = shards_[0]->acceptor.local_endpoint();
+  }
+}
+
+template <typename Protocol>
+SpekeServer<Protocol>::~SpekeServer() {
+  // Nothing runs on the context anymore, so everything can be destroyed
+  // directly, without going through the strands.
+  stopped_ = true;
+  for (auto& shard : shards_) {
+    asio::error_code ec;
+    shard->acceptor.close(ec);
+    shard->reap_timer.cancel();
+    for (auto& pending : shard->pending) {
+      pending.session->Close(SpekeSessionState::STOPPED);
+    }
+    for (auto& session : shard->established) {
+      session->Close(SpekeSessionState::STOPPED);
+    }
+  }
+  shards_.clear();
+}
+
+template <typename Protocol>
+void SpekeServer<Protocol>::open_acceptor(Shard& shard) {
+  shard.acceptor.open(endpoint_.protocol());
+  if constexpr (std::is_same_v<Protocol, asio::ip::tcp>) {
+    shard.acceptor.set_option(asio::socket_base::reuse_address(true));
+    shard.acceptor.set_option(ReusePort(true));
+  }
+  shard.acceptor.bind(endpoint_);
+  shard.acceptor.listen();
+}
+
+template <typename Protocol>
+void SpekeServer<Protocol>::Run() {
+  if (running_.exchange(true)) {
+    throw std::logic_error(
+        __PRETTY_FUNCTION__ +
+        std::string(": The server can only be started once"));
+  }
+
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    Shard& shard = *shards_[i];
+    const bool accepting = i < accepting_shards_;
+    asio::post(shard.strand,
+               [this, &shard, accepting, alive = std::weak_ptr(alive_)]{
+                 if (alive.expired()) return;
+                 if (accepting) start_accepting(shard);
+                 arm_reap_timer(shard);
+               });
+  }
+}
+
+template <typename Protocol>
+void SpekeServer<Protocol>::Stop() {
+  if (stopped_.exchange(true)) return;
+
+  for (auto& shard_ptr : shards_) {
+    Shard& shard = *shard_ptr;
+    asio::post(shard.strand,
+               [this, &shard, alive = std::weak_ptr(alive_)]{
+                 if (alive.expired()) return;
+                 stop_shard(shard);
+               });
+  }
+}
+
+template <typename Protocol>
+typename Protocol::endpoint SpekeServer<Protocol>::GetLocalEndpoint() const {
+  return endpoint_;
+}
+
+template <typename Protocol>
+size_t SpekeServer<Protocol>::GetSessionCount() const noexcept {
+  return session_count_;
+}
+
+template <typename Protocol>
+size_t SpekeServer<Protocol>::GetPendingHandshakes() const noexcept {
+  return pending_handshakes_;
+}
+
+template <typename Protocol>
+void SpekeServer<Protocol>::start_accepting(Shard& shard) {
+  if (stopped_) return;
+  if (pending_handshakes_ >= options_.max_pending_handshakes) {
+    // Resumed by reap() when some handshakes finish.
+    shard.accept_paused = true;
+    return;
+  }
+
+  // Sessions get the context's executor, they make their own strands.
+  shard.acceptor.async_accept(
+      asio::any_io_executor(context_.get_executor()),
+      asio::bind_executor(
+          shard.strand,
+          [this, &shard, alive = std::weak_ptr(alive_)](
+              const asio::error_code& ec,
+              typename Protocol::socket socket) {
+            if (alive.expired()) return;
+            handle_accept(shard, ec, std::move(socket));
+          }));
+}
+
+template <typename Protocol>
+void SpekeServer<Protocol>::handle_accept(Shard& shard,
+                                          const asio::error_code& ec,
+                                          typename Protocol::socket&& socket) {
+  if (ec) {
+    if (ec == asio::error::operation_aborted or stopped_) return;
+    // TODO: Log it
+    start_accepting(shard);
+    return;
+  }
+
+  if (accepting_shards_ == shards_.size()) {
+    add_session(shard, std::move(socket));
+  } else {
+    // One acceptor feeds all the shards.
+    Shard& target = *shards_[next_shard_++ % shards_.size()];
+    asio::post(target.strand,
+               [this, &target, socket = std::move(socket),
+                alive = std::weak_ptr(alive_)]() mutable {
+                 if (alive.expired()) return;
+                 add_session(target, std::move(socket));
+               });
+  }
+
+  start_accepting(shard);
+}
+
+template <typename Protocol>
+void SpekeServer<Protocol>::add_session(Shard& shard,
+                                        typename Protocol::socket&& socket) {
+  if (stopped_) return;
+
+  std::shared_ptr<Session> session;
+  try {
+    session = std::make_shared<Session>(std::move(socket), speke_factory_(),
+                                        options_.session_options);
+    ++session_count_;
+    if (options_.handshake_engine) {
+      session->SetHandshakeEngine(options_.handshake_engine);
+    }
+    auto handler = handler_;
+    session->Run(std::move(handler));
+  } catch (const std::exception& e) {
+    // TODO: Log it
+    if (session) release(std::move(session));
+    return;
+  }
+
+  ++pending_handshakes_;
+  shard.pending.push_back(
+      {std::move(session),
+       std::chrono::steady_clock::now() + options_.handshake_timeout});
+}
+
+template <typename Protocol>
+void SpekeServer<Protocol>::arm_reap_timer(Shard& shard) {
+  if (stopped_) return;
+
+  shard.reap_timer.expires_after(options_.reap_interval);
+  shard.reap_timer.async_wait(
+      [this, &shard, alive = std::weak_ptr(alive_)](
+          const asio::error_code& ec) {
+        if (alive.expired() or ec == asio::error::operation_aborted) return;
+        reap(shard);
+        arm_reap_timer(shard);
+      });
+}
+
+template <typename Protocol>
+void SpekeServer<Protocol>::reap(Shard& shard) {
+  const auto now = std::chrono::steady_clock::now();
+
+  // Sessions in the handshake are few, all of them are checked.
+  for (size_t i = 0; i < shard.pending.size();) {
+    PendingSession& pending = shard.pending[i];
+    const SpekeSessionState state = pending.session->GetState();
+
+    if (state >= SpekeSessionState::STOPPED) {
+      release(std::move(pending.session));
+    } else if (pending.session->IsAuthenticated()) {
+      shard.established.push_back(std::move(pending.session));
+    } else if (now >= pending.deadline) {
+      // TODO: Log it
+      pending.session->Close(SpekeSessionState::STOPPED);
+      release(std::move(pending.session));
+    } else {
+      ++i;
+      continue;
+    }
+
+    --pending_handshakes_;
+    pending = std::move(shard.pending.back());
+    shard.pending.pop_back();
+  }
+
+  // Established sessions can be many, only a batch of them is checked,
+  // starting where the last reap stopped.
+  auto& established = shard.established;
+  for (size_t n = 0; n < options_.reap_batch and not established.empty();
+       ++n) {
+    if (shard.reap_cursor >= established.size()) shard.reap_cursor = 0;
+
+    auto& session = established[shard.reap_cursor];
+    if (session->GetState() >= SpekeSessionState::STOPPED) {
+      release(std::move(session));
+      session = std::move(established.back());
+      established.pop_back();
+    } else {
+      ++shard.reap_cursor;
+    }
+  }
+
+  if (shard.accept_paused and
+      pending_handshakes_ < options_.max_pending_handshakes) {
+    shard.accept_paused = false;
+    start_accepting(shard);
+  }
+}
+
+template <typename Protocol>
+void SpekeServer<Protocol>::stop_shard(Shard& shard) {
+  asio::error_code ec;
+  shard.acceptor.close(ec);
+  // TODO: Log if ec
+  shard.reap_timer.cancel();
+
+  for (auto& pending : shard.pending) {
+    pending.session->Close(SpekeSessionState::STOPPED);
+    release(std::move(pending.session));
+    --pending_handshakes_;
+  }
+  shard.pending.clear();
+
+  for (auto& session : shard.established) {
+    session->Close(SpekeSessionState::STOPPED);
+    release(std::move(session));
+  }
+  shard.established.clear();
+}
+
+template <typename Protocol>
+void SpekeServer<Protocol>::release(std::shared_ptr<Session>&& session) {
+  --session_count_;
+  const auto executor = session->GetExecutor();
+  asio::post(executor, [session = std::move(session)]() mutable {
+                         session.reset();
+                       });
+}
+
+template class SpekeServer<asio::ip::tcp>;
+template class SpekeServer<asio::local::stream_protocol>;
+}
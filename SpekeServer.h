@@ -0,0 +1,179 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#ifndef LRM_SPEKESERVER_H_
+#define LRM_SPEKESERVER_H_
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <asio.hpp>
+
+#include "SpekeSession.h"
+
+namespace lrm::crypto {
+/// Tunables of a \ref SpekeServer.
+struct SpekeServerOptions {
+  /// Number of shards, each with its own acceptor, registry and reaper.
+  /// For \c asio::ip::tcp every shard listens on the endpoint with
+  /// SO_REUSEPORT. For \c asio::local::stream_protocol there is one
+  /// acceptor and it hands new sessions to the shards in turn. 0 means one
+  /// per hardware thread.
+  size_t shards = 0;
+  /// Maximal number of sessions in the handshake at once. When it's reached
+  /// the server stops accepting connections until some of them finish. The
+  /// limit is approximate, every shard can go over it by one.
+  size_t max_pending_handshakes = LRM_SPEKE_SERVER_MAX_PENDING_HANDSHAKES;
+  /// Sessions that didn't pass the key confirmation in this time are closed.
+  std::chrono::steady_clock::duration handshake_timeout =
+      std::chrono::milliseconds(LRM_SPEKE_SERVER_HANDSHAKE_TIMEOUT_MS);
+  /// How often every shard reaps closed sessions.
+  std::chrono::steady_clock::duration reap_interval =
+      std::chrono::milliseconds(LRM_SPEKE_SERVER_REAP_INTERVAL_MS);
+  /// Maximal number of established sessions checked by a shard per reap.
+  size_t reap_batch = LRM_SPEKE_SERVER_REAP_BATCH;
+  /// Options of every session.
+  SpekeSessionOptions session_options;
+  /// If set, used by every session, see
+  /// \ref SpekeSession::SetHandshakeEngine().
+  std::shared_ptr<SpekeHandshakeEngine> handshake_engine;
+};
+
+/// \brief Listener that accepts connections and owns a \ref SpekeSession for
+/// every one of them.
+///
+/// Sessions are split between shards. Each shard keeps its sessions in its
+/// own registry, touched only on the shard's strand, so there is no lock
+/// shared between the shards. Every \ref SpekeServerOptions::reap_interval
+/// a shard destroys the sessions that are closed
+/// (\ref SpekeSessionState::STOPPED or above), and closes the ones that
+/// were in the handshake for too long.
+///
+/// Example:
+/// \code{.cpp}
+/// SpekeKeypairPool pool(params, 1024, 256);
+/// SpekeServer<asio::ip::tcp> server(
+///     context, {asio::ip::tcp::v4(), 5555},
+///     [&pool]{ return std::make_shared<SPEKE>("server", pool); },
+///     [](auto message, auto& session) { /* Handle message... */ });
+/// server.Run();
+/// context.run();
+/// \endcode
+///
+/// All public methods are thread-safe. The server must be destroyed only
+/// after the io_context stopped running its handlers.
+template <typename Protocol>
+class SpekeServer {
+ public:
+  using Session = SpekeSession<Protocol>;
+  /// Makes a \ref SpekeInterface for every new connection. It runs on the
+  /// io_context, so it should be quick, e.g. use a \ref SpekeKeypairPool.
+  using SpekeFactory = std::function<std::shared_ptr<SpekeInterface>()>;
+
+  SpekeServer(const SpekeServer&) = delete;
+  SpekeServer& operator=(const SpekeServer&) = delete;
+  /// \param context The context running the acceptors and sessions.
+  /// \param endpoint Local endpoint to listen on.
+  /// \param speke_factory Function making a \ref SpekeInterface for every
+  ///        session.
+  /// \param handler Message handler given to every session.
+  /// \param options See \ref SpekeServerOptions.
+  SpekeServer(asio::io_context& context,
+              const typename Protocol::endpoint& endpoint,
+              SpekeFactory&& speke_factory,
+              typename Session::MessageHandler&& handler,
+              const SpekeServerOptions& options = {});
+  ~SpekeServer();
+
+  /// \brief Start accepting connections.
+  void Run();
+
+  /// \brief Stop accepting connections and close all sessions.
+  ///
+  /// It's asynchronous, sessions are closed on their shards' strands.
+  void Stop();
+
+  /// \brief Get the endpoint the server listens on.
+  typename Protocol::endpoint GetLocalEndpoint() const;
+
+  /// Return the number of sessions owned by the server.
+  size_t GetSessionCount() const noexcept;
+
+  /// Return the number of sessions that didn't pass the key confirmation
+  /// yet.
+  size_t GetPendingHandshakes() const noexcept;
+
+ private:
+  struct PendingSession {
+    std::shared_ptr<Session> session;
+    std::chrono::steady_clock::time_point deadline;
+  };
+
+  struct Shard {
+    explicit Shard(asio::io_context& context);
+
+    asio::strand<asio::io_context::executor_type> strand;
+    typename Protocol::acceptor acceptor;
+    asio::steady_timer reap_timer;
+    // Only touched on the strand.
+    std::vector<PendingSession> pending;
+    std::vector<std::shared_ptr<Session>> established;
+    size_t reap_cursor = 0;
+    bool accept_paused = false;
+  };
+
+  void open_acceptor(Shard& shard);
+  // All of these run on the shard's strand.
+  void start_accepting(Shard& shard);
+  void handle_accept(Shard& shard, const asio::error_code& ec,
+                     typename Protocol::socket&& socket);
+  void add_session(Shard& shard, typename Protocol::socket&& socket);
+  void arm_reap_timer(Shard& shard);
+  void reap(Shard& shard);
+  void stop_shard(Shard& shard);
+
+  // Destroy the session on its own strand.
+  void release(std::shared_ptr<Session>&& session);
+
+  asio::io_context& context_;
+  typename Protocol::endpoint endpoint_;
+  SpekeFactory speke_factory_;
+  typename Session::MessageHandler handler_;
+  const SpekeServerOptions options_;
+
+  std::vector<std::unique_ptr<Shard>> shards_;
+  // Shards with an open acceptor
+  size_t accepting_shards_ = 0;
+  std::atomic_size_t next_shard_ = 0;
+
+  std::atomic_size_t session_count_ = 0;
+  std::atomic_size_t pending_handshakes_ = 0;
+  std::atomic_bool running_ = false;
+  std::atomic_bool stopped_ = false;
+
+  // Handlers hold a weak_ptr to this, so they know if the server still
+  // exists.
+  std::shared_ptr<void> alive_ = std::make_shared<bool>();
+};
+}
+
+#endif  // LRM_SPEKESERVER_H_
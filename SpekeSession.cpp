@@ -18,19 +18,112 @@
 
 #include "SpekeSession.h"
 
+#include <algorithm>
+
 #include "SPEKE.pb.h"
 #include "openssl/md5.h"
 
+#include "SpekeCommon.h"
 #include "Util.h"
 
 namespace lrm::crypto {
+namespace {
+google::protobuf::ArenaOptions arena_options(char* block) {
+  google::protobuf::ArenaOptions options;
+  options.initial_block = block;
+  options.initial_block_size = LRM_SPEKE_ARENA_BLOCK_SIZE;
+  return options;
+}
+
+// Little-endian base 128, the same as protobuf varints.
+size_t varint_size(uint64_t value) {
+  size_t size = 1;
+  for (; value >= 0x80; value >>= 7) ++size;
+  return size;
+}
+
+std::byte* write_varint(uint64_t value, std::byte* out) {
+  for (; value >= 0x80; value >>= 7) {
+    *out++ = static_cast<std::byte>(value | 0x80);
+  }
+  *out++ = static_cast<std::byte>(value);
+  return out;
+}
+
+// Return the number of bytes read or 0 if \e in doesn't start with a valid
+// varint.
+size_t read_varint(std::span<const std::byte> in, uint64_t& value) {
+  constexpr size_t max_size = 10;
+  value = 0;
+  for (size_t i = 0; i < in.size() and i < max_size; ++i) {
+    const uint64_t byte = std::to_integer<uint64_t>(in[i]);
+    if (i == max_size - 1 and byte > 1) return 0;
+
+    value |= (byte & 0x7f) << (7 * i);
+    if ((byte & 0x80) == 0) return i + 1;
+  }
+  return 0;
+}
+
+// Make an asio completion \e handler, which may be move-only, storable in
+// a std::function. It's resumed on its associated executor, so a coroutine
+// doesn't continue on the session's strand.
+template <typename Handler>
+auto resume_on_executor(Handler&& handler) {
+  auto shared = std::make_shared<std::decay_t<Handler>>(
+      std::forward<Handler>(handler));
+  return [shared](auto... args) {
+    auto executor = asio::get_associated_executor(*shared);
+    asio::post(executor, [shared, ...args = std::move(args)]() mutable {
+      std::move(*shared)(std::move(args)...);
+    });
+  };
+}
+
+// Starts the HMAC of every stream, so a stream's signature can't pass for
+// the signature of a message.
+constexpr std::byte stream_hmac_prefix[] = {std::byte{'S'}};
+
+// Append \e value big-endian to \e bytes.
+void append_uint32(Bytes& bytes, uint32_t value) {
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    bytes.push_back(static_cast<std::byte>(value >> shift));
+  }
+}
+
+// Append what \e init_data negotiates to a handshake transcript. The id
+// and the public key are in the key confirmation data anyway.
+void append_transcript(Bytes& transcript,
+                       const SpekeMessage::InitData& init_data) {
+  transcript.push_back(static_cast<std::byte>(init_data.backend()));
+  for (bool flag : {init_data.encryption(), init_data.compact_framing(),
+                    init_data.resumption(), init_data.resumed()}) {
+    transcript.push_back(std::byte{flag});
+  }
+  // The group offer, so the peer's choice can't be steered.
+  transcript.push_back(std::byte{init_data.has_group()});
+  append_uint32(transcript, init_data.group());
+  append_uint32(transcript, init_data.groups_size());
+  for (uint32_t group : init_data.groups()) append_uint32(transcript, group);
+  transcript.push_back(std::byte{init_data.group_chosen()});
+}
+}
+
 template <typename Protocol>
 SpekeSession<Protocol>::SpekeSession(
     asio::basic_stream_socket<Protocol>&& socket,
-    std::shared_ptr<SpekeInterface>&& speke)
+    std::shared_ptr<SpekeInterface>&& speke,
+    const SpekeSessionOptions& options)
     : socket_(std::move(socket)),
+      strand_(asio::make_strand(socket_.get_executor())),
       speke_(std::move(speke)),
-      state_(SpekeSessionState::IDLE){
+      state_(SpekeSessionState::IDLE),
+      options_(options),
+      receive_block_(new char[LRM_SPEKE_ARENA_BLOCK_SIZE]),
+      receive_arena_(arena_options(receive_block_.get())),
+      send_block_(new char[LRM_SPEKE_ARENA_BLOCK_SIZE]),
+      send_arena_(arena_options(send_block_.get())),
+      batch_timer_(strand_) {
   if (not socket_.is_open()) {
     throw std::invalid_argument(
         __PRETTY_FUNCTION__ +
@@ -41,11 +134,39 @@ SpekeSession<Protocol>::SpekeSession(
         __PRETTY_FUNCTION__ +
         std::string(": 'speke' must be already instantiated"));
   }
+  if (options_.choose_group and not options_.speke_factory) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'choose_group' needs 'speke_factory'"));
+  }
+  if (options_.require_encryption and not options_.encryption) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'require_encryption' needs 'encryption'"));
+  }
 }
 
 template <typename Protocol>
 SpekeSession<Protocol>::~SpekeSession() {
   Close(SpekeSessionState::STOPPED);
+
+  // Waits for a handler running on another thread.
+  std::lock_guard lck{lifetime_->mutex};
+  lifetime_->alive = false;
+}
+
+template <typename Protocol>
+template <typename Handler>
+auto SpekeSession<Protocol>::make_handler(Handler&& handler) {
+  return asio::bind_executor(
+      strand_,
+      [lifetime = lifetime_,
+       handler = std::forward<Handler>(handler)](auto&&... args) mutable {
+        // Aborted operations complete after the session is destroyed.
+        std::lock_guard lck{lifetime->mutex};
+        if (not lifetime->alive) return;
+        handler(std::forward<decltype(args)>(args)...);
+      });
 }
 
 template <typename Protocol>
@@ -58,30 +179,89 @@ void SpekeSession<Protocol>::Run(MessageHandler&& handler) {
   }
 
   SetMessageHandler(std::move(handler));
+  run_time_ = std::chrono::steady_clock::now();
+  SpekeStatsCollector::Get().SessionStarted();
+  // Set before the first write and read start, a failed one may close the
+  // session on another thread right away.
+  state_ = SpekeSessionState::RUNNING;
 
-  SpekeMessage message;
-  SpekeMessage::InitData* init_data = message.mutable_init_data();
+  resumed_ = dynamic_cast<const ResumedSpeke*>(speke_.get()) != nullptr;
+  if ((options_.ticket_issuer or options_.choose_group) and not resumed_) {
+    // The peer may present a ticket, so it's not known yet what to send.
+    init_data_sent_ = false;
+  } else {
+    send_init_data();
+  }
+
+  asio::dispatch(make_handler([this]{ continue_reading(); }));
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::send_init_data() {
+  std::lock_guard lck{send_arena_mtx_};
+  SpekeMessage* message = make_send_message();
+  SpekeMessage::InitData* init_data = message->mutable_init_data();
 
   init_data->set_id(speke_->GetId());
+  init_data->set_backend(
+      static_cast<SpekeMessage::Backend>(speke_->GetBackend()));
+  init_data->set_encryption(options_.encryption);
+  init_data->set_compact_framing(options_.compact_framing);
+  init_data->set_resumption(options_.resumption);
+  if (not resumed_) {
+    init_data->set_group(static_cast<uint32_t>(speke_->GetGroup()));
+    if (options_.speke_factory) {
+      for (SpekeGroup group : options_.groups) {
+        init_data->add_groups(static_cast<uint32_t>(group));
+      }
+    }
+    init_data->set_group_chosen(group_chosen_);
+  }
+
+  if (auto resumed = dynamic_cast<const ResumedSpeke*>(speke_.get())) {
+    // Only the client has the ticket.
+    if (resumed->GetTicket().empty()) {
+      init_data->set_resumed(true);
+    } else {
+      init_data->set_ticket(resumed->GetTicket().data(),
+                            resumed->GetTicket().size());
+    }
+  }
 
   const auto pubkey = speke_->GetPublicKey();
   init_data->set_public_key(pubkey.data(), pubkey.size());
 
-  start_reading();
-
-  send_message(message);
-
-  state_ = SpekeSessionState::RUNNING;
+  append_transcript(sent_transcript_, *init_data);
+  send_message(*message);
+  init_data_sent_ = true;
 }
 
 template <typename Protocol>
 void SpekeSession<Protocol>::Close(SpekeSessionState state) noexcept {
-  if (not closed_) {
-    closed_ = true;
-  } else {
-    return;
+  if (closed_.exchange(true)) return;
+
+  // Sessions that never ran aren't counted.
+  if (state_ != SpekeSessionState::IDLE) {
+    SpekeSessionStats stats = GetStats();
+    stats.state = state;
+    SpekeStatsCollector::Get().SessionClosed(stats);
+  }
+
+  {
+    std::lock_guard lck{batch_mtx_};
+    batch_timer_.cancel();
+    batch_.clear();
   }
 
+  // The socket is only touched on the strand. If the session is destroyed
+  // before this runs, the socket's destructor closes it.
+  asio::dispatch(make_handler([this]{ close_socket(); }));
+
+  state_ = state;
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::close_socket() noexcept {
   asio::error_code ec;
 
   if (socket_.is_open()) {
@@ -91,110 +271,853 @@ void SpekeSession<Protocol>::Close(SpekeSessionState state) noexcept {
   socket_.close(ec);
   // TODO: Log if ec
 
-  speke_.reset();
+  {
+    std::lock_guard lck{send_mtx_};
+    send_queue_.clear();
+  }
+  cancel_waiters();
+}
 
-  state_ = state;
+template <typename Protocol>
+typename SpekeSession<Protocol>::MessageHandler
+SpekeSession<Protocol>::MakeOwningHandler(OwningMessageHandler&& handler) {
+  assert(handler);
+  return [handler = std::move(handler)](MessageView message,
+                                        SpekeSession& session) {
+           handler(Bytes(message.begin(), message.end()), session);
+         };
 }
 
 template <typename Protocol>
 void SpekeSession<Protocol>::start_reading() {
-  socket_.async_wait(asio::socket_base::wait_read,
-                     [this](const asio::error_code& ec) {
-                       handle_read(ec);
-                     });
+  if (compact_receive_) {
+    // Read the type and the size byte by byte, until the last byte of the
+    // varint is there. Most sizes fit in one byte, so it's usually one read.
+    asio::async_read(
+        socket_, asio::buffer(compact_header_),
+        [this](const asio::error_code& ec, size_t size) -> size_t {
+          if (ec) return 0;
+          if (size < 2) return 2 - size;
+          if ((compact_header_[size - 1] & std::byte{0x80}) == std::byte{0}) {
+            return 0;
+          }
+          return 1;
+        },
+        make_handler([this](const asio::error_code& ec, size_t size) {
+          handle_compact_header(ec, size);
+        }));
+    return;
+  }
+
+  asio::async_read(socket_,
+                   asio::buffer(&receive_size_, sizeof(receive_size_)),
+                   make_handler([this](const asio::error_code& ec, size_t) {
+                     handle_read_header(ec);
+                   }));
 }
 
 template <typename Protocol>
-void SpekeSession<Protocol>::handle_read(const asio::error_code& ec) {
-  if (ec) {
-    // TODO: log it
-    Close(SpekeSessionState::STOPPED_ERROR);
+void SpekeSession<Protocol>::continue_reading() {
+  if (closed_) return;
+
+  // A frame above the limit is read into a fresh buffer, freed here so one
+  // big message doesn't stay allocated for the life of the session.
+  if (receive_buffer_.capacity() > LRM_SPEKE_RECEIVE_BUFFER_MAX_SIZE) {
+    Bytes().swap(receive_buffer_);
+  }
+  if (open_buffer_.capacity() > LRM_SPEKE_RECEIVE_BUFFER_MAX_SIZE) {
+    Bytes().swap(open_buffer_);
+  }
+
+  if (not can_read()) {
+    read_parked_ = true;
     return;
   }
+  start_reading();
+}
 
-  std::optional<SpekeMessage> message = receive_message();
+template <typename Protocol>
+void SpekeSession<Protocol>::wake_reading() {
+  // Pause() and Release() may race with continue_reading(), but both check
+  // on the strand, so reading is restarted exactly once.
+  asio::dispatch(make_handler([this]{
+    if (not read_parked_ or closed_ or not can_read()) return;
+    read_parked_ = false;
+    start_reading();
+  }));
+}
 
-  if (not message) {
-    Close(SpekeSessionState::STOPPED_ERROR);
+template <typename Protocol>
+bool SpekeSession<Protocol>::can_read() const {
+  return not paused_ and
+      (options_.receive_budget == 0 or
+       unreleased_bytes_ < options_.receive_budget);
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::Pause() {
+  paused_ = true;
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::Resume() {
+  paused_ = false;
+  wake_reading();
+}
+
+template <typename Protocol>
+bool SpekeSession<Protocol>::IsPaused() const {
+  return paused_;
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::Release(size_t bytes) {
+  size_t unreleased = unreleased_bytes_.load();
+  while (not unreleased_bytes_.compare_exchange_weak(
+             unreleased, unreleased - std::min(unreleased, bytes))) {}
+  wake_reading();
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::handle_read_header(const asio::error_code& ec) {
+  if (ec) {
+    handle_io_error(ec);
     return;
   }
 
-  if (message->has_signed_data()) {
-    const Bytes hmac =
-        Util::str_to_bytes(message->signed_data().hmac_signature());
-    Bytes data = Util::str_to_bytes(message->signed_data().data());
+  if (receive_size_ > options_.max_frame_size) {
+    // TODO: Log it
+    Close(SpekeSessionState::STOPPED_PEER_BAD_BEHAVIOR);
+    return;
+  }
 
-    if (speke_->ConfirmHmacSignature(hmac, data)) {
-      handle_message(std::move(data));
-    } else {
-      // Bad HMAC signature
-      increase_bad_behavior_count();
-    }
-  } else if (message->has_init_data()) {
-    const std::string id = message->init_data().id();
-    const Bytes pubkey =
-        Util::str_to_bytes(message->init_data().public_key());
+  // Keeps the capacity, so it only allocates for the biggest message yet.
+  receive_buffer_.resize(receive_size_);
+  asio::async_read(socket_, asio::buffer(receive_buffer_),
+                   make_handler([this](const asio::error_code& ec, size_t) {
+                     handle_read(ec);
+                   }));
+}
 
-    try {
-      speke_->ProvideRemotePublicKeyIdPair(pubkey, id);
+template <typename Protocol>
+void SpekeSession<Protocol>::handle_compact_header(const asio::error_code& ec,
+                                                   size_t size) {
+  if (ec) {
+    handle_io_error(ec);
+    return;
+  }
 
-      send_key_confirmation();
-    } catch (const std::logic_error& e) {
-      // This error will occur if the pubkey and id were already provided.
+  compact_type_ = static_cast<CompactFrameType>(compact_header_[0]);
+  switch (compact_type_) {
+    case CompactFrameType::SIGNED_DATA:
+    case CompactFrameType::SIGNED_BATCH:
+    case CompactFrameType::SIGNED_STREAM_END:
+      compact_tag_size_ = hmac_size_;
+      break;
+    case CompactFrameType::SIGNED_STREAM_CHUNK:
+      compact_tag_size_ = 0;
+      break;
+    case CompactFrameType::ENCRYPTED_DATA:
+    case CompactFrameType::ENCRYPTED_BATCH:
+    case CompactFrameType::ENCRYPTED_STREAM_CHUNK:
+    case CompactFrameType::ENCRYPTED_STREAM_END:
+      compact_tag_size_ = Aead::TAG_SIZE;
+      break;
+    default:
+      // The stream can't be followed anymore.
       // TODO: Log it
-      // increase_bad_behavior_count();
-    } catch (const std::runtime_error& e) {
-      // This will occur if the peer's id or public key is invalid.
+      Close(SpekeSessionState::STOPPED_PEER_BAD_BEHAVIOR);
+      return;
+  }
+
+  uint64_t payload_size = 0;
+  if (read_varint(std::span(compact_header_).subspan(1, size - 1),
+                  payload_size) != size - 1 or
+      payload_size > options_.max_frame_size or
+      compact_tag_size_ + payload_size > options_.max_frame_size) {
+    // TODO: Log it
+    Close(SpekeSessionState::STOPPED_PEER_BAD_BEHAVIOR);
+    return;
+  }
+
+  receive_buffer_.resize(compact_tag_size_ + payload_size);
+  asio::async_read(socket_, asio::buffer(receive_buffer_),
+                   make_handler([this](const asio::error_code& ec, size_t) {
+                     handle_compact_frame(ec);
+                   }));
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::handle_compact_frame(const asio::error_code& ec) {
+  if (ec) {
+    handle_io_error(ec);
+    return;
+  }
+
+  const MessageView frame{receive_buffer_};
+  const MessageView tag = frame.first(compact_tag_size_);
+  const MessageView payload = frame.subspan(compact_tag_size_);
+  switch (compact_type_) {
+    case CompactFrameType::SIGNED_DATA:
+      handle_signed(tag, payload, PayloadType::MESSAGE);
+      break;
+    case CompactFrameType::SIGNED_BATCH:
+      handle_signed(tag, payload, PayloadType::BATCH);
+      break;
+    case CompactFrameType::SIGNED_STREAM_CHUNK:
+      handle_signed(tag, payload, PayloadType::STREAM_CHUNK);
+      break;
+    case CompactFrameType::SIGNED_STREAM_END:
+      handle_signed(tag, payload, PayloadType::STREAM_END);
+      break;
+    case CompactFrameType::ENCRYPTED_DATA:
+      handle_encrypted(tag, payload, PayloadType::MESSAGE);
+      break;
+    case CompactFrameType::ENCRYPTED_BATCH:
+      handle_encrypted(tag, payload, PayloadType::BATCH);
+      break;
+    case CompactFrameType::ENCRYPTED_STREAM_CHUNK:
+      handle_encrypted(tag, payload, PayloadType::STREAM_CHUNK);
+      break;
+    case CompactFrameType::ENCRYPTED_STREAM_END:
+      handle_encrypted(tag, payload, PayloadType::STREAM_END);
+      break;
+  }
+
+  continue_reading();
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::handle_io_error(const asio::error_code& ec) {
+  switch (ec.value()) {
+    case asio::error::eof:
+    case asio::error::bad_descriptor:
+    case asio::error::broken_pipe:
+    case asio::error::connection_reset:
       // TODO: Log it
-      Close(SpekeSessionState::STOPPED_PEER_PUBLIC_KEY_OR_ID_INVALID);
+      Close(SpekeSessionState::STOPPED_PEER_DISCONNECTED);
       return;
+    default:
+      // TODO: Log it
+      Close(SpekeSessionState::STOPPED_ERROR);
+  }
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::handle_read(const asio::error_code& ec) {
+  if (ec) {
+    handle_io_error(ec);
+    return;
+  }
+
+  // Nothing from the previous message is used anymore.
+  receive_arena_.Reset();
+  SpekeMessage* const message =
+      google::protobuf::Arena::CreateMessage<SpekeMessage>(&receive_arena_);
+  if (not message->ParseFromArray(receive_buffer_.data(),
+                                  receive_buffer_.size())) {
+    increase_bad_behavior_count();
+    continue_reading();
+    return;
+  }
+
+  if (message->has_encrypted_data()) {
+    const SpekeMessage::EncryptedData& encrypted = message->encrypted_data();
+    const MessageView data = Util::str_as_bytes(encrypted.data());
+    const PayloadType type =
+        encrypted.batch() ? PayloadType::BATCH :
+        not encrypted.stream() ? PayloadType::MESSAGE :
+        encrypted.last() ? PayloadType::STREAM_END :
+        PayloadType::STREAM_CHUNK;
+
+    if (data.size() < Aead::TAG_SIZE) {
+      increase_bad_behavior_count();
+    } else {
+      handle_encrypted(data.last(Aead::TAG_SIZE),
+                       data.first(data.size() - Aead::TAG_SIZE), type);
     }
+  } else if (message->has_signed_data()) {
+    handle_signed(
+        Util::str_as_bytes(message->signed_data().hmac_signature()),
+        Util::str_as_bytes(message->signed_data().data()),
+        PayloadType::MESSAGE);
+  } else if (message->has_signed_batch()) {
+    handle_signed(
+        Util::str_as_bytes(message->signed_batch().hmac_signature()),
+        Util::str_as_bytes(message->signed_batch().data()),
+        PayloadType::BATCH);
+  } else if (message->has_stream_chunk()) {
+    handle_signed(
+        Util::str_as_bytes(message->stream_chunk().hmac_signature()),
+        Util::str_as_bytes(message->stream_chunk().data()),
+        message->stream_chunk().last() ? PayloadType::STREAM_END :
+        PayloadType::STREAM_CHUNK);
+  } else if (message->has_init_data()) {
+    if (not handle_init_data(message->init_data())) return;
+  } else if (message->has_resumption_ticket()) {
+    handle_resumption_ticket(message->resumption_ticket());
   } else if (message->has_key_confirmation()) {
     const Bytes kcd = Util::str_to_bytes(message->key_confirmation().data());
 
     if (not speke_->ConfirmKey(kcd)) {
+      // What it sent before is dropped unseen.
       // TODO: Log it
+      held_frames_.clear();
       Close(SpekeSessionState::STOPPED_KEY_CONFIRMATION_FAILED);
       return;
     }
+    record_handshake();
+    authenticated_ = true;
+    for (auto& waiter : std::exchange(handshake_waiters_, {})) waiter({});
+
+    // Peer sends compact frames after its key confirmation.
+    if (options_.compact_framing and remote_compact_framing_) {
+      std::array<std::byte, SpekeInterface::MAX_HMAC_SIZE> hmac;
+      hmac_size_ = speke_->HmacSign({}, hmac);
+      compact_receive_ = true;
+    }
+    release_held_frames();
   }
 
-  // This is at the bottom because we want to read messages sequentially
-  // since SPEKE and this class are not entirely thread-safe.
-  start_reading();
+  // This is at the bottom because messages are read sequentially, the next
+  // read starts only when this one is handled.
+  continue_reading();
 }
 
 template <typename Protocol>
-void SpekeSession<Protocol>::handle_message(Bytes&& message) {
-  MessageHandler handler;
-  {
-    std::lock_guard lck{message_handler_mtx_};
+bool SpekeSession<Protocol>::handle_init_data(
+    const SpekeMessage::InitData& init_data) {
+  append_transcript(received_transcript_, init_data);
+  if (static_cast<SpekeBackend>(init_data.backend()) !=
+      speke_->GetBackend()) {
+    // TODO: Log it
+    Close(SpekeSessionState::STOPPED_NEGOTIATION_FAILED);
+    return false;
+  }
 
-    handler = message_handler_;
+  const std::string id = init_data.id();
+  remote_id_ = id;
+  remote_encryption_ = init_data.encryption();
+  remote_compact_framing_ = init_data.compact_framing();
+  remote_resumption_ = init_data.resumption();
+  if (options_.require_encryption and not remote_encryption_) {
+    // TODO: Log it
+    Close(SpekeSessionState::STOPPED_NEGOTIATION_FAILED);
+    return false;
   }
 
-  assert(handler);
-  handler(std::move(message), *this);
+  if (not init_data_sent_) {
+    // A ticket the server can't redeem is ignored like a rejected one, the
+    // peer then gets STOPPED_RESUMPTION_REJECTED and connects again.
+    if (options_.ticket_issuer and not init_data.ticket().empty()) {
+      auto secret = options_.ticket_issuer->Redeem(
+          Util::str_as_bytes(init_data.ticket()));
+      if (secret) {
+        speke_ = std::make_shared<ResumedSpeke>(
+            speke_->GetId(), std::move(*secret), speke_->GetBackend());
+        resumed_ = true;
+      }
+      // TODO: Log it if the ticket was rejected
+    }
+    if (options_.choose_group and not resumed_ and init_data.has_group()) {
+      const std::optional<SpekeGroup> group = choose_group(init_data);
+      if (not group) {
+        // TODO: Log it
+        Close(SpekeSessionState::STOPPED_NEGOTIATION_FAILED);
+        return false;
+      }
+      group_chosen_ = true;
+      if (*group != speke_->GetGroup() and not switch_group(*group)) {
+        return false;
+      }
+      if (*group != static_cast<SpekeGroup>(init_data.group())) {
+        // The peer's key is in another group, it sends a new one.
+        send_init_data();
+        return true;
+      }
+    }
+    send_init_data();
+  } else if (resumed_ != init_data.resumed()) {
+    // TODO: Log it
+    Close(resumed_ ? SpekeSessionState::STOPPED_RESUMPTION_REJECTED :
+          SpekeSessionState::STOPPED_NEGOTIATION_FAILED);
+    return false;
+  }
+
+  if (not resumed_ and init_data.has_group()) {
+    const auto group = static_cast<SpekeGroup>(init_data.group());
+    if (group != speke_->GetGroup()) {
+      // Only the group picked by the peer for both can be followed.
+      if (group_chosen_ or not init_data.group_chosen() or
+          not options_.speke_factory or not accepts_group(group)) {
+        // TODO: Log it
+        Close(SpekeSessionState::STOPPED_NEGOTIATION_FAILED);
+        return false;
+      }
+      if (not switch_group(group)) return false;
+      send_init_data();
+    }
+  }
+  if (not resumed_ and
+      GetSpekeGroupBits(speke_->GetGroup()) < options_.min_group_bits) {
+    // TODO: Log it
+    Close(SpekeSessionState::STOPPED_NEGOTIATION_FAILED);
+    return false;
+  }
+
+  Bytes pubkey = Util::str_to_bytes(init_data.public_key());
+  try {
+    speke_->SetTranscript(sent_transcript_, received_transcript_);
+  } catch (...) {
+    return handle_handshake(std::current_exception());
+  }
+
+  // Resumed sessions only hash a few things, they don't need the engine.
+  if (handshake_engine_ and not resumed_) {
+    // Reading resumes when the handshake is done, so nothing is read
+    // before the keys are ready.
+    handshake_engine_->ProvideRemotePublicKeyIdPair(
+        speke_, std::move(pubkey), id, strand_,
+        [this, lifetime = lifetime_](std::exception_ptr error) {
+          std::lock_guard lck{lifetime->mutex};
+          if (not lifetime->alive) return;
+          if (handle_handshake(error)) continue_reading();
+        });
+    return false;
+  }
+
+  std::exception_ptr error;
+  try {
+    speke_->ProvideRemotePublicKeyIdPair(pubkey, id);
+  } catch (...) {
+    error = std::current_exception();
+  }
+  return handle_handshake(error);
+}
+
+template <typename Protocol>
+std::optional<SpekeGroup> SpekeSession<Protocol>::choose_group(
+    const SpekeMessage::InitData& init_data) const {
+  const auto peer_group = static_cast<SpekeGroup>(init_data.group());
+  std::optional<SpekeGroup> best;
+  auto consider = [&](SpekeGroup group) {
+    if (not accepts_group(group)) return;
+    // The peer's own group wins a tie, it needs no second InitData.
+    if (not best or
+        GetSpekeGroupBits(group) < GetSpekeGroupBits(*best) or
+        (GetSpekeGroupBits(group) == GetSpekeGroupBits(*best) and
+         group == peer_group)) {
+      best = group;
+    }
+  };
+
+  consider(peer_group);
+  for (uint32_t group : init_data.groups()) {
+    consider(static_cast<SpekeGroup>(group));
+  }
+  return best;
+}
+
+template <typename Protocol>
+bool SpekeSession<Protocol>::accepts_group(SpekeGroup group) const {
+  if (GetSpekeGroupBits(group) < options_.min_group_bits) return false;
+  if (group == speke_->GetGroup()) return true;
+  return group != SpekeGroup::CUSTOM and options_.speke_factory and
+      std::find(options_.groups.begin(), options_.groups.end(), group) !=
+      options_.groups.end();
+}
+
+template <typename Protocol>
+bool SpekeSession<Protocol>::switch_group(SpekeGroup group) {
+  if (handshake_done_) {
+    // Other threads may be signing with speke_ now.
+    // TODO: Log it
+    Close(SpekeSessionState::STOPPED_NEGOTIATION_FAILED);
+    return false;
+  }
+
+  std::shared_ptr<SpekeInterface> speke;
+  try {
+    speke = options_.speke_factory(group);
+  } catch (...) {
+    // TODO: Log it
+    Close(SpekeSessionState::STOPPED_ERROR);
+    return false;
+  }
+  if (not speke or speke->GetGroup() != group or
+      speke->GetBackend() != speke_->GetBackend()) {
+    // TODO: Log it
+    Close(SpekeSessionState::STOPPED_ERROR);
+    return false;
+  }
+  speke_ = std::move(speke);
+  return true;
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::handle_resumption_ticket(
+    const SpekeMessage::ResumptionTicket& ticket) {
+  // Tickets come with the peer's key confirmation, once the keys are known.
+  if (not options_.resumption or not handshake_done_ or authenticated_ or
+      ticket.ticket().empty()) {
+    increase_bad_behavior_count();
+    return;
+  }
+
+  // Bounded, so the expiry doesn't overflow.
+  const auto lifetime = std::chrono::seconds(
+      std::min<uint64_t>(ticket.lifetime(), uint64_t{1} << 32));
+  resumption_ticket_ = SpekeResumptionTicket{
+    .ticket = Util::str_to_bytes(ticket.ticket()),
+    .secret = MakeResumptionSecret(speke_->GetEncryptionKey(),
+                                   speke_->GetNonce()),
+    .backend = speke_->GetBackend(),
+    .expiry = std::chrono::system_clock::now() + lifetime};
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::handle_message(MessageView message) {
+  assert(message_handler_);
+  count([size = message.size()](SpekeTrafficCounters& counters) {
+    counters.AddMessageIn(size);
+  });
+  if (options_.receive_budget > 0) unreleased_bytes_ += message.size();
+  message_handler_(message, *this);
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::handle_batch(MessageView batch) {
+  while (not batch.empty() and not closed_) {
+    uint64_t size = 0;
+    const size_t size_length = read_varint(batch, size);
+    if (size_length == 0 or batch.size() - size_length < size) {
+      increase_bad_behavior_count();
+      return;
+    }
+    batch = batch.subspan(size_length);
+
+    handle_message(batch.first(size));
+    batch = batch.subspan(size);
+  }
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::handle_stream(MessageView chunk,
+                                           SpekeStreamStatus status) {
+  if (not stream_handler_) return;
+  count([size = chunk.size()](SpekeTrafficCounters& counters) {
+    counters.AddMessageIn(size);
+  });
+  if (options_.receive_budget > 0) unreleased_bytes_ += chunk.size();
+  stream_handler_(chunk, status, *this);
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::handle_payload(MessageView payload,
+                                            PayloadType type) {
+  switch (type) {
+    case PayloadType::MESSAGE:
+      handle_message(payload);
+      break;
+    case PayloadType::BATCH:
+      handle_batch(payload);
+      break;
+    case PayloadType::STREAM_CHUNK:
+      handle_stream(payload, SpekeStreamStatus::CHUNK);
+      break;
+    case PayloadType::STREAM_END:
+      handle_stream(payload, SpekeStreamStatus::END);
+      break;
+  }
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::handle_signed(MessageView signature,
+                                           MessageView data,
+                                           PayloadType type) {
+  if (options_.early_data and not authenticated_) {
+    hold_frame(signature, data, type, false);
+    return;
+  }
+
+  if (encrypted_) {
+    // The peer agreed to encrypt everything.
+    increase_bad_behavior_count();
+    return;
+  }
+
+  if (type == PayloadType::STREAM_CHUNK or type == PayloadType::STREAM_END) {
+    handle_signed_stream(signature, data, type == PayloadType::STREAM_END);
+    return;
+  }
+
+  if (not speke_->ConfirmHmacSignature(signature, data)) {
+    // Bad HMAC signature
+    count([](SpekeTrafficCounters& counters) {
+      counters.AddHmacFailure();
+    });
+    increase_bad_behavior_count();
+    return;
+  }
+
+  handle_payload(data, type);
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::handle_signed_stream(MessageView signature,
+                                                  MessageView data,
+                                                  bool last) {
+  if (not handshake_done_) {
+    // There is no key to verify it with.
+    increase_bad_behavior_count();
+    return;
+  }
+
+  if (not receive_stream_) {
+    receive_stream_.emplace(speke_->MakeHmacStream());
+    receive_stream_->Update(stream_hmac_prefix);
+  }
+  receive_stream_->Update(data);
+  if (not last) {
+    handle_stream(data, SpekeStreamStatus::CHUNK);
+    return;
+  }
+
+  const bool verified = receive_stream_->Verify(signature);
+  receive_stream_.reset();
+  if (not verified) {
+    count([](SpekeTrafficCounters& counters) {
+      counters.AddHmacFailure();
+    });
+    handle_stream({}, SpekeStreamStatus::ABORTED);
+    increase_bad_behavior_count();
+    return;
+  }
+  handle_stream(data, SpekeStreamStatus::END);
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::handle_encrypted(MessageView tag,
+                                              MessageView ciphertext,
+                                              PayloadType type) {
+  if (options_.early_data and not authenticated_) {
+    hold_frame(tag, ciphertext, type, true);
+    return;
+  }
+
+  if (not encrypted_) {
+    increase_bad_behavior_count();
+    return;
+  }
+
+  const std::byte aad{static_cast<uint8_t>(type)};
+  const uint64_t direction = send_direction_ ^ DIRECTION_BIT;
+  open_buffer_.resize(ciphertext.size());
+  if (not aead_->Open(direction | receive_counter_, {&aad, 1}, ciphertext,
+                      tag, open_buffer_)) {
+    // Counters are implicit, so the stream can't be recovered.
+    // TODO: Log it
+    count([](SpekeTrafficCounters& counters) {
+      counters.AddDecryptionFailure();
+    });
+    Close(SpekeSessionState::STOPPED_PEER_BAD_BEHAVIOR);
+    return;
+  }
+  ++receive_counter_;
+
+  handle_payload(open_buffer_, type);
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::hold_frame(MessageView tag, MessageView payload,
+                                        PayloadType type, bool encrypted) {
+  // The held frames are bounded like a single frame.
+  held_bytes_ += tag.size() + payload.size();
+  if (held_bytes_ > options_.max_frame_size) {
+    // TODO: Log it
+    held_frames_.clear();
+    Close(SpekeSessionState::STOPPED_PEER_BAD_BEHAVIOR);
+    return;
+  }
+  held_frames_.push_back({Bytes(tag.begin(), tag.end()),
+                          Bytes(payload.begin(), payload.end()), type,
+                          encrypted});
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::release_held_frames() {
+  for (const HeldFrame& frame : std::exchange(held_frames_, {})) {
+    if (closed_) break;
+    if (frame.encrypted) {
+      handle_encrypted(frame.tag, frame.payload, frame.type);
+    } else {
+      handle_signed(frame.tag, frame.payload, frame.type);
+    }
+  }
+  held_bytes_ = 0;
+}
+
+template <typename Protocol>
+bool SpekeSession<Protocol>::handle_handshake(std::exception_ptr error) {
+  if (closed_) return false;
+
+  try {
+    if (error) std::rethrow_exception(error);
+
+    // Only the keys are needed from now on. It's swapped before
+    // setup_encryption() lets other threads send, so they never see the
+    // old one.
+    if (not handshake_done_) {
+      if (auto compact = speke_->Compact()) speke_ = std::move(compact);
+    }
+
+    if (not setup_encryption()) {
+      // TODO: Log it
+      Close(SpekeSessionState::STOPPED_NEGOTIATION_FAILED);
+      return false;
+    }
+    send_key_confirmation();
+    if (options_.early_data) send_early_data();
+  } catch (const std::logic_error& e) {
+    // This error will occur if the pubkey and id were already provided.
+    // TODO: Log it
+    // increase_bad_behavior_count();
+  } catch (const std::runtime_error& e) {
+    // This will occur if the peer's id or public key is invalid.
+    // TODO: Log it
+    Close(SpekeSessionState::STOPPED_PEER_PUBLIC_KEY_OR_ID_INVALID);
+    return false;
+  }
+  return true;
+}
+
+template <typename Protocol>
+bool SpekeSession<Protocol>::setup_encryption() {
+  if (handshake_done_) return true;
+
+  if (options_.encryption and remote_encryption_) {
+    // Both directions use the same key, so they need different nonces.
+    if (speke_->GetId() == remote_id_) return false;
+
+    std::lock_guard lck{seal_mtx_};
+    send_direction_ = speke_->GetId() < remote_id_ ? 0 : DIRECTION_BIT;
+    aead_ = std::make_unique<Aead>(speke_->GetEncryptionKey(),
+                                   speke_->GetNonce());
+    encrypted_ = true;
+  }
+  handshake_done_ = true;
+  return true;
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::check_handshake_done() const {
+  if (not handshake_done_) {
+    throw std::logic_error(
+        __PRETTY_FUNCTION__ +
+        std::string(": Messages can only be sent after the handshake"));
+  }
 }
 
 template <typename Protocol>
 void SpekeSession<Protocol>::send_key_confirmation() {
   const auto kcd = speke_->GetKeyConfirmationData();
 
-  SpekeMessage kcd_message;
+  std::lock_guard lck{send_arena_mtx_};
+  if (options_.ticket_issuer and remote_resumption_) {
+    // The ticket is useless to the peer unless it derived the same keys.
+    const Bytes ticket = options_.ticket_issuer->Issue(
+        MakeResumptionSecret(speke_->GetEncryptionKey(),
+                             speke_->GetNonce()));
+
+    SpekeMessage* ticket_message = make_send_message();
+    SpekeMessage::ResumptionTicket* ticket_p =
+        ticket_message->mutable_resumption_ticket();
+    ticket_p->set_ticket(ticket.data(), ticket.size());
+    ticket_p->set_lifetime(options_.ticket_issuer->GetLifetime().count());
+
+    send_message(*ticket_message);
+  }
+
+  SpekeMessage* kcd_message = make_send_message();
   SpekeMessage::KeyConfirmation* kcd_p =
-      kcd_message.mutable_key_confirmation();
+      kcd_message->mutable_key_confirmation();
 
   kcd_p->set_data(kcd.data(), kcd.size());
 
-  send_message(kcd_message);
+  send_message(*kcd_message);
+  key_confirmation_sent_time_ = std::chrono::steady_clock::now();
+
+  // Everything after the key confirmation is in compact frames.
+  compact_send_ = options_.compact_framing and remote_compact_framing_;
+}
+
+template <typename Protocol>
+std::optional<bool> SpekeSession<Protocol>::try_send_early(
+    const Bytes& message) {
+  if (early_data_sent_) return std::nullopt;
+
+  std::lock_guard lck{early_mtx_};
+  // The batch may have been queued while waiting for the lock.
+  if (early_data_sent_) return std::nullopt;
+  if (closed_) return false;
+
+  const size_t size = message.size();
+  const size_t item_size = varint_size(size) + size;
+  // Like the send queue, the first message is always accepted.
+  if (not early_batch_.empty() and early_batch_.size() + item_size >
+      options_.send_queue_high_water_mark) {
+    return false;
+  }
+
+  const size_t offset = early_batch_.size();
+  early_batch_.resize(offset + item_size);
+  std::byte* const data = write_varint(size, early_batch_.data() + offset);
+  Util::safe_memcpy(data, message.data(), size);
+  count([size](SpekeTrafficCounters& counters) {
+    counters.AddMessageOut(size);
+  });
+  return true;
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::send_early_data() {
+  std::lock_guard lck{early_mtx_};
+  if (not early_batch_.empty()) {
+    // The size was checked against the high water mark when the messages
+    // were kept and the key confirmation is queued already.
+    if (encrypted_) seal_and_send(early_batch_, PayloadType::BATCH, false);
+    else sign_and_send(early_batch_, PayloadType::BATCH, false);
+    Bytes{}.swap(early_batch_);
+  }
+  early_data_sent_ = true;
 }
 
 template <typename Protocol>
 void SpekeSession<Protocol>::SetMessageHandler(MessageHandler&& handler) {
   assert(handler);
-  std::lock_guard lck{message_handler_mtx_};
-  message_handler_ = std::move(handler);
+  // Posted even when called on the strand, the handler may be the one
+  // being replaced.
+  asio::post(make_handler([this, handler = std::move(handler)]() mutable {
+    message_handler_ = std::move(handler);
+  }));
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::SetStreamHandler(StreamHandler&& handler) {
+  asio::post(make_handler([this, handler = std::move(handler)]() mutable {
+    stream_handler_ = std::move(handler);
+  }));
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::SetHandshakeEngine(
+    std::shared_ptr<SpekeHandshakeEngine> engine) {
+  if (state_ != SpekeSessionState::IDLE) {
+    throw std::logic_error(
+        __PRETTY_FUNCTION__ +
+        std::string(": The handshake engine can only be set in IDLE state"));
+  }
+  handshake_engine_ = std::move(engine);
 }
 
 template <typename Protocol>
@@ -203,72 +1126,583 @@ SpekeSessionState SpekeSession<Protocol>::GetState() const {
 }
 
 template <typename Protocol>
-void SpekeSession<Protocol>::SendMessage(const Bytes &message) {
+bool SpekeSession<Protocol>::IsAuthenticated() const {
+  return authenticated_;
+}
+
+template <typename Protocol>
+bool SpekeSession<Protocol>::IsResumed() const {
+  return resumed_;
+}
+
+template <typename Protocol>
+std::optional<SpekeResumptionTicket>
+SpekeSession<Protocol>::GetResumptionTicket() const {
+  if (not authenticated_) return std::nullopt;
+  return resumption_ticket_;
+}
+
+template <typename Protocol>
+SpekeSessionStats SpekeSession<Protocol>::GetStats() const {
+  SpekeSessionStats stats{.state = state_, .traffic = traffic_.Load()};
+  if (authenticated_) stats.handshake = handshake_timings_;
+
+  std::lock_guard lck{send_mtx_};
+  stats.send_queue_frames = send_queue_.size() + in_flight_.size();
+  stats.send_queue_bytes = send_queue_bytes_;
+  return stats;
+}
+
+template <typename Protocol>
+asio::strand<asio::any_io_executor>
+SpekeSession<Protocol>::GetExecutor() const {
+  return strand_;
+}
+
+template <typename Protocol>
+bool SpekeSession<Protocol>::IsEncrypted() const {
+  return encrypted_;
+}
+
+template <typename Protocol>
+bool SpekeSession<Protocol>::SendMessage(const Bytes &message) {
   if (SpekeSessionState::RUNNING != state_) {
     throw std::logic_error(
         __PRETTY_FUNCTION__ +
         std::string(": You can only send a message in RUNNING state"));
   }
+  if (options_.early_data) {
+    if (const auto kept = try_send_early(message)) return *kept;
+  }
+  check_handshake_done();
+  const bool sent = encrypted_ ?
+      seal_and_send(message, PayloadType::MESSAGE) :
+      sign_and_send(message, PayloadType::MESSAGE);
+  if (sent) {
+    count([size = message.size()](SpekeTrafficCounters& counters) {
+      counters.AddMessageOut(size);
+    });
+  }
+  return sent;
+}
+
+template <typename Protocol>
+bool SpekeSession<Protocol>::sign_and_send(MessageView payload,
+                                           PayloadType type, bool check_hwm) {
+  std::array<std::byte, SpekeInterface::MAX_HMAC_SIZE> hmac;
+  const size_t hmac_size = speke_->HmacSign(payload, hmac);
+
+  return send_signed(type, std::span(hmac).first(hmac_size), payload,
+                     check_hwm);
+}
+
+template <typename Protocol>
+bool SpekeSession<Protocol>::sign_and_send_chunk(MessageView chunk,
+                                                 bool last) {
+  if (not send_stream_) {
+    send_stream_.emplace(speke_->MakeHmacStream());
+    send_stream_->Update(stream_hmac_prefix);
+  }
 
-  const Bytes hmac = speke_->HmacSign(message);
+  if (not last) {
+    if (not send_signed(PayloadType::STREAM_CHUNK, {}, chunk)) return false;
+    send_stream_->Update(chunk);
+    return true;
+  }
 
-  SpekeMessage msg;
-  SpekeMessage::SignedData* sd = msg.mutable_signed_data();
-  sd->set_hmac_signature(hmac.data(), hmac.size());
-  sd->set_data(message.data(), message.size());
+  // Finished on a copy, so a rejected chunk can be sent again.
+  Hmac::Stream stream = *send_stream_;
+  stream.Update(chunk);
+  std::array<std::byte, SpekeInterface::MAX_HMAC_SIZE> hmac;
+  const size_t hmac_size = stream.Final(hmac);
 
-  send_message(msg);
+  if (not send_signed(PayloadType::STREAM_END,
+                      std::span(hmac).first(hmac_size), chunk)) {
+    return false;
+  }
+  send_stream_.reset();
+  return true;
 }
 
 template <typename Protocol>
-void SpekeSession<Protocol>::send_message(const SpekeMessage& message) {
-  try {
-    SendMessage(message, socket_);
-  } catch (const asio::system_error& e) {
-    switch (e.code().value()) {
-      case asio::error::eof:
-      case asio::error::bad_descriptor:
-      case asio::error::broken_pipe:
-        // TODO: Log it
-        Close(SpekeSessionState::STOPPED_PEER_DISCONNECTED);
-        return;
-      default:
-        // TODO: Log it
-        Close(SpekeSessionState::STOPPED_ERROR);
+bool SpekeSession<Protocol>::send_signed(PayloadType type, MessageView tag,
+                                         MessageView payload,
+                                         bool check_hwm) {
+  std::lock_guard lck{send_arena_mtx_};
+  if (compact_send_) {
+    CompactFrameType frame_type = CompactFrameType::SIGNED_DATA;
+    switch (type) {
+      case PayloadType::MESSAGE:
+        frame_type = CompactFrameType::SIGNED_DATA;
+        break;
+      case PayloadType::BATCH:
+        frame_type = CompactFrameType::SIGNED_BATCH;
+        break;
+      case PayloadType::STREAM_CHUNK:
+        frame_type = CompactFrameType::SIGNED_STREAM_CHUNK;
+        break;
+      case PayloadType::STREAM_END:
+        frame_type = CompactFrameType::SIGNED_STREAM_END;
+        break;
+    }
+
+    size_t tag_offset = 0;
+    Bytes frame = make_compact_frame(frame_type, tag.size(), payload.size(),
+                                     tag_offset);
+    Util::safe_memcpy(frame.data() + tag_offset, tag.data(), tag.size());
+    Util::safe_memcpy(frame.data() + tag_offset + tag.size(), payload.data(),
+                      payload.size());
+    return queue_frame(std::move(frame), check_hwm);
+  }
+
+  SpekeMessage* msg = make_send_message();
+  switch (type) {
+    case PayloadType::MESSAGE: {
+      SpekeMessage::SignedData* sd = msg->mutable_signed_data();
+      sd->set_hmac_signature(tag.data(), tag.size());
+      sd->set_data(payload.data(), payload.size());
+      break;
+    }
+    case PayloadType::BATCH: {
+      SpekeMessage::SignedBatch* sb = msg->mutable_signed_batch();
+      sb->set_hmac_signature(tag.data(), tag.size());
+      sb->set_data(payload.data(), payload.size());
+      break;
+    }
+    case PayloadType::STREAM_CHUNK:
+    case PayloadType::STREAM_END: {
+      SpekeMessage::StreamChunk* sc = msg->mutable_stream_chunk();
+      sc->set_last(type == PayloadType::STREAM_END);
+      sc->set_hmac_signature(tag.data(), tag.size());
+      sc->set_data(payload.data(), payload.size());
+      break;
     }
   }
+
+  return send_message(*msg, check_hwm);
 }
 
 template <typename Protocol>
-std::optional<SpekeMessage> SpekeSession<Protocol>::receive_message() {
-  std::optional<SpekeMessage> message;
+bool SpekeSession<Protocol>::seal_and_send(MessageView payload,
+                                           PayloadType type, bool check_hwm) {
+  std::lock_guard seal_lck{seal_mtx_};
+  std::lock_guard arena_lck{send_arena_mtx_};
+  const std::byte aad{static_cast<uint8_t>(type)};
+  const uint64_t counter = send_direction_ | send_counter_;
+  bool sent = false;
 
-  try {
-    message = ReceiveMessage(socket_);
-  } catch (const asio::system_error& e) {
-    switch (e.code().value()) {
-      case asio::error::eof:
-      case asio::error::bad_descriptor:
-      case asio::error::broken_pipe:
-        // TODO: Log it
-        Close(SpekeSessionState::STOPPED_PEER_DISCONNECTED);
+  if (compact_send_) {
+    CompactFrameType frame_type = CompactFrameType::ENCRYPTED_DATA;
+    switch (type) {
+      case PayloadType::MESSAGE:
+        frame_type = CompactFrameType::ENCRYPTED_DATA;
+        break;
+      case PayloadType::BATCH:
+        frame_type = CompactFrameType::ENCRYPTED_BATCH;
+        break;
+      case PayloadType::STREAM_CHUNK:
+        frame_type = CompactFrameType::ENCRYPTED_STREAM_CHUNK;
+        break;
+      case PayloadType::STREAM_END:
+        frame_type = CompactFrameType::ENCRYPTED_STREAM_END;
         break;
-      default:
-        // TODO: Log it
-        Close(SpekeSessionState::STOPPED_ERROR);
     }
+
+    size_t tag_offset = 0;
+    Bytes frame = make_compact_frame(frame_type, Aead::TAG_SIZE,
+                                     payload.size(), tag_offset);
+    const std::span frame_span{frame};
+    aead_->Seal(counter, {&aad, 1}, payload,
+                frame_span.subspan(tag_offset + Aead::TAG_SIZE),
+                frame_span.subspan(tag_offset, Aead::TAG_SIZE));
+    sent = queue_frame(std::move(frame), check_hwm);
+  } else {
+    SpekeMessage* msg = make_send_message();
+    SpekeMessage::EncryptedData* ed = msg->mutable_encrypted_data();
+    ed->set_batch(type == PayloadType::BATCH);
+    ed->set_stream(type == PayloadType::STREAM_CHUNK or
+                   type == PayloadType::STREAM_END);
+    ed->set_last(type == PayloadType::STREAM_END);
+    std::string* data = ed->mutable_data();
+    data->resize(payload.size() + Aead::TAG_SIZE);
+
+    aead_->Seal(counter, {&aad, 1}, payload,
+                std::span(reinterpret_cast<std::byte*>(data->data()),
+                          data->size()));
+    sent = send_message(*msg, check_hwm);
   }
 
-  return message;
+  // The counter is only used up if the message goes out.
+  if (sent) ++send_counter_;
+  return sent;
+}
+
+template <typename Protocol>
+bool SpekeSession<Protocol>::SendBatched(const Bytes& message) {
+  if (SpekeSessionState::RUNNING != state_) {
+    throw std::logic_error(
+        __PRETTY_FUNCTION__ +
+        std::string(": You can only send a message in RUNNING state"));
+  }
+  if (options_.early_data) {
+    if (const auto kept = try_send_early(message)) return *kept;
+  }
+  check_handshake_done();
+
+  std::lock_guard lck{batch_mtx_};
+  const size_t size = message.size();
+  const size_t item_size = varint_size(size) + size;
+
+  if (not batch_.empty() and
+      batch_.size() + item_size > options_.batch_max_bytes) {
+    if (not flush_batch()) return false;
+  }
+
+  const size_t offset = batch_.size();
+  batch_.resize(offset + item_size);
+  std::byte* const data = write_varint(size, batch_.data() + offset);
+  Util::safe_memcpy(data, message.data(), size);
+  count([size](SpekeTrafficCounters& counters) {
+    counters.AddMessageOut(size);
+  });
+
+  if (batch_.size() >= options_.batch_max_bytes) {
+    // The message is already in the batch, so if the flush is rejected it
+    // just waits for the timer.
+    if (flush_batch()) return true;
+  }
+  if (not batch_timer_armed_) arm_batch_timer();
+
+  return true;
+}
+
+template <typename Protocol>
+bool SpekeSession<Protocol>::SendChunk(MessageView chunk, bool last) {
+  if (SpekeSessionState::RUNNING != state_) {
+    throw std::logic_error(
+        __PRETTY_FUNCTION__ +
+        std::string(": You can only send a message in RUNNING state"));
+  }
+  check_handshake_done();
+
+  std::lock_guard lck{stream_mtx_};
+  const bool sent = encrypted_ ?
+      seal_and_send(chunk, last ? PayloadType::STREAM_END :
+                    PayloadType::STREAM_CHUNK) :
+      sign_and_send_chunk(chunk, last);
+  if (sent) {
+    count([size = chunk.size()](SpekeTrafficCounters& counters) {
+      counters.AddMessageOut(size);
+    });
+  }
+  return sent;
+}
+
+template <typename Protocol>
+bool SpekeSession<Protocol>::FlushBatch() {
+  std::lock_guard lck{batch_mtx_};
+  return flush_batch();
+}
+
+template <typename Protocol>
+bool SpekeSession<Protocol>::flush_batch() {
+  if (batch_.empty()) return true;
+  if (closed_) return false;
+
+  const bool sent = encrypted_ ? seal_and_send(batch_, PayloadType::BATCH) :
+      sign_and_send(batch_, PayloadType::BATCH);
+  if (not sent) return false;
+
+  // Keeps the capacity for the next batch.
+  batch_.clear();
+  return true;
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::arm_batch_timer() {
+  batch_timer_armed_ = true;
+  batch_timer_.expires_after(options_.batch_max_delay);
+  batch_timer_.async_wait(
+      make_handler([this](const asio::error_code& ec) {
+        if (ec == asio::error::operation_aborted) return;
+
+        std::lock_guard lck{batch_mtx_};
+        batch_timer_armed_ = false;
+        if (closed_) return;
+        // Try again later if the send queue is full.
+        if (not flush_batch()) arm_batch_timer();
+      }));
+}
+
+template <typename Protocol>
+bool SpekeSession<Protocol>::send_message(const SpekeMessage& message,
+                                          bool check_hwm) {
+  const size_t size = message.ByteSizeLong();
+
+  Bytes frame = take_spare_frame();
+  frame.resize(sizeof(size) + size);
+  Util::safe_memcpy(frame.data(), &size, sizeof(size));
+  message.SerializeToArray(frame.data() + sizeof(size), size);
+
+  return queue_frame(std::move(frame), check_hwm);
+}
+
+template <typename Protocol>
+Bytes SpekeSession<Protocol>::take_spare_frame() {
+  Bytes frame;
+  std::lock_guard lck{send_mtx_};
+  if (not spare_frames_.empty()) {
+    frame = std::move(spare_frames_.back());
+    spare_frames_.pop_back();
+  }
+  return frame;
+}
+
+template <typename Protocol>
+Bytes SpekeSession<Protocol>::make_compact_frame(CompactFrameType type,
+                                                 size_t tag_size,
+                                                 size_t payload_size,
+                                                 size_t& tag_offset) {
+  Bytes frame = take_spare_frame();
+  tag_offset = 1 + varint_size(payload_size);
+  frame.resize(tag_offset + tag_size + payload_size);
+
+  frame[0] = static_cast<std::byte>(type);
+  write_varint(payload_size, frame.data() + 1);
+  return frame;
+}
+
+template <typename Protocol>
+bool SpekeSession<Protocol>::queue_frame(Bytes&& frame, bool check_hwm) {
+  std::unique_lock lck{send_mtx_};
+  if (closed_) return false;
+  // Always accept a message if nothing is queued, so a single message bigger
+  // than the high water mark can still be sent.
+  if (check_hwm and send_queue_bytes_ != 0 and
+      send_queue_bytes_ + frame.size() > options_.send_queue_high_water_mark) {
+    return false;
+  }
+
+  send_queue_bytes_ += frame.size();
+  send_queue_.push_back(std::move(frame));
+
+  if (not writing_) {
+    writing_ = true;
+    // Runs inline if this is already on the strand, so it can't be called
+    // with send_mtx_ locked.
+    lck.unlock();
+    asio::dispatch(make_handler([this]{ start_writing(); }));
+  }
+  return true;
+}
+
+template <typename Protocol>
+SpekeMessage* SpekeSession<Protocol>::make_send_message() {
+  send_arena_.Reset();
+  return google::protobuf::Arena::CreateMessage<SpekeMessage>(&send_arena_);
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::start_writing() {
+  std::lock_guard lck{send_mtx_};
+  write_queued();
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::write_queued() {
+  assert(writing_);
+  if (send_queue_.empty() or closed_) {
+    writing_ = false;
+    return;
+  }
+
+  // Everything queued so far goes out in one gather write.
+  in_flight_.clear();
+  write_buffers_.clear();
+  while (not send_queue_.empty()) {
+    in_flight_.push_back(std::move(send_queue_.front()));
+    send_queue_.pop_front();
+    write_buffers_.push_back(asio::buffer(in_flight_.back()));
+  }
+
+  asio::async_write(socket_, write_buffers_,
+                    make_handler([this](const asio::error_code& ec, size_t) {
+                      handle_write(ec);
+                    }));
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::handle_write(const asio::error_code& ec) {
+  {
+    std::lock_guard lck{send_mtx_};
+    for (auto& frame : in_flight_) {
+      send_queue_bytes_ -= frame.size();
+      if (spare_frames_.size() < LRM_SPEKE_SPARE_FRAMES and
+          frame.capacity() <= LRM_SPEKE_SPARE_FRAME_MAX_SIZE) {
+        spare_frames_.push_back(std::move(frame));
+      }
+    }
+    in_flight_.clear();
+
+    if (not ec) write_queued();
+    else writing_ = false;
+  }
+
+  // Every write frees some of the queue, so senders waiting for it retry.
+  for (auto& waiter : std::exchange(writable_waiters_, {})) waiter({});
+  if (ec) handle_io_error(ec);
+}
+
+template <typename Protocol>
+asio::awaitable<void> SpekeSession<Protocol>::AsyncHandshake() {
+  if (SpekeSessionState::IDLE == state_) {
+    Run([this](MessageView message, SpekeSession&) {
+          queue_received(message);
+        });
+  }
+
+  co_await asio::async_initiate<const asio::use_awaitable_t<>&,
+                                void(asio::error_code)>(
+      [this](auto handler) {
+        async_wait_handshake(resume_on_executor(std::move(handler)));
+      },
+      asio::use_awaitable);
+}
+
+template <typename Protocol>
+asio::awaitable<Bytes> SpekeSession<Protocol>::AsyncReceive() {
+  co_return co_await asio::async_initiate<const asio::use_awaitable_t<>&,
+                                          void(asio::error_code, Bytes)>(
+      [this](auto handler) {
+        async_receive(resume_on_executor(std::move(handler)));
+      },
+      asio::use_awaitable);
+}
+
+template <typename Protocol>
+asio::awaitable<void> SpekeSession<Protocol>::AsyncSend(const Bytes& message) {
+  while (not SendMessage(message)) {
+    co_await asio::async_initiate<const asio::use_awaitable_t<>&,
+                                  void(asio::error_code)>(
+        [this](auto handler) {
+          async_wait_writable(resume_on_executor(std::move(handler)));
+        },
+        asio::use_awaitable);
+  }
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::async_wait_handshake(WaitHandler&& handler) {
+  asio::dispatch(make_handler([this, handler = std::move(handler)]() mutable {
+    if (authenticated_) {
+      handler({});
+    } else if (closed_) {
+      handler(asio::error::connection_aborted);
+    } else {
+      handshake_waiters_.push_back(std::move(handler));
+    }
+  }));
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::async_wait_writable(WaitHandler&& handler) {
+  asio::dispatch(make_handler([this, handler = std::move(handler)]() mutable {
+    if (closed_) {
+      handler(asio::error::connection_aborted);
+      return;
+    }
+
+    // Rejected early data waits for the handshake, the key confirmation's
+    // write wakes the waiters.
+    if (options_.early_data and not early_data_sent_) {
+      writable_waiters_.push_back(std::move(handler));
+      return;
+    }
+
+    std::unique_lock lck{send_mtx_};
+    // With anything queued a write is pending and wakes the waiters when
+    // it completes.
+    if (send_queue_bytes_ != 0) {
+      writable_waiters_.push_back(std::move(handler));
+      return;
+    }
+    lck.unlock();
+    handler({});
+  }));
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::async_receive(ReceiveHandler&& handler) {
+  asio::dispatch(make_handler([this, handler = std::move(handler)]() mutable {
+    if (received_.empty() and closed_) {
+      handler(asio::error::connection_aborted, {});
+      return;
+    }
+    receive_waiters_.push_back(std::move(handler));
+    deliver_received();
+  }));
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::queue_received(MessageView message) {
+  received_.emplace_back(message.begin(), message.end());
+  deliver_received();
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::deliver_received() {
+  while (not received_.empty() and not receive_waiters_.empty()) {
+    ReceiveHandler handler = std::move(receive_waiters_.front());
+    receive_waiters_.pop_front();
+    Bytes message = std::move(received_.front());
+    received_.pop_front();
+
+    if (options_.receive_budget > 0) Release(message.size());
+    handler({}, std::move(message));
+  }
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::cancel_waiters() {
+  for (auto& waiter : std::exchange(handshake_waiters_, {})) {
+    waiter(asio::error::connection_aborted);
+  }
+  for (auto& waiter : std::exchange(writable_waiters_, {})) {
+    waiter(asio::error::connection_aborted);
+  }
+  // Messages received before closing are still returned.
+  if (received_.empty()) {
+    for (auto& waiter : std::exchange(receive_waiters_, {})) {
+      waiter(asio::error::connection_aborted, {});
+    }
+  }
 }
 
 template <typename Protocol>
 void SpekeSession<Protocol>::increase_bad_behavior_count() {
+  count([](SpekeTrafficCounters& counters) { counters.AddBadBehavior(); });
   if (++bad_behavior_count_ >= BAD_BEHAVIOR_LIMIT) {
     Close(SpekeSessionState::STOPPED_PEER_BAD_BEHAVIOR);
   }
 }
 
+template <typename Protocol>
+template <typename Count>
+void SpekeSession<Protocol>::count(Count&& count) {
+  count(traffic_);
+  count(SpekeStatsCollector::Get().Traffic());
+}
+
+template <typename Protocol>
+void SpekeSession<Protocol>::record_handshake() {
+  const auto now = std::chrono::steady_clock::now();
+
+  handshake_timings_ = speke_->GetHandshakeTimings();
+  handshake_timings_.key_confirmation = now - key_confirmation_sent_time_;
+  handshake_timings_.total = now - run_time_;
+  SpekeStatsCollector::Get().HandshakeDone(handshake_timings_);
+}
+
 template <typename Protocol>
 SpekeMessage SpekeSession<Protocol>::ReceiveMessage(
     asio::basic_stream_socket<Protocol>& socket) {
@@ -284,6 +1718,11 @@ SpekeMessage SpekeSession<Protocol>::ReceiveMessage(
   // May throw
   asio::read(socket, asio::buffer(&size, sizeof(size)),
              asio::transfer_exactly(sizeof(size)));
+  if (size > LRM_SPEKE_MAX_FRAME_SIZE) {
+    throw std::length_error(
+        __PRETTY_FUNCTION__ +
+        std::string(": The message is bigger than LRM_SPEKE_MAX_FRAME_SIZE"));
+  }
 
   std::vector<std::byte> message_arr(size);
   // May throw
@@ -311,8 +1750,8 @@ void SpekeSession<Protocol>::SendMessage(
   Util::safe_memcpy(buffer.data(), &size, sizeof(size));
   message.SerializeToArray(buffer.data() + sizeof(size), size);
 
-  asio::async_write(socket, asio::buffer(buffer),
-                    asio::transfer_exactly(buffer.size()));
+  // May throw
+  asio::write(socket, asio::buffer(buffer));
 }
 
 template class SpekeSession<asio::ip::tcp>;
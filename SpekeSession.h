@@ -19,13 +19,26 @@
 #ifndef LRM_SPEKESESSION_H_
 #define LRM_SPEKESESSION_H_
 
-#include <queue>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
 #include <mutex>
+#include <optional>
+#include <span>
+#include <vector>
 
 #include <asio.hpp>
+#include <google/protobuf/arena.h>
 
 #include "SPEKE.pb.h"
+#include "Aead.h"
+#include "ResumedSpeke.h"
 #include "SPEKE.h"
+#include "SpekeHandshakeEngine.h"
+#include "SpekeStats.h"
+#include "SpekeTicketIssuer.h"
 
 namespace lrm::crypto {
 /// The states are arranged in a way that everything >= STOPPED means that
@@ -48,7 +61,85 @@ enum class SpekeSessionState {
   /// The session was stopped because the peer disconnected.
   STOPPED_PEER_DISCONNECTED,
   /// Peer sent an invalid public key or an invalid id.
-  STOPPED_PEER_PUBLIC_KEY_OR_ID_INVALID
+  STOPPED_PEER_PUBLIC_KEY_OR_ID_INVALID,
+  /// Peer uses a different SPEKE backend (\ref SpekeBackend).
+  STOPPED_NEGOTIATION_FAILED,
+  /// Peer didn't accept the resumption ticket. The session has to be
+  /// established again with the full handshake.
+  STOPPED_RESUMPTION_REJECTED
+};
+static_assert(
+    static_cast<size_t>(SpekeSessionState::STOPPED_RESUMPTION_REJECTED) + 1 ==
+    SpekeProcessStats::STATES,
+    "SpekeProcessStats::STATES must be the number of SpekeSessionStates");
+
+/// What a chunk given to \ref SpekeSession::StreamHandler is, see
+/// \ref session_streams.
+enum class SpekeStreamStatus {
+  /// More chunks of the stream will follow. Chunks of a signed stream
+  /// aren't verified yet.
+  CHUNK,
+  /// The last chunk, the whole stream is verified.
+  END,
+  /// The signature of the stream didn't match, everything received from it
+  /// has to be discarded. The chunk is empty.
+  ABORTED
+};
+
+/// Tunables of a \ref SpekeSession.
+struct SpekeSessionOptions {
+  /// Maximum number of bytes waiting to be written. Above it
+  /// \ref SpekeSession::SendMessage() rejects new messages.
+  size_t send_queue_high_water_mark = LRM_SPEKE_SEND_QUEUE_HIGH_WATER_MARK;
+  /// Size of a batch of messages (\ref SpekeSession::SendBatched()) at
+  /// which it's flushed.
+  size_t batch_max_bytes = LRM_SPEKE_BATCH_MAX_BYTES;
+  /// Maximum time a message waits in a batch before it's flushed.
+  std::chrono::steady_clock::duration batch_max_delay =
+      std::chrono::milliseconds(LRM_SPEKE_BATCH_MAX_DELAY_MS);
+  /// Offer to encrypt messages with \ref LRM_SPEKE_CIPHER_TYPE instead of
+  /// only signing them with HMAC. It's used only if the peer offers it too.
+  bool encryption = false;
+  /// Close the session with
+  /// \ref SpekeSessionState::STOPPED_NEGOTIATION_FAILED instead of only
+  /// signing messages if the peer doesn't offer \ref encryption. It needs
+  /// \ref encryption.
+  bool require_encryption = false;
+  /// Offer to switch to the compact framing after the handshake, see
+  /// \ref SpekeSession. It's used only if the peer offers it too.
+  bool compact_framing = false;
+  /// Queue messages sent before the handshake is done instead of throwing
+  /// and send them right after the key confirmation, see
+  /// \ref session_early_data.
+  bool early_data = false;
+  /// Ask the peer for a resumption ticket, see
+  /// \ref SpekeSession::GetResumptionTicket().
+  bool resumption = false;
+  /// Issue resumption tickets to peers that ask for them and resume
+  /// sessions from their tickets. A session with it waits for the peer's
+  /// InitData before sending its own, so only the accepting side can set it.
+  std::shared_ptr<SpekeTicketIssuer> ticket_issuer;
+  /// Frames bigger than this, including the tag, close the session with
+  /// \ref SpekeSessionState::STOPPED_PEER_BAD_BEHAVIOR. It bounds the
+  /// memory of the receive buffers.
+  size_t max_frame_size = LRM_SPEKE_MAX_FRAME_SIZE;
+  /// Bytes of messages and stream chunks given to the handlers that can be
+  /// outstanding before reading pauses, see \ref session_flow_control.
+  /// 0 disables the budget.
+  size_t receive_budget = 0;
+  /// Groups the session can switch to with \ref speke_factory, besides the
+  /// one of its SPEKE. See \ref session_groups.
+  std::vector<SpekeGroup> groups;
+  /// Make the SPEKE of the session for another group.
+  std::function<std::shared_ptr<SpekeInterface>(SpekeGroup)> speke_factory;
+  /// Wait for the peer's InitData and pick the cheapest group both peers
+  /// accept. It needs \ref speke_factory. Like \ref ticket_issuer, only
+  /// the accepting side can set it.
+  bool choose_group = false;
+  /// Close the session with
+  /// \ref SpekeSessionState::STOPPED_NEGOTIATION_FAILED if its group is
+  /// smaller. Custom groups count as 0 bits.
+  int min_group_bits = 0;
 };
 
 /// \brief Network session authenticated by SPEKE.
@@ -62,19 +153,184 @@ enum class SpekeSessionState {
 ///
 /// The SpekeSession class uses asynchronous asio calls, so the context
 /// tied to the socket that is given in the constructor needs to be running.
+///
+/// \section session_threads Thread safety
+/// All handlers of a session run on its own strand, made from the socket's
+/// executor, so one io_context can be run by many threads. To use an
+/// io_context other than the socket's, create the socket with that
+/// executor. \ref SendMessage(), \ref SendBatched(), \ref FlushBatch(),
+/// \ref Close(), \ref SetMessageHandler(), \ref SetStreamHandler(),
+/// \ref Pause(), \ref Resume(), \ref Release() and \ref GetState() can be
+/// called from any thread. The socket is only touched on the strand.
+///
+/// The session mustn't be destroyed while other threads are calling its
+/// methods, nor from its own handlers, post that to \ref GetExecutor()
+/// instead. The destructor waits for a handler running on another thread,
+/// and handlers still queued return without touching the session.
+///
+/// Outgoing messages are queued and written in order, with only one write
+/// in flight. Messages queued while a write is pending go out together in
+/// a single gather write.
+///
+/// \section compact_framing Compact framing
+/// The handshake is made of protobuf \e SpekeMessage frames, each prefixed
+/// by its size. If both peers enable
+/// \ref SpekeSessionOptions::compact_framing, each one switches to compact
+/// frames right after sending its key confirmation:
+///
+/// | type (1 byte) | payload size (LE varint) | tag | payload |
+///
+/// The type is one of \ref CompactFrameType. The tag is the HMAC signature
+/// of the payload for signed frames or the AEAD tag for encrypted ones, so
+/// its size is fixed for the session. Payloads of batches are encoded like
+/// \e SignedBatch data.
+///
+/// \section session_resumption Resumption
+/// A client that sets \ref SpekeSessionOptions::resumption gets a ticket
+/// from a server with \ref SpekeSessionOptions::ticket_issuer. To
+/// reconnect without the Diffie-Hellman exchange, it makes a new session
+/// with a \ref ResumedSpeke made from \ref GetResumptionTicket(). If the
+/// server doesn't accept the ticket, the client's session closes with
+/// \ref SpekeSessionState::STOPPED_RESUMPTION_REJECTED and it should
+/// connect again with a regular \ref SPEKE.
+///
+/// \section session_groups Groups
+/// Sessions using \ref SPEKE send the \ref SpekeGroup of their public key
+/// in InitData, so peers in different groups stop with
+/// \ref SpekeSessionState::STOPPED_NEGOTIATION_FAILED right away instead
+/// of failing the key confirmation.
+///
+/// To negotiate the group, both peers set
+/// \ref SpekeSessionOptions::speke_factory and list the groups they accept
+/// in \ref SpekeSessionOptions::groups, and the server sets
+/// \ref SpekeSessionOptions::choose_group. The client sends its key in
+/// its preferred group, which should be the cheapest one. The server picks
+/// the smallest group both accept that has at least
+/// \ref SpekeSessionOptions::min_group_bits. If it's the client's, the
+/// handshake goes on as usual. Otherwise the client makes a new SPEKE in
+/// the picked group and sends its InitData again, which costs one more
+/// round trip.
+///
+/// \section session_early_data Early data
+/// With \ref SpekeSessionOptions::early_data, \ref SendMessage() and
+/// \ref SendBatched() can be called as soon as the session is
+/// \ref SpekeSessionState::RUNNING. Messages sent before the keys are
+/// derived are kept, within
+/// \ref SpekeSessionOptions::send_queue_high_water_mark, and go out as one
+/// signed or encrypted batch in the same flight as the key confirmation,
+/// so the first request doesn't wait for another round trip.
+///
+/// A session with the option also holds whatever the peer signs or
+/// encrypts before its key confirmation until the confirmation is
+/// verified, and drops it with the session if it fails, so its handlers
+/// never see data from a peer that didn't prove it knows the password.
+///
+/// \section session_streams Streams
+/// Messages too big to keep in memory, or bigger than
+/// \ref SpekeSessionOptions::max_frame_size, can be sent in chunks with
+/// \ref SendChunk(). Each chunk is a frame of its own and the peer gives it
+/// to its \ref StreamHandler as soon as it arrives, so neither side holds
+/// more than a chunk. Signed streams are signed incrementally, the last
+/// chunk carries the HMAC of all of them. Until it's verified, the chunks
+/// are unauthenticated and the handler gets \ref SpekeStreamStatus::ABORTED
+/// if the signature doesn't match. Each chunk of an encrypted stream is
+/// authenticated on its own, a truncated stream closes the session.
+///
+/// One stream can be sent at a time. Messages sent with \ref SendMessage()
+/// or \ref SendBatched() can go between its chunks.
+///
+/// \section session_flow_control Flow control
+/// A handler that can't keep up calls \ref Pause(), directly or from
+/// another thread, and nothing more is read from the socket until
+/// \ref Resume(). The peer's writes then back up in the socket buffers and
+/// its send queue, so its \ref SendMessage() starts returning false.
+/// Messages already read, i.e. the rest of a batch, are still delivered.
+///
+/// With \ref SpekeSessionOptions::receive_budget the session pauses on its
+/// own. Every message and chunk given to a handler takes its size from the
+/// budget and reading stops when it's used up. The application gives the
+/// bytes back with \ref Release() once it's done with them, e.g. when it
+/// pops a message copied by a \ref MakeOwningHandler() handler from its
+/// queue.
+///
+/// Frames are at most \ref SpekeSessionOptions::max_frame_size each and
+/// the receive buffers don't keep more than
+/// \ref LRM_SPEKE_RECEIVE_BUFFER_MAX_SIZE after a bigger frame, so the
+/// memory held for a session stays bounded.
+///
+/// \section session_coroutines Coroutines
+/// Instead of handlers, a session can be driven from a C++20 coroutine
+/// with asio awaitables:
+/// \code{.cpp}
+/// asio::co_spawn(context, [&session]() -> asio::awaitable<void> {
+///   co_await session.AsyncHandshake();
+///   co_await session.AsyncSend(request);
+///   Bytes response = co_await session.AsyncReceive();
+/// }, asio::detached);
+/// \endcode
+/// The coroutine is resumed on its own executor, not on the session's
+/// strand.
+///
+/// \section session_stats Stats
+/// Every session counts its messages, errors and the time spent in the
+/// phases of the handshake, see \ref GetStats(). The counters are also
+/// summed for the whole process by \ref SpekeStatsCollector, which can call
+/// hooks when a handshake completes and when a session is closed.
 template <typename Protocol>
 class SpekeSession {
  public:
   static constexpr int BAD_BEHAVIOR_LIMIT = 3;
 
-  /// The \e Bytes param is a plain message in bytes, without HMAC signature.
-  using MessageHandler = std::function<void(Bytes&&, SpekeSession&)>;
+  /// View of a plain message, without HMAC signature. It's valid only until
+  /// the handler returns.
+  using MessageView = std::span<const std::byte>;
+
+  /// The \e MessageView param is a plain message in bytes, without HMAC
+  /// signature. It points to the session's receive buffer, so the handler
+  /// has to copy it if it needs to keep it. See \ref MakeOwningHandler().
+  using MessageHandler = std::function<void(MessageView, SpekeSession&)>;
+
+  /// Handler taking an owned copy of the message. Has to be wrapped with
+  /// \ref MakeOwningHandler().
+  using OwningMessageHandler = std::function<void(Bytes&&, SpekeSession&)>;
+
+  /// Type byte of compact frames.
+  enum class CompactFrameType : uint8_t {
+    SIGNED_DATA = 1,
+    SIGNED_BATCH = 2,
+    ENCRYPTED_DATA = 3,
+    ENCRYPTED_BATCH = 4,
+    // The chunks of signed streams have no tag, the last one has the
+    // signature of the stream.
+    SIGNED_STREAM_CHUNK = 5,
+    SIGNED_STREAM_END = 6,
+    ENCRYPTED_STREAM_CHUNK = 7,
+    ENCRYPTED_STREAM_END = 8
+  };
+
+  /// Handler of streamed messages, see \ref session_streams. The chunk is
+  /// valid only until the handler returns.
+  using StreamHandler = std::function<void(MessageView chunk,
+                                           SpekeStreamStatus status,
+                                           SpekeSession&)>;
+
+  /// \brief Make a \ref MessageHandler that gives \e handler a copy of
+  /// every message.
+  ///
+  /// Example:
+  /// \code{.cpp}
+  /// session.Run(SpekeSession::MakeOwningHandler(
+  ///     [&queue](Bytes&& msg, auto&) { queue.push(std::move(msg)); }));
+  /// \endcode
+  static MessageHandler MakeOwningHandler(OwningMessageHandler&& handler);
 
   /// \param socket An already connected tcp socket.
   /// \param speke A pointer to an already constructed \ref SpekeInterface
   /// object. I.e. \ref SPEKE object.
+  /// \param options Session tunables, see \ref SpekeSessionOptions.
   SpekeSession(asio::basic_stream_socket<Protocol>&& socket,
-               std::shared_ptr<SpekeInterface>&& speke);
+               std::shared_ptr<SpekeInterface>&& speke,
+               const SpekeSessionOptions& options = {});
 
   ~SpekeSession();
 
@@ -87,6 +343,9 @@ class SpekeSession {
 
   /// \brief Close the session and severe the connection.
   ///
+  /// The state changes immediately, the socket is closed on the session's
+  /// strand.
+  ///
   /// \param state \ref SpekeSessionState to set while closing the connection.
   void Close(SpekeSessionState state) noexcept;
 
@@ -96,52 +355,441 @@ class SpekeSession {
   ///
   /// Example:
   /// \code{.cpp}
-  /// speke_session.SetMessageHandler([](Bytes&& msg) {
+  /// speke_session.SetMessageHandler([](auto msg, auto& session) {
   ///                                   // Handle msg...
   ///                                 }
   /// \endcode
   ///
+  /// The handler is replaced on the session's strand, so a message being
+  /// handled when it's called still goes to the old one.
+  ///
   /// \param handler A function that will handle messages.
   void SetMessageHandler(MessageHandler&& handler);
 
+  /// \brief Set a handler to handle chunks of streamed messages.
+  ///
+  /// Streams received without a handler are dropped. The handler is
+  /// replaced like in \ref SetMessageHandler().
+  void SetStreamHandler(StreamHandler&& handler);
+
+  /// \brief Run the handshake computations on \e engine instead of the
+  /// thread reading from the socket.
+  ///
+  /// When the peer's public key arrives, it's handed to the \e engine and
+  /// reading from the socket pauses until the keys are derived. Must be
+  /// called before \ref Run().
+  void SetHandshakeEngine(std::shared_ptr<SpekeHandshakeEngine> engine);
+
   /// \brief Get the session state
   SpekeSessionState GetState() const;
 
+  /// \brief Return true if the peer passed the key confirmation.
+  bool IsAuthenticated() const;
+
+  /// \brief Return true if the session was resumed from a ticket, see
+  /// \ref session_resumption.
+  bool IsResumed() const;
+
+  /// \brief Get the ticket the peer issued for resuming this session.
+  ///
+  /// \return std::nullopt until the peer passed the key confirmation, or if
+  /// it didn't issue a ticket.
+  std::optional<SpekeResumptionTicket> GetResumptionTicket() const;
+
+  /// \brief Get a snapshot of the session's counters.
+  ///
+  /// Each counter is read atomically, but not all of them at once.
+  SpekeSessionStats GetStats() const;
+
+  /// \brief Get the strand all handlers of the session run on.
+  ///
+  /// Work posted to it doesn't run concurrently with the session's
+  /// handlers, e.g. the session can be safely destroyed there.
+  asio::strand<asio::any_io_executor> GetExecutor() const;
+
+  /// \brief Return true if messages are encrypted.
+  ///
+  /// Set after the handshake, when both peers enabled
+  /// \ref SpekeSessionOptions::encryption.
+  bool IsEncrypted() const;
+
   /// \brief Send a \e message to peer. The message will be signed with HMAC.
-  void SendMessage(const Bytes& message);
+  ///
+  /// The message is queued and written asynchronously. If the session is
+  /// encrypted (\ref IsEncrypted()) the message is encrypted instead.
+  ///
+  /// \throw std::logic_error If the handshake isn't done yet, so there's
+  /// no key to sign or encrypt the message with. With
+  /// \ref SpekeSessionOptions::early_data the message is kept until there
+  /// is instead.
+  ///
+  /// \return false if the message was rejected because the send queue is
+  /// above \ref SpekeSessionOptions::send_queue_high_water_mark or the
+  /// session is closed. The caller should retry later or slow down.
+  bool SendMessage(const Bytes& message);
+
+  /// \brief Add a \e message to a batch sent to peer under one HMAC
+  /// signature.
+  ///
+  /// The batch is flushed when it reaches
+  /// \ref SpekeSessionOptions::batch_max_bytes, when
+  /// \ref SpekeSessionOptions::batch_max_delay passes after its first
+  /// message was added, or on \ref FlushBatch(). The peer receives the
+  /// messages in order, as if they were sent with \ref SendMessage().
+  /// Messages sent with \ref SendMessage() don't wait for the batch.
+  ///
+  /// \throw std::logic_error See \ref SendMessage().
+  ///
+  /// \return false if the message was rejected. See \ref SendMessage().
+  bool SendBatched(const Bytes& message);
+
+  /// \brief Send the current batch now.
+  ///
+  /// \return false if the batch was rejected and is kept for later.
+  bool FlushBatch();
+
+  /// \brief Send the next chunk of a streamed message, see
+  /// \ref session_streams.
+  ///
+  /// \param chunk Part of the message. It has to fit in the peer's
+  ///        \ref SpekeSessionOptions::max_frame_size with its tag.
+  /// \param last Set for the last chunk, which ends the stream.
+  ///
+  /// \throw std::logic_error See \ref SendMessage().
+  ///
+  /// \return false if the chunk was rejected, see \ref SendMessage(). The
+  /// stream continues, so the same chunk should be sent again.
+  bool SendChunk(MessageView chunk, bool last);
+
+  /// \brief Start the session and wait until the peer is authenticated,
+  /// see \ref session_coroutines.
+  ///
+  /// If the session isn't running yet, it's started with a handler that
+  /// keeps messages for \ref AsyncReceive().
+  ///
+  /// \throw asio::system_error With asio::error::connection_aborted if
+  /// the session is closed first. \ref GetState() tells why.
+  asio::awaitable<void> AsyncHandshake();
+
+  /// \brief Wait for the next message.
+  ///
+  /// Only sessions started by \ref AsyncHandshake() keep messages for it.
+  /// With \ref SpekeSessionOptions::receive_budget the message is released
+  /// when it's returned.
+  ///
+  /// \throw asio::system_error With asio::error::connection_aborted when
+  /// the session is closed and every message received before is returned.
+  asio::awaitable<Bytes> AsyncReceive();
+
+  /// \brief Send a \e message, waiting for the send queue to drain if
+  /// it's above \ref SpekeSessionOptions::send_queue_high_water_mark.
+  ///
+  /// \e message has to stay valid until it completes.
+  ///
+  /// \throw asio::system_error With asio::error::connection_aborted if
+  /// the session is closed.
+  /// \throw std::logic_error See \ref SendMessage().
+  asio::awaitable<void> AsyncSend(const Bytes& message);
+
+  /// \brief Stop reading from the socket after the frame being handled,
+  /// see \ref session_flow_control.
+  void Pause();
+
+  /// \brief Start reading again after \ref Pause().
+  ///
+  /// Reading doesn't start if \ref SpekeSessionOptions::receive_budget is
+  /// used up.
+  void Resume();
+
+  /// \brief Return true if reading is paused by \ref Pause().
+  bool IsPaused() const;
+
+  /// \brief Give \e bytes back to \ref SpekeSessionOptions::receive_budget
+  /// and start reading again if it was stopped by it.
+  void Release(size_t bytes);
 
  protected:
-  // This is synchronous
+  // This is synchronous, the session itself reads asynchronously.
   static SpekeMessage ReceiveMessage(
       asio::basic_stream_socket<Protocol>& socket);
 
-  // This is asynchronous
+  // This is synchronous, the session itself writes asynchronously.
   static void SendMessage(
       const SpekeMessage& message,
       asio::basic_stream_socket<Protocol>& socket);
 
  private:
+  // Reading is a loop of start_reading() -> handle_read_header() ->
+  // handle_read() -> continue_reading(), all of them asynchronous.
+  // Bind the handler to the strand and skip it if the session was
+  // destroyed, see lifetime_.
+  template <typename Handler>
+  auto make_handler(Handler&& handler);
+
+  // What a signed or encrypted payload is, also the AAD of encrypted ones.
+  enum class PayloadType : uint8_t {
+    MESSAGE = 0,
+    BATCH = 1,
+    STREAM_CHUNK = 2,
+    STREAM_END = 3
+  };
+
   void start_reading();
+  // Called on the strand when a frame is handled. Reads the next one,
+  // unless reading is paused.
+  void continue_reading();
+  // Restart the reading stopped by continue_reading() if it can go on.
+  void wake_reading();
+  bool can_read() const;
+  void handle_read_header(const asio::error_code& ec);
   void handle_read(const asio::error_code& ec);
-  void handle_message(Bytes&& message);
+  void handle_io_error(const asio::error_code& ec);
+  // Compact frames are read with start_reading() ->
+  // handle_compact_header() -> handle_compact_frame() -> continue_reading().
+  void handle_compact_header(const asio::error_code& ec, size_t size);
+  void handle_compact_frame(const asio::error_code& ec);
+  void handle_message(MessageView message);
+  // Return true if the session should keep reading
+  bool handle_init_data(const SpekeMessage::InitData& init_data);
+  // Pick the group for both peers, see \ref session_groups.
+  std::optional<SpekeGroup> choose_group(
+      const SpekeMessage::InitData& init_data) const;
+  bool accepts_group(SpekeGroup group) const;
+  // Replace speke_ with one in \e group. Return false if the session was
+  // closed.
+  bool switch_group(SpekeGroup group);
+  void handle_resumption_ticket(
+      const SpekeMessage::ResumptionTicket& ticket);
+  void handle_signed(MessageView signature, MessageView data,
+                     PayloadType type);
+  void handle_signed_stream(MessageView signature, MessageView data,
+                            bool last);
+  void handle_encrypted(MessageView tag, MessageView ciphertext,
+                        PayloadType type);
+  void handle_payload(MessageView payload, PayloadType type);
+  void handle_stream(MessageView chunk, SpekeStreamStatus status);
+  // Return true if the session should keep reading
+  bool handle_handshake(std::exception_ptr error);
+  // Return false if the encryption can't be used with this peer
+  bool setup_encryption();
+  // Throw before the keys are derived. Until then speke_ may be replaced
+  // on the strand, so other threads mustn't touch it.
+  void check_handshake_done() const;
+  void send_init_data();
   void send_key_confirmation();
+  // Keep a message sent before the handshake, see \ref session_early_data.
+  // Return std::nullopt if the handshake is done and it has to be sent as
+  // usual.
+  std::optional<bool> try_send_early(const Bytes& message);
+  // Called on the strand after send_key_confirmation().
+  void send_early_data();
+  // Keep a frame received before the peer's key confirmation, then handle
+  // the kept ones once it passed. Called on the strand.
+  void hold_frame(MessageView tag, MessageView payload, PayloadType type,
+                  bool encrypted);
+  void release_held_frames();
+  // Called on the strand.
+  void close_socket() noexcept;
 
-  void send_message(const SpekeMessage& message);
-  std::optional<SpekeMessage> receive_message();
+  // Queue a frame. Return false if closed or, when \e check_hwm is set,
+  // if the queue is above the high water mark.
+  bool send_message(const SpekeMessage& message, bool check_hwm = false);
+  bool queue_frame(Bytes&& frame, bool check_hwm);
+  Bytes take_spare_frame();
+  // Start a compact frame, return the offset of the tag in it.
+  Bytes make_compact_frame(CompactFrameType type, size_t tag_size,
+                           size_t payload_size, size_t& tag_offset);
+  // Reset the send arena and create a message on it. Has to be called with
+  // send_arena_mtx_ locked, the message lives until the next call.
+  SpekeMessage* make_send_message();
+  // Called on the strand once writing_ is claimed by queue_frame().
+  void start_writing();
+  // Has to be called on the strand with send_mtx_ locked.
+  void write_queued();
+  void handle_write(const asio::error_code& ec);
+
+  // Sign or encrypt and queue, \e check_hwm is passed to queue_frame().
+  bool sign_and_send(MessageView payload, PayloadType type,
+                     bool check_hwm = true);
+  bool seal_and_send(MessageView payload, PayloadType type,
+                     bool check_hwm = true);
+  // Has to be called with stream_mtx_ locked.
+  bool sign_and_send_chunk(MessageView chunk, bool last);
+  bool send_signed(PayloadType type, MessageView tag, MessageView payload,
+                   bool check_hwm = true);
+
+  // Both have to be called with batch_mtx_ locked.
+  bool flush_batch();
+  void arm_batch_timer();
+  void handle_batch(MessageView batch);
+
+  // Coroutine API, see \ref session_coroutines. The async_*() functions
+  // can be called from any thread, handlers are called on the strand.
+  using WaitHandler = std::function<void(const asio::error_code&)>;
+  using ReceiveHandler = std::function<void(const asio::error_code&, Bytes)>;
+  void async_wait_handshake(WaitHandler&& handler);
+  void async_wait_writable(WaitHandler&& handler);
+  void async_receive(ReceiveHandler&& handler);
+  void queue_received(MessageView message);
+  void deliver_received();
+  // Fail everything waiting, called on the strand when closing.
+  void cancel_waiters();
 
   void increase_bad_behavior_count();
+  // Count in both the session's and the process' counters.
+  template <typename Count>
+  void count(Count&& count);
+  // Called once the peer passed the key confirmation.
+  void record_handshake();
 
   asio::basic_stream_socket<Protocol> socket_;
+  asio::strand<asio::any_io_executor> strand_;
 
   std::shared_ptr<SpekeInterface> speke_;
 
+  std::shared_ptr<SpekeHandshakeEngine> handshake_engine_;
+  // Every handler holds the mutex while it runs and checks alive first.
+  // The destructor clears it under the mutex, so it waits for a handler
+  // running on another thread, and the handlers completing later return.
+  // Recursive since handlers dispatch others that run inline.
+  struct Lifetime {
+    std::recursive_mutex mutex;
+    bool alive = true;
+  };
+  std::shared_ptr<Lifetime> lifetime_ = std::make_shared<Lifetime>();
+
   std::atomic<SpekeSessionState> state_;
 
+  const SpekeSessionOptions options_;
+
   int bad_behavior_count_ = 0;
+  SpekeTrafficCounters traffic_;
+  // Written on the strand before authenticated_ is set.
+  std::chrono::steady_clock::time_point run_time_;
+  std::chrono::steady_clock::time_point key_confirmation_sent_time_;
+  SpekeHandshakeTimings handshake_timings_;
   std::atomic_bool closed_ = false;
+  std::atomic_bool authenticated_ = false;
+
+  // Flow control, see \ref session_flow_control. read_parked_ is set on
+  // the strand when continue_reading() doesn't read the next frame.
+  std::atomic_bool paused_ = false;
+  std::atomic<size_t> unreleased_bytes_ = 0;
+  bool read_parked_ = false;
 
-  std::mutex message_handler_mtx_;
+  // Receive state, reused for every message so reading compact frames
+  // doesn't allocate once the buffers are big enough. Protobuf frames are
+  // parsed on an arena reset before every message, which starts with a
+  // block kept here. Their bytes fields still allocate, see
+  // LRM_SPEKE_ARENA_BLOCK_SIZE.
+  size_t receive_size_ = 0;
+  Bytes receive_buffer_;
+  std::unique_ptr<char[]> receive_block_;
+  google::protobuf::Arena receive_arena_;
+
+  // Compact frame header is read here, it's at most a type byte and a
+  // 64-bit varint.
+  std::array<std::byte, 11> compact_header_;
+  CompactFrameType compact_type_;
+  size_t compact_tag_size_ = 0;
+  // Set after peer's key confirmation, used on the reading side only.
+  bool compact_receive_ = false;
+  size_t hmac_size_ = 0;
+
+  // Messages to send are built on their own arena, like received ones.
+  // send_arena_mtx_ also guards compact_send_, so no message is built with
+  // the old framing after the switch.
+  std::mutex send_arena_mtx_;
+  std::unique_ptr<char[]> send_block_;
+  google::protobuf::Arena send_arena_;
+  bool compact_send_ = false;
+
+  // Peer's InitData
+  std::string remote_id_;
+  bool remote_encryption_ = false;
+  bool remote_compact_framing_ = false;
+  bool remote_resumption_ = false;
+
+  // Cleared by Run() if InitData waits for the peer's one, then set on the
+  // strand when it's sent. speke_ is only replaced on the strand before
+  // handshake_done_ is set, and other threads only read it after.
+  bool init_data_sent_ = true;
+  // Set when this side picked the group, see \ref session_groups.
+  bool group_chosen_ = false;
+  std::atomic_bool resumed_ = false;
+  // Only written before the peer is authenticated.
+  std::optional<SpekeResumptionTicket> resumption_ticket_;
+  // What every InitData sent and received negotiates. Both go into the key
+  // confirmation data, so the peers don't agree on options changed on the
+  // way.
+  Bytes sent_transcript_;
+  Bytes received_transcript_;
+
+  // Encryption state, set up after the handshake. Nonces are counters with
+  // the highest bit set in one direction, which is picked by comparing ids.
+  std::atomic_bool handshake_done_ = false;
+  std::atomic_bool encrypted_ = false;
+  static constexpr uint64_t DIRECTION_BIT = uint64_t{1} << 63;
+  std::unique_ptr<Aead> aead_;
+  uint64_t send_direction_ = 0;
+  // seal_mtx_ keeps nonces in the same order as messages in the queue.
+  std::mutex seal_mtx_;
+  uint64_t send_counter_ = 0;
+  uint64_t receive_counter_ = 0;
+  Bytes open_buffer_;
+
+  // Messages sent before the handshake, see \ref session_early_data.
+  // They're encoded like batch_ and sent as one batch. early_data_sent_ is
+  // set with early_mtx_ locked once it's queued.
+  std::mutex early_mtx_;
+  Bytes early_batch_;
+  std::atomic_bool early_data_sent_ = false;
+  // Frames the peer signed or encrypted before its key confirmation, used
+  // on the strand.
+  struct HeldFrame {
+    Bytes tag;
+    Bytes payload;
+    PayloadType type;
+    bool encrypted;
+  };
+  std::vector<HeldFrame> held_frames_;
+  size_t held_bytes_ = 0;
+
+  // Send state. Frames in send_queue_ wait for the write of in_flight_ to
+  // complete, write_buffers_ point into in_flight_.
+  mutable std::mutex send_mtx_;
+  std::deque<Bytes> send_queue_;
+  std::vector<Bytes> in_flight_;
+  std::vector<asio::const_buffer> write_buffers_;
+  // Sent frames kept to be reused, see LRM_SPEKE_SPARE_FRAMES.
+  std::vector<Bytes> spare_frames_;
+  size_t send_queue_bytes_ = 0;
+  // Set while a write is in flight or about to start.
+  bool writing_ = false;
+
+  // Messages added with SendBatched(), each prefixed by its size as a
+  // varint.
+  std::mutex batch_mtx_;
+  Bytes batch_;
+  asio::steady_timer batch_timer_;
+  bool batch_timer_armed_ = false;
+
+  // The outgoing stream's HMAC, keeps the chunks in order.
+  std::mutex stream_mtx_;
+  std::optional<Hmac::Stream> send_stream_;
+  // HMAC of the incoming stream, used on the strand.
+  std::optional<Hmac::Stream> receive_stream_;
+
+  // Used on the strand only, so calling them needs no lock or copy.
   MessageHandler message_handler_;
+  StreamHandler stream_handler_;
+
+  // Coroutine API state, used on the strand. Messages of sessions started
+  // by AsyncHandshake() wait in received_ for AsyncReceive().
+  std::deque<Bytes> received_;
+  std::deque<ReceiveHandler> receive_waiters_;
+  std::vector<WaitHandler> handshake_waiters_;
+  std::vector<WaitHandler> writable_waiters_;
 };
 }
 
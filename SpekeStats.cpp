@@ -0,0 +1,120 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#include "SpekeStats.h"
+
+namespace lrm::crypto {
+namespace {
+void add_ns(std::atomic<uint64_t>& counter, std::chrono::nanoseconds time) {
+  counter.fetch_add(time.count(), std::memory_order_relaxed);
+}
+
+std::chrono::nanoseconds load_ns(const std::atomic<uint64_t>& counter) {
+  return std::chrono::nanoseconds(counter.load(std::memory_order_relaxed));
+}
+}
+
+SpekeTrafficStats SpekeTrafficCounters::Load() const noexcept {
+  SpekeTrafficStats stats;
+  AddTo(stats);
+  return stats;
+}
+
+void SpekeTrafficCounters::AddTo(SpekeTrafficStats& stats) const noexcept {
+  constexpr auto order = std::memory_order_relaxed;
+  stats.messages_in += messages_in_.load(order);
+  stats.bytes_in += bytes_in_.load(order);
+  stats.messages_out += messages_out_.load(order);
+  stats.bytes_out += bytes_out_.load(order);
+  stats.hmac_failures += hmac_failures_.load(order);
+  stats.decryption_failures += decryption_failures_.load(order);
+  stats.bad_behavior += bad_behavior_.load(order);
+}
+
+SpekeStatsCollector& SpekeStatsCollector::Get() {
+  // Never destroyed, sessions may still report during static destruction.
+  static SpekeStatsCollector* const collector = new SpekeStatsCollector;
+  return *collector;
+}
+
+SpekeProcessStats SpekeStatsCollector::Snapshot() const {
+  constexpr auto order = std::memory_order_relaxed;
+  SpekeProcessStats stats;
+
+  stats.sessions = sessions_.load(order);
+  stats.handshakes = handshakes_.load(order);
+  stats.handshake_totals = SpekeHandshakeTimings{
+    .keygen = load_ns(keygen_ns_),
+    .dh = load_ns(dh_ns_),
+    .kdf = load_ns(kdf_ns_),
+    .key_confirmation = load_ns(key_confirmation_ns_),
+    .total = load_ns(total_ns_)};
+  for (const Shard& shard : shards_) {
+    shard.traffic.AddTo(stats.traffic);
+  }
+  for (size_t i = 0; i < closed_.size(); ++i) {
+    stats.closed[i] = closed_[i].load(order);
+  }
+  return stats;
+}
+
+void SpekeStatsCollector::SetHooks(SpekeStatsHooks hooks) {
+  hooks_.store(std::make_shared<const SpekeStatsHooks>(std::move(hooks)),
+               std::memory_order_release);
+}
+
+SpekeTrafficCounters& SpekeStatsCollector::Traffic() noexcept {
+  static std::atomic<size_t> next_shard = 0;
+  thread_local const size_t shard =
+      next_shard.fetch_add(1, std::memory_order_relaxed) % shards_.size();
+  return shards_[shard].traffic;
+}
+
+void SpekeStatsCollector::SessionStarted() noexcept {
+  sessions_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void SpekeStatsCollector::HandshakeDone(
+    const SpekeHandshakeTimings& timings) noexcept {
+  handshakes_.fetch_add(1, std::memory_order_relaxed);
+  add_ns(keygen_ns_, timings.keygen);
+  add_ns(dh_ns_, timings.dh);
+  add_ns(kdf_ns_, timings.kdf);
+  add_ns(key_confirmation_ns_, timings.key_confirmation);
+  add_ns(total_ns_, timings.total);
+
+  const auto hooks = hooks_.load(std::memory_order_acquire);
+  if (hooks and hooks->on_handshake) {
+    hooks->on_handshake(timings);
+  }
+}
+
+void SpekeStatsCollector::SessionClosed(
+    const SpekeSessionStats& stats) noexcept {
+  const auto state = static_cast<size_t>(stats.state);
+  if (state < closed_.size()) {
+    closed_[state].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  const auto hooks = hooks_.load(std::memory_order_acquire);
+  if (hooks and hooks->on_close) {
+    hooks->on_close(stats);
+  }
+}
+}
@@ -0,0 +1,206 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#ifndef LRM_SPEKESTATS_H_
+#define LRM_SPEKESTATS_H_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#include "config.h"
+
+namespace lrm::crypto {
+// Defined in SpekeSession.h
+enum class SpekeSessionState;
+
+/// Time spent in each phase of a handshake.
+///
+/// Phases that weren't measured, i.e. generating a keypair taken from a
+/// \ref SpekeKeypairPool, are 0.
+struct SpekeHandshakeTimings {
+  /// Generating the ephemeral keypair.
+  std::chrono::nanoseconds keygen{0};
+  /// Computing the Diffie-Hellman shared secret.
+  std::chrono::nanoseconds dh{0};
+  /// Deriving the keys and key confirmation data from the shared secret.
+  std::chrono::nanoseconds kdf{0};
+  /// From sending the key confirmation to confirming the peer's one. It
+  /// includes a network round trip.
+  std::chrono::nanoseconds key_confirmation{0};
+  /// From \ref SpekeSession::Run() to confirming the peer's key.
+  std::chrono::nanoseconds total{0};
+};
+
+/// Messages and errors counted by a \ref SpekeSession, or all of them.
+struct SpekeTrafficStats {
+  /// Messages passed to the message handler and their sizes.
+  uint64_t messages_in = 0;
+  uint64_t bytes_in = 0;
+  /// Messages accepted by \ref SpekeSession::SendMessage() or
+  /// \ref SpekeSession::SendBatched() and their sizes.
+  uint64_t messages_out = 0;
+  uint64_t bytes_out = 0;
+  /// Messages with a wrong HMAC signature.
+  uint64_t hmac_failures = 0;
+  /// Encrypted messages that couldn't be opened.
+  uint64_t decryption_failures = 0;
+  /// Every bad behavior of peers, see \ref SpekeSession::BAD_BEHAVIOR_LIMIT.
+  uint64_t bad_behavior = 0;
+};
+
+/// Returned by \ref SpekeSession::GetStats().
+struct SpekeSessionStats {
+  SpekeSessionState state;
+  SpekeTrafficStats traffic;
+  /// Zeros until the peer passed the key confirmation.
+  SpekeHandshakeTimings handshake;
+  /// Frames waiting to be written and their size in bytes.
+  size_t send_queue_frames = 0;
+  size_t send_queue_bytes = 0;
+};
+
+/// Returned by \ref SpekeStatsCollector::Snapshot().
+struct SpekeProcessStats {
+  /// Number of values of \ref SpekeSessionState.
+  static constexpr size_t STATES = 10;
+
+  /// Sessions started with \ref SpekeSession::Run().
+  uint64_t sessions = 0;
+  /// Handshakes completed and the sums of their timings. Divide them by
+  /// \ref handshakes for the mean, or use
+  /// \ref SpekeStatsHooks::on_handshake for the distribution.
+  uint64_t handshakes = 0;
+  SpekeHandshakeTimings handshake_totals;
+  SpekeTrafficStats traffic;
+  /// Closed sessions by the state they were closed with, indexed by
+  /// <tt> static_cast<size_t>(state) </tt>.
+  std::array<uint64_t, STATES> closed{};
+};
+
+/// Callbacks of \ref SpekeStatsCollector, any of them can be empty.
+///
+/// They're called by sessions, on any thread, so they have to be
+/// thread-safe. They must not throw.
+struct SpekeStatsHooks {
+  /// Called when a handshake completes, on the session's strand.
+  std::function<void(const SpekeHandshakeTimings&)> on_handshake;
+  /// Called when a session is closed, with its final stats.
+  std::function<void(const SpekeSessionStats&)> on_close;
+};
+
+/// Lock-free counters behind \ref SpekeTrafficStats.
+class SpekeTrafficCounters {
+ public:
+  inline void AddMessageIn(size_t size) noexcept {
+    add(messages_in_, 1);
+    add(bytes_in_, size);
+  }
+  inline void AddMessageOut(size_t size) noexcept {
+    add(messages_out_, 1);
+    add(bytes_out_, size);
+  }
+  inline void AddHmacFailure() noexcept { add(hmac_failures_, 1); }
+  inline void AddDecryptionFailure() noexcept {
+    add(decryption_failures_, 1);
+  }
+  inline void AddBadBehavior() noexcept { add(bad_behavior_, 1); }
+
+  SpekeTrafficStats Load() const noexcept;
+  /// Add the counters to \e stats.
+  void AddTo(SpekeTrafficStats& stats) const noexcept;
+
+ private:
+  static inline void add(std::atomic<uint64_t>& counter,
+                         uint64_t value) noexcept {
+    counter.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> messages_in_ = 0;
+  std::atomic<uint64_t> bytes_in_ = 0;
+  std::atomic<uint64_t> messages_out_ = 0;
+  std::atomic<uint64_t> bytes_out_ = 0;
+  std::atomic<uint64_t> hmac_failures_ = 0;
+  std::atomic<uint64_t> decryption_failures_ = 0;
+  std::atomic<uint64_t> bad_behavior_ = 0;
+};
+
+/// \brief Counters of all sessions in the process.
+///
+/// Every \ref SpekeSession reports to the one returned by \ref Get(). Traffic
+/// is counted on \ref LRM_SPEKE_STATS_SHARDS shards picked by the thread, so
+/// counting doesn't make threads contend. \ref Snapshot() sums them, it
+/// isn't atomic as a whole, but every counter in it is.
+///
+/// \ref SetHooks() installs callbacks for handshakes and closed sessions,
+/// e.g. to feed a latency histogram.
+///
+/// All methods are thread-safe.
+class SpekeStatsCollector {
+ public:
+  SpekeStatsCollector(const SpekeStatsCollector&) = delete;
+  SpekeStatsCollector& operator=(const SpekeStatsCollector&) = delete;
+
+  /// Return the process-wide collector.
+  static SpekeStatsCollector& Get();
+
+  /// Return the counters summed over every session so far.
+  SpekeProcessStats Snapshot() const;
+
+  /// Replace the hooks. Calls already in progress use the old ones.
+  void SetHooks(SpekeStatsHooks hooks);
+
+  /// \name Reporting
+  /// Called by sessions.
+  /// @{
+  /// Return the traffic counters of the calling thread's shard.
+  SpekeTrafficCounters& Traffic() noexcept;
+  void SessionStarted() noexcept;
+  void HandshakeDone(const SpekeHandshakeTimings& timings) noexcept;
+  void SessionClosed(const SpekeSessionStats& stats) noexcept;
+  /// @}
+
+ private:
+  SpekeStatsCollector() = default;
+
+  struct alignas(64) Shard {
+    SpekeTrafficCounters traffic;
+  };
+  std::array<Shard, LRM_SPEKE_STATS_SHARDS> shards_;
+
+  std::atomic<uint64_t> sessions_ = 0;
+  std::atomic<uint64_t> handshakes_ = 0;
+  // Sums of SpekeHandshakeTimings in nanoseconds
+  std::atomic<uint64_t> keygen_ns_ = 0;
+  std::atomic<uint64_t> dh_ns_ = 0;
+  std::atomic<uint64_t> kdf_ns_ = 0;
+  std::atomic<uint64_t> key_confirmation_ns_ = 0;
+  std::atomic<uint64_t> total_ns_ = 0;
+  std::array<std::atomic<uint64_t>, SpekeProcessStats::STATES> closed_{};
+
+  // Loaded for every handshake and closed session, so it's swapped
+  // atomically instead of under a mutex.
+  std::atomic<std::shared_ptr<const SpekeStatsHooks>> hooks_;
+};
+}
+
+#endif  // LRM_SPEKESTATS_H_
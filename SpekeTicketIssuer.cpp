@@ -0,0 +1,120 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#include "SpekeTicketIssuer.h"
+
+#include <stdexcept>
+#include <string>
+
+#include "Aead.h"
+#include "SpekeCommon.h"
+
+namespace lrm::crypto {
+namespace {
+// Ticket: nonce | Seal(expiry | secret)
+// The expiry is in seconds since the epoch, big-endian.
+constexpr size_t EXPIRY_SIZE = 8;
+// Every ticket has a random nonce, so the counter is always the same.
+constexpr uint64_t TICKET_COUNTER = 0;
+constexpr char TICKET_AAD[] = "Larmo_SPEKE_ticket";
+
+std::span<const std::byte> ticket_aad() {
+  // Drop the last null byte
+  return std::as_bytes(std::span(TICKET_AAD, sizeof(TICKET_AAD) - 1));
+}
+
+size_t nonce_size() {
+  return EVP_CIPHER_iv_length(LRM_SPEKE_CIPHER_TYPE);
+}
+}
+
+SpekeTicketIssuer::SpekeTicketIssuer(std::chrono::seconds lifetime)
+    : SpekeTicketIssuer(
+          MakeRandomBytes(EVP_CIPHER_key_length(LRM_SPEKE_CIPHER_TYPE)),
+          lifetime) {}
+
+SpekeTicketIssuer::SpekeTicketIssuer(std::span<const std::byte> key,
+                                     std::chrono::seconds lifetime)
+    : key_(key.begin(), key.end()),
+      lifetime_(lifetime) {
+  if (key_.size() !=
+      static_cast<size_t>(EVP_CIPHER_key_length(LRM_SPEKE_CIPHER_TYPE))) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ +
+        std::string(": 'key' length doesn't match the cipher"));
+  }
+  if (lifetime_ <= std::chrono::seconds::zero()) {
+    throw std::invalid_argument(
+        __PRETTY_FUNCTION__ + std::string(": 'lifetime' must be positive"));
+  }
+}
+
+Bytes SpekeTicketIssuer::Issue(
+    std::span<const std::byte> resumption_secret) const {
+  const uint64_t expiry = std::chrono::duration_cast<std::chrono::seconds>(
+      (std::chrono::system_clock::now() + lifetime_).time_since_epoch())
+                          .count();
+
+  Bytes plaintext(EXPIRY_SIZE + resumption_secret.size());
+  for (size_t i = 0; i < EXPIRY_SIZE; ++i) {
+    plaintext[i] =
+        static_cast<std::byte>(expiry >> (8 * (EXPIRY_SIZE - 1 - i)));
+  }
+  std::copy(resumption_secret.begin(), resumption_secret.end(),
+            plaintext.begin() + EXPIRY_SIZE);
+
+  Bytes ticket = MakeRandomBytes(nonce_size());
+  ticket.resize(ticket.size() + plaintext.size() + Aead::TAG_SIZE);
+
+  const std::span<const std::byte> nonce(ticket.data(), nonce_size());
+  Aead aead(key_, nonce);
+  aead.Seal(TICKET_COUNTER, ticket_aad(), plaintext,
+            std::span(ticket).subspan(nonce_size()));
+
+  return ticket;
+}
+
+std::optional<Bytes> SpekeTicketIssuer::Redeem(
+    std::span<const std::byte> ticket) const {
+  if (ticket.size() < nonce_size() + EXPIRY_SIZE + Aead::TAG_SIZE) {
+    return std::nullopt;
+  }
+
+  Aead aead(key_, ticket.first(nonce_size()));
+  const auto ciphertext = ticket.subspan(nonce_size());
+  Bytes plaintext(ciphertext.size() - Aead::TAG_SIZE);
+  if (not aead.Open(TICKET_COUNTER, ticket_aad(), ciphertext, plaintext)) {
+    return std::nullopt;
+  }
+
+  uint64_t expiry = 0;
+  for (size_t i = 0; i < EXPIRY_SIZE; ++i) {
+    expiry = (expiry << 8) | std::to_integer<uint64_t>(plaintext[i]);
+  }
+  const auto now = std::chrono::duration_cast<std::chrono::seconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  if (static_cast<uint64_t>(now) >= expiry) return std::nullopt;
+
+  return Bytes(plaintext.begin() + EXPIRY_SIZE, plaintext.end());
+}
+
+std::chrono::seconds SpekeTicketIssuer::GetLifetime() const noexcept {
+  return lifetime_;
+}
+}
@@ -0,0 +1,82 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#ifndef LRM_SPEKETICKETISSUER_H_
+#define LRM_SPEKETICKETISSUER_H_
+
+#include <chrono>
+#include <optional>
+#include <span>
+
+#include "config.h"
+
+namespace lrm::crypto {
+/// \brief Issues and redeems resumption tickets on the server side.
+///
+/// A ticket is the resumption secret of a session (see
+/// \ref MakeResumptionSecret()) and its expiry time, encrypted with
+/// \ref LRM_SPEKE_CIPHER_TYPE under a ticket key known only to the server.
+/// The server doesn't keep any state for issued tickets, so any issuer with
+/// the same key can redeem them, e.g. after a restart or on another shard.
+///
+/// A ticket alone doesn't authenticate anyone: a client resuming with it
+/// still has to prove it knows the secret in the key confirmation. See
+/// \ref ResumedSpeke.
+///
+/// All methods are thread-safe.
+class SpekeTicketIssuer {
+ public:
+  SpekeTicketIssuer(const SpekeTicketIssuer&) = delete;
+  SpekeTicketIssuer& operator=(const SpekeTicketIssuer&) = delete;
+  /// Construct with a random ticket key. Tickets can't be redeemed by other
+  /// instances.
+  ///
+  /// \param lifetime Time after which issued tickets expire.
+  explicit SpekeTicketIssuer(
+      std::chrono::seconds lifetime =
+      std::chrono::seconds(LRM_SPEKE_TICKET_LIFETIME_S));
+  /// \param key Ticket key, its length must match \ref LRM_SPEKE_CIPHER_TYPE.
+  /// \param lifetime Time after which issued tickets expire.
+  ///
+  /// \throw std::invalid_argument If \e key has a wrong length or
+  /// \e lifetime isn't positive.
+  explicit SpekeTicketIssuer(
+      std::span<const std::byte> key,
+      std::chrono::seconds lifetime =
+      std::chrono::seconds(LRM_SPEKE_TICKET_LIFETIME_S));
+
+  /// \brief Make a ticket carrying \e resumption_secret.
+  Bytes Issue(std::span<const std::byte> resumption_secret) const;
+
+  /// \brief Get the resumption secret from a \e ticket.
+  ///
+  /// \return std::nullopt if the ticket wasn't issued with this key, was
+  /// modified or has expired.
+  std::optional<Bytes> Redeem(std::span<const std::byte> ticket) const;
+
+  /// Return the lifetime of issued tickets.
+  std::chrono::seconds GetLifetime() const noexcept;
+
+ private:
+  const Bytes key_;
+  const std::chrono::seconds lifetime_;
+};
+}
+
+#endif  // LRM_SPEKETICKETISSUER_H_
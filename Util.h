@@ -1,5 +1,10 @@
 #pragma once
 
+#include <cstring>
+#include <span>
+#include <string_view>
+#include <vector>
+
 namespace lrm::Util {
 inline void safe_memcpy(void* dest, const void* src, size_t size) {
   if (dest == nullptr or src == nullptr or size == 0) return;
@@ -11,4 +16,9 @@ inline std::vector<std::byte> str_to_bytes(std::string_view str) {
   safe_memcpy(result.data(), str.data(), str.size());
   return result;
 }
+
+/// View the contents of \e str as bytes, without copying.
+inline std::span<const std::byte> str_as_bytes(std::string_view str) {
+  return std::as_bytes(std::span(str.data(), str.size()));
+}
 }
@@ -0,0 +1,61 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#include <benchmark/benchmark.h>
+
+#include "BigNum.h"
+
+using namespace lrm::crypto;
+
+namespace {
+// A modulus doesn't have to be prime for ModExp, only odd for Montgomery
+// multiplication, so a random one of the right size is enough.
+BigNum random_modulus(int bits) {
+  BigNum result;
+  BN_rand(result.get(), bits, BN_RAND_TOP_ONE, BN_RAND_BOTTOM_ODD);
+  return result;
+}
+}
+
+static void BM_BigNum_ModExp(benchmark::State& state) {
+  const BigNum mod = random_modulus(state.range(0));
+  const BigNum base = RandomInRange(mod);
+  const BigNum power = RandomInRange(mod);
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(base.ModExp(power, mod));
+  }
+}
+BENCHMARK(BM_BigNum_ModExp)->Arg(2048)->Arg(3072)->Arg(4096)
+->Unit(benchmark::kMillisecond);
+
+static void BM_BigNum_ModExpMontgomery(benchmark::State& state) {
+  const BigNum mod = random_modulus(state.range(0));
+  const MontgomeryContext mont(mod);
+  const BigNum base = RandomInRange(mod);
+  const BigNum power = RandomInRange(mod);
+  BigNum result;
+
+  for (auto _ : state) {
+    base.ModExpInto(result, power, mont);
+    benchmark::DoNotOptimize(result);
+  }
+}
+BENCHMARK(BM_BigNum_ModExpMontgomery)->Arg(2048)->Arg(3072)->Arg(4096)
+->Unit(benchmark::kMillisecond);
@@ -0,0 +1,117 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#include <benchmark/benchmark.h>
+
+#include "SPEKE.h"
+#include "SpekeParams.h"
+
+using namespace lrm::crypto;
+
+static void BM_SPEKE_Construct(benchmark::State& state) {
+  const BigNum prime(LRM_SPEKE_SAFE_PRIME);
+
+  for (auto _ : state) {
+    SPEKE speke("id", "password", prime);
+    benchmark::DoNotOptimize(speke.GetPublicKey());
+  }
+}
+BENCHMARK(BM_SPEKE_Construct)->Unit(benchmark::kMillisecond);
+
+static void BM_SPEKE_ConstructSharedParams(benchmark::State& state) {
+  auto params = std::make_shared<const SpekeParams>(
+      "password", BigNum(LRM_SPEKE_SAFE_PRIME));
+
+  for (auto _ : state) {
+    SPEKE speke("id", params);
+    benchmark::DoNotOptimize(speke.GetPublicKey());
+  }
+}
+BENCHMARK(BM_SPEKE_ConstructSharedParams)->Unit(benchmark::kMillisecond);
+
+static void BM_SPEKE_Handshake(benchmark::State& state) {
+  auto params = std::make_shared<const SpekeParams>(
+      "password", BigNum(LRM_SPEKE_SAFE_PRIME));
+
+  for (auto _ : state) {
+    SPEKE client("client", params);
+    SPEKE server("server", params);
+
+    client.ProvideRemotePublicKeyIdPair(server.GetPublicKey(),
+                                        server.GetId());
+    server.ProvideRemotePublicKeyIdPair(client.GetPublicKey(),
+                                        client.GetId());
+    if (not server.ConfirmKey(client.GetKeyConfirmationData()) or
+        not client.ConfirmKey(server.GetKeyConfirmationData())) {
+      state.SkipWithError("Key confirmation failed");
+      break;
+    }
+  }
+}
+BENCHMARK(BM_SPEKE_Handshake)->Unit(benchmark::kMillisecond);
+
+namespace {
+class SpekePair : public benchmark::Fixture {
+ public:
+  std::unique_ptr<SPEKE> signer;
+  std::unique_ptr<SPEKE> verifier;
+
+  void SetUp(const benchmark::State&) override {
+    auto params = std::make_shared<const SpekeParams>(
+        "password", BigNum(LRM_SPEKE_SAFE_PRIME));
+    signer = std::make_unique<SPEKE>("signer", params);
+    verifier = std::make_unique<SPEKE>("verifier", params);
+    signer->ProvideRemotePublicKeyIdPair(verifier->GetPublicKey(),
+                                         verifier->GetId());
+    verifier->ProvideRemotePublicKeyIdPair(signer->GetPublicKey(),
+                                           signer->GetId());
+  }
+
+  void TearDown(const benchmark::State&) override {
+    signer.reset();
+    verifier.reset();
+  }
+};
+}
+
+BENCHMARK_DEFINE_F(SpekePair, HmacSign)(benchmark::State& state) {
+  const Bytes message(state.range(0), std::byte{'a'});
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(signer->HmacSign(message));
+  }
+  state.SetBytesProcessed(state.iterations() * message.size());
+}
+BENCHMARK_REGISTER_F(SpekePair, HmacSign)->RangeMultiplier(8)
+->Range(16, 1 << 20);
+
+BENCHMARK_DEFINE_F(SpekePair, ConfirmHmacSignature)(benchmark::State& state) {
+  const Bytes message(state.range(0), std::byte{'a'});
+  const Bytes signature = signer->HmacSign(message);
+
+  for (auto _ : state) {
+    if (not verifier->ConfirmHmacSignature(signature, message)) {
+      state.SkipWithError("Signature not confirmed");
+      break;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * message.size());
+}
+BENCHMARK_REGISTER_F(SpekePair, ConfirmHmacSignature)->RangeMultiplier(8)
+->Range(16, 1 << 20);
@@ -0,0 +1,138 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#include <benchmark/benchmark.h>
+
+#include <asio.hpp>
+
+#include "SPEKE.h"
+#include "SpekeSession.h"
+
+using namespace lrm::crypto;
+using tcp = asio::ip::tcp;
+using stream_protocol = asio::local::stream_protocol;
+
+namespace {
+template <typename Protocol>
+std::pair<typename Protocol::socket, typename Protocol::socket>
+connect_pair(asio::io_context& context);
+
+template <>
+std::pair<stream_protocol::socket, stream_protocol::socket>
+connect_pair<stream_protocol>(asio::io_context& context) {
+  std::pair<stream_protocol::socket, stream_protocol::socket> result{
+    context, context};
+  asio::local::connect_pair(result.first, result.second);
+  return result;
+}
+
+template <>
+std::pair<tcp::socket, tcp::socket>
+connect_pair<tcp>(asio::io_context& context) {
+  tcp::acceptor acceptor(context,
+                         tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+  std::pair<tcp::socket, tcp::socket> result{context, context};
+  result.first.connect(acceptor.local_endpoint());
+  acceptor.accept(result.second);
+  result.first.set_option(tcp::no_delay(true));
+  result.second.set_option(tcp::no_delay(true));
+  return result;
+}
+
+// Two sessions talking through a connected socket pair. Everything runs
+// on the benchmark thread: the context is polled until the awaited event
+// happens.
+template <typename Protocol>
+class SessionPair {
+ public:
+  asio::io_context context;
+  std::unique_ptr<SpekeSession<Protocol>> client;
+  std::unique_ptr<SpekeSession<Protocol>> server;
+  size_t replies = 0;
+
+  explicit SessionPair(const SpekeSessionOptions& options) {
+    auto params = std::make_shared<const SpekeParams>(
+        "password", BigNum(LRM_SPEKE_SAFE_PRIME),
+        LRM_SPEKE_SHORT_EXPONENT_BITS);
+    auto sockets = connect_pair<Protocol>(context);
+    client = std::make_unique<SpekeSession<Protocol>>(
+        std::move(sockets.first), std::make_shared<SPEKE>("client", params),
+        options);
+    server = std::make_unique<SpekeSession<Protocol>>(
+        std::move(sockets.second), std::make_shared<SPEKE>("server", params),
+        options);
+
+    client->Run([this](auto, auto&){ ++replies; });
+    server->Run([](auto message, auto& session){
+      session.SendMessage(Bytes(message.begin(), message.end()));
+    });
+    while (not (client->IsAuthenticated() and server->IsAuthenticated())) {
+      if (client->GetState() >= SpekeSessionState::STOPPED or
+          server->GetState() >= SpekeSessionState::STOPPED) {
+        throw std::runtime_error("Handshake failed");
+      }
+      context.run_one();
+    }
+  }
+
+  ~SessionPair() {
+    context.stop();
+    client.reset();
+    server.reset();
+  }
+
+  bool RoundTrip(const Bytes& message) {
+    const size_t expected = replies + 1;
+    if (not client->SendMessage(message)) return false;
+    while (replies < expected) {
+      if (client->GetState() >= SpekeSessionState::STOPPED) return false;
+      context.run_one();
+    }
+    return true;
+  }
+};
+
+template <typename Protocol>
+void BM_SpekeSession_RoundTrip(benchmark::State& state) {
+  SpekeSessionOptions options;
+  options.encryption = state.range(1);
+  SessionPair<Protocol> pair(options);
+  const Bytes message(state.range(0), std::byte{'a'});
+
+  for (auto _ : state) {
+    if (not pair.RoundTrip(message)) {
+      state.SkipWithError("Session closed");
+      break;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * message.size() * 2);
+}
+
+void round_trip_args(benchmark::internal::Benchmark* bench) {
+  bench->ArgNames({"size", "encryption"});
+  for (int encryption : {0, 1}) {
+    for (int size : {64, 1024, 16 * 1024, 64 * 1024}) {
+      bench->Args({size, encryption});
+    }
+  }
+}
+}
+
+BENCHMARK(BM_SpekeSession_RoundTrip<stream_protocol>)->Apply(round_trip_args);
+BENCHMARK(BM_SpekeSession_RoundTrip<tcp>)->Apply(round_trip_args);
@@ -31,6 +31,13 @@ static const EVP_MD* LRM_RSA_KEY_SIGN_DIGEST = EVP_sha256();
 static const EVP_CIPHER* LRM_SPEKE_CIPHER_TYPE = EVP_aes_192_gcm();
 static const EVP_MD* LRM_SPEKE_HASHFUNC = EVP_sha3_512();
 
+// Curve used by EcSpeke. It has to be a prime field curve with cofactor 1.
+static constexpr int LRM_SPEKE_EC_CURVE = NID_X9_62_prime256v1;
+// Number of candidates for the password-derived point tried by EcSpeke.
+// All of them are always tried, so the number of rounds doesn't depend on
+// the password. The chance of none of them being on the curve is 2^-40.
+static constexpr int LRM_SPEKE_EC_HASH_TO_CURVE_ROUNDS = 40;
+
 // 4096-bit safe prime
 static const char LRM_SPEKE_SAFE_PRIME[] =
     "901461244723357275807455577213220180450928876216770160525104880396721411"
@@ -52,6 +59,58 @@ static const char LRM_SPEKE_SAFE_PRIME[] =
     "236113018802586784951379853118530388694146979344425384554341464672795704"
     "095945203";
 
+// Recommended private key length when short exponents are enabled in
+// SpekeParams.
+static constexpr int LRM_SPEKE_SHORT_EXPONENT_BITS = 320;
+
+// Default limit of bytes waiting in SpekeSession's outbound queue, above
+// which SpekeSession::SendMessage() rejects new messages.
+static constexpr size_t LRM_SPEKE_SEND_QUEUE_HIGH_WATER_MARK = 1024 * 1024;
+
+// Defaults for SpekeSession::SendBatched(). A batch is flushed when it
+// reaches the size or when the delay since its first message passes.
+static constexpr size_t LRM_SPEKE_BATCH_MAX_BYTES = 16 * 1024;
+static constexpr int LRM_SPEKE_BATCH_MAX_DELAY_MS = 5;
+
+// Size of the blocks SpekeSession keeps for the protobuf arenas of the
+// messages it sends and receives. The message objects of handshake and
+// protobuf-framed data fit in it, but their bytes fields are std::strings
+// that still allocate when they're longer than the small string buffer,
+// e.g. every HMAC signature. Only compact framing skips them.
+static constexpr size_t LRM_SPEKE_ARENA_BLOCK_SIZE = 4096;
+// Number of frame buffers SpekeSession keeps for reuse after they're sent,
+// and the largest capacity a kept buffer can have.
+static constexpr size_t LRM_SPEKE_SPARE_FRAMES = 16;
+static constexpr size_t LRM_SPEKE_SPARE_FRAME_MAX_SIZE = 64 * 1024;
+
+// Defaults for SpekeServer. Above the maximal number of sessions in the
+// handshake, the server stops accepting until some of them finish. Every
+// reap interval the server checks all sessions in the handshake and at most
+// reap batch of the established ones.
+static constexpr size_t LRM_SPEKE_SERVER_MAX_PENDING_HANDSHAKES = 1024;
+static constexpr int LRM_SPEKE_SERVER_HANDSHAKE_TIMEOUT_MS = 10000;
+static constexpr int LRM_SPEKE_SERVER_REAP_INTERVAL_MS = 100;
+static constexpr size_t LRM_SPEKE_SERVER_REAP_BATCH = 1024;
+
+// Size of the registry counting sessions with every remote id, see
+// SpekeIdRegistry, and the number of its independently locked shards.
+static constexpr size_t LRM_SPEKE_ID_REGISTRY_CAPACITY = 64 * 1024;
+static constexpr size_t LRM_SPEKE_ID_REGISTRY_SHARDS = 64;
+
+// Default lifetime of the resumption tickets issued by SpekeTicketIssuer.
+static constexpr int LRM_SPEKE_TICKET_LIFETIME_S = 3600;
+
+// Default limit of the size of a frame SpekeSession reads. Bigger
+// messages have to be streamed in chunks, see SpekeSession::SendChunk().
+static constexpr size_t LRM_SPEKE_MAX_FRAME_SIZE = 16 * 1024 * 1024;
+// Largest capacity SpekeSession's receive buffers keep between frames. A
+// bigger frame is read into a buffer freed right after it's handled.
+static constexpr size_t LRM_SPEKE_RECEIVE_BUFFER_MAX_SIZE = 64 * 1024;
+
+// Number of shards the process-wide counters of SpekeStatsCollector are
+// split into, so threads counting messages rarely share a cache line.
+static constexpr size_t LRM_SPEKE_STATS_SHARDS = 16;
+
 using Bytes = std::vector<std::byte>;
 }
 
@@ -0,0 +1,104 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#include <gtest/gtest.h>
+
+#include "Aead.h"
+#include "Util.h"
+
+using namespace lrm::crypto;
+
+namespace {
+const Bytes key(EVP_CIPHER_key_length(LRM_SPEKE_CIPHER_TYPE), std::byte{1});
+const Bytes nonce(EVP_CIPHER_iv_length(LRM_SPEKE_CIPHER_TYPE), std::byte{2});
+const Bytes aad = lrm::Util::str_to_bytes("aad");
+const Bytes plaintext = lrm::Util::str_to_bytes("plaintext");
+
+Bytes seal(Aead& aead, uint64_t counter) {
+  Bytes ciphertext(plaintext.size() + Aead::TAG_SIZE);
+  aead.Seal(counter, aad, plaintext, ciphertext);
+  return ciphertext;
+}
+}
+
+TEST(AeadTest, Construct_ThrowOnWrongKeyOrNonceLength) {
+  const Bytes short_key(key.size() - 1);
+  const Bytes short_nonce(nonce.size() - 1);
+
+  EXPECT_THROW(Aead(short_key, nonce), std::invalid_argument);
+  EXPECT_THROW(Aead(key, short_nonce), std::invalid_argument);
+  EXPECT_NO_THROW(Aead(key, nonce));
+}
+
+TEST(AeadTest, SealOpen) {
+  Aead sealer(key, nonce);
+  Aead opener(key, nonce);
+
+  for (uint64_t counter = 0; counter < 3; ++counter) {
+    const Bytes ciphertext = seal(sealer, counter);
+    EXPECT_NE(plaintext,
+              Bytes(ciphertext.begin(), ciphertext.end() - Aead::TAG_SIZE));
+
+    Bytes result(plaintext.size());
+    EXPECT_TRUE(opener.Open(counter, aad, ciphertext, result));
+    EXPECT_EQ(plaintext, result);
+  }
+}
+
+TEST(AeadTest, DifferentCountersGiveDifferentCiphertexts) {
+  Aead aead(key, nonce);
+
+  EXPECT_NE(seal(aead, 0), seal(aead, 1));
+  EXPECT_NE(seal(aead, 0), seal(aead, uint64_t{1} << 63));
+}
+
+TEST(AeadTest, Open_FalseWhenTampered) {
+  Aead aead(key, nonce);
+  Bytes ciphertext = seal(aead, 0);
+  Bytes result(plaintext.size());
+
+  EXPECT_FALSE(aead.Open(1, aad, ciphertext, result));
+  EXPECT_FALSE(aead.Open(0, lrm::Util::str_to_bytes("bad"), ciphertext,
+                         result));
+
+  ciphertext[0] ^= std::byte{1};
+  EXPECT_FALSE(aead.Open(0, aad, ciphertext, result));
+  ciphertext[0] ^= std::byte{1};
+
+  ciphertext.back() ^= std::byte{1};
+  EXPECT_FALSE(aead.Open(0, aad, ciphertext, result));
+  ciphertext.back() ^= std::byte{1};
+
+  EXPECT_TRUE(aead.Open(0, aad, ciphertext, result));
+}
+
+TEST(AeadTest, Open_FalseWhenTooShort) {
+  Aead aead(key, nonce);
+  const Bytes ciphertext(Aead::TAG_SIZE - 1);
+
+  EXPECT_FALSE(aead.Open(0, aad, ciphertext, {}));
+}
+
+TEST(AeadTest, EmptyPlaintext) {
+  Aead aead(key, nonce);
+  Bytes ciphertext(Aead::TAG_SIZE);
+  aead.Seal(0, aad, {}, ciphertext);
+
+  EXPECT_TRUE(aead.Open(0, aad, ciphertext, {}));
+}
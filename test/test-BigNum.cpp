@@ -0,0 +1,134 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#include <gtest/gtest.h>
+
+#include <array>
+
+#include "BigNum.h"
+
+using namespace lrm::crypto;
+
+namespace {
+const BigNum mod{"2692367"};
+}
+
+TEST(BigNumTest, Operators) {
+  const BigNum a{"123456789012345678901234567890"};
+  const BigNum b{"987654321"};
+
+  EXPECT_EQ(BigNum("123456789012345678902222222211"), a + b);
+  EXPECT_EQ(BigNum("123456789012345678900246913569"), a - b);
+  EXPECT_EQ(a, (a + b) - b);
+  EXPECT_EQ(BigNum(125), BigNum(5) ^ BigNum(3));
+  EXPECT_EQ(BigNum(7), BigNum(47) / BigNum(6));
+  EXPECT_EQ(BigNum(5), BigNum(47) % BigNum(6));
+  EXPECT_EQ(BigNum(42), BigNum(6) * BigNum(7));
+
+  BigNum c = b;
+  c += 1;
+  EXPECT_EQ(BigNum("987654322"), c);
+  c -= 2;
+  EXPECT_EQ(BigNum("987654320"), c);
+}
+
+TEST(BigNumTest, Into_SameAsReturning) {
+  const BigNum a{"1234567"};
+  const BigNum b{"2345678"};
+  const auto mont = MontgomeryContext::GetShared(mod);
+
+  BigNum result;
+  a.ModAddInto(result, b, mod);
+  EXPECT_EQ(a.ModAdd(b, mod), result);
+  a.ModSubInto(result, b, mod);
+  EXPECT_EQ(a.ModSub(b, mod), result);
+  a.ModMulInto(result, b, mod);
+  EXPECT_EQ(a.ModMul(b, mod), result);
+  a.ModSqrInto(result, mod);
+  EXPECT_EQ(a.ModSqr(mod), result);
+  a.ModExpInto(result, b, mod);
+  EXPECT_EQ(a.ModExp(b, mod), result);
+  a.ModExpInto(result, b, *mont);
+  EXPECT_EQ(a.ModExp(b, mod), result);
+}
+
+TEST(BigNumTest, Into_ResultCanBeAnArgument) {
+  BigNum a{"1234567"};
+  const BigNum b{"2345678"};
+  const BigNum expected = a.ModMul(b, mod);
+
+  a.ModMulInto(a, b, mod);
+  EXPECT_EQ(expected, a);
+}
+
+TEST(BigNumTest, SetBytes) {
+  const BigNum a{"123456789012345678901234567890"};
+  BigNum b{"1"};
+
+  b.SetBytes(a.to_bytes());
+  EXPECT_EQ(a, b);
+}
+
+TEST(BigNumTest, SetSecret_KeptByCopiesAndMoves) {
+  BigNum secret{"42"};
+  EXPECT_FALSE(secret.IsSecret());
+  secret.SetSecret();
+
+  BigNum copy{secret};
+  EXPECT_TRUE(copy.IsSecret());
+  BigNum assigned{"1"};
+  assigned = secret;
+  EXPECT_TRUE(assigned.IsSecret());
+  BigNum moved{std::move(copy)};
+  EXPECT_TRUE(moved.IsSecret());
+  BigNum move_assigned;
+  move_assigned = std::move(assigned);
+  EXPECT_TRUE(move_assigned.IsSecret());
+  EXPECT_EQ(secret, move_assigned);
+}
+
+TEST(BigNumTest, ToBytes_Padded) {
+  const BigNum a{"258"};
+  std::array<std::byte, 4> out;
+  out.fill(std::byte{0xff});
+
+  a.to_bytes(out);
+  EXPECT_EQ((std::array<std::byte, 4>{std::byte{0}, std::byte{0},
+                                      std::byte{1}, std::byte{2}}),
+            out);
+  EXPECT_EQ(2, a.ByteSize());
+
+  std::array<std::byte, 1> small;
+  EXPECT_THROW(a.to_bytes(small), std::invalid_argument);
+}
+
+TEST(BigNumTest, RandomInRange_InBounds) {
+  const BigNum low{100};
+  const BigNum high{103};
+
+  BigNum result;
+  for (int i = 0; i < 100; ++i) {
+    RandomInRangeInto(result, low, high);
+    EXPECT_GE(result, low);
+    EXPECT_LE(result, high);
+
+    RandomInRangeInto(result, high);
+    EXPECT_LT(result, high);
+  }
+}
@@ -0,0 +1,114 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#include <gtest/gtest.h>
+
+#include "ConfirmedSpeke.h"
+#include "EcSpeke.h"
+#include "ResumedSpeke.h"
+#include "SPEKE.h"
+#include "Util.h"
+
+using namespace lrm::crypto;
+
+namespace {
+void exchange_keys(SpekeInterface& peer1, SpekeInterface& peer2) {
+  auto peer1_key = peer1.GetPublicKey();
+  auto peer2_key = peer2.GetPublicKey();
+
+  peer2.ProvideRemotePublicKeyIdPair(peer1_key, peer1.GetId());
+  peer1.ProvideRemotePublicKeyIdPair(peer2_key, peer2.GetId());
+}
+
+// Check that the compacted peer1 works with peer2 like peer1 did.
+void expect_compacted(SpekeInterface& peer1, SpekeInterface& peer2) {
+  const std::unique_ptr<SpekeInterface> compact = peer1.Compact();
+  ASSERT_TRUE(compact);
+
+  EXPECT_EQ(peer1.GetBackend(), compact->GetBackend());
+  EXPECT_EQ(peer1.GetGroup(), compact->GetGroup());
+  EXPECT_EQ(peer1.GetId(), compact->GetId());
+  EXPECT_EQ(peer1.GetEncryptionKey(), compact->GetEncryptionKey());
+  EXPECT_EQ(peer1.GetNonce(), compact->GetNonce());
+  EXPECT_EQ(peer1.GetKeyConfirmationData(),
+            compact->GetKeyConfirmationData());
+  EXPECT_TRUE(compact->ConfirmKey(peer2.GetKeyConfirmationData()));
+  EXPECT_FALSE(compact->ConfirmKey(peer1.GetKeyConfirmationData()));
+
+  const Bytes message = lrm::Util::str_to_bytes("message");
+  EXPECT_TRUE(peer2.ConfirmHmacSignature(compact->HmacSign(message),
+                                         message));
+  EXPECT_TRUE(compact->ConfirmHmacSignature(peer2.HmacSign(message),
+                                            message));
+}
+}
+
+TEST(ConfirmedSpekeTest, Construct_ThrowOnEmptyKey) {
+  EXPECT_THROW(ConfirmedSpeke(SpekeBackend::FINITE_FIELD, SpekeGroup::CUSTOM,
+                              "id", {}, Bytes(12), Bytes(32), Bytes(32), {}),
+               std::invalid_argument);
+}
+
+TEST(ConfirmedSpekeTest, ThrowOnAnotherHandshake) {
+  ConfirmedSpeke speke(SpekeBackend::FINITE_FIELD, SpekeGroup::CUSTOM, "id",
+                       Bytes(32, std::byte{1}), Bytes(12), Bytes(32),
+                       Bytes(32), {});
+
+  EXPECT_TRUE(speke.GetPublicKey().empty());
+  EXPECT_THROW(speke.ProvideRemotePublicKeyIdPair(Bytes(32), "remote"),
+               std::logic_error);
+}
+
+TEST(ConfirmedSpekeTest, Compact_SPEKE) {
+  auto params = std::make_shared<const SpekeParams>(
+      "password", SpekeGroup::MODP_2048, LRM_SPEKE_SHORT_EXPONENT_BITS);
+  SPEKE peer1("peer1", params);
+  SPEKE peer2("peer2", params);
+  exchange_keys(peer1, peer2);
+
+  expect_compacted(peer1, peer2);
+  EXPECT_EQ(SpekeGroup::MODP_2048, peer1.Compact()->GetGroup());
+}
+
+TEST(ConfirmedSpekeTest, Compact_SPEKE_ThrowBeforeHandshake) {
+  SPEKE speke("peer", "password", 2692367);
+
+  EXPECT_THROW(speke.Compact(), std::logic_error);
+}
+
+TEST(ConfirmedSpekeTest, Compact_EcSpeke) {
+  EcSpeke peer1("peer1", "password");
+  EcSpeke peer2("peer2", "password");
+  exchange_keys(peer1, peer2);
+
+  expect_compacted(peer1, peer2);
+}
+
+TEST(ConfirmedSpekeTest, Compact_ResumedSpeke) {
+  const Bytes secret = lrm::Util::str_to_bytes("secret");
+  ResumedSpeke client("client",
+                      SpekeResumptionTicket{.ticket = Bytes(1),
+                                            .secret = secret});
+  // Ids of other tests' peers are counted too, so this one is unique.
+  ResumedSpeke server("compact-server", secret, SpekeBackend::FINITE_FIELD);
+  exchange_keys(client, server);
+
+  expect_compacted(client, server);
+  expect_compacted(server, client);
+}
@@ -0,0 +1,138 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include <gtest/gtest.h>
+
+#include <set>
+
+#include <openssl/obj_mac.h>
+
+#include "EcSpeke.h"
+#include "Util.h"
+
+using namespace lrm::crypto;
+
+namespace {
+void exchange_keys(EcSpeke& peer1, EcSpeke& peer2) {
+  auto peer1_key = peer1.GetPublicKey();
+  auto peer2_key = peer2.GetPublicKey();
+
+  peer2.ProvideRemotePublicKeyIdPair(peer1_key, peer1.GetId());
+  peer1.ProvideRemotePublicKeyIdPair(peer2_key, peer2.GetId());
+}
+}
+
+TEST(EcSpekeTest, GetBackend) {
+  EcSpeke speke("id", "password");
+
+  EXPECT_EQ(SpekeBackend::ELLIPTIC_CURVE, speke.GetBackend());
+}
+
+TEST(EcSpekeTest, PublicKeyCompressed) {
+  EcSpeke speke("id", "password");
+
+  EXPECT_EQ(33, speke.GetPublicKey().size());
+}
+
+TEST(EcSpekeTest, RandomPublicKey) {
+  std::set<Bytes> pubkeys;
+  const int num_pubkeys = 10;
+
+  for (auto i = 0; i < num_pubkeys; ++i) {
+    EcSpeke speke("id", "password");
+    pubkeys.insert(speke.GetPublicKey());
+  }
+
+  EXPECT_EQ(num_pubkeys, pubkeys.size());
+}
+
+TEST(EcSpekeTest, ThrowOnUnsupportedCurve) {
+  EXPECT_THROW(EcSpeke("id", "password", NID_undef), std::invalid_argument);
+  EXPECT_THROW(EcSpeke("id", "password", NID_sect163k1),
+               std::invalid_argument);
+}
+
+TEST(EcSpekeTest, EncryptionKey_SameForBoth) {
+  EcSpeke peer1("peer1", "password");
+  EcSpeke peer2("peer2", "password");
+
+  exchange_keys(peer1, peer2);
+
+  EXPECT_EQ(peer1.GetEncryptionKey(), peer2.GetEncryptionKey());
+  EXPECT_EQ(peer1.GetNonce(), peer2.GetNonce());
+}
+
+TEST(EcSpekeTest, ConfirmKey) {
+  EcSpeke peer1("peer1", "password");
+  EcSpeke peer2("peer2", "password");
+
+  exchange_keys(peer1, peer2);
+
+  EXPECT_TRUE(peer2.ConfirmKey(peer1.GetKeyConfirmationData()));
+  EXPECT_TRUE(peer1.ConfirmKey(peer2.GetKeyConfirmationData()));
+}
+
+TEST(EcSpekeTest, ConfirmKey_WrongPassword) {
+  EcSpeke peer1("peer1", "password1");
+  EcSpeke peer2("peer2", "password2");
+
+  exchange_keys(peer1, peer2);
+
+  EXPECT_FALSE(peer2.ConfirmKey(peer1.GetKeyConfirmationData()));
+  EXPECT_FALSE(peer1.ConfirmKey(peer2.GetKeyConfirmationData()));
+}
+
+TEST(EcSpekeTest, ConfirmKey_WrongCurve) {
+  EcSpeke peer1("peer1", "password", NID_X9_62_prime256v1);
+  EcSpeke peer2("peer2", "password", NID_secp384r1);
+
+  EXPECT_ANY_THROW(
+      peer2.ProvideRemotePublicKeyIdPair(peer1.GetPublicKey(),
+                                         peer1.GetId()));
+}
+
+TEST(EcSpekeTest, ProvideRemotePubkeyAndId_InvalidKey) {
+  EcSpeke speke("peer1", "password");
+  Bytes pubkey = EcSpeke("peer2", "password").GetPublicKey();
+  // Not a valid point encoding
+  pubkey[0] = std::byte{5};
+
+  EXPECT_THROW(speke.ProvideRemotePublicKeyIdPair(pubkey, "peer2"),
+               std::runtime_error);
+  EXPECT_THROW(speke.ProvideRemotePublicKeyIdPair(Bytes(33), "peer2"),
+               std::runtime_error);
+}
+
+TEST(EcSpekeTest, ConfirmHmacSignature) {
+  EcSpeke peer1("peer1", "password");
+  EcSpeke peer2("peer2", "password");
+
+  exchange_keys(peer1, peer2);
+
+  const Bytes msg = lrm::Util::str_to_bytes("message");
+
+  EXPECT_TRUE(peer2.ConfirmHmacSignature(peer1.HmacSign(msg), msg));
+  EXPECT_FALSE(peer2.ConfirmHmacSignature(peer1.HmacSign(msg),
+                                          lrm::Util::str_to_bytes("other")));
+}
+
+TEST(EcSpekeTest, HmacSign_WithoutProvidingPkey) {
+  EcSpeke speke("id", "password");
+
+  EXPECT_ANY_THROW(speke.HmacSign(Bytes()));
+}
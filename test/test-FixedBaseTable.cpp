@@ -0,0 +1,104 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#include <gtest/gtest.h>
+
+#include "FixedBaseTable.h"
+#include "SPEKE.h"
+#include "SpekeParams.h"
+
+using namespace lrm::crypto;
+
+namespace {
+const BigNum small_prime{"2692367"};
+}
+
+TEST(FixedBaseTableTest, Construct_ThrowOnBadArguments) {
+  auto mont = MontgomeryContext::GetShared(small_prime);
+
+  EXPECT_THROW(FixedBaseTable(BigNum(5), nullptr, 32, 4),
+               std::invalid_argument);
+  EXPECT_THROW(FixedBaseTable(BigNum(5), mont, 32, 0),
+               std::invalid_argument);
+  EXPECT_THROW(FixedBaseTable(BigNum(5), mont, 32,
+                              FixedBaseTable::MAX_WINDOW_BITS + 1),
+               std::invalid_argument);
+  EXPECT_THROW(FixedBaseTable(BigNum(5), mont, 0, 4),
+               std::invalid_argument);
+  EXPECT_THROW(FixedBaseTable(small_prime, mont, 32, 4),
+               std::invalid_argument);
+}
+
+TEST(FixedBaseTableTest, ModExp_SameAsBigNum) {
+  auto mont = MontgomeryContext::GetShared(small_prime);
+  const BigNum base{"1234567"};
+
+  for (int window_bits : {1, 3, 4, 8}) {
+    FixedBaseTable table(base, mont, 22, window_bits);
+    EXPECT_GE(table.GetExponentBits(), 22);
+
+    for (BigNum exponent : {BigNum(0ul), BigNum(1ul), BigNum(2ul),
+                            BigNum("4194303"), RandomInRange(BigNum(1ul << 22))}) {
+      EXPECT_EQ(base.ModExp(exponent, small_prime), table.ModExp(exponent))
+          << "window_bits: " << window_bits << ", exponent: " << exponent;
+    }
+  }
+}
+
+TEST(FixedBaseTableTest, ModExp_BigPrime) {
+  const BigNum prime(LRM_SPEKE_SAFE_PRIME);
+  auto mont = MontgomeryContext::GetShared(prime);
+  const BigNum base = RandomInRange(prime);
+  FixedBaseTable table(base, mont, LRM_SPEKE_SHORT_EXPONENT_BITS, 4);
+
+  EXPECT_EQ(LRM_SPEKE_SHORT_EXPONENT_BITS / 4 * 16 * prime.ByteSize(),
+            table.MemoryUsage());
+  for (int i = 0; i < 4; ++i) {
+    const BigNum exponent =
+        RandomInRange(BigNum(2) ^ BigNum(LRM_SPEKE_SHORT_EXPONENT_BITS));
+    EXPECT_EQ(base.ModExp(exponent, *mont), table.ModExp(exponent));
+  }
+}
+
+TEST(FixedBaseTableTest, ModExp_ThrowOnTooLongExponent) {
+  auto mont = MontgomeryContext::GetShared(small_prime);
+  FixedBaseTable table(BigNum(5), mont, 8, 4);
+
+  EXPECT_NO_THROW(table.ModExp(BigNum(255)));
+  EXPECT_THROW(table.ModExp(BigNum(256)), std::invalid_argument);
+}
+
+TEST(FixedBaseTableTest, SpekeParams_KeysWorkWithTable) {
+  auto params = std::make_shared<const SpekeParams>(
+      "password", BigNum(LRM_SPEKE_SAFE_PRIME),
+      LRM_SPEKE_SHORT_EXPONENT_BITS, 4);
+  ASSERT_NE(nullptr, params->GetFixedBaseTable());
+
+  const SpekeKeypair keypair = params->GenerateKeypair();
+  EXPECT_TRUE(keypair.privkey.IsSecret());
+  EXPECT_EQ(params->GetGenerator().ModExp(keypair.privkey,
+                                          params->GetMontgomeryContext()),
+            keypair.pubkey);
+
+  SPEKE peer1("peer1", params);
+  SPEKE peer2("peer2", "password", BigNum(LRM_SPEKE_SAFE_PRIME));
+  peer2.ProvideRemotePublicKeyIdPair(peer1.GetPublicKey(), peer1.GetId());
+  peer1.ProvideRemotePublicKeyIdPair(peer2.GetPublicKey(), peer2.GetId());
+  EXPECT_TRUE(peer1.ConfirmKey(peer2.GetKeyConfirmationData()));
+}
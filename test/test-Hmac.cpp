@@ -0,0 +1,89 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include <gtest/gtest.h>
+
+#include "Hmac.h"
+#include "Util.h"
+
+using namespace lrm::crypto;
+
+namespace {
+const Bytes key = lrm::Util::str_to_bytes("key");
+const Bytes message = lrm::Util::str_to_bytes("first part, second part");
+
+Bytes sign(const Hmac& hmac, const Bytes& data) {
+  std::array<std::byte, Hmac::MAX_SIZE> signature;
+  return Bytes(signature.begin(),
+               signature.begin() + hmac.Sign(data, signature));
+}
+
+Bytes finish(Hmac::Stream& stream) {
+  std::array<std::byte, Hmac::MAX_SIZE> signature;
+  return Bytes(signature.begin(), signature.begin() + stream.Final(signature));
+}
+}
+
+TEST(HmacTest, MakeStream_ThrowWithoutKey) {
+  Hmac hmac;
+
+  EXPECT_THROW(hmac.MakeStream(), std::logic_error);
+}
+
+TEST(HmacTest, Stream_SameAsSign) {
+  Hmac hmac(key);
+  Hmac::Stream stream = hmac.MakeStream();
+
+  const std::span<const std::byte> view(message);
+  stream.Update(view.first(10));
+  stream.Update(view.subspan(10));
+
+  EXPECT_EQ(sign(hmac, message), finish(stream));
+}
+
+TEST(HmacTest, Stream_CopyContinuesIndependently) {
+  Hmac hmac(key);
+  Hmac::Stream stream = hmac.MakeStream();
+
+  const std::span<const std::byte> view(message);
+  stream.Update(view.first(10));
+  Hmac::Stream copy = stream;
+  copy.Update(view.subspan(10));
+
+  EXPECT_EQ(sign(hmac, message), finish(copy));
+  EXPECT_EQ(sign(hmac, Bytes(message.begin(), message.begin() + 10)),
+            finish(stream));
+}
+
+TEST(HmacTest, Stream_Verify) {
+  Hmac hmac(key);
+  Hmac::Stream stream = hmac.MakeStream();
+  stream.Update(message);
+
+  EXPECT_TRUE(stream.Verify(sign(hmac, message)));
+}
+
+TEST(HmacTest, Stream_VerifyWrongSignature) {
+  Hmac hmac(key);
+  Hmac::Stream stream = hmac.MakeStream();
+  stream.Update(message);
+
+  Bytes signature = sign(hmac, message);
+  signature[0] ^= std::byte{1};
+  EXPECT_FALSE(stream.Verify(signature));
+}
@@ -0,0 +1,177 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#include <gtest/gtest.h>
+
+#include <thread>
+
+#include "ResumedSpeke.h"
+#include "SpekeCommon.h"
+#include "SpekeTicketIssuer.h"
+#include "Util.h"
+
+using namespace lrm::crypto;
+
+namespace {
+void exchange_keys(SpekeInterface& peer1, SpekeInterface& peer2) {
+  auto peer1_key = peer1.GetPublicKey();
+  auto peer2_key = peer2.GetPublicKey();
+
+  peer2.ProvideRemotePublicKeyIdPair(peer1_key, peer1.GetId());
+  peer1.ProvideRemotePublicKeyIdPair(peer2_key, peer2.GetId());
+}
+
+SpekeResumptionTicket make_ticket(SpekeTicketIssuer& issuer,
+                                  const Bytes& secret) {
+  return {issuer.Issue(secret), secret, SpekeBackend::FINITE_FIELD,
+          std::chrono::system_clock::now() + issuer.GetLifetime()};
+}
+
+// Redeem the client's ticket like the server would.
+ResumedSpeke make_server(SpekeTicketIssuer& issuer,
+                         const ResumedSpeke& client) {
+  return ResumedSpeke("server", *issuer.Redeem(client.GetTicket()),
+                      SpekeBackend::FINITE_FIELD);
+}
+}
+
+TEST(SpekeTicketIssuerTest, Construct_ThrowOnBadArguments) {
+  EXPECT_THROW(SpekeTicketIssuer(Bytes(3)), std::invalid_argument);
+  EXPECT_THROW(SpekeTicketIssuer(std::chrono::seconds(0)),
+               std::invalid_argument);
+}
+
+TEST(SpekeTicketIssuerTest, Redeem_ReturnsTheSecret) {
+  SpekeTicketIssuer issuer;
+  const Bytes secret = lrm::Util::str_to_bytes("secret");
+
+  const auto redeemed = issuer.Redeem(issuer.Issue(secret));
+  ASSERT_TRUE(redeemed.has_value());
+  EXPECT_EQ(secret, *redeemed);
+}
+
+TEST(SpekeTicketIssuerTest, Redeem_WithTheSameKey) {
+  const Bytes key(EVP_CIPHER_key_length(LRM_SPEKE_CIPHER_TYPE),
+                  std::byte{7});
+  SpekeTicketIssuer issuer1(key);
+  SpekeTicketIssuer issuer2(key);
+  SpekeTicketIssuer other;
+  const Bytes secret = lrm::Util::str_to_bytes("secret");
+  const Bytes ticket = issuer1.Issue(secret);
+
+  EXPECT_EQ(secret, issuer2.Redeem(ticket));
+  EXPECT_FALSE(other.Redeem(ticket).has_value());
+}
+
+TEST(SpekeTicketIssuerTest, Redeem_RejectModified) {
+  SpekeTicketIssuer issuer;
+  Bytes ticket = issuer.Issue(lrm::Util::str_to_bytes("secret"));
+
+  for (size_t i = 0; i < ticket.size(); ++i) {
+    Bytes modified = ticket;
+    modified[i] ^= std::byte{1};
+    EXPECT_FALSE(issuer.Redeem(modified).has_value()) << "at byte " << i;
+  }
+  ticket.pop_back();
+  EXPECT_FALSE(issuer.Redeem(ticket).has_value());
+  EXPECT_FALSE(issuer.Redeem(Bytes()).has_value());
+}
+
+TEST(SpekeTicketIssuerTest, Redeem_RejectExpired) {
+  SpekeTicketIssuer issuer(std::chrono::seconds(1));
+  const Bytes ticket = issuer.Issue(lrm::Util::str_to_bytes("secret"));
+  ASSERT_TRUE(issuer.Redeem(ticket).has_value());
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(2100));
+  EXPECT_FALSE(issuer.Redeem(ticket).has_value());
+}
+
+TEST(ResumedSpekeTest, Construct_ThrowOnEmptySecret) {
+  EXPECT_THROW(ResumedSpeke("id", SpekeResumptionTicket{}),
+               std::invalid_argument);
+  EXPECT_THROW(ResumedSpeke("id", Bytes(), SpekeBackend::FINITE_FIELD),
+               std::invalid_argument);
+}
+
+TEST(ResumedSpekeTest, RandomNonce) {
+  SpekeTicketIssuer issuer;
+  const auto ticket = make_ticket(issuer, lrm::Util::str_to_bytes("secret"));
+  ResumedSpeke speke1("id", ticket);
+  ResumedSpeke speke2("id", ticket);
+
+  EXPECT_EQ(ResumedSpeke::NONCE_SIZE, speke1.GetPublicKey().size());
+  EXPECT_NE(speke1.GetPublicKey(), speke2.GetPublicKey());
+  EXPECT_EQ(ticket.ticket, speke1.GetTicket());
+}
+
+TEST(ResumedSpekeTest, EncryptionKey_SameForBoth) {
+  SpekeTicketIssuer issuer;
+  ResumedSpeke client(
+      "client", make_ticket(issuer, lrm::Util::str_to_bytes("secret")));
+  ResumedSpeke server = make_server(issuer, client);
+  exchange_keys(client, server);
+
+  EXPECT_EQ(client.GetEncryptionKey(), server.GetEncryptionKey());
+  EXPECT_EQ(client.GetNonce(), server.GetNonce());
+  EXPECT_TRUE(client.ConfirmKey(server.GetKeyConfirmationData()));
+  EXPECT_TRUE(server.ConfirmKey(client.GetKeyConfirmationData()));
+
+  const Bytes message = lrm::Util::str_to_bytes("message");
+  EXPECT_TRUE(server.ConfirmHmacSignature(client.HmacSign(message),
+                                          message));
+}
+
+TEST(ResumedSpekeTest, EncryptionKey_DifferentEverySession) {
+  SpekeTicketIssuer issuer;
+  const auto ticket = make_ticket(issuer, lrm::Util::str_to_bytes("secret"));
+
+  ResumedSpeke client1("client", ticket);
+  ResumedSpeke server1 = make_server(issuer, client1);
+  exchange_keys(client1, server1);
+  ResumedSpeke client2("client", ticket);
+  ResumedSpeke server2 = make_server(issuer, client2);
+  exchange_keys(client2, server2);
+
+  EXPECT_NE(client1.GetEncryptionKey(), client2.GetEncryptionKey());
+}
+
+TEST(ResumedSpekeTest, ConfirmKey_WrongSecret) {
+  SpekeTicketIssuer issuer;
+  auto ticket = make_ticket(issuer, lrm::Util::str_to_bytes("secret"));
+  ticket.secret = lrm::Util::str_to_bytes("guess");
+  ResumedSpeke client("client", ticket);
+  ResumedSpeke server = make_server(issuer, client);
+  exchange_keys(client, server);
+
+  EXPECT_FALSE(client.ConfirmKey(server.GetKeyConfirmationData()));
+  EXPECT_FALSE(server.ConfirmKey(client.GetKeyConfirmationData()));
+}
+
+TEST(ResumedSpekeTest, ProvideRemotePubkeyAndId_InvalidNonce) {
+  SpekeTicketIssuer issuer;
+  ResumedSpeke client(
+      "client", make_ticket(issuer, lrm::Util::str_to_bytes("secret")));
+
+  EXPECT_THROW(client.ProvideRemotePublicKeyIdPair(Bytes(3), "server"),
+               std::runtime_error);
+  EXPECT_THROW(client.ProvideRemotePublicKeyIdPair(client.GetPublicKey(),
+                                                   "server"),
+               std::runtime_error);
+  EXPECT_THROW(client.GetEncryptionKey(), std::logic_error);
+}
@@ -18,7 +18,9 @@
 
 #include <gtest/gtest.h>
 
+#include <atomic>
 #include <cstring>
+#include <thread>
 
 #include <openssl/rand.h>
 #include <openssl/md5.h>
@@ -176,6 +178,33 @@ TEST(SpekeTest, RandomPublicKey) {
   EXPECT_EQ(num_pubkeys, pubkeys.size());
 }
 
+TEST(SpekeTest, PublicKey_PaddedToPrimeSize) {
+  const BigNum prime(LRM_SPEKE_SAFE_PRIME);
+  auto params = std::make_shared<const SpekeParams>("password", prime, 320);
+
+  for (int i = 0; i < 10; ++i) {
+    SPEKE speke("id", params);
+    EXPECT_EQ(prime.ByteSize(), speke.GetPublicKey().size());
+  }
+}
+
+TEST(SpekeTest, EncryptionKey_SameWithUnpaddedRemoteKey) {
+  SPEKE peer1("peer1", "password", 2692367);
+  SPEKE peer2("peer2", "password", 2692367);
+
+  // Peers may send keys with any padding, they're normalized.
+  auto peer1_key = BigNum(peer1.GetPublicKey()).to_bytes();
+  auto peer2_key = peer2.GetPublicKey();
+  peer2_key.insert(peer2_key.begin(), std::byte{0});
+
+  peer2.ProvideRemotePublicKeyIdPair(peer1_key, peer1.GetId());
+  peer1.ProvideRemotePublicKeyIdPair(peer2_key, peer2.GetId());
+
+  EXPECT_EQ(peer1.GetEncryptionKey(), peer2.GetEncryptionKey());
+  EXPECT_TRUE(peer2.ConfirmKey(peer1.GetKeyConfirmationData()));
+  EXPECT_TRUE(peer1.ConfirmKey(peer2.GetKeyConfirmationData()));
+}
+
 TEST(SpekeTest, ProvideRemotePubkeyAndId_SameId) {
   SPEKE peer1("peer", "password", 2692367);
   SPEKE peer2("peer", "password", 2692367);
@@ -221,6 +250,37 @@ TEST(SpekeTest, ConfirmKey) {
   EXPECT_TRUE(peer1.ConfirmKey(peer2_kcd));
 }
 
+TEST(SpekeTest, ConfirmKey_SameTranscript) {
+  SPEKE peer1("peer1", "password", 2692367);
+  SPEKE peer2("peer2", "password", 2692367);
+  const Bytes sent1 = lrm::Util::str_to_bytes("sent by 1");
+  const Bytes sent2 = lrm::Util::str_to_bytes("sent by 2");
+
+  peer1.SetTranscript(sent1, sent2);
+  peer2.SetTranscript(sent2, sent1);
+  peer2.ProvideRemotePublicKeyIdPair(peer1.GetPublicKey(), peer1.GetId());
+  peer1.ProvideRemotePublicKeyIdPair(peer2.GetPublicKey(), peer2.GetId());
+
+  EXPECT_TRUE(peer2.ConfirmKey(peer1.GetKeyConfirmationData()));
+  EXPECT_TRUE(peer1.ConfirmKey(peer2.GetKeyConfirmationData()));
+}
+
+TEST(SpekeTest, ConfirmKey_DifferentTranscript) {
+  SPEKE peer1("peer1", "password", 2692367);
+  SPEKE peer2("peer2", "password", 2692367);
+  const Bytes sent1 = lrm::Util::str_to_bytes("sent by 1");
+  const Bytes sent2 = lrm::Util::str_to_bytes("sent by 2");
+
+  // peer2 got something else than peer1 sent.
+  peer1.SetTranscript(sent1, sent2);
+  peer2.SetTranscript(sent2, lrm::Util::str_to_bytes("changed"));
+  peer2.ProvideRemotePublicKeyIdPair(peer1.GetPublicKey(), peer1.GetId());
+  peer1.ProvideRemotePublicKeyIdPair(peer2.GetPublicKey(), peer2.GetId());
+
+  EXPECT_FALSE(peer2.ConfirmKey(peer1.GetKeyConfirmationData()));
+  EXPECT_FALSE(peer1.ConfirmKey(peer2.GetKeyConfirmationData()));
+}
+
 TEST(SpekeTest, ConfirmKey_WrongPassword) {
   SPEKE peer1("peer1", "password1", 2692367);
   SPEKE peer2("peer2", "password2", 2692367);
@@ -255,6 +315,82 @@ TEST(SpekeTest, ConfirmKey_WrongPrime_BothSafe) {
   EXPECT_FALSE(peer1.ConfirmKey(peer2_kcd));
 }
 
+TEST(SpekeTest, SharedParams_EncryptionKeySameForBoth) {
+  auto params = std::make_shared<const SpekeParams>("password", 2692367);
+  SPEKE peer1("peer1", params);
+  SPEKE peer2("peer2", params);
+
+  auto peer1_key = peer1.GetPublicKey();
+  auto peer2_key = peer2.GetPublicKey();
+
+  peer2.ProvideRemotePublicKeyIdPair(peer1_key, peer1.GetId());
+  peer1.ProvideRemotePublicKeyIdPair(peer2_key, peer2.GetId());
+
+  EXPECT_EQ(peer1.GetEncryptionKey(), peer2.GetEncryptionKey());
+  EXPECT_TRUE(peer2.ConfirmKey(peer1.GetKeyConfirmationData()));
+  EXPECT_TRUE(peer1.ConfirmKey(peer2.GetKeyConfirmationData()));
+}
+
+TEST(SpekeTest, SharedParams_CompatibleWithPasswordConstructor) {
+  auto params = std::make_shared<const SpekeParams>("password", 2692367);
+  SPEKE peer1("peer1", params);
+  SPEKE peer2("peer2", "password", 2692367);
+
+  auto peer1_key = peer1.GetPublicKey();
+  auto peer2_key = peer2.GetPublicKey();
+
+  peer2.ProvideRemotePublicKeyIdPair(peer1_key, peer1.GetId());
+  peer1.ProvideRemotePublicKeyIdPair(peer2_key, peer2.GetId());
+
+  EXPECT_TRUE(peer2.ConfirmKey(peer1.GetKeyConfirmationData()));
+  EXPECT_TRUE(peer1.ConfirmKey(peer2.GetKeyConfirmationData()));
+}
+
+TEST(SpekeTest, SharedParams_ThrowOnNullptr) {
+  EXPECT_THROW(SPEKE("id", std::shared_ptr<const SpekeParams>()),
+               std::invalid_argument);
+}
+
+TEST(SpekeTest, SharedParams_ThrowOnEvenPrime) {
+  EXPECT_ANY_THROW(SpekeParams("password", 2692368));
+}
+
+TEST(SpekeTest, ShortExponent_PublicKeyInRange) {
+  auto params = std::make_shared<const SpekeParams>("password", 2692367, 4);
+  std::set<std::string> allowed;
+  for (int i = 1; i < 16; ++i) {
+    allowed.insert(params->GetGenerator().ModExp(i, 2692367).to_string());
+  }
+
+  for (int i = 0; i < 20; ++i) {
+    SPEKE speke("id", params);
+    EXPECT_EQ(1, allowed.count(BigNum(speke.GetPublicKey()).to_string()))
+        << "Private key is longer than 4 bits";
+  }
+}
+
+TEST(SpekeTest, ShortExponent_ThrowOnNegative) {
+  EXPECT_THROW(SpekeParams("password", 2692367, -1), std::invalid_argument);
+}
+
+TEST(SpekeTest, ShortExponent_AgreesWithFullLength) {
+  const BigNum prime(LRM_SPEKE_SAFE_PRIME);
+  SPEKE peer1("peer1", std::make_shared<const SpekeParams>(
+      "password", prime, LRM_SPEKE_SHORT_EXPONENT_BITS));
+  SPEKE peer2("peer2", std::make_shared<const SpekeParams>(
+      "password", prime));
+
+  auto peer1_key = peer1.GetPublicKey();
+  auto peer2_key = peer2.GetPublicKey();
+
+  peer2.ProvideRemotePublicKeyIdPair(peer1_key, peer1.GetId());
+  peer1.ProvideRemotePublicKeyIdPair(peer2_key, peer2.GetId());
+
+  EXPECT_EQ(peer1.GetEncryptionKey(), peer2.GetEncryptionKey());
+  EXPECT_TRUE(peer2.ConfirmKey(peer1.GetKeyConfirmationData()));
+  EXPECT_TRUE(peer1.ConfirmKey(peer2.GetKeyConfirmationData()));
+}
+
 TEST(SpekeTest, HmacSign) {
   SPEKE peer1("peer1", "password", 2692367);
   SPEKE peer2("peer2", "password", 2692367);
@@ -314,6 +450,104 @@ TEST(SpekeTest, ConfirmHmacSignature) {
   EXPECT_TRUE(peer2.ConfirmHmacSignature(peer1_msg_hmac, msg_bytes));
 }
 
+TEST(SpekeTest, HmacSign_FixedBufferMatchesBytes) {
+  SPEKE peer1("peer1", "password", 2692367);
+  SPEKE peer2("peer2", "password", 2692367);
+
+  auto peer1_key = peer1.GetPublicKey();
+  auto peer2_key = peer2.GetPublicKey();
+
+  peer2.ProvideRemotePublicKeyIdPair(peer1_key, peer1.GetId());
+  peer1.ProvideRemotePublicKeyIdPair(peer2_key, peer2.GetId());
+
+  const Bytes msg = lrm::Util::str_to_bytes("message");
+  std::array<std::byte, SPEKE::MAX_HMAC_SIZE> signature;
+  const size_t size = peer1.HmacSign(std::span<const std::byte>(msg),
+                                     signature);
+
+  EXPECT_EQ(peer1.HmacSign(msg),
+            Bytes(signature.begin(), signature.begin() + size));
+  EXPECT_TRUE(peer2.ConfirmHmacSignature(
+      std::span<const std::byte>(signature.data(), size),
+      std::span<const std::byte>(msg)));
+}
+
+TEST(SpekeTest, ConfirmHmacSignature_RejectsModifiedSignature) {
+  SPEKE peer1("peer1", "password", 2692367);
+  SPEKE peer2("peer2", "password", 2692367);
+
+  auto peer1_key = peer1.GetPublicKey();
+  auto peer2_key = peer2.GetPublicKey();
+
+  peer2.ProvideRemotePublicKeyIdPair(peer1_key, peer1.GetId());
+  peer1.ProvideRemotePublicKeyIdPair(peer2_key, peer2.GetId());
+
+  const Bytes msg = lrm::Util::str_to_bytes("message");
+  Bytes signature = peer1.HmacSign(msg);
+
+  EXPECT_FALSE(peer2.ConfirmHmacSignature(
+      Bytes(signature.begin(), signature.end() - 1), msg))
+      << "Truncated signature shouldn't be accepted";
+
+  signature.back() ^= std::byte{1};
+  EXPECT_FALSE(peer2.ConfirmHmacSignature(signature, msg));
+  EXPECT_FALSE(peer2.ConfirmHmacSignature(Bytes(), msg));
+}
+
+TEST(SpekeTest, ConcurrentHmacSign) {
+  SPEKE peer1("peer1", "password", 2692367);
+  SPEKE peer2("peer2", "password", 2692367);
+
+  auto peer1_key = peer1.GetPublicKey();
+  auto peer2_key = peer2.GetPublicKey();
+
+  peer2.ProvideRemotePublicKeyIdPair(peer1_key, peer1.GetId());
+  peer1.ProvideRemotePublicKeyIdPair(peer2_key, peer2.GetId());
+
+  const Bytes msg = lrm::Util::str_to_bytes("message");
+  const Bytes control = peer1.HmacSign(msg);
+
+  std::atomic_int failures = 0;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([&]{
+      for (int j = 0; j < 1000; ++j) {
+        if (peer1.HmacSign(msg) != control or
+            not peer2.ConfirmHmacSignature(control, msg)) {
+          ++failures;
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) thread.join();
+
+  EXPECT_EQ(0, failures);
+}
+
+TEST(SpekeTest, ConcurrentHandshakes) {
+  auto params = std::make_shared<const SpekeParams>("password", 2692367);
+  std::atomic_int failures = 0;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([&]{
+      for (int j = 0; j < 100; ++j) {
+        SPEKE peer1("peer1", params);
+        SPEKE peer2("peer2", params);
+        auto peer1_key = peer1.GetPublicKey();
+        auto peer2_key = peer2.GetPublicKey();
+        peer2.ProvideRemotePublicKeyIdPair(peer1_key, peer1.GetId());
+        peer1.ProvideRemotePublicKeyIdPair(peer2_key, peer2.GetId());
+        if (not peer1.ConfirmKey(peer2.GetKeyConfirmationData())) {
+          ++failures;
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) thread.join();
+
+  EXPECT_EQ(0, failures);
+}
+
 TEST(SpekeTest, GetEncryptionKey_WithoutProvidingPkey) {
   SPEKE speke("id", "password", 2692367);
 
@@ -0,0 +1,85 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#include <gtest/gtest.h>
+
+#include "SpekeGroup.h"
+#include "SpekeParams.h"
+
+using namespace lrm::crypto;
+
+namespace {
+const SpekeGroup known_groups[] = {
+  SpekeGroup::LRM_4096, SpekeGroup::MODP_2048, SpekeGroup::MODP_3072,
+  SpekeGroup::MODP_4096, SpekeGroup::MODP_6144};
+}
+
+TEST(SpekeGroupTest, PrimesOfTheirSize) {
+  for (SpekeGroup group : known_groups) {
+    const BigNum p = GetSpekeGroupPrime(group);
+
+    EXPECT_EQ(GetSpekeGroupBits(group), BN_num_bits(p.get()));
+    EXPECT_TRUE(p.IsOdd());
+  }
+}
+
+TEST(SpekeGroupTest, ModpPrimesHaveRfc3526Form) {
+  // The highest and the lowest 64 bits of every MODP prime are set.
+  const BigNum ones = (BigNum(2) ^ 64) - 1;
+  for (SpekeGroup group : known_groups) {
+    if (group == SpekeGroup::LRM_4096) continue;
+    const BigNum p = GetSpekeGroupPrime(group);
+    const int bits = GetSpekeGroupBits(group);
+
+    EXPECT_EQ(ones, p % (BigNum(2) ^ 64));
+    EXPECT_EQ(ones, p / (BigNum(2) ^ (bits - 64)));
+  }
+}
+
+TEST(SpekeGroupTest, Modp2048IsSafePrime) {
+  // Bigger ones take too long to test.
+  const BigNum p = GetSpekeGroupPrime(SpekeGroup::MODP_2048);
+
+  EXPECT_TRUE(p.IsPrime());
+  EXPECT_TRUE(((p - 1) / 2).IsPrime());
+}
+
+TEST(SpekeGroupTest, FindSpekeGroup) {
+  for (SpekeGroup group : known_groups) {
+    EXPECT_EQ(group, FindSpekeGroup(GetSpekeGroupPrime(group)));
+  }
+  EXPECT_EQ(SpekeGroup::CUSTOM, FindSpekeGroup(BigNum(2692367)));
+}
+
+TEST(SpekeGroupTest, GetSpekeGroupPrime_ThrowOnCustom) {
+  EXPECT_THROW(GetSpekeGroupPrime(SpekeGroup::CUSTOM),
+               std::invalid_argument);
+  EXPECT_EQ(0, GetSpekeGroupBits(SpekeGroup::CUSTOM));
+}
+
+TEST(SpekeGroupTest, SpekeParams_GetGroup) {
+  EXPECT_EQ(SpekeGroup::MODP_2048,
+            SpekeParams("password", SpekeGroup::MODP_2048).GetGroup());
+  EXPECT_EQ(SpekeGroup::LRM_4096,
+            SpekeParams("password", BigNum(LRM_SPEKE_SAFE_PRIME)).GetGroup());
+  EXPECT_EQ(SpekeGroup::CUSTOM,
+            SpekeParams("password", BigNum(2692367)).GetGroup());
+  EXPECT_THROW(SpekeParams("password", SpekeGroup::CUSTOM),
+               std::invalid_argument);
+}
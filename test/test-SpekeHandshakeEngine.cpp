@@ -0,0 +1,99 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include <gtest/gtest.h>
+
+#include <thread>
+
+#include <asio.hpp>
+
+#include "SPEKE.h"
+#include "SpekeHandshakeEngine.h"
+
+using namespace lrm::crypto;
+
+TEST(SpekeHandshakeEngineTest, HandshakesCompleteOnExecutor) {
+  const int num_pairs = 16;
+  auto params = std::make_shared<const SpekeParams>("password", 2692367);
+  SpekeHandshakeEngine engine(4);
+  asio::io_context context;
+  auto work = asio::make_work_guard(context);
+
+  std::vector<std::shared_ptr<SPEKE>> pekes;
+  for (int i = 0; i < num_pairs * 2; ++i) {
+    pekes.push_back(std::make_shared<SPEKE>("peer" + std::to_string(i),
+                                            params));
+  }
+
+  int completed = 0;
+  int failed = 0;
+  const auto context_thread = std::this_thread::get_id();
+  for (int i = 0; i < num_pairs * 2; ++i) {
+    auto& remote = pekes[i % 2 ? i - 1 : i + 1];
+    engine.ProvideRemotePublicKeyIdPair(
+        pekes[i], remote->GetPublicKey(), remote->GetId(),
+        context.get_executor(),
+        [&](std::exception_ptr error) {
+          if (error or std::this_thread::get_id() != context_thread) {
+            ++failed;
+          }
+          ++completed;
+        });
+  }
+
+  while (completed < num_pairs * 2) {
+    context.run_one();
+  }
+
+  EXPECT_EQ(0, failed);
+  EXPECT_EQ(0, engine.GetPending());
+  for (int i = 0; i < num_pairs * 2; i += 2) {
+    EXPECT_TRUE(pekes[i]->ConfirmKey(pekes[i + 1]->GetKeyConfirmationData()));
+  }
+}
+
+TEST(SpekeHandshakeEngineTest, ErrorPassedToHandler) {
+  SpekeHandshakeEngine engine(1);
+  asio::io_context context;
+  auto work = asio::make_work_guard(context);
+  auto speke = std::make_shared<SPEKE>("id", "password", 2692367);
+
+  std::exception_ptr result;
+  bool called = false;
+  engine.ProvideRemotePublicKeyIdPair(
+      speke, BigNum(1).to_bytes(), "remote", context.get_executor(),
+      [&](std::exception_ptr error) {
+        result = error;
+        called = true;
+      });
+
+  while (not called) context.run_one();
+
+  ASSERT_TRUE(result);
+  EXPECT_THROW(std::rethrow_exception(result), std::runtime_error);
+}
+
+TEST(SpekeHandshakeEngineTest, ThrowOnNullptr) {
+  SpekeHandshakeEngine engine(1);
+  asio::io_context context;
+
+  EXPECT_THROW(engine.ProvideRemotePublicKeyIdPair(
+                   nullptr, Bytes(), "remote", context.get_executor(),
+                   [](std::exception_ptr){}),
+               std::invalid_argument);
+}
@@ -0,0 +1,87 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#include <gtest/gtest.h>
+
+#include <thread>
+#include <vector>
+
+#include "SpekeIdRegistry.h"
+
+using namespace lrm::crypto;
+
+TEST(SpekeIdRegistryTest, Construct_ThrowOnBadArguments) {
+  EXPECT_THROW(SpekeIdRegistry(16, 0), std::invalid_argument);
+  EXPECT_THROW(SpekeIdRegistry(4, 8), std::invalid_argument);
+}
+
+TEST(SpekeIdRegistryTest, Next_CountsEveryId) {
+  SpekeIdRegistry registry(16, 2);
+
+  EXPECT_EQ(1, registry.Next("a"));
+  EXPECT_EQ(1, registry.Next("b"));
+  EXPECT_EQ(2, registry.Next("a"));
+  EXPECT_EQ(3, registry.Next("a"));
+  EXPECT_EQ(2, registry.Next("b"));
+  EXPECT_EQ(2, registry.Size());
+}
+
+TEST(SpekeIdRegistryTest, Next_EvictsLeastRecentlyUsed) {
+  SpekeIdRegistry registry(2, 1);
+
+  registry.Next("a");
+  registry.Next("b");
+  // "a" is used more recently than "b" now.
+  EXPECT_EQ(2, registry.Next("a"));
+  EXPECT_EQ(1, registry.Next("c"));
+  EXPECT_EQ(2, registry.Size());
+
+  EXPECT_EQ(3, registry.Next("a"));
+  EXPECT_EQ(2, registry.Next("c"));
+  EXPECT_EQ(1, registry.Next("b"));
+}
+
+TEST(SpekeIdRegistryTest, Size_Bounded) {
+  SpekeIdRegistry registry(64, 4);
+
+  for (int i = 0; i < 1000; ++i) {
+    registry.Next("id-" + std::to_string(i));
+  }
+  EXPECT_LE(registry.Size(), 64);
+}
+
+TEST(SpekeIdRegistryTest, Next_Concurrent) {
+  SpekeIdRegistry registry(1024, 8);
+  constexpr int threads_num = 8;
+  constexpr int count = 1000;
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < threads_num; ++i) {
+    threads.emplace_back([&registry]{
+                           for (int j = 0; j < count; ++j) {
+                             registry.Next("shared");
+                             registry.Next("id-" + std::to_string(j % 100));
+                           }
+                         });
+  }
+  for (auto& thread : threads) thread.join();
+
+  EXPECT_EQ(threads_num * count + 1, registry.Next("shared"));
+  EXPECT_EQ(threads_num * count / 100 + 1, registry.Next("id-0"));
+}
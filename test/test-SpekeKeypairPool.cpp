@@ -0,0 +1,110 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <set>
+#include <thread>
+
+#include "SPEKE.h"
+#include "SpekeKeypairPool.h"
+
+using namespace lrm::crypto;
+
+namespace {
+std::shared_ptr<const SpekeParams> make_params() {
+  return std::make_shared<const SpekeParams>("password", 2692367);
+}
+
+template<typename Predicate, class Rep, class Period>
+bool wait_predicate(Predicate&& pred,
+                    const std::chrono::duration<Rep, Period>& timeout){
+  std::chrono::time_point wake_time =
+      std::chrono::high_resolution_clock::now() + timeout;
+
+  while(not std::invoke(pred)) {
+    if (std::chrono::high_resolution_clock::now() > wake_time) return false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return true;
+}
+}
+
+TEST(SpekeKeypairPoolTest, Construct_ThrowOnBadArguments) {
+  EXPECT_THROW(SpekeKeypairPool(nullptr, 4, 1), std::invalid_argument);
+  EXPECT_THROW(SpekeKeypairPool(make_params(), 0, 0), std::invalid_argument);
+  EXPECT_THROW(SpekeKeypairPool(make_params(), 4, 4), std::invalid_argument);
+  EXPECT_THROW(SpekeKeypairPool(make_params(), 4, 1, 0),
+               std::invalid_argument);
+}
+
+TEST(SpekeKeypairPoolTest, FillsToCapacity) {
+  SpekeKeypairPool pool(make_params(), 8, 2, 2);
+
+  EXPECT_TRUE(wait_predicate([&pool]{ return pool.Size() == 8; },
+                             std::chrono::seconds(1)));
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  EXPECT_EQ(8, pool.Size()) << "The pool should never exceed its capacity";
+}
+
+TEST(SpekeKeypairPoolTest, RefillsBelowLowWaterMark) {
+  SpekeKeypairPool pool(make_params(), 8, 2);
+  ASSERT_TRUE(wait_predicate([&pool]{ return pool.Size() == 8; },
+                             std::chrono::seconds(1)));
+
+  for (int i = 0; i < 6; ++i) pool.Pop();
+
+  EXPECT_TRUE(wait_predicate([&pool]{ return pool.Size() == 8; },
+                             std::chrono::seconds(1)));
+}
+
+TEST(SpekeKeypairPoolTest, PopWhenEmpty) {
+  SpekeKeypairPool pool(make_params(), 1, 0);
+
+  std::set<std::string> pubkeys;
+  for (int i = 0; i < 10; ++i) {
+    pubkeys.insert(pool.Pop().pubkey.to_string());
+  }
+
+  EXPECT_EQ(10, pubkeys.size()) << "Keypairs should never be reused";
+}
+
+TEST(SpekeKeypairPoolTest, KeypairValid) {
+  auto params = make_params();
+  SpekeKeypair keypair = SpekeKeypairPool(params, 2, 1).Pop();
+
+  EXPECT_EQ(params->GetGenerator().ModExp(keypair.privkey,
+                                          params->GetSafePrime()),
+            keypair.pubkey);
+}
+
+TEST(SpekeKeypairPoolTest, SpekeFromPool_EncryptionKeySameForBoth) {
+  SpekeKeypairPool pool(make_params(), 4, 1);
+  SPEKE peer1("peer1", pool);
+  SPEKE peer2("peer2", pool);
+
+  auto peer1_key = peer1.GetPublicKey();
+  auto peer2_key = peer2.GetPublicKey();
+
+  peer2.ProvideRemotePublicKeyIdPair(peer1_key, peer1.GetId());
+  peer1.ProvideRemotePublicKeyIdPair(peer2_key, peer2.GetId());
+
+  EXPECT_EQ(peer1.GetEncryptionKey(), peer2.GetEncryptionKey());
+  EXPECT_TRUE(peer2.ConfirmKey(peer1.GetKeyConfirmationData()));
+}
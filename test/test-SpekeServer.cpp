@@ -0,0 +1,275 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+
+#include <asio.hpp>
+
+#include "SPEKE.h"
+#include "SpekeServer.h"
+
+#include "Util.h"
+
+using namespace lrm::crypto;
+using namespace std::chrono_literals;
+using tcp = asio::ip::tcp;
+using stream_protocol = asio::local::stream_protocol;
+
+namespace {
+template<typename Predicate, class Rep, class Period>
+bool wait_predicate(Predicate&& pred,
+                    const std::chrono::duration<Rep, Period>& timeout){
+  std::chrono::time_point wake_time =
+      std::chrono::high_resolution_clock::now() + timeout;
+
+  while(not std::invoke(pred)) {
+    if (std::chrono::high_resolution_clock::now() > wake_time) return false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return true;
+}
+
+class SpekeServerTest : public ::testing::Test {
+ protected:
+  asio::io_context context;
+  std::shared_ptr<const SpekeParams> params =
+      std::make_shared<const SpekeParams>("password", 2692367);
+  std::string socket_path =
+      (std::filesystem::temp_directory_path() /
+       ("test-speke-server-" + std::to_string(getpid()))).string();
+
+  std::unique_ptr<SpekeServer<stream_protocol>> server;
+  std::vector<std::unique_ptr<SpekeSession<stream_protocol>>> clients;
+
+  std::mutex received_mtx;
+  std::vector<std::string> received;
+
+  void SetUp() override {
+    ::unlink(socket_path.c_str());
+  }
+
+  void TearDown() override {
+    context.stop();
+    for (auto& thread : context_threads_) thread.join();
+    clients.clear();
+    server.reset();
+    ::unlink(socket_path.c_str());
+  }
+
+  void StartServer(const SpekeServerOptions& options = {}) {
+    server = std::make_unique<SpekeServer<stream_protocol>>(
+        context, stream_protocol::endpoint(socket_path),
+        [this]{ return std::make_shared<SPEKE>("server", params); },
+        [this](auto message, auto& session) {
+          std::string str(reinterpret_cast<const char*>(message.data()),
+                          message.size());
+          session.SendMessage(lrm::Util::str_to_bytes("re: " + str));
+        },
+        options);
+    server->Run();
+
+    for (int i = 0; i < 2; ++i) {
+      context_threads_.emplace_back([this]{ context.run(); });
+    }
+  }
+
+  SpekeSession<stream_protocol>& Connect() {
+    stream_protocol::socket socket(context);
+    socket.connect(stream_protocol::endpoint(socket_path));
+    clients.push_back(std::make_unique<SpekeSession<stream_protocol>>(
+        std::move(socket), std::make_shared<SPEKE>("client", params)));
+    clients.back()->Run(
+        [this](auto message, auto&) {
+          std::lock_guard lck(received_mtx);
+          received.emplace_back(reinterpret_cast<const char*>(message.data()),
+                                message.size());
+        });
+    return *clients.back();
+  }
+
+  size_t ReceivedCount() {
+    std::lock_guard lck(received_mtx);
+    return received.size();
+  }
+
+ private:
+  asio::executor_work_guard<asio::io_context::executor_type> work_ =
+      asio::make_work_guard(context);
+  std::vector<std::thread> context_threads_;
+};
+}
+
+TEST_F(SpekeServerTest, Construct_ThrowOnBadArguments) {
+  EXPECT_THROW(SpekeServer<stream_protocol>(
+                   context, stream_protocol::endpoint(socket_path),
+                   nullptr, [](auto, auto&){}),
+               std::invalid_argument);
+  EXPECT_THROW(SpekeServer<stream_protocol>(
+                   context, stream_protocol::endpoint(socket_path),
+                   [this]{ return std::make_shared<SPEKE>("server", params); },
+                   nullptr),
+               std::invalid_argument);
+}
+
+TEST_F(SpekeServerTest, Run_ThrowIfRunTwice) {
+  StartServer();
+  EXPECT_THROW(server->Run(), std::logic_error);
+}
+
+TEST_F(SpekeServerTest, ClientsAuthenticateAndExchangeMessages) {
+  SpekeServerOptions options;
+  options.shards = 3;
+  StartServer(options);
+
+  constexpr int count = 6;
+  for (int i = 0; i < count; ++i) Connect();
+
+  for (auto& client : clients) {
+    ASSERT_TRUE(wait_predicate([&client]{ return client->IsAuthenticated(); },
+                               5s));
+  }
+  EXPECT_TRUE(wait_predicate([this]{ return server->GetSessionCount() == count;},
+                             1s));
+  EXPECT_TRUE(wait_predicate(
+      [this]{ return server->GetPendingHandshakes() == 0; }, 1s));
+
+  for (auto& client : clients) {
+    client->SendMessage(lrm::Util::str_to_bytes("hello"));
+  }
+  ASSERT_TRUE(wait_predicate([this]{ return ReceivedCount() == count; }, 5s));
+  for (auto& message : received) {
+    EXPECT_EQ("re: hello", message);
+  }
+}
+
+TEST_F(SpekeServerTest, ReapDisconnectedSessions) {
+  SpekeServerOptions options;
+  options.shards = 2;
+  options.reap_interval = 5ms;
+  options.reap_batch = 1;
+  StartServer(options);
+
+  for (int i = 0; i < 4; ++i) Connect();
+  for (auto& client : clients) {
+    ASSERT_TRUE(wait_predicate([&client]{ return client->IsAuthenticated(); },
+                               5s));
+  }
+  ASSERT_TRUE(wait_predicate([this]{ return server->GetSessionCount() == 4; },
+                             1s));
+
+  clients[0]->Close(SpekeSessionState::STOPPED);
+  clients[3]->Close(SpekeSessionState::STOPPED);
+  EXPECT_TRUE(wait_predicate([this]{ return server->GetSessionCount() == 2; },
+                             2s));
+}
+
+TEST_F(SpekeServerTest, CloseHandshakesOnTimeout) {
+  SpekeServerOptions options;
+  options.handshake_timeout = 50ms;
+  options.reap_interval = 5ms;
+  StartServer(options);
+
+  // Connects, but never sends anything.
+  stream_protocol::socket silent(context);
+  silent.connect(stream_protocol::endpoint(socket_path));
+  ASSERT_TRUE(wait_predicate(
+      [this]{ return server->GetPendingHandshakes() == 1; }, 1s));
+
+  EXPECT_TRUE(wait_predicate([this]{ return server->GetSessionCount() == 0; },
+                             2s));
+  EXPECT_EQ(0, server->GetPendingHandshakes());
+}
+
+TEST_F(SpekeServerTest, PauseAcceptingOverPendingHandshakes) {
+  SpekeServerOptions options;
+  options.shards = 1;
+  options.max_pending_handshakes = 1;
+  options.handshake_timeout = 200ms;
+  options.reap_interval = 5ms;
+  StartServer(options);
+
+  stream_protocol::socket silent1(context);
+  silent1.connect(stream_protocol::endpoint(socket_path));
+  stream_protocol::socket silent2(context);
+  silent2.connect(stream_protocol::endpoint(socket_path));
+
+  ASSERT_TRUE(wait_predicate([this]{ return server->GetSessionCount() == 1; },
+                             1s));
+  std::this_thread::sleep_for(50ms);
+  EXPECT_EQ(1, server->GetSessionCount());
+  EXPECT_EQ(1, server->GetPendingHandshakes());
+
+  // After the first one times out the second one is accepted, and then it
+  // times out too.
+  EXPECT_TRUE(wait_predicate([this]{ return server->GetSessionCount() == 0; },
+                             2s));
+}
+
+TEST_F(SpekeServerTest, Stop_ClosesAllSessions) {
+  StartServer();
+  auto& client = Connect();
+  ASSERT_TRUE(wait_predicate([&client]{ return client.IsAuthenticated(); },
+                             5s));
+
+  server->Stop();
+  EXPECT_TRUE(wait_predicate(
+      [&client]{ return client.GetState() >= SpekeSessionState::STOPPED; },
+      2s));
+  EXPECT_EQ(0, server->GetSessionCount());
+}
+
+TEST(SpekeServerTcpTest, ShardsShareThePort) {
+  asio::io_context context;
+  auto params = std::make_shared<const SpekeParams>("password", 2692367);
+  SpekeServerOptions options;
+  options.shards = 4;
+  SpekeServer<tcp> server(
+      context, tcp::endpoint(asio::ip::address_v4::loopback(), 0),
+      [&params]{ return std::make_shared<SPEKE>("server", params); },
+      [](auto, auto&){}, options);
+  ASSERT_NE(0, server.GetLocalEndpoint().port());
+  server.Run();
+
+  auto work = asio::make_work_guard(context);
+  std::thread context_thread([&context]{ context.run(); });
+
+  std::vector<std::unique_ptr<SpekeSession<tcp>>> clients;
+  for (int i = 0; i < 8; ++i) {
+    tcp::socket socket(context);
+    socket.connect(server.GetLocalEndpoint());
+    clients.push_back(std::make_unique<SpekeSession<tcp>>(
+        std::move(socket), std::make_shared<SPEKE>("client", params)));
+    clients.back()->Run([](auto, auto&){});
+  }
+  for (auto& client : clients) {
+    EXPECT_TRUE(wait_predicate([&client]{ return client->IsAuthenticated(); },
+                               5s));
+  }
+  EXPECT_TRUE(wait_predicate([&server]{ return server.GetSessionCount() == 8;},
+                             1s));
+
+  context.stop();
+  context_thread.join();
+}
@@ -23,7 +23,11 @@
 #include "SPEKE.h"
 #include "SpekeSession.h"
 
+#include <future>
+
 #include <asio.hpp>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 
 #include "Util.h"
 
@@ -35,8 +39,9 @@ namespace {
 class TestSpekeSession : public SpekeSession<stream_protocol> {
  public:
   TestSpekeSession(asio::basic_stream_socket<stream_protocol>&& socket,
-                   std::shared_ptr<SpekeInterface>&& speke)
-      : SpekeSession(std::move(socket), std::move(speke)) {}
+                   std::shared_ptr<SpekeInterface>&& speke,
+                   const SpekeSessionOptions& options = {})
+      : SpekeSession(std::move(socket), std::move(speke), options) {}
   virtual ~TestSpekeSession(){}
 
   static void TestSendMessage(
@@ -57,8 +62,10 @@ class FakeSpeke : public SpekeInterface {
  private:
   Bytes pkey_ = lrm::Util::str_to_bytes("pkey");
   std::string id_{"id"};
-  Bytes enc_key_ = lrm::Util::str_to_bytes("enckey");
-  Bytes nonce_ = lrm::Util::str_to_bytes("nonce");
+  Bytes enc_key_ = Bytes(EVP_CIPHER_key_length(LRM_SPEKE_CIPHER_TYPE),
+                         std::byte{1});
+  Bytes nonce_ = Bytes(EVP_CIPHER_iv_length(LRM_SPEKE_CIPHER_TYPE),
+                       std::byte{2});
   Bytes kcd_ = lrm::Util::str_to_bytes("kcd");
 
   Bytes bad_bytes_ = lrm::Util::str_to_bytes("bad");
@@ -66,9 +73,15 @@ class FakeSpeke : public SpekeInterface {
 
   bool init_data_already_sent_ = false;
 
+  Hmac hmac_{lrm::Util::str_to_bytes("key")};
+
  public:
   virtual ~FakeSpeke() {};
 
+  virtual SpekeBackend GetBackend() const override {
+    return SpekeBackend::FINITE_FIELD;
+  }
+
   virtual Bytes GetPublicKey() const override {
     return pkey_;
   }
@@ -92,6 +105,8 @@ class FakeSpeke : public SpekeInterface {
     init_data_already_sent_ = true;
   }
 
+  virtual void SetTranscript(Bytes, Bytes) override {}
+
   virtual const Bytes& GetEncryptionKey() override {
     return enc_key_;
   }
@@ -117,6 +132,10 @@ class FakeSpeke : public SpekeInterface {
       const Bytes&) override {
     return hmac_signature != bad_bytes_;
   }
+
+  virtual Hmac::Stream MakeHmacStream() override {
+    return hmac_.MakeStream();
+  }
 };
 
 class SpekeSessionTestF : public ::testing::Test {
@@ -146,6 +165,14 @@ class SpekeSessionTestF : public ::testing::Test {
     TestSpekeSession::TestSendMessage(message, peer_socket);
   }
 
+  // Send InitData and skip the session's InitData and KeyConfirmation, so
+  // the session can send messages.
+  void Handshake() {
+    SendInitData();
+    TestSpekeSession::TestReceiveMessage(peer_socket);
+    TestSpekeSession::TestReceiveMessage(peer_socket);
+  }
+
  public:
   SpekeSessionTestF()
       : ::testing::Test(), priv_socket(context), peer_socket(context) {
@@ -245,6 +272,9 @@ TEST(SpekeSessionTest, Run_InitDataIsSent) {
   auto session = TestSpekeSession(std::move(sockets.first), std::move(speke));
 
   ASSERT_NO_THROW(session.Run([](auto, auto&){}));
+  // The write starts on the session's strand.
+  context_glob.restart();
+  context_glob.poll();
 
   SpekeMessage peer_data =
       TestSpekeSession::TestReceiveMessage(sockets.second);
@@ -252,6 +282,40 @@ TEST(SpekeSessionTest, Run_InitDataIsSent) {
   ASSERT_TRUE(peer_data.has_init_data());
   EXPECT_EQ("id", peer_data.init_data().id());
   EXPECT_EQ("pkey", peer_data.init_data().public_key());
+  EXPECT_EQ(SpekeMessage::FINITE_FIELD, peer_data.init_data().backend());
+}
+
+TEST(SpekeSessionTest, Run_StopsOnDisconnectedPeer_MultiThreadedContext) {
+  // The first write or read may fail on a context thread before Run()
+  // returns, the stopped state mustn't be overwritten by RUNNING then.
+  asio::io_context context;
+  auto context_guard = asio::make_work_guard(context);
+  std::vector<std::thread> context_threads;
+  for (int i = 0; i < 4; ++i) {
+    context_threads.emplace_back([&context]{ context.run(); });
+  }
+
+  std::vector<std::unique_ptr<TestSpekeSession>> sessions;
+  for (int i = 0; i < 500; ++i) {
+    auto sockets = get_local_socketpair(context);
+    sockets.second.close();
+    sessions.push_back(std::make_unique<TestSpekeSession>(
+        std::move(sockets.first), std::make_shared<FakeSpeke>()));
+    sessions.back()->Run([](auto, auto&){});
+  }
+
+  EXPECT_TRUE(wait_predicate(
+      [&sessions]{
+        return std::none_of(sessions.begin(), sessions.end(),
+            [](const auto& session){
+              return session->GetState() == SpekeSessionState::RUNNING;
+            });
+      },
+      std::chrono::seconds(5)));
+
+  context_guard.reset();
+  context.stop();
+  for (auto& thread : context_threads) thread.join();
 }
 
 TEST_F(SpekeSessionTestF, ConnectionDroppedOnIncorrectPublicKey) {
@@ -275,6 +339,28 @@ TEST_F(SpekeSessionTestF, ConnectionDroppedOnIncorrectPublicKey) {
       << "Socket should be closed after the server closed the connection";
 }
 
+TEST_F(SpekeSessionTestF, ConnectionDroppedOnBackendMismatch) {
+  auto session = GetSession();
+  session->Run([](auto, auto&){});
+
+  SpekeMessage message;
+  SpekeMessage::InitData* init_data = message.mutable_init_data();
+  init_data->set_id("id");
+  init_data->set_public_key("pkey");
+  init_data->set_backend(SpekeMessage::ELLIPTIC_CURVE);
+
+  TestSpekeSession::TestSendMessage(message, GetSocket());
+
+  wait_predicate(
+      [&session]{
+        return SpekeSessionState::RUNNING != session->GetState(); },
+      std::chrono::milliseconds(10));
+
+  EXPECT_EQ(SpekeSessionState::STOPPED_NEGOTIATION_FAILED,
+            session->GetState())
+      << "Session should be closed when the peer uses a different backend";
+}
+
 TEST_F(SpekeSessionTestF, ConnectionNotDroppedOnCorrectPublicKey) {
   auto session = GetSession();
   session->Run([](auto, auto&){});
@@ -316,6 +402,37 @@ TEST_F(SpekeSessionTestF, SendsKeyConfirmation) {
   EXPECT_EQ("kcd", message.key_confirmation().data());
 }
 
+TEST_F(SpekeSessionTestF, SendsKeyConfirmation_HandshakeEngine) {
+  auto session = GetSession();
+  auto engine = std::make_shared<SpekeHandshakeEngine>(1);
+  session->SetHandshakeEngine(engine);
+  session->Run([](auto, auto&){});
+
+  SendInitData();
+
+  auto& socket = GetSocket();
+
+  // Receive init data
+  SpekeMessage message =
+      TestSpekeSession::TestReceiveMessage(socket);
+
+  // Receive the next message, which should be key confirmation data
+  message = TestSpekeSession::TestReceiveMessage(socket);
+
+  EXPECT_EQ(SpekeSessionState::RUNNING, session->GetState());
+  ASSERT_TRUE(message.has_key_confirmation());
+  EXPECT_EQ("kcd", message.key_confirmation().data());
+}
+
+TEST_F(SpekeSessionTestF, SetHandshakeEngine_ThrowWhenRunning) {
+  auto session = GetSession();
+  session->Run([](auto, auto&){});
+
+  EXPECT_THROW(
+      session->SetHandshakeEngine(std::make_shared<SpekeHandshakeEngine>(1)),
+      std::logic_error);
+}
+
 TEST_F(SpekeSessionTestF, ConnectionDroppedOnBadKeyConfirmation) {
   auto session = GetSession();
   session->Run([](auto, auto&){});
@@ -442,7 +559,7 @@ TEST_F(SpekeSessionTestF, MessageHandlerCalledOnHMACmessage) {
   auto session = GetSession();
   std::string result;
   session->Run(
-      [&result](Bytes&& message, auto&){
+      [&result](auto message, auto&){
         result.resize(message.size());
         lrm::Util::safe_memcpy(result.data(), message.data(), message.size());
       });
@@ -468,11 +585,11 @@ TEST_F(SpekeSessionTestF, SetMessageHandler) {
   SendInitData();
 
   std::string result;
-  session->SetMessageHandler(
+  session->SetMessageHandler(TestSpekeSession::MakeOwningHandler(
       [&result](Bytes&& message, auto&){
         result.resize(message.size());
         lrm::Util::safe_memcpy(result.data(), message.data(), message.size());
-      });
+      }));
 
   SpekeMessage message;
   SpekeMessage::SignedData* sd = message.mutable_signed_data();
@@ -486,23 +603,1752 @@ TEST_F(SpekeSessionTestF, SetMessageHandler) {
   EXPECT_EQ(result, "test");
 }
 
-TEST_F(SpekeSessionTestF, SendMessage) {
+TEST_F(SpekeSessionTestF, MessageHandlerCalledOnFragmentedMessage) {
   auto session = GetSession();
   std::string result;
+  session->Run(
+      [&result](auto message, auto&){
+        result.assign(reinterpret_cast<const char*>(message.data()),
+                      message.size());
+      });
+
+  SendInitData();
+
+  SpekeMessage message;
+  SpekeMessage::SignedData* sd = message.mutable_signed_data();
+  sd->set_hmac_signature("hmac");
+  sd->set_data("test");
+  const size_t size = message.ByteSizeLong();
+  std::string frame(reinterpret_cast<const char*>(&size), sizeof(size));
+  frame += message.SerializeAsString();
+
+  // Send the frame in pieces, the session has to wait for all of them
+  // without blocking the io thread.
+  const size_t split = sizeof(size) + 2;
+  asio::write(GetSocket(), asio::buffer(frame.data(), 3));
+  std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  asio::write(GetSocket(), asio::buffer(frame.data() + 3, split - 3));
+  std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  EXPECT_TRUE(result.empty());
+  EXPECT_EQ(SpekeSessionState::RUNNING, session->GetState());
+
+  asio::write(GetSocket(),
+              asio::buffer(frame.data() + split, frame.size() - split));
+
+  wait_predicate([&result]{return result == "test";},
+                 std::chrono::milliseconds(3));
+
+  EXPECT_EQ(result, "test");
+}
+
+TEST_F(SpekeSessionTestF, UnparsableMessageIsBadBehavior) {
+  auto session = GetSession();
   session->Run([](auto, auto&){});
 
   SendInitData();
 
+  const std::string garbage = "\xff\xff\xff";
+  const size_t size = garbage.size();
+  for (int i = 0; i < TestSpekeSession::BAD_BEHAVIOR_LIMIT; ++i) {
+    asio::write(GetSocket(), asio::buffer(&size, sizeof(size)));
+    asio::write(GetSocket(), asio::buffer(garbage));
+  }
+
+  wait_predicate(
+      [&session]{
+        return SpekeSessionState::STOPPED_PEER_BAD_BEHAVIOR ==
+            session->GetState(); },
+      std::chrono::milliseconds(10));
+
+  EXPECT_EQ(SpekeSessionState::STOPPED_PEER_BAD_BEHAVIOR, session->GetState());
+}
+
+TEST_F(SpekeSessionTestF, MessageHandlerCalledOnMessagesBiggerThanArena) {
+  auto session = GetSession();
+  std::vector<std::string> result;
+  std::mutex result_mtx;
+  session->Run(
+      [&](auto message, auto&){
+        std::lock_guard lck{result_mtx};
+        result.emplace_back(reinterpret_cast<const char*>(message.data()),
+                            message.size());
+      });
+
+  SendInitData();
+
+  const std::vector<std::string> messages{
+    "small", std::string(4 * LRM_SPEKE_ARENA_BLOCK_SIZE, 'a'), "small"};
+  for (const auto& data : messages) {
+    SpekeMessage message;
+    SpekeMessage::SignedData* sd = message.mutable_signed_data();
+    sd->set_hmac_signature("hmac");
+    sd->set_data(data);
+    TestSpekeSession::TestSendMessage(message, GetSocket());
+  }
+
+  wait_predicate([&]{
+                   std::lock_guard lck{result_mtx};
+                   return result.size() == messages.size(); },
+                 std::chrono::milliseconds(10));
+
+  std::lock_guard lck{result_mtx};
+  EXPECT_EQ(messages, result);
+}
+
+TEST_F(SpekeSessionTestF, SendMessage) {
+  auto session = GetSession();
+  std::string result;
+  session->Run([](auto, auto&){});
+
+  Handshake();
+
   session->SendMessage(lrm::Util::str_to_bytes("test"));
 
   SpekeMessage message;
-  // 3 messages sent by the session would be: init data, key confirmation and
-  // our signed message
-  for (int i = 0; i < 3; ++i) {
-    message = TestSpekeSession::TestReceiveMessage(GetSocket());
-    if (message.has_signed_data()) break;
-  }
+  message = TestSpekeSession::TestReceiveMessage(GetSocket());
 
   EXPECT_EQ("hmac", message.signed_data().hmac_signature());
   EXPECT_EQ("test", message.signed_data().data());
 }
+
+TEST_F(SpekeSessionTestF, SendMessage_KeepsOrder) {
+  auto session = GetSession();
+  session->Run([](auto, auto&){});
+
+  Handshake();
+
+  constexpr int count = 100;
+  for (int i = 0; i < count; ++i) {
+    ASSERT_TRUE(session->SendMessage(
+        lrm::Util::str_to_bytes(std::to_string(i))));
+  }
+
+  int received = 0;
+  while (received < count) {
+    SpekeMessage message = TestSpekeSession::TestReceiveMessage(GetSocket());
+    if (not message.has_signed_data()) continue;
+    EXPECT_EQ(std::to_string(received), message.signed_data().data());
+    ++received;
+  }
+}
+
+TEST(SpekeSessionTest, SendMessage_RejectedAboveHighWaterMark) {
+  asio::io_context context;
+  auto sockets = get_local_socketpair(context);
+  SpekeSessionOptions options;
+  options.send_queue_high_water_mark = 1024;
+  TestSpekeSession session(std::move(sockets.first),
+                           std::make_shared<FakeSpeke>(), options);
+  std::thread context_thread([&context]{
+    auto context_guard = asio::make_work_guard(context);
+    context.run_for(std::chrono::seconds(5));
+  });
+  session.Run([](auto, auto&){});
+  SpekeMessage init;
+  init.mutable_init_data()->set_id("peer");
+  init.mutable_init_data()->set_public_key("pkey");
+  TestSpekeSession::TestSendMessage(init, sockets.second);
+  ASSERT_TRUE(
+      TestSpekeSession::TestReceiveMessage(sockets.second).has_init_data());
+  ASSERT_TRUE(TestSpekeSession::TestReceiveMessage(sockets.second)
+              .has_key_confirmation());
+
+  // Nobody reads from the peer socket now, so this write can't complete.
+  const Bytes big(8 * 1024 * 1024);
+  ASSERT_TRUE(session.SendMessage(big));
+  EXPECT_FALSE(session.SendMessage(big));
+  EXPECT_FALSE(session.SendMessage(lrm::Util::str_to_bytes("test")));
+
+  SpekeMessage message;
+  do {
+    message = TestSpekeSession::TestReceiveMessage(sockets.second);
+  } while (not message.has_signed_data());
+  EXPECT_EQ(big.size(), message.signed_data().data().size());
+
+  // Once the queue is drained, messages are accepted again.
+  wait_predicate(
+      [&session]{
+        return session.SendMessage(lrm::Util::str_to_bytes("test")); },
+      std::chrono::milliseconds(100));
+  do {
+    message = TestSpekeSession::TestReceiveMessage(sockets.second);
+  } while (not message.has_signed_data());
+  EXPECT_EQ("test", message.signed_data().data());
+
+  session.Close(SpekeSessionState::STOPPED);
+  context.stop();
+  context_thread.join();
+}
+
+namespace {
+std::string make_batch(const std::vector<std::string>& messages) {
+  std::string batch;
+  for (const auto& message : messages) {
+    google::protobuf::io::StringOutputStream stream(&batch);
+    google::protobuf::io::CodedOutputStream(&stream).WriteVarint64(
+        message.size());
+    batch += message;
+  }
+  return batch;
+}
+}
+
+TEST_F(SpekeSessionTestF, MessageHandlerCalledForEveryMessageInBatch) {
+  auto session = GetSession();
+  std::vector<std::string> result;
+  std::mutex result_mtx;
+  session->Run(
+      [&](auto message, auto&){
+        std::lock_guard lck{result_mtx};
+        result.emplace_back(reinterpret_cast<const char*>(message.data()),
+                            message.size());
+      });
+
+  SendInitData();
+
+  const std::vector<std::string> messages{"one", "", "three"};
+  SpekeMessage message;
+  SpekeMessage::SignedBatch* sb = message.mutable_signed_batch();
+  sb->set_hmac_signature("hmac");
+  sb->set_data(make_batch(messages));
+  TestSpekeSession::TestSendMessage(message, GetSocket());
+
+  wait_predicate([&]{
+                   std::lock_guard lck{result_mtx};
+                   return result.size() == messages.size(); },
+                 std::chrono::milliseconds(3));
+
+  std::lock_guard lck{result_mtx};
+  EXPECT_EQ(messages, result);
+}
+
+TEST_F(SpekeSessionTestF, MalformedBatchIsBadBehavior) {
+  auto session = GetSession();
+  session->Run([](auto, auto&){});
+
+  SendInitData();
+
+  std::string batch = make_batch({"test"});
+  batch.pop_back();
+  SpekeMessage message;
+  SpekeMessage::SignedBatch* sb = message.mutable_signed_batch();
+  sb->set_hmac_signature("hmac");
+  sb->set_data(batch);
+  for (int i = 0; i < TestSpekeSession::BAD_BEHAVIOR_LIMIT; ++i) {
+    TestSpekeSession::TestSendMessage(message, GetSocket());
+  }
+
+  wait_predicate(
+      [&session]{
+        return SpekeSessionState::STOPPED_PEER_BAD_BEHAVIOR ==
+            session->GetState(); },
+      std::chrono::milliseconds(10));
+
+  EXPECT_EQ(SpekeSessionState::STOPPED_PEER_BAD_BEHAVIOR, session->GetState());
+}
+
+TEST_F(SpekeSessionTestF, SendBatched_FlushedAfterDelay) {
+  auto session = GetSession();
+  session->Run([](auto, auto&){});
+
+  Handshake();
+
+  EXPECT_TRUE(session->SendBatched(lrm::Util::str_to_bytes("one")));
+  EXPECT_TRUE(session->SendBatched(lrm::Util::str_to_bytes("two")));
+
+  SpekeMessage message;
+  do {
+    message = TestSpekeSession::TestReceiveMessage(GetSocket());
+  } while (not message.has_signed_batch());
+
+  EXPECT_EQ("hmac", message.signed_batch().hmac_signature());
+  EXPECT_EQ(make_batch({"one", "two"}), message.signed_batch().data());
+}
+
+TEST_F(SpekeSessionTestF, SendBatched_FlushedWhenFull) {
+  auto session = GetSession();
+  session->Run([](auto, auto&){});
+
+  Handshake();
+
+  const std::string payload(SpekeSessionOptions{}.batch_max_bytes / 2, 'a');
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_TRUE(session->SendBatched(lrm::Util::str_to_bytes(payload)));
+  }
+  EXPECT_TRUE(session->FlushBatch());
+
+  // The first two don't fit together.
+  for (int i = 0; i < 3; ++i) {
+    SpekeMessage message;
+    do {
+      message = TestSpekeSession::TestReceiveMessage(GetSocket());
+    } while (not message.has_signed_batch());
+    EXPECT_EQ(make_batch({payload}), message.signed_batch().data());
+  }
+}
+
+namespace {
+// The session is "id" and the peer is "peer", so the session uses nonces
+// without the highest bit set.
+constexpr uint64_t PEER_DIRECTION = uint64_t{1} << 63;
+
+class SpekeSessionPeerTest : public ::testing::Test {
+  asio::io_context context;
+  std::pair<stream_protocol::socket, stream_protocol::socket> sockets;
+  std::thread context_thread;
+
+ protected:
+  std::unique_ptr<TestSpekeSession> session;
+  Aead peer_aead{FakeSpeke().GetEncryptionKey(), FakeSpeke().GetNonce()};
+
+  stream_protocol::socket& GetSocket() {
+    return sockets.second;
+  }
+
+  void Start(bool peer_encryption, bool compact_framing = false) {
+    SpekeSessionOptions options;
+    options.encryption = true;
+    options.compact_framing = compact_framing;
+    Start(options, peer_encryption, compact_framing);
+  }
+
+  void Start(const SpekeSessionOptions& options, bool peer_encryption,
+             bool peer_compact_framing) {
+    Run(options);
+    SendInitData(peer_encryption, peer_compact_framing);
+
+    // Skip the session's InitData and KeyConfirmation.
+    TestSpekeSession::TestReceiveMessage(GetSocket());
+    TestSpekeSession::TestReceiveMessage(GetSocket());
+  }
+
+  void Run(const SpekeSessionOptions& options) {
+    session = std::make_unique<TestSpekeSession>(
+        std::move(sockets.first), std::make_shared<FakeSpeke>(), options);
+    session->Run([this](auto message, auto&){
+                   std::lock_guard lck{received_mtx};
+                   received.emplace_back(message.begin(), message.end());
+                 });
+  }
+
+  void SendInitData(bool peer_encryption, bool peer_compact_framing) {
+    SpekeMessage message;
+    SpekeMessage::InitData* init_data = message.mutable_init_data();
+    init_data->set_id("peer");
+    init_data->set_public_key("pkey");
+    init_data->set_encryption(peer_encryption);
+    init_data->set_compact_framing(peer_compact_framing);
+    TestSpekeSession::TestSendMessage(message, GetSocket());
+  }
+
+  SpekeMessage Encrypt(const Bytes& plaintext, uint64_t counter) {
+    SpekeMessage message;
+    std::string* data = message.mutable_encrypted_data()->mutable_data();
+    data->resize(plaintext.size() + Aead::TAG_SIZE);
+    const std::byte aad{0};
+    peer_aead.Seal(PEER_DIRECTION | counter, {&aad, 1}, plaintext,
+                   std::span(reinterpret_cast<std::byte*>(data->data()),
+                             data->size()));
+    return message;
+  }
+
+  std::mutex received_mtx;
+  std::vector<Bytes> received;
+
+ public:
+  SpekeSessionPeerTest() : sockets(get_local_socketpair(context)) {
+    context_thread = std::thread(
+        [this](){
+          auto context_guard = asio::make_work_guard(context);
+          context.run();
+        });
+  }
+
+  virtual ~SpekeSessionPeerTest() {
+    session.reset();
+    context.stop();
+    context_thread.join();
+  }
+};
+}
+
+TEST_F(SpekeSessionPeerTest, NotEncryptedIfPeerDoesntOfferIt) {
+  Start(false);
+
+  EXPECT_FALSE(session->IsEncrypted());
+}
+
+TEST_F(SpekeSessionPeerTest, SendMessage_ThrowBeforeHandshake) {
+  for (const bool encryption : {false, true}) {
+    SpekeSessionOptions options;
+    options.encryption = encryption;
+    auto sockets = get_local_socketpair(context_glob);
+    TestSpekeSession session(std::move(sockets.first),
+                             std::make_shared<FakeSpeke>(), options);
+    session.Run([](auto, auto&){});
+
+    EXPECT_THROW(session.SendMessage(lrm::Util::str_to_bytes("test")),
+                 std::logic_error);
+    EXPECT_THROW(session.SendBatched(lrm::Util::str_to_bytes("test")),
+                 std::logic_error);
+    EXPECT_THROW(session.SendChunk(lrm::Util::str_to_bytes("test"), true),
+                 std::logic_error);
+  }
+}
+
+TEST_F(SpekeSessionPeerTest, SendMessage_Encrypted) {
+  Start(true);
+  ASSERT_TRUE(session->IsEncrypted());
+
+  const Bytes plaintext = lrm::Util::str_to_bytes("test");
+  for (uint64_t counter = 0; counter < 2; ++counter) {
+    ASSERT_TRUE(session->SendMessage(plaintext));
+
+    SpekeMessage message = TestSpekeSession::TestReceiveMessage(GetSocket());
+    ASSERT_TRUE(message.has_encrypted_data());
+    EXPECT_FALSE(message.encrypted_data().batch());
+
+    Bytes result(plaintext.size());
+    const std::byte aad{0};
+    EXPECT_TRUE(peer_aead.Open(
+        counter, {&aad, 1},
+        lrm::Util::str_as_bytes(message.encrypted_data().data()), result));
+    EXPECT_EQ(plaintext, result);
+  }
+}
+
+TEST_F(SpekeSessionPeerTest, SendBatched_Encrypted) {
+  Start(true);
+
+  ASSERT_TRUE(session->SendBatched(lrm::Util::str_to_bytes("test")));
+  ASSERT_TRUE(session->FlushBatch());
+
+  SpekeMessage message = TestSpekeSession::TestReceiveMessage(GetSocket());
+  ASSERT_TRUE(message.has_encrypted_data());
+  EXPECT_TRUE(message.encrypted_data().batch());
+
+  const std::string expected = make_batch({"test"});
+  Bytes result(expected.size());
+  const std::byte aad{1};
+  EXPECT_TRUE(peer_aead.Open(
+      0, {&aad, 1},
+      lrm::Util::str_as_bytes(message.encrypted_data().data()), result));
+  EXPECT_EQ(lrm::Util::str_to_bytes(expected), result);
+}
+
+TEST_F(SpekeSessionPeerTest, ReceivesEncrypted) {
+  Start(true);
+
+  TestSpekeSession::TestSendMessage(
+      Encrypt(lrm::Util::str_to_bytes("one"), 0), GetSocket());
+  TestSpekeSession::TestSendMessage(
+      Encrypt(lrm::Util::str_to_bytes("two"), 1), GetSocket());
+
+  wait_predicate([this]{
+                   std::lock_guard lck{received_mtx};
+                   return received.size() == 2; },
+                 std::chrono::milliseconds(3));
+
+  std::lock_guard lck{received_mtx};
+  ASSERT_EQ(2, received.size());
+  EXPECT_EQ(lrm::Util::str_to_bytes("one"), received[0]);
+  EXPECT_EQ(lrm::Util::str_to_bytes("two"), received[1]);
+}
+
+TEST_F(SpekeSessionPeerTest, ConnectionDroppedOnReplay) {
+  Start(true);
+
+  const SpekeMessage message = Encrypt(lrm::Util::str_to_bytes("one"), 0);
+  TestSpekeSession::TestSendMessage(message, GetSocket());
+  TestSpekeSession::TestSendMessage(message, GetSocket());
+
+  wait_predicate(
+      [this]{
+        return SpekeSessionState::STOPPED_PEER_BAD_BEHAVIOR ==
+            session->GetState(); },
+      std::chrono::milliseconds(3));
+
+  EXPECT_EQ(SpekeSessionState::STOPPED_PEER_BAD_BEHAVIOR, session->GetState());
+  std::lock_guard lck{received_mtx};
+  EXPECT_EQ(1, received.size());
+}
+
+TEST_F(SpekeSessionPeerTest, SignedDataRejectedWhenEncrypted) {
+  Start(true);
+
+  SpekeMessage message;
+  SpekeMessage::SignedData* sd = message.mutable_signed_data();
+  sd->set_hmac_signature("hmac");
+  sd->set_data("test");
+  TestSpekeSession::TestSendMessage(message, GetSocket());
+  TestSpekeSession::TestSendMessage(
+      Encrypt(lrm::Util::str_to_bytes("one"), 0), GetSocket());
+
+  wait_predicate([this]{
+                   std::lock_guard lck{received_mtx};
+                   return received.size() == 1; },
+                 std::chrono::milliseconds(3));
+
+  std::lock_guard lck{received_mtx};
+  ASSERT_EQ(1, received.size());
+  EXPECT_EQ(lrm::Util::str_to_bytes("one"), received[0]);
+}
+
+namespace {
+TEST_F(SpekeSessionPeerTest, RequireEncryption_ClosedIfPeerDoesntOffer) {
+  SpekeSessionOptions options;
+  options.encryption = true;
+  options.require_encryption = true;
+  Run(options);
+  SendInitData(false, false);
+
+  EXPECT_TRUE(wait_predicate(
+      [this]{ return session->GetState() ==
+              SpekeSessionState::STOPPED_NEGOTIATION_FAILED; },
+      std::chrono::seconds(1)));
+  EXPECT_FALSE(session->IsAuthenticated());
+}
+
+TEST_F(SpekeSessionPeerTest, RequireEncryption_EncryptedIfPeerOffers) {
+  SpekeSessionOptions options;
+  options.encryption = true;
+  options.require_encryption = true;
+  Start(options, true, false);
+
+  EXPECT_TRUE(session->IsEncrypted());
+  EXPECT_EQ(SpekeSessionState::RUNNING, session->GetState());
+}
+
+TEST_F(SpekeSessionPeerTest, TicketIgnoredWithoutIssuer) {
+  SpekeSessionOptions options;
+  options.choose_group = true;
+  options.speke_factory = [](SpekeGroup) {
+    return std::make_shared<FakeSpeke>();
+  };
+  Run(options);
+
+  SpekeMessage message;
+  SpekeMessage::InitData* init_data = message.mutable_init_data();
+  init_data->set_id("peer");
+  init_data->set_public_key("pkey");
+  init_data->set_ticket("ticket");
+  TestSpekeSession::TestSendMessage(message, GetSocket());
+
+  EXPECT_TRUE(TestSpekeSession::TestReceiveMessage(GetSocket())
+              .has_init_data());
+  EXPECT_TRUE(TestSpekeSession::TestReceiveMessage(GetSocket())
+              .has_key_confirmation());
+  EXPECT_EQ(SpekeSessionState::RUNNING, session->GetState());
+  EXPECT_FALSE(session->IsResumed());
+}
+
+TEST_F(SpekeSessionPeerTest, EarlyData_SentAfterKeyConfirmation) {
+  SpekeSessionOptions options;
+  options.encryption = true;
+  options.early_data = true;
+  Run(options);
+
+  ASSERT_TRUE(session->SendMessage(lrm::Util::str_to_bytes("one")));
+  ASSERT_TRUE(session->SendBatched(lrm::Util::str_to_bytes("two")));
+  SendInitData(true, false);
+
+  EXPECT_TRUE(TestSpekeSession::TestReceiveMessage(GetSocket())
+              .has_init_data());
+  EXPECT_TRUE(TestSpekeSession::TestReceiveMessage(GetSocket())
+              .has_key_confirmation());
+
+  SpekeMessage message = TestSpekeSession::TestReceiveMessage(GetSocket());
+  ASSERT_TRUE(message.has_encrypted_data());
+  EXPECT_TRUE(message.encrypted_data().batch());
+
+  const std::string expected = make_batch({"one", "two"});
+  Bytes result(expected.size());
+  const std::byte aad{1};
+  EXPECT_TRUE(peer_aead.Open(
+      0, {&aad, 1},
+      lrm::Util::str_as_bytes(message.encrypted_data().data()), result));
+  EXPECT_EQ(lrm::Util::str_to_bytes(expected), result);
+}
+
+TEST_F(SpekeSessionPeerTest, EarlyData_RejectedAboveHighWaterMark) {
+  SpekeSessionOptions options;
+  options.early_data = true;
+  options.send_queue_high_water_mark = 8;
+  Run(options);
+
+  EXPECT_TRUE(session->SendMessage(lrm::Util::str_to_bytes("0123456789")));
+  EXPECT_FALSE(session->SendMessage(lrm::Util::str_to_bytes("next")));
+}
+
+TEST_F(SpekeSessionPeerTest, EarlyData_HeldUntilKeyConfirmation) {
+  SpekeSessionOptions options;
+  options.early_data = true;
+  Start(options, false, false);
+
+  SpekeMessage message;
+  SpekeMessage::SignedData* sd = message.mutable_signed_data();
+  sd->set_hmac_signature("hmac");
+  sd->set_data("test");
+  TestSpekeSession::TestSendMessage(message, GetSocket());
+
+  wait_predicate([this]{
+                   std::lock_guard lck{received_mtx};
+                   return not received.empty(); },
+                 std::chrono::milliseconds(3));
+  {
+    std::lock_guard lck{received_mtx};
+    EXPECT_TRUE(received.empty())
+        << "Nothing should be delivered before the key confirmation";
+  }
+
+  SpekeMessage kcd_message;
+  kcd_message.mutable_key_confirmation()->set_data("kcd");
+  TestSpekeSession::TestSendMessage(kcd_message, GetSocket());
+
+  wait_predicate([this]{
+                   std::lock_guard lck{received_mtx};
+                   return not received.empty(); },
+                 std::chrono::milliseconds(10));
+
+  std::lock_guard lck{received_mtx};
+  ASSERT_EQ(1, received.size());
+  EXPECT_EQ(lrm::Util::str_to_bytes("test"), received[0]);
+}
+
+TEST_F(SpekeSessionPeerTest, EarlyData_DroppedOnBadKeyConfirmation) {
+  SpekeSessionOptions options;
+  options.early_data = true;
+  Start(options, false, false);
+
+  SpekeMessage message;
+  SpekeMessage::SignedData* sd = message.mutable_signed_data();
+  sd->set_hmac_signature("hmac");
+  sd->set_data("test");
+  TestSpekeSession::TestSendMessage(message, GetSocket());
+
+  SpekeMessage kcd_message;
+  kcd_message.mutable_key_confirmation()->set_data("bad");
+  TestSpekeSession::TestSendMessage(kcd_message, GetSocket());
+
+  wait_predicate(
+      [this]{
+        return SpekeSessionState::STOPPED_KEY_CONFIRMATION_FAILED ==
+            session->GetState(); },
+      std::chrono::milliseconds(10));
+
+  EXPECT_EQ(SpekeSessionState::STOPPED_KEY_CONFIRMATION_FAILED,
+            session->GetState());
+  std::lock_guard lck{received_mtx};
+  EXPECT_TRUE(received.empty());
+}
+
+struct CompactFrame {
+  uint8_t type;
+  std::string tag;
+  std::string payload;
+};
+
+CompactFrame receive_compact_frame(stream_protocol::socket& socket,
+                                   size_t tag_size) {
+  CompactFrame frame;
+  asio::read(socket, asio::buffer(&frame.type, 1));
+
+  uint64_t size = 0;
+  uint8_t byte = 0;
+  for (int shift = 0; shift == 0 or byte & 0x80; shift += 7) {
+    asio::read(socket, asio::buffer(&byte, 1));
+    size |= uint64_t{byte & 0x7fu} << shift;
+  }
+
+  frame.tag.resize(tag_size);
+  frame.payload.resize(size);
+  asio::read(socket, asio::buffer(frame.tag));
+  asio::read(socket, asio::buffer(frame.payload));
+  return frame;
+}
+
+void send_compact_frame(stream_protocol::socket& socket, uint8_t type,
+                        const std::string& tag, const std::string& payload) {
+  std::string frame(1, static_cast<char>(type));
+  {
+    google::protobuf::io::StringOutputStream stream(&frame);
+    google::protobuf::io::CodedOutputStream(&stream).WriteVarint64(
+        payload.size());
+  }
+  frame += tag;
+  frame += payload;
+  asio::write(socket, asio::buffer(frame));
+}
+
+void send_key_confirmation(stream_protocol::socket& socket) {
+  SpekeMessage message;
+  message.mutable_key_confirmation()->set_data("kcd");
+  TestSpekeSession::TestSendMessage(message, socket);
+}
+}
+
+TEST_F(SpekeSessionPeerTest, CompactFraming_NotUsedIfPeerDoesntOfferIt) {
+  SpekeSessionOptions options;
+  options.compact_framing = true;
+  Start(options, false, false);
+
+  ASSERT_TRUE(session->SendMessage(lrm::Util::str_to_bytes("test")));
+
+  SpekeMessage message = TestSpekeSession::TestReceiveMessage(GetSocket());
+  ASSERT_TRUE(message.has_signed_data());
+  EXPECT_EQ("test", message.signed_data().data());
+}
+
+TEST_F(SpekeSessionPeerTest, CompactFraming_SendMessage) {
+  SpekeSessionOptions options;
+  options.compact_framing = true;
+  Start(options, false, true);
+
+  ASSERT_TRUE(session->SendMessage(lrm::Util::str_to_bytes("test")));
+  const std::string long_payload(300, 'a');
+  ASSERT_TRUE(session->SendMessage(lrm::Util::str_to_bytes(long_payload)));
+
+  CompactFrame frame = receive_compact_frame(GetSocket(), 4);
+  EXPECT_EQ(1, frame.type);
+  EXPECT_EQ("hmac", frame.tag);
+  EXPECT_EQ("test", frame.payload);
+
+  frame = receive_compact_frame(GetSocket(), 4);
+  EXPECT_EQ(1, frame.type);
+  EXPECT_EQ(long_payload, frame.payload);
+}
+
+TEST_F(SpekeSessionPeerTest, CompactFraming_SendBatched) {
+  SpekeSessionOptions options;
+  options.compact_framing = true;
+  Start(options, false, true);
+
+  ASSERT_TRUE(session->SendBatched(lrm::Util::str_to_bytes("one")));
+  ASSERT_TRUE(session->SendBatched(lrm::Util::str_to_bytes("two")));
+  ASSERT_TRUE(session->FlushBatch());
+
+  CompactFrame frame = receive_compact_frame(GetSocket(), 4);
+  EXPECT_EQ(2, frame.type);
+  EXPECT_EQ(make_batch({"one", "two"}), frame.payload);
+}
+
+TEST_F(SpekeSessionPeerTest, CompactFraming_Receive) {
+  SpekeSessionOptions options;
+  options.compact_framing = true;
+  Start(options, false, true);
+
+  send_key_confirmation(GetSocket());
+  send_compact_frame(GetSocket(), 1, "hmac", "one");
+  send_compact_frame(GetSocket(), 2, "hmac", make_batch({"two", "three"}));
+
+  wait_predicate([this]{
+                   std::lock_guard lck{received_mtx};
+                   return received.size() == 3; },
+                 std::chrono::milliseconds(3));
+
+  std::lock_guard lck{received_mtx};
+  ASSERT_EQ(3, received.size());
+  EXPECT_EQ(lrm::Util::str_to_bytes("one"), received[0]);
+  EXPECT_EQ(lrm::Util::str_to_bytes("two"), received[1]);
+  EXPECT_EQ(lrm::Util::str_to_bytes("three"), received[2]);
+}
+
+TEST_F(SpekeSessionPeerTest, CompactFraming_Encrypted) {
+  Start(true, true);
+  ASSERT_TRUE(session->IsEncrypted());
+
+  const Bytes plaintext = lrm::Util::str_to_bytes("test");
+  ASSERT_TRUE(session->SendMessage(plaintext));
+
+  CompactFrame frame = receive_compact_frame(GetSocket(), Aead::TAG_SIZE);
+  EXPECT_EQ(3, frame.type);
+
+  Bytes result(plaintext.size());
+  const std::byte aad{0};
+  EXPECT_TRUE(peer_aead.Open(0, {&aad, 1},
+                             lrm::Util::str_as_bytes(frame.payload),
+                             lrm::Util::str_as_bytes(frame.tag), result));
+  EXPECT_EQ(plaintext, result);
+}
+
+TEST_F(SpekeSessionPeerTest, CompactFraming_ConnectionDroppedOnUnknownType) {
+  SpekeSessionOptions options;
+  options.compact_framing = true;
+  Start(options, false, true);
+
+  send_key_confirmation(GetSocket());
+  send_compact_frame(GetSocket(), 42, "hmac", "test");
+
+  wait_predicate(
+      [this]{
+        return SpekeSessionState::STOPPED_PEER_BAD_BEHAVIOR ==
+            session->GetState(); },
+      std::chrono::milliseconds(3));
+
+  EXPECT_EQ(SpekeSessionState::STOPPED_PEER_BAD_BEHAVIOR, session->GetState());
+}
+
+namespace {
+SpekeMessage make_stream_chunk(const std::string& data, bool last,
+                               const std::string& signature = "") {
+  SpekeMessage message;
+  SpekeMessage::StreamChunk* chunk = message.mutable_stream_chunk();
+  chunk->set_data(data);
+  chunk->set_last(last);
+  chunk->set_hmac_signature(signature);
+  return message;
+}
+
+std::string stream_signature(const std::string& data) {
+  Hmac::Stream stream =
+      Hmac(lrm::Util::str_to_bytes("key")).MakeStream();
+  stream.Update(lrm::Util::str_to_bytes("S" + data));
+  std::array<std::byte, Hmac::MAX_SIZE> signature;
+  const size_t size = stream.Final(signature);
+  return std::string(reinterpret_cast<const char*>(signature.data()), size);
+}
+}
+
+TEST_F(SpekeSessionPeerTest, ReceiveStream) {
+  Start(false);
+  std::mutex mtx;
+  std::vector<std::pair<std::string, SpekeStreamStatus>> chunks;
+  session->SetStreamHandler([&](auto chunk, auto status, auto&){
+    std::lock_guard lck{mtx};
+    chunks.emplace_back(
+        std::string(reinterpret_cast<const char*>(chunk.data()),
+                    chunk.size()), status);
+  });
+
+  send_key_confirmation(GetSocket());
+  TestSpekeSession::TestSendMessage(make_stream_chunk("one", false),
+                                    GetSocket());
+  TestSpekeSession::TestSendMessage(
+      make_stream_chunk("two", true, stream_signature("onetwo")),
+      GetSocket());
+
+  ASSERT_TRUE(wait_predicate([&]{
+                               std::lock_guard lck{mtx};
+                               return chunks.size() == 2; },
+      std::chrono::milliseconds(100)));
+  EXPECT_EQ(std::pair(std::string("one"), SpekeStreamStatus::CHUNK),
+            chunks[0]);
+  EXPECT_EQ(std::pair(std::string("two"), SpekeStreamStatus::END),
+            chunks[1]);
+  EXPECT_EQ(SpekeSessionState::RUNNING, session->GetState());
+}
+
+TEST_F(SpekeSessionPeerTest, ReceiveStream_AbortedOnBadSignature) {
+  Start(false);
+  std::mutex mtx;
+  std::vector<SpekeStreamStatus> statuses;
+  session->SetStreamHandler([&](auto, auto status, auto&){
+    std::lock_guard lck{mtx};
+    statuses.push_back(status);
+  });
+
+  send_key_confirmation(GetSocket());
+  TestSpekeSession::TestSendMessage(make_stream_chunk("one", false),
+                                    GetSocket());
+  TestSpekeSession::TestSendMessage(
+      make_stream_chunk("two", true, stream_signature("onethree")),
+      GetSocket());
+
+  ASSERT_TRUE(wait_predicate([&]{
+                               std::lock_guard lck{mtx};
+                               return statuses.size() == 2; },
+      std::chrono::milliseconds(100)));
+  EXPECT_EQ(SpekeStreamStatus::CHUNK, statuses[0]);
+  EXPECT_EQ(SpekeStreamStatus::ABORTED, statuses[1]);
+}
+
+TEST_F(SpekeSessionPeerTest, SendChunk_SignedOverWholeStream) {
+  Start(false);
+
+  ASSERT_TRUE(session->SendChunk(lrm::Util::str_to_bytes("one"), false));
+  ASSERT_TRUE(session->SendChunk(lrm::Util::str_to_bytes("two"), true));
+
+  SpekeMessage message = TestSpekeSession::TestReceiveMessage(GetSocket());
+  ASSERT_TRUE(message.has_stream_chunk());
+  EXPECT_EQ("one", message.stream_chunk().data());
+  EXPECT_FALSE(message.stream_chunk().last());
+  EXPECT_TRUE(message.stream_chunk().hmac_signature().empty());
+
+  message = TestSpekeSession::TestReceiveMessage(GetSocket());
+  ASSERT_TRUE(message.has_stream_chunk());
+  EXPECT_EQ("two", message.stream_chunk().data());
+  EXPECT_TRUE(message.stream_chunk().last());
+  EXPECT_EQ(stream_signature("onetwo"),
+            message.stream_chunk().hmac_signature());
+}
+
+TEST_F(SpekeSessionPeerTest, ConnectionDroppedOnFrameAboveMaxSize) {
+  SpekeSessionOptions options;
+  options.max_frame_size = 64;
+  Start(options, false, false);
+
+  SpekeMessage message;
+  SpekeMessage::SignedData* sd = message.mutable_signed_data();
+  sd->set_hmac_signature("hmac");
+  sd->set_data(std::string(100, 'a'));
+  TestSpekeSession::TestSendMessage(message, GetSocket());
+
+  wait_predicate(
+      [this]{
+        return SpekeSessionState::STOPPED_PEER_BAD_BEHAVIOR ==
+            session->GetState(); },
+      std::chrono::milliseconds(100));
+
+  EXPECT_EQ(SpekeSessionState::STOPPED_PEER_BAD_BEHAVIOR, session->GetState());
+}
+
+TEST_F(SpekeSessionPeerTest, CompactFraming_ConnectionDroppedAboveMaxSize) {
+  SpekeSessionOptions options;
+  options.compact_framing = true;
+  options.max_frame_size = 64;
+  Start(options, false, true);
+
+  send_key_confirmation(GetSocket());
+  send_compact_frame(GetSocket(), 1, "hmac", std::string(100, 'a'));
+
+  wait_predicate(
+      [this]{
+        return SpekeSessionState::STOPPED_PEER_BAD_BEHAVIOR ==
+            session->GetState(); },
+      std::chrono::milliseconds(100));
+
+  EXPECT_EQ(SpekeSessionState::STOPPED_PEER_BAD_BEHAVIOR, session->GetState());
+}
+
+namespace {
+SpekeMessage make_signed_data(const std::string& data) {
+  SpekeMessage message;
+  SpekeMessage::SignedData* sd = message.mutable_signed_data();
+  sd->set_hmac_signature("hmac");
+  sd->set_data(data);
+  return message;
+}
+}
+
+TEST_F(SpekeSessionPeerTest, Pause_FromHandler) {
+  Start(false);
+  session->SetMessageHandler([this](auto message, auto& session){
+    {
+      std::lock_guard lck{received_mtx};
+      received.emplace_back(message.begin(), message.end());
+    }
+    session.Pause();
+  });
+
+  send_key_confirmation(GetSocket());
+  TestSpekeSession::TestSendMessage(make_signed_data("one"), GetSocket());
+  TestSpekeSession::TestSendMessage(make_signed_data("two"), GetSocket());
+
+  ASSERT_TRUE(wait_predicate([this]{
+                               std::lock_guard lck{received_mtx};
+                               return received.size() == 1; },
+      std::chrono::milliseconds(100)));
+  EXPECT_TRUE(session->IsPaused());
+  EXPECT_FALSE(wait_predicate([this]{
+                                std::lock_guard lck{received_mtx};
+                                return received.size() == 2; },
+      std::chrono::milliseconds(20)));
+
+  session->Resume();
+  ASSERT_TRUE(wait_predicate([this]{
+                               std::lock_guard lck{received_mtx};
+                               return received.size() == 2; },
+      std::chrono::milliseconds(100)));
+  EXPECT_EQ(lrm::Util::str_to_bytes("two"), received[1]);
+}
+
+TEST_F(SpekeSessionPeerTest, ReceiveBudget_PausesUntilReleased) {
+  SpekeSessionOptions options;
+  options.receive_budget = 5;
+  Start(options, false, false);
+
+  send_key_confirmation(GetSocket());
+  TestSpekeSession::TestSendMessage(make_signed_data("one"), GetSocket());
+  TestSpekeSession::TestSendMessage(make_signed_data("two"), GetSocket());
+  TestSpekeSession::TestSendMessage(make_signed_data("six"), GetSocket());
+
+  ASSERT_TRUE(wait_predicate([this]{
+                               std::lock_guard lck{received_mtx};
+                               return received.size() == 2; },
+      std::chrono::milliseconds(100)));
+  EXPECT_FALSE(wait_predicate([this]{
+                                std::lock_guard lck{received_mtx};
+                                return received.size() == 3; },
+      std::chrono::milliseconds(20)));
+  EXPECT_FALSE(session->IsPaused());
+
+  session->Release(6);
+  ASSERT_TRUE(wait_predicate([this]{
+                               std::lock_guard lck{received_mtx};
+                               return received.size() == 3; },
+      std::chrono::milliseconds(100)));
+  EXPECT_EQ(lrm::Util::str_to_bytes("six"), received[2]);
+}
+
+TEST_F(SpekeSessionPeerTest, ReadsOnAfterFrameAboveRetainedSize) {
+  Start(false);
+
+  send_key_confirmation(GetSocket());
+  const std::string big(LRM_SPEKE_RECEIVE_BUFFER_MAX_SIZE * 2, 'a');
+  TestSpekeSession::TestSendMessage(make_signed_data(big), GetSocket());
+  TestSpekeSession::TestSendMessage(make_signed_data("small"), GetSocket());
+
+  ASSERT_TRUE(wait_predicate([this]{
+                               std::lock_guard lck{received_mtx};
+                               return received.size() == 2; },
+      std::chrono::milliseconds(100)));
+  EXPECT_EQ(lrm::Util::str_to_bytes(big), received[0]);
+  EXPECT_EQ(lrm::Util::str_to_bytes("small"), received[1]);
+}
+
+namespace {
+// A client and a server session connected to each other, with a thread
+// running their context.
+class SpekeSessionPairTest : public ::testing::Test {
+ protected:
+  asio::io_context context;
+  std::thread context_thread;
+  std::shared_ptr<const SpekeParams> params =
+      std::make_shared<const SpekeParams>("password", 2692367);
+
+  std::unique_ptr<SpekeSession<stream_protocol>> client;
+  std::unique_ptr<SpekeSession<stream_protocol>> server;
+
+  // Messages the server received after Run().
+  std::mutex received_mtx;
+  std::vector<Bytes> received;
+
+  std::shared_ptr<SpekeInterface> MakeSpeke(const std::string& id) {
+    return std::make_shared<SPEKE>(id, params);
+  }
+
+  // Make both sessions on a new socket pair, they get a SPEKE from
+  // MakeSpeke() unless one is given.
+  void MakeSessions(const SpekeSessionOptions& client_options = {},
+                    const SpekeSessionOptions& server_options = {},
+                    std::shared_ptr<SpekeInterface> client_speke = nullptr,
+                    std::shared_ptr<SpekeInterface> server_speke = nullptr) {
+    auto sockets = get_local_socketpair(context);
+    if (not client_speke) client_speke = MakeSpeke("client");
+    if (not server_speke) server_speke = MakeSpeke("server");
+
+    client = std::make_unique<SpekeSession<stream_protocol>>(
+        std::move(sockets.first), std::move(client_speke), client_options);
+    server = std::make_unique<SpekeSession<stream_protocol>>(
+        std::move(sockets.second), std::move(server_speke), server_options);
+  }
+
+  void Run() {
+    server->Run([this](auto message, auto&){
+                  std::lock_guard lck{received_mtx};
+                  received.emplace_back(message.begin(), message.end());
+                });
+    client->Run([](auto, auto&){});
+  }
+
+  bool WaitAuthenticated() {
+    return wait_predicate(
+        [this]{ return client->IsAuthenticated() and
+                server->IsAuthenticated(); },
+        std::chrono::seconds(5));
+  }
+
+ public:
+  SpekeSessionPairTest() {
+    context_thread = std::thread(
+        [this](){
+          auto context_guard = asio::make_work_guard(context);
+          context.run();
+        });
+  }
+
+  // Not in the destructor, the sessions' handlers may still use members of
+  // the derived fixtures.
+  void TearDown() override {
+    client.reset();
+    server.reset();
+    context.stop();
+    context_thread.join();
+  }
+};
+
+struct StreamTestParam {
+  bool encryption;
+  bool compact_framing;
+};
+
+class SpekeSessionStreamTest
+    : public SpekeSessionPairTest,
+      public ::testing::WithParamInterface<StreamTestParam> {
+ protected:
+  std::mutex chunks_mtx;
+  std::vector<std::pair<Bytes, SpekeStreamStatus>> chunks;
+
+ public:
+  SpekeSessionStreamTest() {
+    SpekeSessionOptions options;
+    options.encryption = GetParam().encryption;
+    options.compact_framing = GetParam().compact_framing;
+    MakeSessions(options, options);
+
+    server->SetStreamHandler([this](auto chunk, auto status, auto&){
+      std::lock_guard lck{chunks_mtx};
+      chunks.emplace_back(Bytes(chunk.begin(), chunk.end()), status);
+    });
+    Run();
+  }
+};
+}
+
+TEST_P(SpekeSessionStreamTest, SendChunk) {
+  ASSERT_TRUE(WaitAuthenticated());
+  EXPECT_EQ(GetParam().encryption, client->IsEncrypted());
+
+  const Bytes big(100000, std::byte{'b'});
+  ASSERT_TRUE(client->SendChunk(lrm::Util::str_to_bytes("one"), false));
+  ASSERT_TRUE(client->SendChunk(big, false));
+  ASSERT_TRUE(client->SendChunk(lrm::Util::str_to_bytes("end"), true));
+  // The next stream starts from scratch.
+  ASSERT_TRUE(client->SendChunk(lrm::Util::str_to_bytes("again"), true));
+
+  ASSERT_TRUE(wait_predicate([this]{
+                               std::lock_guard lck{chunks_mtx};
+                               return chunks.size() == 4; },
+      std::chrono::seconds(1)));
+  EXPECT_EQ(lrm::Util::str_to_bytes("one"), chunks[0].first);
+  EXPECT_EQ(SpekeStreamStatus::CHUNK, chunks[0].second);
+  EXPECT_EQ(big, chunks[1].first);
+  EXPECT_EQ(SpekeStreamStatus::CHUNK, chunks[1].second);
+  EXPECT_EQ(lrm::Util::str_to_bytes("end"), chunks[2].first);
+  EXPECT_EQ(SpekeStreamStatus::END, chunks[2].second);
+  EXPECT_EQ(lrm::Util::str_to_bytes("again"), chunks[3].first);
+  EXPECT_EQ(SpekeStreamStatus::END, chunks[3].second);
+  EXPECT_EQ(SpekeSessionState::RUNNING, server->GetState());
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Framing, SpekeSessionStreamTest,
+    ::testing::Values(StreamTestParam{false, false},
+                      StreamTestParam{true, false},
+                      StreamTestParam{false, true},
+                      StreamTestParam{true, true}));
+
+TEST_F(SpekeSessionPairTest, Encrypted_SendWhileReceiving) {
+  SpekeSessionOptions options;
+  options.encryption = true;
+  MakeSessions(options, options);
+  Run();
+  ASSERT_TRUE(WaitAuthenticated());
+  ASSERT_TRUE(client->IsEncrypted());
+
+  // Both directions use one key, each session seals on a sender thread
+  // while its strand opens what the other one sends.
+  constexpr int count = 1000;
+  auto send = [](SpekeSession<stream_protocol>& session) {
+    for (int i = 0; i < count; ++i) {
+      while (not session.SendMessage(
+                 lrm::Util::str_to_bytes(std::to_string(i)))) {
+        std::this_thread::yield();
+      }
+    }
+  };
+  std::thread server_sender([&]{ send(*server); });
+  send(*client);
+  server_sender.join();
+
+  ASSERT_TRUE(wait_predicate(
+      [this]{
+        std::lock_guard lck{received_mtx};
+        return received.size() == count and
+            client->GetStats().traffic.messages_in == count;
+      },
+      std::chrono::seconds(5)));
+  for (int i = 0; i < count; ++i) {
+    EXPECT_EQ(lrm::Util::str_to_bytes(std::to_string(i)), received[i]);
+  }
+  EXPECT_EQ(SpekeSessionState::RUNNING, client->GetState());
+  EXPECT_EQ(SpekeSessionState::RUNNING, server->GetState());
+}
+
+namespace {
+// Sessions connected through a relay that can change their InitData on the
+// way, like a man in the middle without the password.
+class SpekeSessionRelayTest : public SpekeSessionPairTest {
+ protected:
+  using Tamper = std::function<void(SpekeMessage::InitData&)>;
+
+  std::pair<stream_protocol::socket, stream_protocol::socket> client_link =
+      get_local_socketpair(context);
+  std::pair<stream_protocol::socket, stream_protocol::socket> server_link =
+      get_local_socketpair(context);
+  std::vector<std::thread> relays;
+
+  void Connect(const SpekeSessionOptions& client_options,
+               const SpekeSessionOptions& server_options,
+               const Tamper& tamper,
+               std::shared_ptr<SpekeInterface> client_speke = nullptr,
+               std::shared_ptr<SpekeInterface> server_speke = nullptr) {
+    client = std::make_unique<SpekeSession<stream_protocol>>(
+        std::move(client_link.first),
+        client_speke ? client_speke : MakeSpeke("client"), client_options);
+    server = std::make_unique<SpekeSession<stream_protocol>>(
+        std::move(server_link.first),
+        server_speke ? server_speke : MakeSpeke("server"), server_options);
+    relays.emplace_back([this, tamper]{
+      relay(client_link.second, server_link.second, tamper);
+    });
+    relays.emplace_back([this, tamper]{
+      relay(server_link.second, client_link.second, tamper);
+    });
+    Run();
+  }
+
+  bool WaitStopped() {
+    return wait_predicate(
+        [this]{ return client->GetState() >= SpekeSessionState::STOPPED and
+                server->GetState() >= SpekeSessionState::STOPPED; },
+        std::chrono::seconds(5));
+  }
+
+  void TearDown() override {
+    // The relays stop when the sessions close their sockets.
+    SpekeSessionPairTest::TearDown();
+    for (auto& relay : relays) relay.join();
+  }
+
+ private:
+  static void relay(stream_protocol::socket& from,
+                    stream_protocol::socket& to, const Tamper& tamper) {
+    try {
+      while (true) {
+        SpekeMessage message = TestSpekeSession::TestReceiveMessage(from);
+        if (message.has_init_data()) tamper(*message.mutable_init_data());
+        TestSpekeSession::TestSendMessage(message, to);
+      }
+    } catch (const std::exception&) {}
+  }
+};
+}
+
+TEST_F(SpekeSessionRelayTest, Untouched_Authenticated) {
+  SpekeSessionOptions options;
+  options.encryption = true;
+  Connect(options, options, [](auto&){});
+
+  ASSERT_TRUE(WaitAuthenticated());
+  EXPECT_TRUE(client->IsEncrypted());
+  EXPECT_TRUE(server->IsEncrypted());
+}
+
+TEST_F(SpekeSessionRelayTest, EncryptionCleared_FailsKeyConfirmation) {
+  SpekeSessionOptions options;
+  options.encryption = true;
+  Connect(options, options, [](auto& init_data){
+    init_data.set_encryption(false);
+  });
+
+  ASSERT_TRUE(WaitStopped());
+  EXPECT_EQ(SpekeSessionState::STOPPED_KEY_CONFIRMATION_FAILED,
+            client->GetState());
+  EXPECT_EQ(SpekeSessionState::STOPPED_KEY_CONFIRMATION_FAILED,
+            server->GetState());
+  EXPECT_FALSE(client->IsAuthenticated());
+  EXPECT_FALSE(server->IsAuthenticated());
+}
+
+namespace {
+class SpekeSessionCoroutineTest : public SpekeSessionPairTest {
+ protected:
+  template <typename Awaitable>
+  auto Spawn(Awaitable&& awaitable) {
+    return asio::co_spawn(context, std::forward<Awaitable>(awaitable),
+                          asio::use_future);
+  }
+};
+}
+
+TEST_F(SpekeSessionCoroutineTest, RequestResponse) {
+  SpekeSessionOptions options;
+  options.encryption = true;
+  MakeSessions(options, options);
+
+  auto server_done = Spawn(
+      [this]() -> asio::awaitable<void> {
+        co_await server->AsyncHandshake();
+        for (int i = 0; i < 3; ++i) {
+          Bytes request = co_await server->AsyncReceive();
+          request.push_back(std::byte{'!'});
+          co_await server->AsyncSend(request);
+        }
+      });
+  auto responses = Spawn(
+      [this]() -> asio::awaitable<std::vector<Bytes>> {
+        co_await client->AsyncHandshake();
+        std::vector<Bytes> responses;
+        for (const char* request : {"one", "two", "three"}) {
+          co_await client->AsyncSend(lrm::Util::str_to_bytes(request));
+          responses.push_back(co_await client->AsyncReceive());
+        }
+        co_return responses;
+      });
+
+  ASSERT_EQ(std::future_status::ready,
+            responses.wait_for(std::chrono::seconds(5)));
+  EXPECT_EQ((std::vector<Bytes>{lrm::Util::str_to_bytes("one!"),
+                                lrm::Util::str_to_bytes("two!"),
+                                lrm::Util::str_to_bytes("three!")}),
+            responses.get());
+  EXPECT_NO_THROW(server_done.get());
+  EXPECT_TRUE(client->IsEncrypted());
+}
+
+TEST_F(SpekeSessionCoroutineTest, AsyncHandshake_ThrowOnWrongPassword) {
+  MakeSessions({}, {}, nullptr,
+               std::make_shared<SPEKE>(
+                   "server",
+                   std::make_shared<const SpekeParams>("wrong", 2692367)));
+
+  auto client_done = Spawn(client->AsyncHandshake());
+  auto server_done = Spawn(server->AsyncHandshake());
+
+  ASSERT_EQ(std::future_status::ready,
+            server_done.wait_for(std::chrono::seconds(5)));
+  EXPECT_THROW(server_done.get(), asio::system_error);
+  EXPECT_EQ(SpekeSessionState::STOPPED_KEY_CONFIRMATION_FAILED,
+            server->GetState());
+}
+
+TEST_F(SpekeSessionCoroutineTest, AsyncReceive_ReturnsReceivedThenThrows) {
+  MakeSessions();
+
+  auto client_done = Spawn(client->AsyncHandshake());
+  auto server_done = Spawn(server->AsyncHandshake());
+  client_done.get();
+  server_done.get();
+  client->SendMessage(lrm::Util::str_to_bytes("last"));
+  ASSERT_TRUE(wait_predicate(
+      [this]{ return server->GetStats().traffic.messages_in == 1; },
+      std::chrono::seconds(1)));
+  server->Close(SpekeSessionState::STOPPED);
+
+  EXPECT_EQ(lrm::Util::str_to_bytes("last"),
+            Spawn(server->AsyncReceive()).get());
+  EXPECT_THROW(Spawn(server->AsyncReceive()).get(), asio::system_error);
+}
+
+TEST_F(SpekeSessionCoroutineTest, AsyncSend_WaitsForQueueToDrain) {
+  SpekeSessionOptions options;
+  options.send_queue_high_water_mark = 1024;
+  MakeSessions(options);
+
+  constexpr int count = 100;
+  auto client_done = Spawn(
+      [this]() -> asio::awaitable<void> {
+        co_await client->AsyncHandshake();
+        const Bytes message(4096, std::byte{'a'});
+        for (int i = 0; i < count; ++i) {
+          co_await client->AsyncSend(message);
+        }
+      });
+  auto received = Spawn(
+      [this]() -> asio::awaitable<size_t> {
+        co_await server->AsyncHandshake();
+        size_t received = 0;
+        for (int i = 0; i < count; ++i) {
+          received += (co_await server->AsyncReceive()).size();
+        }
+        co_return received;
+      });
+
+  ASSERT_EQ(std::future_status::ready,
+            received.wait_for(std::chrono::seconds(5)));
+  EXPECT_EQ(count * 4096, received.get());
+  EXPECT_NO_THROW(client_done.get());
+}
+
+TEST_F(SpekeSessionCoroutineTest, CompactsSpekeAfterHandshake) {
+  auto client_speke = MakeSpeke("client");
+  auto server_speke = MakeSpeke("server");
+  const std::weak_ptr<SpekeInterface> client_weak = client_speke;
+  const std::weak_ptr<SpekeInterface> server_weak = server_speke;
+
+  SpekeSessionOptions options;
+  options.encryption = true;
+  MakeSessions(options, options, std::move(client_speke),
+               std::move(server_speke));
+
+  auto server_done = Spawn(
+      [this]() -> asio::awaitable<Bytes> {
+        co_await server->AsyncHandshake();
+        co_return co_await server->AsyncReceive();
+      });
+  auto client_done = Spawn(
+      [this]() -> asio::awaitable<void> {
+        co_await client->AsyncHandshake();
+        co_await client->AsyncSend(lrm::Util::str_to_bytes("test"));
+      });
+
+  ASSERT_EQ(std::future_status::ready,
+            server_done.wait_for(std::chrono::seconds(5)));
+  EXPECT_EQ(lrm::Util::str_to_bytes("test"), server_done.get());
+  EXPECT_NO_THROW(client_done.get());
+  EXPECT_TRUE(client_weak.expired())
+      << "The session should only keep the keys after the handshake";
+  EXPECT_TRUE(server_weak.expired());
+}
+
+namespace {
+std::shared_ptr<SpekeInterface> make_group_speke(const std::string& id,
+                                                 SpekeGroup group) {
+  return std::make_shared<SPEKE>(
+      id, std::make_shared<const SpekeParams>(
+          "password", group, LRM_SPEKE_SHORT_EXPONENT_BITS));
+}
+
+class SpekeSessionGroupTest : public SpekeSessionPairTest {
+ protected:
+  // Groups the factories were called with, written on the context thread.
+  std::vector<SpekeGroup> client_switches;
+  std::vector<SpekeGroup> server_switches;
+
+  void Connect(SpekeGroup client_group, SpekeSessionOptions client_options,
+               SpekeGroup server_group, SpekeSessionOptions server_options) {
+    client_options.speke_factory = [this](SpekeGroup group) {
+      client_switches.push_back(group);
+      return make_group_speke("client", group);
+    };
+    server_options.speke_factory = [this](SpekeGroup group) {
+      server_switches.push_back(group);
+      return make_group_speke("server", group);
+    };
+
+    MakeSessions(client_options, server_options,
+                 make_group_speke("client", client_group),
+                 make_group_speke("server", server_group));
+    Run();
+  }
+
+  bool WaitState(SpekeSession<stream_protocol>& session,
+                 SpekeSessionState state) {
+    return wait_predicate([&]{ return session.GetState() == state; },
+                          std::chrono::seconds(5));
+  }
+};
+}
+
+TEST_F(SpekeSessionGroupTest, DifferentGroupsFailNegotiation) {
+  Connect(SpekeGroup::MODP_2048, {}, SpekeGroup::MODP_3072, {});
+
+  EXPECT_TRUE(WaitState(*server,
+                        SpekeSessionState::STOPPED_NEGOTIATION_FAILED));
+  EXPECT_FALSE(client->IsAuthenticated());
+}
+
+TEST_F(SpekeSessionGroupTest, ChooseGroup_CheapestOfferedByClient) {
+  SpekeSessionOptions client_options;
+  client_options.groups = {SpekeGroup::MODP_3072};
+  SpekeSessionOptions server_options;
+  server_options.choose_group = true;
+  server_options.groups = {SpekeGroup::MODP_2048};
+  Connect(SpekeGroup::MODP_2048, client_options,
+          SpekeGroup::MODP_3072, server_options);
+
+  ASSERT_TRUE(WaitAuthenticated());
+  EXPECT_TRUE(client_switches.empty());
+  EXPECT_EQ(std::vector{SpekeGroup::MODP_2048}, server_switches);
+}
+
+TEST_F(SpekeSessionGroupTest, ChooseGroup_ClientSwitchesToServerMinimum) {
+  SpekeSessionOptions client_options;
+  client_options.groups = {SpekeGroup::MODP_3072, SpekeGroup::MODP_4096};
+  SpekeSessionOptions server_options;
+  server_options.choose_group = true;
+  server_options.groups = {SpekeGroup::MODP_2048, SpekeGroup::MODP_3072};
+  server_options.min_group_bits = 3072;
+  Connect(SpekeGroup::MODP_2048, client_options,
+          SpekeGroup::MODP_4096, server_options);
+
+  ASSERT_TRUE(WaitAuthenticated());
+  EXPECT_EQ(std::vector{SpekeGroup::MODP_3072}, client_switches);
+  EXPECT_EQ(std::vector{SpekeGroup::MODP_3072}, server_switches);
+}
+
+TEST_F(SpekeSessionGroupTest, ChooseGroup_NoCommonGroupAboveMinimum) {
+  SpekeSessionOptions server_options;
+  server_options.choose_group = true;
+  server_options.groups = {SpekeGroup::MODP_2048};
+  server_options.min_group_bits = 3072;
+  Connect(SpekeGroup::MODP_2048, {}, SpekeGroup::MODP_3072, server_options);
+
+  EXPECT_TRUE(WaitState(*server,
+                        SpekeSessionState::STOPPED_NEGOTIATION_FAILED));
+  EXPECT_FALSE(client->IsAuthenticated());
+}
+
+TEST_F(SpekeSessionGroupTest, MinGroupBitsEnforcedWithoutNegotiation) {
+  SpekeSessionOptions server_options;
+  server_options.min_group_bits = 3072;
+  Connect(SpekeGroup::MODP_2048, {}, SpekeGroup::MODP_2048, server_options);
+
+  EXPECT_TRUE(WaitState(*server,
+                        SpekeSessionState::STOPPED_NEGOTIATION_FAILED));
+}
+
+TEST_F(SpekeSessionRelayTest, GroupsStripped_FailsKeyConfirmation) {
+  SpekeSessionOptions client_options;
+  client_options.groups = {SpekeGroup::MODP_3072};
+  client_options.speke_factory = [](SpekeGroup group) {
+    return make_group_speke("client", group);
+  };
+  SpekeSessionOptions server_options;
+  server_options.choose_group = true;
+  server_options.groups = {SpekeGroup::MODP_2048};
+  server_options.speke_factory = [](SpekeGroup group) {
+    return make_group_speke("server", group);
+  };
+  // The server still finds a common group without the client's offer.
+  Connect(client_options, server_options,
+          [](auto& init_data){ init_data.clear_groups(); },
+          make_group_speke("client", SpekeGroup::MODP_2048),
+          make_group_speke("server", SpekeGroup::MODP_3072));
+
+  ASSERT_TRUE(WaitStopped());
+  EXPECT_EQ(SpekeSessionState::STOPPED_KEY_CONFIRMATION_FAILED,
+            client->GetState());
+  EXPECT_EQ(SpekeSessionState::STOPPED_KEY_CONFIRMATION_FAILED,
+            server->GetState());
+}
+
+TEST(SpekeSessionTest, Construct_ThrowRequireEncryptionWithoutEncryption) {
+  auto sockets = get_local_socketpair(context_glob);
+  SpekeSessionOptions options;
+  options.require_encryption = true;
+
+  EXPECT_THROW(TestSpekeSession(std::move(sockets.first),
+                                std::make_shared<FakeSpeke>(), options),
+               std::invalid_argument);
+}
+
+TEST(SpekeSessionTest, Construct_ThrowChooseGroupWithoutFactory) {
+  auto sockets = get_local_socketpair(context_glob);
+  SpekeSessionOptions options;
+  options.choose_group = true;
+
+  EXPECT_THROW(TestSpekeSession(std::move(sockets.first),
+                                std::make_shared<FakeSpeke>(), options),
+               std::invalid_argument);
+}
+
+TEST(SpekeSessionTest, MultiThreadedContext_ConcurrentSenders) {
+  asio::io_context context;
+  auto sockets = get_local_socketpair(context);
+  auto session = std::make_unique<TestSpekeSession>(
+      std::move(sockets.first), std::make_shared<FakeSpeke>());
+
+  auto context_guard = asio::make_work_guard(context);
+  std::vector<std::thread> context_threads;
+  for (int i = 0; i < 4; ++i) {
+    context_threads.emplace_back([&context]{ context.run(); });
+  }
+
+  session->Run([](auto, auto&){});
+  SpekeMessage init;
+  init.mutable_init_data()->set_id("peer");
+  init.mutable_init_data()->set_public_key("pkey");
+  TestSpekeSession::TestSendMessage(init, sockets.second);
+  // Messages can be sent once the key confirmation is out.
+  while (not TestSpekeSession::TestReceiveMessage(sockets.second)
+         .has_key_confirmation()) {}
+
+  constexpr int senders = 4;
+  constexpr int count = 200;
+  std::vector<std::thread> sender_threads;
+  for (int i = 0; i < senders; ++i) {
+    sender_threads.emplace_back(
+        [&session, i]{
+          for (int j = 0; j < count; ++j) {
+            const std::string message =
+                std::to_string(i) + ':' + std::to_string(j);
+            while (not session->SendMessage(
+                       lrm::Util::str_to_bytes(message))) {
+              std::this_thread::yield();
+            }
+          }
+        });
+  }
+
+  // Messages from every sender arrive in the order they were sent.
+  std::vector<int> next(senders, 0);
+  for (int received = 0; received < senders * count;) {
+    SpekeMessage message = TestSpekeSession::TestReceiveMessage(
+        sockets.second);
+    if (not message.has_signed_data()) continue;
+
+    const std::string& data = message.signed_data().data();
+    const size_t colon = data.find(':');
+    const int sender = std::stoi(data.substr(0, colon));
+    EXPECT_EQ(next[sender]++, std::stoi(data.substr(colon + 1)));
+    ++received;
+  }
+
+  for (auto& thread : sender_threads) thread.join();
+
+  std::thread closer([&session]{
+    session->Close(SpekeSessionState::STOPPED);
+  });
+  closer.join();
+  EXPECT_EQ(SpekeSessionState::STOPPED, session->GetState());
+
+  context.stop();
+  for (auto& thread : context_threads) thread.join();
+}
+
+TEST(SpekeSessionTest, MultiThreadedContext_DestroyedDuringHandler) {
+  asio::io_context context;
+  auto sockets = get_local_socketpair(context);
+  auto session = std::make_unique<TestSpekeSession>(
+      std::move(sockets.first), std::make_shared<FakeSpeke>());
+
+  auto context_guard = asio::make_work_guard(context);
+  std::thread context_thread([&context]{ context.run(); });
+
+  std::promise<void> entered;
+  std::atomic<bool> handler_done = false;
+  session->Run([&](auto, auto& session){
+                 entered.set_value();
+                 std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                 // The destructor closed it and waits for the handler.
+                 EXPECT_EQ(SpekeSessionState::STOPPED, session.GetState());
+                 handler_done = true;
+               });
+
+  SpekeMessage message;
+  message.mutable_init_data()->set_id("peer");
+  message.mutable_init_data()->set_public_key("pkey");
+  TestSpekeSession::TestSendMessage(message, sockets.second);
+  message.Clear();
+  message.mutable_signed_data()->set_hmac_signature("hmac");
+  message.mutable_signed_data()->set_data("test");
+  TestSpekeSession::TestSendMessage(message, sockets.second);
+
+  entered.get_future().wait();
+  session.reset();
+  EXPECT_TRUE(handler_done);
+
+  context.stop();
+  context_thread.join();
+}
+
+namespace {
+class SpekeSessionResumptionTest : public SpekeSessionPairTest {
+ protected:
+  std::shared_ptr<SpekeTicketIssuer> issuer =
+      std::make_shared<SpekeTicketIssuer>();
+
+  void Connect(std::shared_ptr<SpekeInterface>&& client_speke,
+               std::shared_ptr<SpekeTicketIssuer> server_issuer,
+               bool encryption = false) {
+    SpekeSessionOptions client_options;
+    client_options.resumption = true;
+    client_options.encryption = encryption;
+    SpekeSessionOptions server_options;
+    server_options.ticket_issuer = std::move(server_issuer);
+    server_options.encryption = encryption;
+
+    MakeSessions(client_options, server_options, std::move(client_speke));
+    Run();
+  }
+
+  SpekeResumptionTicket FullHandshake() {
+    Connect(MakeSpeke("client"), issuer);
+    EXPECT_TRUE(WaitAuthenticated());
+    EXPECT_FALSE(client->IsResumed());
+    auto ticket = client->GetResumptionTicket();
+    EXPECT_TRUE(ticket.has_value());
+    return ticket.value_or(SpekeResumptionTicket{});
+  }
+};
+}
+
+TEST_F(SpekeSessionResumptionTest, NoTicketIfNotAsked) {
+  SpekeSessionOptions server_options;
+  server_options.ticket_issuer = issuer;
+  MakeSessions({}, server_options);
+  Run();
+
+  ASSERT_TRUE(WaitAuthenticated());
+  EXPECT_FALSE(client->GetResumptionTicket().has_value());
+}
+
+TEST_F(SpekeSessionResumptionTest, Resume) {
+  const SpekeResumptionTicket ticket = FullHandshake();
+  EXPECT_GT(ticket.expiry, std::chrono::system_clock::now());
+
+  Connect(std::make_shared<ResumedSpeke>("client", ticket), issuer);
+  ASSERT_TRUE(WaitAuthenticated());
+  EXPECT_TRUE(client->IsResumed());
+  EXPECT_TRUE(server->IsResumed());
+  // Resumed sessions get a new ticket too.
+  EXPECT_TRUE(client->GetResumptionTicket().has_value());
+
+  client->SendMessage(lrm::Util::str_to_bytes("resumed"));
+  ASSERT_TRUE(wait_predicate([this]{
+                               std::lock_guard lck{received_mtx};
+                               return received.size() == 1; },
+      std::chrono::seconds(1)));
+  EXPECT_EQ(lrm::Util::str_to_bytes("resumed"), received[0]);
+}
+
+TEST_F(SpekeSessionResumptionTest, Resume_Encrypted) {
+  const SpekeResumptionTicket ticket = FullHandshake();
+
+  Connect(std::make_shared<ResumedSpeke>("client", ticket), issuer, true);
+  ASSERT_TRUE(WaitAuthenticated());
+  EXPECT_TRUE(client->IsEncrypted());
+
+  client->SendMessage(lrm::Util::str_to_bytes("resumed"));
+  ASSERT_TRUE(wait_predicate([this]{
+                               std::lock_guard lck{received_mtx};
+                               return received.size() == 1; },
+      std::chrono::seconds(1)));
+  EXPECT_EQ(lrm::Util::str_to_bytes("resumed"), received[0]);
+}
+
+TEST_F(SpekeSessionResumptionTest, Resume_RejectedByOtherIssuer) {
+  const SpekeResumptionTicket ticket = FullHandshake();
+
+  Connect(std::make_shared<ResumedSpeke>("client", ticket),
+          std::make_shared<SpekeTicketIssuer>());
+  EXPECT_TRUE(wait_predicate(
+      [this]{ return client->GetState() ==
+              SpekeSessionState::STOPPED_RESUMPTION_REJECTED; },
+      std::chrono::seconds(1)));
+  EXPECT_FALSE(client->IsAuthenticated());
+}
+
+TEST_F(SpekeSessionResumptionTest, Resume_RejectedWithoutIssuer) {
+  const SpekeResumptionTicket ticket = FullHandshake();
+
+  Connect(std::make_shared<ResumedSpeke>("client", ticket), nullptr);
+  EXPECT_TRUE(wait_predicate(
+      [this]{ return client->GetState() ==
+              SpekeSessionState::STOPPED_RESUMPTION_REJECTED; },
+      std::chrono::seconds(1)));
+}
+
+TEST_F(SpekeSessionResumptionTest, Resume_WrongSecretFailsKeyConfirmation) {
+  SpekeResumptionTicket ticket = FullHandshake();
+  ticket.secret[0] ^= std::byte{1};
+
+  Connect(std::make_shared<ResumedSpeke>("client", ticket), issuer);
+  EXPECT_TRUE(wait_predicate(
+      [this]{ return server->GetState() ==
+              SpekeSessionState::STOPPED_KEY_CONFIRMATION_FAILED; },
+      std::chrono::seconds(1)));
+  EXPECT_FALSE(server->IsAuthenticated());
+}
@@ -0,0 +1,215 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <asio.hpp>
+
+#include "SPEKE.h"
+#include "SpekeSession.h"
+#include "SpekeStats.h"
+
+#include "Util.h"
+
+using namespace lrm::crypto;
+using namespace std::chrono_literals;
+using stream_protocol = asio::local::stream_protocol;
+
+namespace {
+template<typename Predicate>
+bool wait_predicate(Predicate&& pred) {
+  const auto wake_time = std::chrono::steady_clock::now() + 5s;
+  while (not std::invoke(pred)) {
+    if (std::chrono::steady_clock::now() > wake_time) return false;
+    std::this_thread::sleep_for(1ms);
+  }
+  return true;
+}
+
+class SpekeStatsSessionTest : public ::testing::Test {
+ protected:
+  asio::io_context context;
+  std::thread context_thread;
+  std::shared_ptr<const SpekeParams> params =
+      std::make_shared<const SpekeParams>("password", 2692367);
+
+  std::unique_ptr<SpekeSession<stream_protocol>> client;
+  std::unique_ptr<SpekeSession<stream_protocol>> server;
+  std::atomic<int> received = 0;
+
+  void Start() {
+    stream_protocol::socket client_socket(context);
+    stream_protocol::socket server_socket(context);
+    asio::local::connect_pair(client_socket, server_socket);
+
+    client = std::make_unique<SpekeSession<stream_protocol>>(
+        std::move(client_socket), std::make_shared<SPEKE>("client", params));
+    server = std::make_unique<SpekeSession<stream_protocol>>(
+        std::move(server_socket), std::make_shared<SPEKE>("server", params));
+    client->Run([this](auto, auto&){ ++received; });
+    server->Run([](auto message, auto& session){
+      session.SendMessage(Bytes(message.begin(), message.end()));
+    });
+
+    context_thread = std::thread(
+        [this]{
+          auto context_guard = asio::make_work_guard(context);
+          context.run();
+        });
+  }
+
+  void TearDown() override {
+    context.stop();
+    if (context_thread.joinable()) context_thread.join();
+    client.reset();
+    server.reset();
+    SpekeStatsCollector::Get().SetHooks({});
+  }
+};
+}
+
+TEST(SpekeStatsTest, TrafficCounters_Count) {
+  SpekeTrafficCounters counters;
+
+  counters.AddMessageIn(10);
+  counters.AddMessageIn(5);
+  counters.AddMessageOut(7);
+  counters.AddHmacFailure();
+  counters.AddDecryptionFailure();
+  counters.AddBadBehavior();
+  counters.AddBadBehavior();
+
+  const SpekeTrafficStats stats = counters.Load();
+  EXPECT_EQ(2, stats.messages_in);
+  EXPECT_EQ(15, stats.bytes_in);
+  EXPECT_EQ(1, stats.messages_out);
+  EXPECT_EQ(7, stats.bytes_out);
+  EXPECT_EQ(1, stats.hmac_failures);
+  EXPECT_EQ(1, stats.decryption_failures);
+  EXPECT_EQ(2, stats.bad_behavior);
+}
+
+TEST(SpekeStatsTest, Collector_SumsThreads) {
+  const SpekeProcessStats before = SpekeStatsCollector::Get().Snapshot();
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([]{
+      for (int j = 0; j < 100; ++j) {
+        SpekeStatsCollector::Get().Traffic().AddMessageOut(2);
+      }
+    });
+  }
+  for (auto& thread : threads) thread.join();
+
+  const SpekeProcessStats after = SpekeStatsCollector::Get().Snapshot();
+  EXPECT_EQ(400, after.traffic.messages_out - before.traffic.messages_out);
+  EXPECT_EQ(800, after.traffic.bytes_out - before.traffic.bytes_out);
+}
+
+TEST(SpekeStatsTest, SPEKE_HandshakeTimings) {
+  auto params = std::make_shared<const SpekeParams>("password", 2692367);
+  SPEKE peer1("peer1", params);
+  SPEKE peer2("peer2", params, params->GenerateKeypair());
+
+  EXPECT_GT(peer1.GetHandshakeTimings().keygen.count(), 0);
+  EXPECT_EQ(0, peer2.GetHandshakeTimings().keygen.count());
+  EXPECT_EQ(0, peer1.GetHandshakeTimings().dh.count());
+
+  peer1.ProvideRemotePublicKeyIdPair(peer2.GetPublicKey(), peer2.GetId());
+  EXPECT_GT(peer1.GetHandshakeTimings().dh.count(), 0);
+  EXPECT_GT(peer1.GetHandshakeTimings().kdf.count(), 0);
+}
+
+TEST_F(SpekeStatsSessionTest, CountsTrafficAndHandshake) {
+  std::atomic<int> handshakes = 0;
+  SpekeStatsCollector::Get().SetHooks({
+      .on_handshake = [&handshakes](const SpekeHandshakeTimings& timings) {
+        EXPECT_GT(timings.total.count(), 0);
+        ++handshakes;
+      }});
+  const SpekeProcessStats before = SpekeStatsCollector::Get().Snapshot();
+
+  Start();
+  ASSERT_TRUE(wait_predicate([this]{
+    return client->IsAuthenticated() and server->IsAuthenticated();
+  }));
+  EXPECT_EQ(2, handshakes);
+
+  ASSERT_TRUE(client->SendMessage(lrm::Util::str_to_bytes("test")));
+  ASSERT_TRUE(client->SendMessage(lrm::Util::str_to_bytes("test2")));
+  ASSERT_TRUE(wait_predicate([this]{ return received == 2; }));
+
+  const SpekeSessionStats stats = client->GetStats();
+  EXPECT_EQ(SpekeSessionState::RUNNING, stats.state);
+  EXPECT_EQ(2, stats.traffic.messages_out);
+  EXPECT_EQ(9, stats.traffic.bytes_out);
+  EXPECT_EQ(2, stats.traffic.messages_in);
+  EXPECT_EQ(9, stats.traffic.bytes_in);
+  EXPECT_EQ(0, stats.traffic.bad_behavior);
+  EXPECT_GT(stats.handshake.keygen.count(), 0);
+  EXPECT_GT(stats.handshake.dh.count(), 0);
+  EXPECT_GT(stats.handshake.key_confirmation.count(), 0);
+  EXPECT_GE(stats.handshake.total, stats.handshake.key_confirmation);
+
+  const SpekeProcessStats after = SpekeStatsCollector::Get().Snapshot();
+  EXPECT_EQ(2, after.sessions - before.sessions);
+  EXPECT_EQ(2, after.handshakes - before.handshakes);
+  EXPECT_GE(after.traffic.messages_out - before.traffic.messages_out, 4);
+  EXPECT_GT((after.handshake_totals.total -
+             before.handshake_totals.total).count(), 0);
+}
+
+TEST_F(SpekeStatsSessionTest, CountsCloseReasons) {
+  std::mutex closed_mtx;
+  std::vector<SpekeSessionState> closed;
+  SpekeStatsCollector::Get().SetHooks({
+      .on_close = [&](const SpekeSessionStats& stats) {
+        std::lock_guard lck{closed_mtx};
+        closed.push_back(stats.state);
+      }});
+  const SpekeProcessStats before = SpekeStatsCollector::Get().Snapshot();
+  const auto index = [](SpekeSessionState state) {
+    return static_cast<size_t>(state);
+  };
+
+  Start();
+  ASSERT_TRUE(wait_predicate([this]{ return client->IsAuthenticated(); }));
+  client->Close(SpekeSessionState::STOPPED);
+  ASSERT_TRUE(wait_predicate([this]{
+    return server->GetState() == SpekeSessionState::STOPPED_PEER_DISCONNECTED;
+  }));
+
+  const SpekeProcessStats after = SpekeStatsCollector::Get().Snapshot();
+  EXPECT_EQ(1, after.closed[index(SpekeSessionState::STOPPED)] -
+            before.closed[index(SpekeSessionState::STOPPED)]);
+  EXPECT_EQ(
+      1,
+      after.closed[index(SpekeSessionState::STOPPED_PEER_DISCONNECTED)] -
+      before.closed[index(SpekeSessionState::STOPPED_PEER_DISCONNECTED)]);
+
+  std::lock_guard lck{closed_mtx};
+  EXPECT_EQ((std::vector{SpekeSessionState::STOPPED,
+                         SpekeSessionState::STOPPED_PEER_DISCONNECTED}),
+            closed);
+}
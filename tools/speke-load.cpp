@@ -0,0 +1,625 @@
+// Copyright (C) 2019 by Jakub Wojciech
+
+// This file is part of Lelo Remote Music Player.
+
+// Lelo Remote Music Player is free software: you can redistribute it
+// and/or modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation, either version 3 of
+// the License, or (at your option) any later version.
+
+// Lelo Remote Music Player is distributed in the hope that it will be
+// useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+// of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with Lelo Remote Music Player. If not, see
+// <https://www.gnu.org/licenses/>.
+
+
+// Load generator for SpekeSession: opens many sessions against a server at
+// a given rate, streams messages that the server echoes back and reports
+// handshake and message rates with latency percentiles.
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <unistd.h>
+
+#include <asio.hpp>
+
+#include "SPEKE.h"
+#include "SpekeServer.h"
+#include "SpekeSession.h"
+
+using namespace lrm::crypto;
+using Clock = std::chrono::steady_clock;
+using tcp = asio::ip::tcp;
+using stream_protocol = asio::local::stream_protocol;
+
+namespace {
+const char USAGE[] =
+    R"(Usage: speke-load [OPTION]... ENDPOINT
+
+Open sessions against a server echoing every message back, stream
+messages through them and report the rates and latencies.
+
+ENDPOINT is tcp:HOST:PORT or unix:PATH.
+
+Options:
+  --serve                 Run an echo SpekeServer on ENDPOINT in-process
+  --sessions=N            Number of sessions to open (default: 100)
+  --connect-rate=R        New connections per second, 0 means all at once
+                          (default: 100)
+  --message-size=BYTES    Size of each message, at least 8 (default: 64)
+  --message-rate=R        Messages per second per session, 0 means one
+                          message in flight per session (default: 0)
+  --duration=SECONDS      Length of the run (default: 10)
+  --threads=N             Threads running the io_context (default: number
+                          of hardware threads)
+  --password=PASSWORD     Password of the sessions (default: password)
+  --group=BITS            Use the RFC 3526 group of 2048, 3072, 4096 or
+                          6144 bits (default: LRM_SPEKE_SAFE_PRIME)
+  --exponent-bits=BITS    Length of private keys, 0 means full-length
+                          (default: LRM_SPEKE_SHORT_EXPONENT_BITS)
+  --fixed-base-window=W   Use a fixed-base table with W-bit windows for
+                          key generation (default: 0, no table)
+  --encryption            Encrypt messages
+  --compact-framing       Use compact framing
+  --json                  Print the report as JSON
+)";
+
+struct LoadOptions {
+  std::string endpoint;
+  bool serve = false;
+  size_t sessions = 100;
+  double connect_rate = 100;
+  size_t message_size = 64;
+  double message_rate = 0;
+  std::chrono::milliseconds duration{10000};
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  std::string password = "password";
+  SpekeGroup group = SpekeGroup::LRM_4096;
+  int exponent_bits = LRM_SPEKE_SHORT_EXPONENT_BITS;
+  int fixed_base_window_bits = 0;
+  bool encryption = false;
+  bool compact_framing = false;
+  bool json = false;
+};
+
+template <typename T>
+bool parse_number(std::string_view str, T& result) {
+  const auto [end, ec] =
+      std::from_chars(str.data(), str.data() + str.size(), result);
+  return ec == std::errc() and end == str.data() + str.size();
+}
+
+bool parse_options(int argc, char* argv[], LoadOptions& options) {
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg = argv[i];
+    if (not arg.starts_with("--")) {
+      if (not options.endpoint.empty()) return false;
+      options.endpoint = arg;
+      continue;
+    }
+
+    const size_t eq = arg.find('=');
+    const std::string_view name = arg.substr(2, eq - 2);
+    const std::string_view value =
+        eq == std::string_view::npos ? std::string_view{} : arg.substr(eq + 1);
+
+    double seconds = 0;
+    bool ok = true;
+    if (name == "serve") {
+      options.serve = true;
+    } else if (name == "encryption") {
+      options.encryption = true;
+    } else if (name == "compact-framing") {
+      options.compact_framing = true;
+    } else if (name == "json") {
+      options.json = true;
+    } else if (name == "sessions") {
+      ok = parse_number(value, options.sessions);
+    } else if (name == "connect-rate") {
+      ok = parse_number(value, options.connect_rate) and
+          options.connect_rate >= 0;
+    } else if (name == "message-size") {
+      ok = parse_number(value, options.message_size) and
+          options.message_size >= sizeof(int64_t);
+    } else if (name == "message-rate") {
+      ok = parse_number(value, options.message_rate) and
+          options.message_rate >= 0;
+    } else if (name == "duration") {
+      ok = parse_number(value, seconds) and seconds > 0;
+      options.duration = std::chrono::milliseconds(
+          static_cast<int64_t>(seconds * 1000));
+    } else if (name == "threads") {
+      ok = parse_number(value, options.threads) and options.threads > 0;
+    } else if (name == "password") {
+      options.password = value;
+    } else if (name == "group") {
+      int bits = 0;
+      ok = parse_number(value, bits);
+      switch (bits) {
+        case 2048: options.group = SpekeGroup::MODP_2048; break;
+        case 3072: options.group = SpekeGroup::MODP_3072; break;
+        case 4096: options.group = SpekeGroup::MODP_4096; break;
+        case 6144: options.group = SpekeGroup::MODP_6144; break;
+        default: ok = false;
+      }
+    } else if (name == "exponent-bits") {
+      ok = parse_number(value, options.exponent_bits);
+    } else if (name == "fixed-base-window") {
+      ok = parse_number(value, options.fixed_base_window_bits);
+    } else {
+      ok = false;
+    }
+    if (not ok) {
+      std::cerr << "speke-load: Invalid option '" << arg << "'\n";
+      return false;
+    }
+  }
+  return not options.endpoint.empty();
+}
+
+struct Percentiles {
+  double p50 = 0;
+  double p90 = 0;
+  double p99 = 0;
+  double p999 = 0;
+  double max = 0;
+};
+
+// Values are in nanoseconds, the result is in \e unit.
+template <typename Unit>
+Percentiles percentiles(std::vector<int64_t>& values) {
+  Percentiles result;
+  if (values.empty()) return result;
+
+  std::sort(values.begin(), values.end());
+  const auto at = [&values](double quantile) {
+    const auto index = static_cast<size_t>(quantile * (values.size() - 1));
+    return std::chrono::duration<double, typename Unit::period>(
+        std::chrono::nanoseconds(values[index])).count();
+  };
+  result.p50 = at(0.5);
+  result.p90 = at(0.9);
+  result.p99 = at(0.99);
+  result.p999 = at(0.999);
+  result.max = at(1);
+  return result;
+}
+
+struct LoadReport {
+  double elapsed_s = 0;
+  size_t sessions = 0;
+  size_t connect_failures = 0;
+  size_t handshakes = 0;
+  size_t handshake_failures = 0;
+  double handshakes_per_s = 0;
+  // From the start of connecting to the peer's key confirmation
+  Percentiles handshake_ms;
+  // Means of the client sessions' SpekeHandshakeTimings
+  double keygen_ms = 0;
+  double dh_ms = 0;
+  double kdf_ms = 0;
+  double key_confirmation_ms = 0;
+  uint64_t messages = 0;
+  uint64_t rejected = 0;
+  double messages_per_s = 0;
+  double mib_per_s = 0;
+  Percentiles round_trip_us;
+};
+
+void print_percentiles(const char* name, const Percentiles& p,
+                       const char* unit) {
+  std::printf("%-22s p50 %.3f%s, p90 %.3f%s, p99 %.3f%s, p99.9 %.3f%s, "
+              "max %.3f%s\n",
+              name, p.p50, unit, p.p90, unit, p.p99, unit, p.p999, unit,
+              p.max, unit);
+}
+
+void print_percentiles_json(const char* name, const Percentiles& p) {
+  std::printf("  \"%s\": {\"p50\": %g, \"p90\": %g, \"p99\": %g, "
+              "\"p999\": %g, \"max\": %g},\n",
+              name, p.p50, p.p90, p.p99, p.p999, p.max);
+}
+
+void print_report(const LoadReport& r, bool json) {
+  if (json) {
+    std::printf("{\n");
+    std::printf("  \"elapsed_s\": %g,\n", r.elapsed_s);
+    std::printf("  \"sessions\": %zu,\n", r.sessions);
+    std::printf("  \"connect_failures\": %zu,\n", r.connect_failures);
+    std::printf("  \"handshakes\": %zu,\n", r.handshakes);
+    std::printf("  \"handshake_failures\": %zu,\n", r.handshake_failures);
+    std::printf("  \"handshakes_per_s\": %g,\n", r.handshakes_per_s);
+    print_percentiles_json("handshake_ms", r.handshake_ms);
+    std::printf("  \"handshake_phases_ms\": {\"keygen\": %g, \"dh\": %g, "
+                "\"kdf\": %g, \"key_confirmation\": %g},\n",
+                r.keygen_ms, r.dh_ms, r.kdf_ms, r.key_confirmation_ms);
+    std::printf("  \"messages\": %lu,\n", r.messages);
+    std::printf("  \"rejected\": %lu,\n", r.rejected);
+    std::printf("  \"messages_per_s\": %g,\n", r.messages_per_s);
+    std::printf("  \"mib_per_s\": %g,\n", r.mib_per_s);
+    print_percentiles_json("round_trip_us", r.round_trip_us);
+    std::printf("  \"end\": true\n}\n");
+    return;
+  }
+
+  std::printf("%-22s %.3fs\n", "elapsed:", r.elapsed_s);
+  std::printf("%-22s %zu (%zu connect failures)\n", "sessions:", r.sessions,
+              r.connect_failures);
+  std::printf("%-22s %zu (%zu failed), %.1f/s\n", "handshakes:",
+              r.handshakes, r.handshake_failures, r.handshakes_per_s);
+  print_percentiles("handshake latency:", r.handshake_ms, "ms");
+  std::printf("%-22s keygen %.3fms, dh %.3fms, kdf %.3fms, "
+              "key confirmation %.3fms\n",
+              "handshake phases:", r.keygen_ms, r.dh_ms, r.kdf_ms,
+              r.key_confirmation_ms);
+  std::printf("%-22s %lu (%lu rejected), %.1f/s, %.2f MiB/s\n",
+              "messages:", r.messages, r.rejected, r.messages_per_s,
+              r.mib_per_s);
+  print_percentiles("round trip:", r.round_trip_us, "us");
+}
+
+// Opens the sessions and streams messages. Everything except the clients'
+// own traffic runs on the control strand.
+template <typename Protocol>
+class LoadGenerator {
+ public:
+  LoadGenerator(asio::io_context& context,
+                const typename Protocol::endpoint& endpoint,
+                std::shared_ptr<const SpekeParams> params,
+                const LoadOptions& options)
+      : context_(context),
+        control_(asio::make_strand(context)),
+        connect_timer_(control_),
+        poll_timer_(control_),
+        endpoint_(endpoint),
+        params_(std::move(params)),
+        options_(options) {
+    session_options_.encryption = options.encryption;
+    session_options_.compact_framing = options.compact_framing;
+  }
+
+  void Start() {
+    start_time_ = Clock::now();
+    asio::dispatch(control_, [this]{
+      next_connect_ = Clock::now();
+      connect_next();
+      poll();
+    });
+  }
+
+  // Has to be followed by stopping the context.
+  void Stop() {
+    running_ = false;
+    end_time_ = Clock::now();
+  }
+
+  // Call only after the context stopped.
+  LoadReport GetReport() {
+    LoadReport report;
+    const auto elapsed = end_time_ - start_time_;
+    report.elapsed_s = std::chrono::duration<double>(elapsed).count();
+    report.sessions = clients_.size();
+    report.connect_failures = connect_failures_;
+    report.handshake_failures = handshake_failures_;
+
+    std::vector<int64_t> handshakes;
+    std::vector<int64_t> round_trips;
+    SpekeHandshakeTimings phases;
+    Clock::time_point last_handshake = start_time_;
+    Clock::time_point first_streaming = end_time_;
+    for (const auto& client : clients_) {
+      report.rejected += client->rejected;
+      round_trips.insert(round_trips.end(), client->round_trips.begin(),
+                         client->round_trips.end());
+      if (not client->authenticated) continue;
+
+      handshakes.push_back(client->handshake_time.count());
+      phases.keygen += client->phases.keygen;
+      phases.dh += client->phases.dh;
+      phases.kdf += client->phases.kdf;
+      phases.key_confirmation += client->phases.key_confirmation;
+      last_handshake = std::max(last_handshake, client->authenticated_time);
+      first_streaming = std::min(first_streaming, client->authenticated_time);
+    }
+
+    report.handshakes = handshakes.size();
+    if (not handshakes.empty()) {
+      const double count = handshakes.size();
+      const auto ms = [count](std::chrono::nanoseconds time) {
+        return std::chrono::duration<double, std::milli>(time).count() /
+            count;
+      };
+      report.handshakes_per_s = count / std::chrono::duration<double>(
+          last_handshake - start_time_).count();
+      report.keygen_ms = ms(phases.keygen);
+      report.dh_ms = ms(phases.dh);
+      report.kdf_ms = ms(phases.kdf);
+      report.key_confirmation_ms = ms(phases.key_confirmation);
+    }
+    report.handshake_ms = percentiles<std::chrono::milliseconds>(handshakes);
+
+    report.messages = round_trips.size();
+    if (first_streaming < end_time_) {
+      const double seconds =
+          std::chrono::duration<double>(end_time_ - first_streaming).count();
+      report.messages_per_s = report.messages / seconds;
+      report.mib_per_s = report.messages_per_s * options_.message_size /
+          (1024 * 1024);
+    }
+    report.round_trip_us =
+        percentiles<std::chrono::microseconds>(round_trips);
+    return report;
+  }
+
+ private:
+  struct Client {
+    explicit Client(asio::io_context& context)
+        : strand(asio::make_strand(context)),
+          socket(strand),
+          send_timer(strand) {}
+
+    asio::strand<asio::io_context::executor_type> strand;
+    // Moved into the session once connected
+    typename Protocol::socket socket;
+    std::unique_ptr<SpekeSession<Protocol>> session;
+    asio::steady_timer send_timer;
+
+    Clock::time_point connect_time;
+    Clock::time_point run_time;
+
+    // Control strand
+    bool authenticated = false;
+    Clock::time_point authenticated_time;
+    std::chrono::nanoseconds handshake_time{0};
+    SpekeHandshakeTimings phases;
+
+    // Written on the session's strand
+    std::vector<int64_t> round_trips;
+    // Written on the client's strand, or the session's when there is one
+    // message in flight
+    uint64_t rejected = 0;
+  };
+
+  void connect_next() {
+    if (not running_) return;
+
+    do {
+      if (clients_.size() >= options_.sessions) return;
+
+      Client& client = *clients_.emplace_back(
+          std::make_unique<Client>(context_));
+      client.connect_time = Clock::now();
+      client.socket.async_connect(
+          endpoint_, [this, &client](const asio::error_code& ec) {
+                       handle_connect(client, ec);
+                     });
+    } while (options_.connect_rate == 0);
+
+    next_connect_ += std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(1 / options_.connect_rate));
+    connect_timer_.expires_at(next_connect_);
+    connect_timer_.async_wait([this](const asio::error_code& ec) {
+      if (not ec) connect_next();
+    });
+  }
+
+  // On the client's strand
+  void handle_connect(Client& client, const asio::error_code& ec) {
+    if (ec) {
+      asio::post(control_, [this]{ ++connect_failures_; });
+      return;
+    }
+    if constexpr (std::is_same_v<Protocol, tcp>) {
+      asio::error_code ignored;
+      client.socket.set_option(tcp::no_delay(true), ignored);
+    }
+
+    client.session = std::make_unique<SpekeSession<Protocol>>(
+        std::move(client.socket), std::make_shared<SPEKE>("load", params_),
+        session_options_);
+    client.run_time = Clock::now();
+    client.session->Run([this, &client](auto message, auto&) {
+      handle_echo(client, message);
+    });
+
+    asio::post(control_, [this, &client]{ pending_.push_back(&client); });
+  }
+
+  void poll() {
+    if (not running_) return;
+
+    const auto now = Clock::now();
+    std::erase_if(pending_, [this, now](Client* client) {
+      const SpekeSession<Protocol>& session = *client->session;
+      if (session.GetState() >= SpekeSessionState::STOPPED) {
+        ++handshake_failures_;
+        return true;
+      }
+      if (not session.IsAuthenticated()) return false;
+
+      // The session measured its handshake, polling only notices it.
+      client->phases = session.GetStats().handshake;
+      client->handshake_time = (client->run_time - client->connect_time) +
+          client->phases.total;
+      client->authenticated_time = now;
+      client->authenticated = true;
+      asio::post(client->strand, [this, client]{ start_streaming(*client); });
+      return true;
+    });
+
+    poll_timer_.expires_after(std::chrono::milliseconds(1));
+    poll_timer_.async_wait([this](const asio::error_code& ec) {
+      if (not ec) poll();
+    });
+  }
+
+  // On the client's strand
+  void start_streaming(Client& client) {
+    if (options_.message_rate == 0) {
+      send(client);
+      return;
+    }
+    client.send_timer.expires_after(std::chrono::seconds(0));
+    send_on_timer(client, std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(1 / options_.message_rate)));
+  }
+
+  void send_on_timer(Client& client, Clock::duration interval) {
+    client.send_timer.async_wait(
+        [this, &client, interval](const asio::error_code& ec) {
+          if (ec or not running_) return;
+          send(client);
+          client.send_timer.expires_at(client.send_timer.expiry() +
+                                       interval);
+          send_on_timer(client, interval);
+        });
+  }
+
+  void send(Client& client) {
+    if (not running_) return;
+
+    Bytes message(options_.message_size);
+    const int64_t now = Clock::now().time_since_epoch().count();
+    std::memcpy(message.data(), &now, sizeof(now));
+    try {
+      if (not client.session->SendMessage(message)) ++client.rejected;
+    } catch (const std::logic_error&) {
+      // The session was closed.
+    }
+  }
+
+  // On the session's strand
+  void handle_echo(Client& client,
+                   typename SpekeSession<Protocol>::MessageView message) {
+    if (message.size() < sizeof(int64_t)) return;
+
+    int64_t sent = 0;
+    std::memcpy(&sent, message.data(), sizeof(sent));
+    client.round_trips.push_back(
+        (Clock::now().time_since_epoch() - Clock::duration(sent)).count());
+
+    if (options_.message_rate == 0) send(client);
+  }
+
+  asio::io_context& context_;
+  asio::strand<asio::io_context::executor_type> control_;
+  asio::steady_timer connect_timer_;
+  asio::steady_timer poll_timer_;
+  const typename Protocol::endpoint endpoint_;
+  const std::shared_ptr<const SpekeParams> params_;
+  const LoadOptions options_;
+  SpekeSessionOptions session_options_;
+
+  std::atomic_bool running_ = true;
+  Clock::time_point start_time_;
+  Clock::time_point end_time_;
+
+  // Control strand
+  Clock::time_point next_connect_;
+  std::vector<std::unique_ptr<Client>> clients_;
+  std::vector<Client*> pending_;
+  size_t connect_failures_ = 0;
+  size_t handshake_failures_ = 0;
+};
+
+template <typename Protocol>
+int run(const LoadOptions& options, typename Protocol::endpoint endpoint) {
+  auto params = std::make_shared<const SpekeParams>(
+      options.password, options.group, options.exponent_bits,
+      options.fixed_base_window_bits);
+
+  // Declared first, so the server and the sessions are destroyed before it.
+  asio::io_context context;
+
+  std::unique_ptr<SpekeServer<Protocol>> server;
+  if (options.serve) {
+    if constexpr (std::is_same_v<Protocol, stream_protocol>) {
+      ::unlink(endpoint.path().c_str());
+    }
+    SpekeServerOptions server_options;
+    server_options.session_options.encryption = options.encryption;
+    server_options.session_options.compact_framing = options.compact_framing;
+    server = std::make_unique<SpekeServer<Protocol>>(
+        context, endpoint,
+        [params]{ return std::make_shared<SPEKE>("server", params); },
+        [](auto message, auto& session) {
+          try {
+            session.SendMessage(Bytes(message.begin(), message.end()));
+          } catch (const std::logic_error&) {
+            // The session was closed.
+          }
+        },
+        server_options);
+    server->Run();
+    endpoint = server->GetLocalEndpoint();
+  }
+
+  LoadGenerator<Protocol> generator(context, endpoint, params, options);
+  generator.Start();
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < options.threads; ++i) {
+    threads.emplace_back([&context]{
+      auto context_guard = asio::make_work_guard(context);
+      context.run();
+    });
+  }
+
+  std::this_thread::sleep_for(options.duration);
+  generator.Stop();
+  context.stop();
+  for (auto& thread : threads) thread.join();
+
+  print_report(generator.GetReport(), options.json);
+  return 0;
+}
+}
+
+int main(int argc, char* argv[]) {
+  LoadOptions options;
+  if (not parse_options(argc, argv, options)) {
+    std::cerr << USAGE;
+    return 2;
+  }
+
+  try {
+    const std::string_view endpoint = options.endpoint;
+    if (endpoint.starts_with("unix:")) {
+      return run<stream_protocol>(
+          options, stream_protocol::endpoint(endpoint.substr(5)));
+    }
+    if (endpoint.starts_with("tcp:")) {
+      const std::string_view address = endpoint.substr(4);
+      const size_t colon = address.rfind(':');
+      if (colon != std::string_view::npos) {
+        asio::io_context resolver_context;
+        tcp::resolver resolver(resolver_context);
+        const auto results = resolver.resolve(address.substr(0, colon),
+                                              address.substr(colon + 1));
+        return run<tcp>(options, results.begin()->endpoint());
+      }
+    }
+  } catch (const std::exception& e) {
+    std::cerr << "speke-load: " << e.what() << '\n';
+    return 1;
+  }
+
+  std::cerr << "speke-load: Invalid endpoint '" << options.endpoint << "'\n";
+  return 2;
+}